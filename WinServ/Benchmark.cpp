@@ -0,0 +1,2602 @@
+#pragma region Includes
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+#include "Benchmark.h"
+#include "BufferPool.h"
+#include "Config.h"
+#include "Coroutine.h"
+#include "CpuTopology.h"
+#include "InProcessServiceHost.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "ServiceBase.h"
+#include "SocketServer.h"
+#include "Task.h"
+#include "ThreadPool.h"
+#include "TimerService.h"
+#include "Trace.h"
+#include "Watchdog.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+#pragma endregion
+
+#pragma region Allocation Counting
+
+namespace
+{
+    // Heap allocations made by threads that count them; see TasksBenchmark.
+    // A constant-initialized thread_local, so reading it never allocates.
+    std::atomic<size_t> s_allocations(0);
+    thread_local bool t_countAllocations = false;
+}
+
+// The global operator new and delete of the executable, counting the
+// allocations of the threads that asked for it. Array and nothrow forms
+// call these; over-aligned ones keep their own.
+void *operator new(size_t size)
+{
+    if (t_countAllocations)
+    {
+        s_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    void *block = malloc(size != 0 ? size : 1);
+    if (block == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+// GCC pairs the free below with the new it sees inlined at each call site
+// and warns of a mismatch; both sides are this file's malloc and free.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void *block) noexcept
+{
+    free(block);
+}
+
+void operator delete(void *block, size_t) noexcept
+{
+    free(block);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#pragma endregion
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    double SecondsSince(Clock::time_point start)
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    double MicrosecondsSince(Clock::time_point start)
+    {
+        return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+    }
+
+    // One measured value, kept for the machine-readable report.
+    struct Result
+    {
+        std::wstring benchmark;
+        std::wstring metric;
+        double value;
+        std::wstring unit;
+    };
+
+    std::vector<Result> s_results;
+
+    // Set when a benchmark's own consistency check fails.
+    bool s_failed = false;
+
+    void Record(const wchar_t *pszBenchmark, const wchar_t *pszMetric,
+                double value, const wchar_t *pszUnit)
+    {
+        Result result = {pszBenchmark, pszMetric, value, pszUnit};
+        s_results.push_back(result);
+    }
+
+    // The sample at the given percentile (nearest rank); sorts the samples.
+    double Percentile(std::vector<double> &samples, double percentile)
+    {
+        if (samples.empty())
+        {
+            return 0;
+        }
+        std::sort(samples.begin(), samples.end());
+        size_t rank = static_cast<size_t>(percentile / 100.0 * samples.size() + 0.5);
+        rank = std::min(std::max<size_t>(rank, 1), samples.size());
+        return samples[rank - 1];
+    }
+
+    // Print and record p50, p99 and max of a set of latencies.
+    void ReportLatencies(const wchar_t *pszBenchmark, const wchar_t *pszOperation,
+                         std::vector<double> &samples)
+    {
+        double p50 = Percentile(samples, 50);
+        double p99 = Percentile(samples, 99);
+        double max = samples.empty() ? 0 : samples.back();
+        wprintf(L"%ls: %-10ls p50 %9.1f us, p99 %9.1f us, max %9.1f us (%u samples)\n",
+                pszBenchmark, pszOperation, p50, p99, max,
+                static_cast<unsigned int>(samples.size()));
+
+        std::wstring metric(pszOperation);
+        Record(pszBenchmark, (metric + L".p50").c_str(), p50, L"us");
+        Record(pszBenchmark, (metric + L".p99").c_str(), p99, L"us");
+        Record(pszBenchmark, (metric + L".max").c_str(), max, L"us");
+    }
+
+    // Write the recorded results as JSON.
+    bool WriteResults(const wchar_t *pszPath)
+    {
+        FILE *file = NULL;
+#ifdef _WIN32
+        if (_wfopen_s(&file, pszPath, L"w") != 0)
+        {
+            file = NULL;
+        }
+#else
+        std::string path(wcstombs(NULL, pszPath, 0) + 1, '\0');
+        wcstombs(&path[0], pszPath, path.size());
+        file = fopen(path.c_str(), "w");
+#endif
+        if (file == NULL)
+        {
+            return false;
+        }
+
+        fprintf(file, "{\n  \"results\": [");
+        for (size_t i = 0; i < s_results.size(); i++)
+        {
+            fprintf(file, "%s\n    {\"benchmark\": \"%ls\", \"metric\": \"%ls\", "
+                          "\"value\": %.3f, \"unit\": \"%ls\"}",
+                    (i == 0) ? "" : ",", s_results[i].benchmark.c_str(),
+                    s_results[i].metric.c_str(), s_results[i].value,
+                    s_results[i].unit.c_str());
+        }
+        fprintf(file, "\n  ]\n}\n");
+        return fclose(file) == 0;
+    }
+
+    // A sink that only counts what reaches it.
+    class NullLogSink : public LogSink
+    {
+    public:
+        NullLogSink(std::atomic<unsigned long long> &records) : m_records(records) {}
+
+        virtual void Write(const LogRecord *, size_t count)
+        {
+            m_records.fetch_add(count, std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<unsigned long long> &m_records;
+    };
+
+    /**
+     *   Logger throughput: producers push as fast as they can into a
+     *   logger with a counting sink. Reports how fast they offered messages,
+     *   how fast the logger accepted them, the end-to-end rate including
+     *   the final flush, and what share was dropped because the ring was
+     *   full. Only accepted messages count as throughput.
+     */
+    void LoggerBenchmark(void)
+    {
+        const unsigned int threadCounts[] = {1, 4};
+        const unsigned int messagesPerThread = 250000;
+
+        for (size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++)
+        {
+            unsigned int threads = threadCounts[t];
+            std::atomic<unsigned long long> received(0);
+            Logger logger(4096);
+            logger.AddSink(std::unique_ptr<LogSink>(new NullLogSink(received)));
+
+            Clock::time_point start = Clock::now();
+            std::vector<std::thread> producers;
+            for (unsigned int i = 0; i < threads; i++)
+            {
+                producers.push_back(std::thread([&logger, messagesPerThread]() {
+                    for (unsigned int n = 0; n < messagesPerThread; n++)
+                    {
+                        logger.Write(L"Benchmark", L"WinServ logger benchmark message",
+                                     EVENTLOG_INFORMATION_TYPE);
+                    }
+                }));
+            }
+            for (size_t i = 0; i < producers.size(); i++)
+            {
+                producers[i].join();
+            }
+            double produced = SecondsSince(start);
+            logger.Flush();
+            double drained = SecondsSince(start);
+
+            Logger::Statistics statistics = logger.GetStatistics();
+            double total = static_cast<double>(threads) * messagesPerThread;
+            double accepted = total - static_cast<double>(statistics.dropped);
+            double dropRate = 100.0 * static_cast<double>(statistics.dropped) / total;
+            wprintf(L"logger: %u producer(s), %.0f messages offered at %.2f M msg/s, "
+                    L"accepted %.2f M msg/s, written %.2f M msg/s, dropped %.1f%% (%llu), %llu batches\n",
+                    threads, total, total / produced / 1e6, accepted / produced / 1e6,
+                    static_cast<double>(statistics.written) / drained / 1e6,
+                    dropRate, statistics.dropped, statistics.batches);
+
+            std::wstring prefix = (threads == 1) ? L"producers1" : L"producers4";
+            Record(L"logger", (prefix + L".offered").c_str(), total / produced, L"msg/s");
+            Record(L"logger", (prefix + L".accepted").c_str(), accepted / produced, L"msg/s");
+            Record(L"logger", (prefix + L".written").c_str(),
+                   static_cast<double>(statistics.written) / drained, L"msg/s");
+            Record(L"logger", (prefix + L".dropped").c_str(),
+                   static_cast<double>(statistics.dropped), L"msg");
+            Record(L"logger", (prefix + L".drop_rate").c_str(), dropRate, L"%");
+        }
+    }
+
+    // A service that does what a typical one does on start and stop:
+    // schedule its periodic work, and cancel it again.
+    class LifecycleService : public ServiceBase
+    {
+    public:
+        LifecycleService(void)
+            : ServiceBase(const_cast<PWSTR>(L"LifecycleBenchmark"), TRUE, TRUE, TRUE),
+              m_timer(0)
+        {
+        }
+
+    protected:
+        virtual void OnStart(DWORD, PWSTR *)
+        {
+            m_timer = TimerService::Default().SchedulePeriodic(1000, [this]() {
+                if (!GetStopToken().StopRequested())
+                {
+                    WriteEventLogEntry(L"Lifecycle benchmark tick", EVENTLOG_INFORMATION_TYPE);
+                }
+            });
+        }
+
+        virtual void OnStop()
+        {
+            TimerService::Default().Cancel(m_timer);
+            m_timer = 0;
+        }
+
+    private:
+        TimerService::TimerId m_timer;
+    };
+
+    /**
+     *   Service lifecycle: runs a service through start, interrogate,
+     *   pause, continue and stop cycles under the in-process host, and
+     *   reports the latency of each request from sending it until the
+     *   service has reached the state it asks for.
+     */
+    void LifecycleBenchmark(void)
+    {
+        const unsigned int warmupCycles = 20;
+        const unsigned int cycles = 500;
+        const unsigned int interrogatesPerCycle = 10;
+
+        std::atomic<unsigned long long> records(0);
+        Logger logger(1024);
+        logger.AddSink(std::unique_ptr<LogSink>(new NullLogSink(records)));
+
+        LifecycleService service;
+        service.SetLogger(logger);
+        InProcessServiceHost host;
+        PWSTR pszArgv[] = {const_cast<PWSTR>(L"LifecycleBenchmark"), NULL};
+
+        std::vector<double> start, dispatch, pause, resume, stop;
+        for (unsigned int cycle = 0; cycle < warmupCycles + cycles; cycle++)
+        {
+            bool measure = cycle >= warmupCycles;
+            std::thread dispatcher([&service, &host]() { ServiceBase::Run(service, host); });
+
+            Clock::time_point sent = Clock::now();
+            host.SendStart(1, pszArgv);
+            double elapsed = MicrosecondsSince(sent);
+            if (measure)
+                start.push_back(elapsed);
+
+            for (unsigned int i = 0; i < interrogatesPerCycle; i++)
+            {
+                sent = Clock::now();
+                host.SendControl(SERVICE_CONTROL_INTERROGATE);
+                elapsed = MicrosecondsSince(sent);
+                if (measure)
+                    dispatch.push_back(elapsed);
+            }
+
+            sent = Clock::now();
+            host.SendControl(SERVICE_CONTROL_PAUSE);
+            host.WaitForState(SERVICE_PAUSED);
+            elapsed = MicrosecondsSince(sent);
+            if (measure)
+                pause.push_back(elapsed);
+
+            sent = Clock::now();
+            host.SendControl(SERVICE_CONTROL_CONTINUE);
+            host.WaitForState(SERVICE_RUNNING);
+            elapsed = MicrosecondsSince(sent);
+            if (measure)
+                resume.push_back(elapsed);
+
+            sent = Clock::now();
+            host.SendControl(SERVICE_CONTROL_STOP);
+            host.WaitForState(SERVICE_STOPPED);
+            elapsed = MicrosecondsSince(sent);
+            if (measure)
+                stop.push_back(elapsed);
+
+            dispatcher.join();
+        }
+
+        ReportLatencies(L"lifecycle", L"start", start);
+        ReportLatencies(L"lifecycle", L"dispatch", dispatch);
+        ReportLatencies(L"lifecycle", L"pause", pause);
+        ReportLatencies(L"lifecycle", L"continue", resume);
+        ReportLatencies(L"lifecycle", L"stop", stop);
+    }
+
+    // A host that only counts the status reports that reach it.
+    class CountingServiceHost : public InProcessServiceHost
+    {
+    public:
+        CountingServiceHost(void) : m_reports(0) {}
+
+        virtual void ReportStatus(ServiceBase &service, const SERVICE_STATUS &status)
+        {
+            m_reports.fetch_add(1, std::memory_order_relaxed);
+            InProcessServiceHost::ReportStatus(service, status);
+        }
+
+        unsigned long long GetReportCount(void) const { return m_reports.load(); }
+
+    private:
+        std::atomic<unsigned long long> m_reports;
+    };
+
+    // A service whose start is a burst of progress updates from several
+    // threads, as parallel startup stages and workers produce them.
+    class StatusService : public ServiceBase
+    {
+    public:
+        StatusService(unsigned int threads, unsigned int updatesPerThread)
+            : ServiceBase(const_cast<PWSTR>(L"StatusBenchmark")),
+              m_threads(threads), m_updatesPerThread(updatesPerThread),
+              m_seconds(0), m_reads(0)
+        {
+        }
+
+        double GetSeconds(void) const { return m_seconds; }
+        unsigned long long GetReadCount(void) const { return m_reads; }
+
+    protected:
+        virtual void OnStart(DWORD, PWSTR *)
+        {
+            std::atomic<bool> done(false);
+            std::atomic<unsigned long long> reads(0);
+            std::thread reader([this, &done, &reads]() {
+                while (!done.load())
+                {
+                    GetStatus();
+                    reads.fetch_add(1, std::memory_order_relaxed);
+                }
+            });
+
+            Clock::time_point start = Clock::now();
+            std::vector<std::thread> writers;
+            for (unsigned int i = 0; i < m_threads; i++)
+            {
+                writers.push_back(std::thread([this]() {
+                    for (unsigned int n = 0; n < m_updatesPerThread; n++)
+                    {
+                        SetServiceStatus(SERVICE_START_PENDING, NO_ERROR, 30000);
+                    }
+                }));
+            }
+            for (size_t i = 0; i < writers.size(); i++)
+            {
+                writers[i].join();
+            }
+            m_seconds = SecondsSince(start);
+
+            done.store(true);
+            reader.join();
+            m_reads = reads.load();
+        }
+
+    private:
+        unsigned int m_threads;
+        unsigned int m_updatesPerThread;
+        double m_seconds;
+        unsigned long long m_reads;
+    };
+
+    /**
+     *   Status publication: writer threads report start progress as fast as
+     *   they can while another thread reads the status. Reports how long an
+     *   update takes and how many of them reached the host after
+     *   coalescing.
+     */
+    void StatusBenchmark(void)
+    {
+        const unsigned int threads = 4;
+        const unsigned int updatesPerThread = 100000;
+
+        std::atomic<unsigned long long> records(0);
+        Logger logger(1024);
+        logger.AddSink(std::unique_ptr<LogSink>(new NullLogSink(records)));
+
+        StatusService service(threads, updatesPerThread);
+        service.SetLogger(logger);
+        CountingServiceHost host;
+        std::thread dispatcher([&service, &host]() { ServiceBase::Run(service, host); });
+
+        PWSTR pszArgv[] = {const_cast<PWSTR>(L"StatusBenchmark"), NULL};
+        host.SendStart(1, pszArgv);
+        unsigned long long reports = host.GetReportCount();
+        host.SendControl(SERVICE_CONTROL_STOP);
+        dispatcher.join();
+
+        double updates = static_cast<double>(threads) * updatesPerThread;
+        double nanoseconds = service.GetSeconds() * 1e9 / updates;
+        wprintf(L"status: %u writer(s), %.0f updates, %.1f ns/update, %llu reported to the host, "
+                L"%llu lock-free reads\n",
+                threads, updates, nanoseconds, reports, service.GetReadCount());
+
+        Record(L"status", L"update", nanoseconds, L"ns");
+        Record(L"status", L"reported", static_cast<double>(reports), L"reports");
+    }
+
+    // A host that records every state its service reports, so the history
+    // can be checked, and lets any thread deliver a control directly, the
+    // way concurrent requests reach the SCM dispatcher.
+    class RecordingServiceHost : public InProcessServiceHost
+    {
+    public:
+        virtual void ReportStatus(ServiceBase &service, const SERVICE_STATUS &status)
+        {
+            {
+                std::lock_guard<std::mutex> guard(m_historyLock);
+                m_history.push_back(status.dwCurrentState);
+            }
+            InProcessServiceHost::ReportStatus(service, status);
+        }
+
+        DWORD Deliver(ServiceBase &service, DWORD dwCtrl) { return Control(service, dwCtrl); }
+
+        std::vector<DWORD> GetHistory(void) const
+        {
+            std::lock_guard<std::mutex> guard(m_historyLock);
+            return m_history;
+        }
+
+    private:
+        mutable std::mutex m_historyLock;
+        std::vector<DWORD> m_history;
+    };
+
+    // A service whose pause takes a moment and sometimes fails, so that
+    // controls arrive while transitions are in progress.
+    class ControlService : public ServiceBase
+    {
+    public:
+        ControlService(void)
+            : ServiceBase(const_cast<PWSTR>(L"ControlBenchmark"), TRUE, TRUE, TRUE),
+              m_pauses(0)
+        {
+        }
+
+    protected:
+        virtual void OnPause()
+        {
+            std::this_thread::yield();
+            if (++m_pauses % 7 == 0)
+            {
+                throw static_cast<DWORD>(ERROR_OPERATION_ABORTED);
+            }
+        }
+
+        virtual void OnContinue()
+        {
+            std::this_thread::yield();
+        }
+
+    private:
+        unsigned int m_pauses;
+    };
+
+    // Whether a service may report dwTo right after dwFrom.
+    bool IsLegalTransition(DWORD dwFrom, DWORD dwTo)
+    {
+        if (dwFrom == dwTo)
+        {
+            return true;
+        }
+        switch (dwFrom)
+        {
+        case SERVICE_STOPPED:
+            return dwTo == SERVICE_START_PENDING;
+        case SERVICE_START_PENDING:
+            return dwTo == SERVICE_RUNNING || dwTo == SERVICE_STOP_PENDING || dwTo == SERVICE_STOPPED;
+        case SERVICE_RUNNING:
+            return dwTo == SERVICE_PAUSE_PENDING || dwTo == SERVICE_STOP_PENDING || dwTo == SERVICE_STOPPED;
+        case SERVICE_PAUSE_PENDING:
+            return dwTo == SERVICE_PAUSED || dwTo == SERVICE_RUNNING;
+        case SERVICE_PAUSED:
+            return dwTo == SERVICE_CONTINUE_PENDING || dwTo == SERVICE_STOP_PENDING || dwTo == SERVICE_STOPPED;
+        case SERVICE_CONTINUE_PENDING:
+            return dwTo == SERVICE_RUNNING || dwTo == SERVICE_PAUSED;
+        case SERVICE_STOP_PENDING:
+            return dwTo == SERVICE_STOPPED || dwTo == SERVICE_RUNNING || dwTo == SERVICE_PAUSED;
+        default:
+            return false;
+        }
+    }
+
+    /**
+     *   Control dispatch under contention: threads fire pause, continue and
+     *   interrogate requests at a running service as fast as they can, then
+     *   race to stop or shut it down, over several start/stop rounds.
+     *   Reports how long the dispatcher is held per control and how many
+     *   were coalesced or rejected, and checks that every state the
+     *   service reported is a legal successor of the one before.
+     */
+    void ControlsBenchmark(void)
+    {
+        const unsigned int rounds = 20;
+        const unsigned int threads = 4;
+        const unsigned int controlsPerThread = 2500;
+        const unsigned int stopsPerThread = 10;
+        const DWORD controls[] = {SERVICE_CONTROL_PAUSE, SERVICE_CONTROL_CONTINUE,
+                                  SERVICE_CONTROL_INTERROGATE, SERVICE_CONTROL_PAUSE,
+                                  SERVICE_CONTROL_CONTINUE};
+
+        std::atomic<unsigned long long> records(0);
+        Logger logger(1024);
+        logger.AddSink(std::unique_ptr<LogSink>(new NullLogSink(records)));
+
+        ControlService service;
+        service.SetLogger(logger);
+        RecordingServiceHost host;
+        PWSTR pszArgv[] = {const_cast<PWSTR>(L"ControlBenchmark"), NULL};
+
+        std::atomic<unsigned long long> accepted(0);
+        std::atomic<unsigned long long> rejected(0);
+        std::vector<double> ack;
+        std::mutex ackLock;
+        for (unsigned int round = 0; round < rounds; round++)
+        {
+            std::thread dispatcher([&service, &host]() { ServiceBase::Run(service, host); });
+            host.SendStart(1, pszArgv);
+
+            std::vector<std::thread> senders;
+            for (unsigned int t = 0; t < threads; t++)
+            {
+                senders.push_back(std::thread([&, t]() {
+                    std::vector<double> samples;
+                    samples.reserve(controlsPerThread + stopsPerThread);
+                    for (unsigned int n = 0; n < controlsPerThread + stopsPerThread; n++)
+                    {
+                        DWORD dwCtrl = (n < controlsPerThread)
+                                           ? controls[(n + t) % ARRAYSIZE(controls)]
+                                           : ((n + t) % 2 ? SERVICE_CONTROL_STOP : SERVICE_CONTROL_SHUTDOWN);
+                        Clock::time_point sent = Clock::now();
+                        DWORD dwError = host.Deliver(service, dwCtrl);
+                        samples.push_back(MicrosecondsSince(sent));
+                        (dwError == NO_ERROR ? accepted : rejected).fetch_add(1, std::memory_order_relaxed);
+
+                        // Give the control thread a chance to apply some
+                        // transitions before the next burst.
+                        if (n % 16 == 15)
+                        {
+                            std::this_thread::yield();
+                        }
+                    }
+                    std::lock_guard<std::mutex> guard(ackLock);
+                    ack.insert(ack.end(), samples.begin(), samples.end());
+                }));
+            }
+            for (size_t i = 0; i < senders.size(); i++)
+            {
+                senders[i].join();
+            }
+            dispatcher.join();
+        }
+
+        std::vector<DWORD> history = host.GetHistory();
+        unsigned long long illegal = 0;
+        for (size_t i = 1; i < history.size(); i++)
+        {
+            if (!IsLegalTransition(history[i - 1], history[i]))
+            {
+                if (illegal == 0)
+                {
+                    wprintf(L"controls: illegal transition from state %lu to %lu at report %u\n",
+                            history[i - 1], history[i], static_cast<unsigned int>(i));
+                }
+                illegal++;
+            }
+        }
+        if (history.empty() || history.back() != SERVICE_STOPPED)
+        {
+            illegal++;
+        }
+
+        std::vector<MetricValue> metrics = MetricsRegistry::Default().Read();
+        unsigned long long coalesced = 0;
+        for (size_t i = 0; i < metrics.size(); i++)
+        {
+            if (metrics[i].name == "ControlBenchmark.controls_coalesced")
+            {
+                coalesced = static_cast<unsigned long long>(metrics[i].value);
+            }
+        }
+
+        ReportLatencies(L"controls", L"ack", ack);
+        wprintf(L"controls: %u round(s), %llu accepted (%llu coalesced), %llu rejected, "
+                L"%u reports, %llu illegal transition(s)\n",
+                rounds, accepted.load(), coalesced, rejected.load(),
+                static_cast<unsigned int>(history.size()), illegal);
+
+        Record(L"controls", L"accepted", static_cast<double>(accepted.load()), L"controls");
+        Record(L"controls", L"coalesced", static_cast<double>(coalesced), L"controls");
+        Record(L"controls", L"rejected", static_cast<double>(rejected.load()), L"controls");
+        Record(L"controls", L"illegal", static_cast<double>(illegal), L"transitions");
+        if (illegal != 0)
+        {
+            s_failed = true;
+        }
+    }
+
+    // Blocking client sockets for the socket benchmark.
+#ifdef _WIN32
+    typedef SOCKET ClientSocket;
+    const ClientSocket InvalidClientSocket = INVALID_SOCKET;
+
+    void CloseClientSocket(ClientSocket socket)
+    {
+        closesocket(socket);
+    }
+#else
+    typedef int ClientSocket;
+    const ClientSocket InvalidClientSocket = -1;
+
+    void CloseClientSocket(ClientSocket socket)
+    {
+        close(socket);
+    }
+#endif
+
+    // Connect a TCP or UDP socket to a port on 127.0.0.1, with a receive
+    // timeout so that a lost reply cannot hang the benchmark.
+    ClientSocket ConnectLoopback(bool fTcp, unsigned short port)
+    {
+        ClientSocket client = socket(AF_INET, fTcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+        if (client == InvalidClientSocket)
+        {
+            return InvalidClientSocket;
+        }
+
+#ifdef _WIN32
+        DWORD timeout = 2000;
+#else
+        timeval timeout = {2, 0};
+#endif
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char *>(&timeout), sizeof(timeout));
+        int on = 1;
+        if (fTcp)
+        {
+            setsockopt(client, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&on), sizeof(on));
+        }
+
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(client, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+        {
+            CloseClientSocket(client);
+            return InvalidClientSocket;
+        }
+        return client;
+    }
+
+    bool SendAll(ClientSocket client, const char *data, size_t size)
+    {
+        while (size != 0)
+        {
+            int sent = static_cast<int>(send(client, data, static_cast<int>(std::min<size_t>(size, 1 << 20)), 0));
+            if (sent <= 0)
+            {
+                return false;
+            }
+            data += sent;
+            size -= static_cast<size_t>(sent);
+        }
+        return true;
+    }
+
+    bool ReceiveAll(ClientSocket client, char *data, size_t size)
+    {
+        while (size != 0)
+        {
+            int received = static_cast<int>(recv(client, data, static_cast<int>(std::min<size_t>(size, 1 << 20)), 0));
+            if (received <= 0)
+            {
+                return false;
+            }
+            data += received;
+            size -= static_cast<size_t>(received);
+        }
+        return true;
+    }
+
+    /**
+     *   Socket server over loopback: an echo server with a TCP and a UDP
+     *   endpoint. Reports TCP round-trip latency with one connection, echo
+     *   throughput with several connections streaming at once, and UDP
+     *   round-trip latency. The server must end with every connection
+     *   closed and every byte echoed.
+     */
+    void SocketBenchmark(void)
+    {
+        const unsigned int roundTrips = 10000;
+        const size_t messageSize = 64;
+        const unsigned int streams = 4;
+        const size_t bytesPerStream = 16 * 1024 * 1024;
+
+        SocketServer server;
+        size_t tcp = server.ListenTcp("127.0.0.1", 0,
+                                      [](const SocketConnectionPtr &connection, const char *data, size_t size) {
+                                          connection->Send(data, size);
+                                      });
+        size_t udp = server.BindUdp("127.0.0.1", 0, [](SocketDatagram &datagram) {
+            datagram.Reply(datagram.GetData(), datagram.GetSize());
+        });
+        try
+        {
+            server.Start();
+        }
+        catch (DWORD dwError)
+        {
+            wprintf(L"socket: the server could not start (error %lu)\n", dwError);
+            s_failed = true;
+            return;
+        }
+
+        bool fOk = true;
+        char message[messageSize];
+        char reply[messageSize];
+        memset(message, 'x', sizeof(message));
+
+        // TCP round trips on one connection.
+        std::vector<double> tcpSamples;
+        ClientSocket client = ConnectLoopback(true, server.GetPort(tcp));
+        fOk = fOk && (client != InvalidClientSocket);
+        for (unsigned int i = 0; fOk && i < roundTrips; i++)
+        {
+            Clock::time_point start = Clock::now();
+            fOk = SendAll(client, message, sizeof(message)) && ReceiveAll(client, reply, sizeof(reply));
+            tcpSamples.push_back(MicrosecondsSince(start));
+        }
+        if (client != InvalidClientSocket)
+        {
+            CloseClientSocket(client);
+        }
+
+        // TCP echo throughput: each connection has a writer and a reader
+        // thread, so neither side waits for the other.
+        std::atomic<unsigned long long> echoed(0);
+        std::atomic<bool> fStreamsOk(true);
+        Clock::time_point start = Clock::now();
+        std::vector<std::thread> threads;
+        std::vector<ClientSocket> clients;
+        for (unsigned int s = 0; s < streams; s++)
+        {
+            ClientSocket stream = ConnectLoopback(true, server.GetPort(tcp));
+            if (stream == InvalidClientSocket)
+            {
+                fStreamsOk = false;
+                continue;
+            }
+            threads.push_back(std::thread([stream, &fStreamsOk]() {
+                std::vector<char> chunk(64 * 1024, 'y');
+                for (size_t sent = 0; sent < bytesPerStream; sent += chunk.size())
+                {
+                    if (!SendAll(stream, chunk.data(), chunk.size()))
+                    {
+                        fStreamsOk = false;
+                        return;
+                    }
+                }
+            }));
+            threads.push_back(std::thread([stream, &echoed, &fStreamsOk]() {
+                std::vector<char> chunk(64 * 1024);
+                for (size_t received = 0; received < bytesPerStream; received += chunk.size())
+                {
+                    if (!ReceiveAll(stream, chunk.data(), chunk.size()))
+                    {
+                        fStreamsOk = false;
+                        return;
+                    }
+                    echoed.fetch_add(chunk.size());
+                }
+            }));
+            clients.push_back(stream);
+        }
+        for (size_t i = 0; i < threads.size(); i++)
+        {
+            threads[i].join();
+        }
+        for (size_t i = 0; i < clients.size(); i++)
+        {
+            CloseClientSocket(clients[i]);
+        }
+        double seconds = SecondsSince(start);
+        fOk = fOk && fStreamsOk.load();
+
+        // UDP round trips.
+        std::vector<double> udpSamples;
+        unsigned int lost = 0;
+        client = ConnectLoopback(false, server.GetPort(udp));
+        fOk = fOk && (client != InvalidClientSocket);
+        for (unsigned int i = 0; fOk && i < roundTrips; i++)
+        {
+            Clock::time_point sent = Clock::now();
+            if (send(client, message, static_cast<int>(sizeof(message)), 0) != static_cast<int>(sizeof(message)) ||
+                recv(client, reply, static_cast<int>(sizeof(reply)), 0) != static_cast<int>(sizeof(reply)))
+            {
+                lost++;
+                continue;
+            }
+            udpSamples.push_back(MicrosecondsSince(sent));
+        }
+        if (client != InvalidClientSocket)
+        {
+            CloseClientSocket(client);
+        }
+
+        server.Stop(5000);
+        if (server.GetConnectionCount() != 0 || echoed.load() != streams * bytesPerStream)
+        {
+            fOk = false;
+        }
+
+        ReportLatencies(L"socket", L"tcp", tcpSamples);
+        ReportLatencies(L"socket", L"udp", udpSamples);
+        double throughput = echoed.load() / seconds / (1024 * 1024);
+        wprintf(L"socket: %u connection(s) echoed %llu MB in %.2f s, %.1f MB/s; %u datagram(s) lost\n",
+                streams, echoed.load() / (1024 * 1024), seconds, throughput, lost);
+        Record(L"socket", L"throughput", throughput, L"MB/s");
+        Record(L"socket", L"udp.lost", lost, L"datagrams");
+
+        if (!fOk)
+        {
+            wprintf(L"socket: the echo did not complete\n");
+            s_failed = true;
+        }
+    }
+
+    CoTask<void> HopLoop(ThreadPool &pool, unsigned int hops)
+    {
+        for (unsigned int i = 0; i < hops; i++)
+        {
+            co_await CoSchedule(pool);
+        }
+    }
+
+    CoTask<unsigned int> Sleeper(TimerService &timers, DWORD dwMilliseconds, unsigned int naps)
+    {
+        unsigned int slept = 0;
+        for (unsigned int i = 0; i < naps; i++)
+        {
+            bool fSlept = co_await CoDelay(dwMilliseconds, StopToken(), timers);
+            if (fSlept)
+                slept++;
+        }
+        co_return slept;
+    }
+
+    CoTask<void> CountSleeps(TimerService &timers, DWORD dwMilliseconds, unsigned int naps,
+                             std::atomic<unsigned int> &total)
+    {
+        total.fetch_add(co_await Sleeper(timers, dwMilliseconds, naps));
+    }
+
+    CoTask<void> StopWaiter(StopToken token, std::atomic<unsigned int> &woken)
+    {
+        co_await CoWaitForStop(token);
+        woken.fetch_add(1);
+    }
+
+    CoTask<void> EchoConnection(SocketConnectionPtr connection)
+    {
+        for (;;)
+        {
+            Buffer data = co_await connection->Read();
+            if (!data)
+                break;
+            connection->Send(data.GetData(), data.GetSize());
+        }
+    }
+
+    /**
+     *   Coroutines on a pool of two workers: one coroutine hops from worker
+     *   to worker, thousands sleep on timers at once, thousands wait for a
+     *   stop, and a TCP echo server runs a coroutine per connection.
+     *   Reports the cost of a hop, how long the sleepers took beyond their
+     *   sleep, how long the stop took to wake every waiter, and the echo
+     *   round-trip latency. Every coroutine must finish.
+     */
+    void CoroutinesBenchmark(void)
+    {
+        const unsigned int hops = 100000;
+        const unsigned int sleepers = 10000;
+        const unsigned int naps = 3;
+        const DWORD nap = 20;
+        const unsigned int waiters = 10000;
+        const unsigned int roundTrips = 2000;
+        bool fOk = true;
+
+        ThreadPool pool(2);
+        TimerService timers(pool);
+
+        Clock::time_point start = Clock::now();
+        CoSpawn(HopLoop(pool, hops), pool).get();
+        double hop = SecondsSince(start) * 1e9 / hops;
+        wprintf(L"coroutines: %.0f ns per hop to the pool\n", hop);
+        Record(L"coroutines", L"hop", hop, L"ns");
+
+        std::atomic<unsigned int> slept(0);
+        std::vector<std::future<void>> done;
+        start = Clock::now();
+        for (unsigned int i = 0; i < sleepers; i++)
+        {
+            done.push_back(CoSpawn(CountSleeps(timers, nap, naps, slept), pool));
+        }
+        for (size_t i = 0; i < done.size(); i++)
+        {
+            done[i].get();
+        }
+        double overhead = SecondsSince(start) * 1e3 - static_cast<double>(nap) * naps;
+        wprintf(L"coroutines: %u sleepers x %u naps of %lu ms on %u threads, %.1f ms over the sleep time\n",
+                sleepers, naps, nap, static_cast<unsigned int>(pool.GetThreadCount()), overhead);
+        Record(L"coroutines", L"sleep.overhead", overhead, L"ms");
+        fOk = fOk && (slept.load() == sleepers * naps);
+
+        StopSource stop;
+        std::atomic<unsigned int> woken(0);
+        done.clear();
+        for (unsigned int i = 0; i < waiters; i++)
+        {
+            done.push_back(CoSpawn(StopWaiter(stop.GetToken(), woken), pool));
+        }
+        start = Clock::now();
+        stop.RequestStop();
+        for (size_t i = 0; i < done.size(); i++)
+        {
+            done[i].get();
+        }
+        double wake = SecondsSince(start) * 1e3;
+        wprintf(L"coroutines: a stop woke %u waiters in %.1f ms\n", woken.load(), wake);
+        Record(L"coroutines", L"stop.wake", wake, L"ms");
+        fOk = fOk && (woken.load() == waiters);
+
+        SocketServer server(pool);
+        size_t tcp = server.ListenTcp("127.0.0.1", 0, EchoConnection);
+        try
+        {
+            server.Start(1);
+        }
+        catch (DWORD dwError)
+        {
+            wprintf(L"coroutines: the server could not start (error %lu)\n", dwError);
+            s_failed = true;
+            return;
+        }
+
+        std::vector<double> samples;
+        char message[64];
+        char reply[64];
+        memset(message, 'x', sizeof(message));
+        ClientSocket client = ConnectLoopback(true, server.GetPort(tcp));
+        fOk = fOk && (client != InvalidClientSocket);
+        for (unsigned int i = 0; fOk && i < roundTrips; i++)
+        {
+            Clock::time_point sent = Clock::now();
+            fOk = SendAll(client, message, sizeof(message)) && ReceiveAll(client, reply, sizeof(reply));
+            samples.push_back(MicrosecondsSince(sent));
+        }
+        if (client != InvalidClientSocket)
+        {
+            CloseClientSocket(client);
+        }
+        server.Stop(5000);
+        ReportLatencies(L"coroutines", L"tcp", samples);
+        fOk = fOk && (server.GetConnectionCount() == 0);
+
+        if (!fOk)
+        {
+            wprintf(L"coroutines: not every coroutine finished\n");
+            s_failed = true;
+        }
+    }
+
+    /**
+     *   Buffer churn: threads get bursts of 2 KB buffers and release them,
+     *   first with new[]/delete[] and then from a BufferPool; then one
+     *   thread gets the bursts and another releases them, as when a reader
+     *   hands buffers to a worker. Reports the cost of a get and release
+     *   pair, and the pool's cache hit rate and high-water mark.
+     */
+    void BuffersBenchmark(void)
+    {
+        const unsigned int threadCounts[] = {1, 4};
+        const size_t bufferSize = BufferPool::DefaultBufferSize;
+        const unsigned int burst = 64;
+        const unsigned int rounds = 20000;
+        std::atomic<unsigned long long> sink(0);
+
+        for (size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++)
+        {
+            unsigned int threads = threadCounts[t];
+            BufferPool pool(bufferSize);
+            double nanoseconds[2];
+            for (int fPool = 0; fPool < 2; fPool++)
+            {
+                Clock::time_point start = Clock::now();
+                std::vector<std::thread> workers;
+                for (unsigned int i = 0; i < threads; i++)
+                {
+                    workers.push_back(std::thread([&, fPool]() {
+                        std::vector<char *> heap(burst);
+                        std::vector<Buffer> pooled(burst);
+                        unsigned long long total = 0;
+                        for (unsigned int r = 0; r < rounds; r++)
+                        {
+                            for (unsigned int n = 0; n < burst; n++)
+                            {
+                                char *data;
+                                if (fPool)
+                                {
+                                    pooled[n] = pool.Allocate();
+                                    data = pooled[n].GetData();
+                                }
+                                else
+                                {
+                                    heap[n] = new char[bufferSize];
+                                    data = heap[n];
+                                }
+                                data[0] = static_cast<char>(n);
+                                total += static_cast<unsigned char>(data[0]);
+                            }
+                            for (unsigned int n = 0; n < burst; n++)
+                            {
+                                if (fPool)
+                                    pooled[n].Reset();
+                                else
+                                    delete[] heap[n];
+                            }
+                        }
+                        sink.fetch_add(total, std::memory_order_relaxed);
+                    }));
+                }
+                for (size_t i = 0; i < workers.size(); i++)
+                {
+                    workers[i].join();
+                }
+                nanoseconds[fPool] = SecondsSince(start) * 1e9 / (static_cast<double>(rounds) * burst);
+            }
+
+            BufferPool::Statistics statistics = pool.GetStatistics();
+            wprintf(L"buffers: %u thread(s), new/delete %.1f ns, pool %.1f ns per buffer; "
+                    L"%.2f%% cache hits, high water %u\n",
+                    threads, nanoseconds[0], nanoseconds[1],
+                    100.0 * statistics.cacheHits / statistics.allocations,
+                    static_cast<unsigned int>(statistics.highWater));
+
+            std::wstring prefix = (threads == 1) ? L"threads1" : L"threads4";
+            Record(L"buffers", (prefix + L".heap").c_str(), nanoseconds[0], L"ns");
+            Record(L"buffers", (prefix + L".pool").c_str(), nanoseconds[1], L"ns");
+            Record(L"buffers", (prefix + L".hit_rate").c_str(),
+                   100.0 * statistics.cacheHits / statistics.allocations, L"%");
+        }
+
+        // Handoff: every burst is released on the other thread.
+        BufferPool pool(bufferSize);
+        double nanoseconds[2];
+        for (int fPool = 0; fPool < 2; fPool++)
+        {
+            std::mutex lock;
+            std::condition_variable changed;
+            std::vector<char *> heapBurst;
+            std::vector<Buffer> pooledBurst;
+            bool fFull = false;
+            bool fDone = false;
+
+            Clock::time_point start = Clock::now();
+            std::thread consumer([&]() {
+                for (;;)
+                {
+                    std::vector<char *> heap;
+                    std::vector<Buffer> pooled;
+                    {
+                        std::unique_lock<std::mutex> guard(lock);
+                        changed.wait(guard, [&]() { return fFull || fDone; });
+                        if (!fFull)
+                            return;
+                        heap.swap(heapBurst);
+                        pooled.swap(pooledBurst);
+                        fFull = false;
+                    }
+                    changed.notify_all();
+                    for (size_t n = 0; n < heap.size(); n++)
+                    {
+                        delete[] heap[n];
+                    }
+                }
+            });
+            for (unsigned int r = 0; r < rounds; r++)
+            {
+                std::vector<char *> heap;
+                std::vector<Buffer> pooled;
+                for (unsigned int n = 0; n < burst; n++)
+                {
+                    if (fPool)
+                        pooled.push_back(pool.Allocate());
+                    else
+                        heap.push_back(new char[bufferSize]);
+                }
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&]() { return !fFull; });
+                heapBurst.swap(heap);
+                pooledBurst.swap(pooled);
+                fFull = true;
+                changed.notify_all();
+            }
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&]() { return !fFull; });
+                fDone = true;
+            }
+            changed.notify_all();
+            consumer.join();
+            nanoseconds[fPool] = SecondsSince(start) * 1e9 / (static_cast<double>(rounds) * burst);
+        }
+
+        BufferPool::Statistics statistics = pool.GetStatistics();
+        wprintf(L"buffers: handoff, new/delete %.1f ns, pool %.1f ns per buffer; "
+                L"%.2f%% cache hits, high water %u, %u buffers in %u slab(s), %u in use\n",
+                nanoseconds[0], nanoseconds[1],
+                100.0 * statistics.cacheHits / statistics.allocations,
+                static_cast<unsigned int>(statistics.highWater),
+                static_cast<unsigned int>(statistics.buffers),
+                static_cast<unsigned int>(statistics.slabs),
+                static_cast<unsigned int>(statistics.inUse));
+        Record(L"buffers", L"handoff.heap", nanoseconds[0], L"ns");
+        Record(L"buffers", L"handoff.pool", nanoseconds[1], L"ns");
+        Record(L"buffers", L"handoff.hit_rate", 100.0 * statistics.cacheHits / statistics.allocations, L"%");
+        if (statistics.inUse != 0)
+        {
+            s_failed = true;
+        }
+    }
+
+    // Keep the calling thread busy for the given time, as a stand-in for
+    // real work.
+    void Spin(double microseconds)
+    {
+        Clock::time_point start = Clock::now();
+        while (SecondsSince(start) * 1e6 < microseconds)
+        {
+        }
+    }
+
+    /**
+     *   Priority classes under load: each probe is queued behind a burst of
+     *   bulk work, first at normal priority like the bulk, then at high
+     *   priority. Then the workers are held up while a bounded low priority
+     *   queue overflows under each policy. Reports how long the probes
+     *   waited and how long a blocked submitter waits, and checks what each
+     *   policy accepted, refused and shed.
+     */
+    void PriorityBenchmark(void)
+    {
+        const unsigned int probes = 200;
+        const unsigned int bulkPerProbe = 20;
+        const double bulkMicroseconds = 50;
+
+        const WorkPriority priorities[] = {PriorityNormal, PriorityHigh};
+        const wchar_t *const names[] = {L"normal", L"high"};
+        for (size_t p = 0; p < 2; p++)
+        {
+            ThreadPool pool(2);
+            std::vector<double> samples;
+            for (unsigned int i = 0; i < probes; i++)
+            {
+                for (unsigned int n = 0; n < bulkPerProbe; n++)
+                {
+                    pool.Submit([bulkMicroseconds]() { Spin(bulkMicroseconds); }, PriorityNormal);
+                }
+
+                std::mutex lock;
+                std::condition_variable ran;
+                bool fRan = false;
+                double waited = 0;
+                Clock::time_point queued = Clock::now();
+                pool.Submit([&]() {
+                    std::lock_guard<std::mutex> guard(lock);
+                    waited = SecondsSince(queued) * 1e6;
+                    fRan = true;
+                    ran.notify_one();
+                }, priorities[p]);
+
+                std::unique_lock<std::mutex> guard(lock);
+                ran.wait(guard, [&]() { return fRan; });
+                samples.push_back(waited);
+            }
+            ReportLatencies(L"priority", names[p], samples);
+        }
+
+        // Overflow: both workers wait on a gate while a low priority queue
+        // of 16 items is offered 100, or 17 when the submitter blocks.
+        const unsigned int capacity = 16;
+        const unsigned int offered = 100;
+        const OverflowPolicy policies[] = {OverflowReject, OverflowShedOldest, OverflowBlock};
+        const wchar_t *const policyNames[] = {L"reject", L"shed", L"block"};
+        for (size_t p = 0; p < 3; p++)
+        {
+            bool fBlock = (policies[p] == OverflowBlock);
+            ThreadPool pool(2);
+            QueueLimit limit = {capacity, policies[p], 20};
+            pool.SetQueueLimit(PriorityLow, limit);
+
+            std::mutex lock;
+            std::condition_variable opened;
+            bool fOpen = false;
+            std::atomic<unsigned int> waiting(0);
+            for (int w = 0; w < 2; w++)
+            {
+                pool.Submit([&]() {
+                    waiting.fetch_add(1);
+                    std::unique_lock<std::mutex> guard(lock);
+                    opened.wait(guard, [&]() { return fOpen; });
+                });
+            }
+            while (waiting.load() != 2)
+            {
+                std::this_thread::yield();
+            }
+
+            std::atomic<unsigned int> ran(0);
+            unsigned int submitted = fBlock ? capacity + 1 : offered;
+            unsigned int accepted = 0;
+            for (unsigned int i = 0; i < submitted; i++)
+            {
+                if (pool.Submit([&ran]() { ran.fetch_add(1); }, PriorityLow))
+                    accepted++;
+            }
+            unsigned int expectedRan = capacity;
+            unsigned int expectedAccepted = (policies[p] == OverflowShedOldest) ? offered : capacity;
+
+            double blocked = 0;
+            if (fBlock)
+            {
+                // The last submission timed out. Without a timeout the next
+                // one waits until the gate opens and a worker makes room.
+                limit.dwTimeout = INFINITE;
+                pool.SetQueueLimit(PriorityLow, limit);
+                std::thread opener([&]() {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                    std::lock_guard<std::mutex> guard(lock);
+                    fOpen = true;
+                    opened.notify_all();
+                });
+                Clock::time_point start = Clock::now();
+                if (pool.Submit([&ran]() { ran.fetch_add(1); }, PriorityLow))
+                    accepted++;
+                blocked = SecondsSince(start) * 1e6;
+                opener.join();
+                submitted++;
+                expectedRan++;
+                expectedAccepted++;
+            }
+            else
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                fOpen = true;
+                opened.notify_all();
+            }
+            pool.Shutdown();
+
+            wprintf(L"priority: %-6ls offered %u, accepted %u, ran %u", policyNames[p],
+                    submitted, accepted, ran.load());
+            if (fBlock)
+                wprintf(L", blocked %.0f us", blocked);
+            wprintf(L"\n");
+
+            std::wstring metric(policyNames[p]);
+            Record(L"priority", (metric + L".accepted").c_str(), accepted, L"items");
+            if (fBlock)
+                Record(L"priority", L"block.wait", blocked, L"us");
+            if (accepted != expectedAccepted || ran.load() != expectedRan)
+            {
+                s_failed = true;
+            }
+        }
+    }
+
+    // A host that notes when a service last reported SERVICE_RUNNING, so
+    // that a continue is timed to the report itself rather than to when
+    // the thread waiting for it next gets a CPU from the busy workers.
+    class RunningServiceHost : public InProcessServiceHost
+    {
+    public:
+        virtual void ReportStatus(ServiceBase &service, const SERVICE_STATUS &status)
+        {
+            if (status.dwCurrentState == SERVICE_RUNNING)
+            {
+                std::lock_guard<std::mutex> guard(m_runningLock);
+                m_running = Clock::now();
+            }
+            InProcessServiceHost::ReportStatus(service, status);
+        }
+
+        Clock::time_point GetRunningTime(void) const
+        {
+            std::lock_guard<std::mutex> guard(m_runningLock);
+            return m_running;
+        }
+
+    private:
+        mutable std::mutex m_runningLock;
+        Clock::time_point m_running;
+    };
+
+    // A service with a pool, timer service and socket server of its own,
+    // which it holds still while it is paused. Bulk work is fed to the
+    // pool from outside and a timer ticks every millisecond.
+    class PauseService : public ServiceBase
+    {
+    public:
+        PauseService(void)
+            : ServiceBase(const_cast<PWSTR>(L"PauseBenchmark"), TRUE, TRUE, TRUE),
+              m_pool(2), m_timers(m_pool, 1), m_server(m_pool), m_timer(0), m_started(0), m_ticks(0),
+              m_fMarked(false)
+        {
+            m_tcp = m_server.ListenTcp("127.0.0.1", 0, [](const SocketConnectionPtr &, const char *, size_t) {});
+
+            // What produces work first, the pool that runs it last.
+            AddPausable(m_server);
+            AddPausable(m_timers);
+            AddPausable(m_pool);
+        }
+
+        // Queue an item of bulk work, which notes that it started, and when
+        // if it is the first since MarkFirstStart.
+        bool SubmitWork(double microseconds)
+        {
+            return m_pool.Submit([this, microseconds]() {
+                m_started.fetch_add(1);
+                if (m_fMarked.exchange(false))
+                {
+                    std::lock_guard<std::mutex> guard(m_firstLock);
+                    m_firstStart = Clock::now();
+                }
+                Spin(microseconds);
+            });
+        }
+
+        // Note the start of the next item of bulk work.
+        void MarkFirstStart(void) { m_fMarked = true; }
+        Clock::time_point GetFirstStart(void) const
+        {
+            std::lock_guard<std::mutex> guard(m_firstLock);
+            return m_firstStart;
+        }
+
+        ThreadPool &GetPool(void) { return m_pool; }
+        unsigned short GetPort(void) const { return m_server.GetPort(m_tcp); }
+        size_t GetConnectionCount(void) const { return m_server.GetConnectionCount(); }
+        unsigned long long GetStarted(void) const { return m_started.load(); }
+        unsigned long long GetTicks(void) const { return m_ticks.load(); }
+
+    protected:
+        virtual void OnStart(DWORD, PWSTR *)
+        {
+            m_server.Start(1);
+            m_timer = m_timers.SchedulePeriodic(1, [this]() { m_ticks.fetch_add(1); });
+        }
+
+        virtual void OnStop()
+        {
+            m_timers.Cancel(m_timer);
+            m_server.Stop(1000);
+        }
+
+    private:
+        ThreadPool m_pool;
+        TimerService m_timers;
+        SocketServer m_server;
+        size_t m_tcp;
+        TimerService::TimerId m_timer;
+        std::atomic<unsigned long long> m_started;
+        std::atomic<unsigned long long> m_ticks;
+        std::atomic<bool> m_fMarked;
+        mutable std::mutex m_firstLock;
+        Clock::time_point m_firstStart;
+    };
+
+    /**
+     *   Pause and continue under load: while bulk work keeps the pool of a
+     *   service busy, the service is paused and continued repeatedly.
+     *   While it is paused a connection is made and a high priority probe
+     *   is queued. Reports how long the pause took to quiesce, how long the
+     *   continue took to be reported and how soon held work started again,
+     *   both as stamped by the service and the work themselves, and how
+     *   long the probe waited; checks that no bulk work, timer or accept ran while
+     *   paused, and that all of them did after the continue.
+     */
+    void PauseBenchmark(void)
+    {
+        const unsigned int cycles = 50;
+        const double bulkMicroseconds = 200;
+        const size_t backlog = 32;
+        bool fHeld = true;
+        bool fResumed = true;
+
+        std::atomic<unsigned long long> records(0);
+        Logger logger(1024);
+        logger.AddSink(std::unique_ptr<LogSink>(new NullLogSink(records)));
+
+        PauseService service;
+        service.SetLogger(logger);
+        RunningServiceHost host;
+        PWSTR pszArgv[] = {const_cast<PWSTR>(L"PauseBenchmark"), NULL};
+        std::thread dispatcher([&service, &host]() { ServiceBase::Run(service, host); });
+        host.SendStart(1, pszArgv);
+        if (!host.WaitForState(SERVICE_RUNNING, 0, 5000))
+        {
+            wprintf(L"pause: the service did not start\n");
+            s_failed = true;
+            host.SendControl(SERVICE_CONTROL_STOP);
+            dispatcher.join();
+            return;
+        }
+
+        // Keep a backlog of bulk work queued on the pool of the service.
+        std::atomic<bool> fFeeding(true);
+        std::thread feeder([&]() {
+            while (fFeeding.load())
+            {
+                if (service.GetPool().GetQueueDepth(PriorityNormal) < backlog)
+                    service.SubmitWork(bulkMicroseconds);
+                else
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        });
+
+        std::vector<double> pause, resume, held, probe;
+        for (unsigned int cycle = 0; cycle < cycles; cycle++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+            Clock::time_point sent = Clock::now();
+            host.SendControl(SERVICE_CONTROL_PAUSE);
+            host.WaitForState(SERVICE_PAUSED);
+            pause.push_back(MicrosecondsSince(sent));
+
+            unsigned long long started = service.GetStarted();
+            unsigned long long ticks = service.GetTicks();
+            size_t connections = service.GetConnectionCount();
+            ClientSocket client = ConnectLoopback(true, service.GetPort());
+
+            std::mutex lock;
+            std::condition_variable ran;
+            bool fRan = false;
+            double waited = 0;
+            Clock::time_point queued = Clock::now();
+            service.GetPool().Submit([&]() {
+                std::lock_guard<std::mutex> guard(lock);
+                waited = MicrosecondsSince(queued);
+                fRan = true;
+                ran.notify_one();
+            }, PriorityHigh);
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                ran.wait(guard, [&]() { return fRan; });
+            }
+            probe.push_back(waited);
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            if (service.GetStarted() != started || service.GetTicks() != ticks ||
+                service.GetConnectionCount() != connections)
+            {
+                fHeld = false;
+            }
+
+            service.MarkFirstStart();
+            sent = Clock::now();
+            host.SendControl(SERVICE_CONTROL_CONTINUE);
+            host.WaitForState(SERVICE_RUNNING);
+            resume.push_back(std::chrono::duration<double, std::micro>(host.GetRunningTime() - sent).count());
+
+            // The held work runs as soon as the workers are let go.
+            while (service.GetStarted() == started && SecondsSince(sent) < 1)
+            {
+                std::this_thread::yield();
+            }
+            held.push_back(std::chrono::duration<double, std::micro>(service.GetFirstStart() - sent).count());
+
+            while ((service.GetTicks() == ticks || service.GetConnectionCount() == connections) &&
+                   SecondsSince(sent) < 1)
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            if (service.GetStarted() == started || service.GetTicks() == ticks ||
+                service.GetConnectionCount() == connections)
+            {
+                fResumed = false;
+            }
+            if (client != InvalidClientSocket)
+            {
+                CloseClientSocket(client);
+            }
+        }
+
+        fFeeding = false;
+        feeder.join();
+        host.SendControl(SERVICE_CONTROL_STOP);
+        host.WaitForState(SERVICE_STOPPED);
+        dispatcher.join();
+
+        ReportLatencies(L"pause", L"pause", pause);
+        ReportLatencies(L"pause", L"continue", resume);
+        ReportLatencies(L"pause", L"held.run", held);
+        ReportLatencies(L"pause", L"high", probe);
+        if (!fHeld)
+        {
+            wprintf(L"pause: work, a timer or an accept ran while the service was paused\n");
+            s_failed = true;
+        }
+        if (!fResumed)
+        {
+            wprintf(L"pause: held work did not run after the continue\n");
+            s_failed = true;
+        }
+
+        // Services sharing a pool pause it once each: it stays paused until
+        // the last of them continues.
+        ThreadPool shared(1);
+        std::atomic<bool> fSharedRan(false);
+        shared.Pause();
+        shared.Pause();
+        shared.Resume();
+        shared.Submit([&fSharedRan]() { fSharedRan = true; });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        bool fHeldByOther = !fSharedRan.load();
+        shared.Resume();
+        shared.WaitUntilIdle(1000);
+        if (!fHeldByOther || !fSharedRan.load())
+        {
+            wprintf(L"pause: a pool paused twice did not stay paused until both resumed\n");
+            s_failed = true;
+        }
+
+        // A timer service shuts down without waiting for a run it queued
+        // on a paused pool; the run, once the pool resumes, does nothing.
+        std::atomic<bool> fHeldRan(false);
+        shared.Pause();
+        Clock::time_point shutdownStart;
+        {
+            TimerService timers(shared, 1);
+            timers.ScheduleOnce(1, [&fHeldRan]() { fHeldRan = true; });
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            shutdownStart = Clock::now();
+        }
+        double shutdownMilliseconds = SecondsSince(shutdownStart) * 1000;
+        shared.Resume();
+        shared.WaitUntilIdle(1000);
+        wprintf(L"pause: timer shutdown on a paused pool %.2f ms\n", shutdownMilliseconds);
+        Record(L"pause", L"timer_shutdown", shutdownMilliseconds, L"ms");
+        if (fHeldRan.load())
+        {
+            wprintf(L"pause: a run queued before its timer service shut down still ran\n");
+            s_failed = true;
+        }
+    }
+
+    // A log sink that counts the warnings that reach it.
+    class WarningLogSink : public LogSink
+    {
+    public:
+        WarningLogSink(std::atomic<unsigned long long> &warnings) : m_warnings(warnings) {}
+
+        virtual void Write(const LogRecord *records, size_t count)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                if (records[i].type == EVENTLOG_WARNING_TYPE)
+                    m_warnings.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+    private:
+        std::atomic<unsigned long long> &m_warnings;
+    };
+
+    // A host that checks the SERVICE_STOP_PENDING reports of a stop: how
+    // many there were, that the checkpoint moved every time, and the
+    // largest wait hint.
+    class StopPendingHost : public InProcessServiceHost
+    {
+    public:
+        StopPendingHost(void) : m_reports(0), m_dwLastCheckPoint(0), m_dwMaxWaitHint(0), m_fMoved(true) {}
+
+        virtual void ReportStatus(ServiceBase &service, const SERVICE_STATUS &status)
+        {
+            if (status.dwCurrentState == SERVICE_STOP_PENDING)
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                if (m_reports > 0 && status.dwCheckPoint <= m_dwLastCheckPoint)
+                    m_fMoved = false;
+                m_reports++;
+                m_dwLastCheckPoint = status.dwCheckPoint;
+                m_dwMaxWaitHint = std::max(m_dwMaxWaitHint, status.dwWaitHint);
+            }
+            InProcessServiceHost::ReportStatus(service, status);
+        }
+
+        unsigned int GetReports(void) const
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            return m_reports;
+        }
+
+        DWORD GetMaxWaitHint(void) const
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            return m_dwMaxWaitHint;
+        }
+
+        bool CheckPointMoved(void) const
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            return m_fMoved;
+        }
+
+    private:
+        mutable std::mutex m_lock;
+        unsigned int m_reports;
+        DWORD m_dwLastCheckPoint;
+        DWORD m_dwMaxWaitHint;
+        bool m_fMoved;
+    };
+
+    // A service whose stop drains the work queued on its pool. On the
+    // abort path the work still queued gives up at once.
+    class DrainService : public ServiceBase
+    {
+    public:
+        DrainService(DWORD dwDeadline)
+            : ServiceBase(const_cast<PWSTR>(L"DrainBenchmark")), m_pool(2), m_executed(0), m_fAbandon(false)
+        {
+            SetDrainDeadlines(dwDeadline, dwDeadline);
+            SetStopLatencyBudget(INFINITE);
+            AddDrainStep(L"work",
+                         [this](DWORD dwMilliseconds) { return m_pool.WaitUntilIdle(dwMilliseconds); },
+                         [this](DWORD) { m_fAbandon = true; });
+        }
+
+        // Queue an item of work that spins unless the drain was aborted.
+        bool SubmitWork(double microseconds)
+        {
+            return m_pool.Submit([this, microseconds]() {
+                if (!m_fAbandon.load())
+                {
+                    Spin(microseconds);
+                    m_executed.fetch_add(1);
+                }
+            });
+        }
+
+        unsigned long long GetExecuted(void) const { return m_executed.load(); }
+
+    private:
+        ThreadPool m_pool;
+        std::atomic<unsigned long long> m_executed;
+        std::atomic<bool> m_fAbandon;
+    };
+
+    /**
+     *   Stops that drain the work queued on the pool of a service: one
+     *   whose work fits in the stop deadline, and one with ten times more
+     *   work than the deadline allows. Reports how long each stop took and
+     *   how many SERVICE_STOP_PENDING reports it made. The first must run
+     *   all its work without a warning; the second must stop within its
+     *   deadline, abandon the rest of its work, and have its warning in
+     *   the log by the time the service reports SERVICE_STOPPED. Every
+     *   wait hint must stay within the deadline, and every report must
+     *   move the checkpoint.
+     */
+    void DrainBenchmark(void)
+    {
+        struct Scenario
+        {
+            const wchar_t *name;
+            unsigned int items;
+            bool fOverrun;
+        };
+        const Scenario scenarios[] = {{L"graceful", 100, false}, {L"overrun", 5000, true}};
+        const DWORD dwDeadline = 1000;
+        const double itemMicroseconds = 2000;
+        const double slackMilliseconds = 250;
+
+        for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++)
+        {
+            const Scenario &scenario = scenarios[s];
+            std::atomic<unsigned long long> warnings(0);
+            Logger logger(1024);
+            logger.AddSink(std::unique_ptr<LogSink>(new WarningLogSink(warnings)));
+
+            DrainService service(dwDeadline);
+            service.SetLogger(logger);
+            StopPendingHost host;
+            PWSTR pszArgv[] = {const_cast<PWSTR>(L"DrainBenchmark"), NULL};
+            std::thread dispatcher([&service, &host]() { ServiceBase::Run(service, host); });
+            host.SendStart(1, pszArgv);
+            if (!host.WaitForState(SERVICE_RUNNING, 0, 5000))
+            {
+                wprintf(L"drain: the service did not start\n");
+                s_failed = true;
+                host.SendControl(SERVICE_CONTROL_STOP);
+                dispatcher.join();
+                return;
+            }
+
+            for (unsigned int i = 0; i < scenario.items; i++)
+            {
+                service.SubmitWork(itemMicroseconds);
+            }
+
+            Clock::time_point sent = Clock::now();
+            host.SendControl(SERVICE_CONTROL_STOP);
+            host.WaitForState(SERVICE_STOPPED);
+            double stop = SecondsSince(sent) * 1e3;
+            unsigned long long logged = warnings.load();
+            dispatcher.join();
+
+            wprintf(L"drain: %ls stop of %u items took %.1f ms with a %lu ms deadline, "
+                    L"%u stop pending reports, %llu items ran\n",
+                    scenario.name, scenario.items, stop, dwDeadline, host.GetReports(),
+                    service.GetExecuted());
+            Record(L"drain", (std::wstring(scenario.name) + L".stop").c_str(), stop, L"ms");
+            Record(L"drain", (std::wstring(scenario.name) + L".reports").c_str(),
+                   static_cast<double>(host.GetReports()), L"reports");
+
+            if (scenario.fOverrun)
+            {
+                if (stop > dwDeadline + slackMilliseconds || service.GetExecuted() == scenario.items)
+                {
+                    wprintf(L"drain: the overrun stop did not abort within its deadline\n");
+                    s_failed = true;
+                }
+                if (logged == 0)
+                {
+                    wprintf(L"drain: the aborted drain did not log its warning before stopping\n");
+                    s_failed = true;
+                }
+            }
+            else if (service.GetExecuted() != scenario.items || logged != 0)
+            {
+                wprintf(L"drain: the graceful stop did not run all its work\n");
+                s_failed = true;
+            }
+            if (host.GetReports() == 0 || host.GetMaxWaitHint() > dwDeadline || !host.CheckPointMoved())
+            {
+                wprintf(L"drain: the stop pending reports were wrong\n");
+                s_failed = true;
+            }
+        }
+    }
+
+    /**
+     *   Metric updates: threads increment a shared counter and record into
+     *   a shared histogram as fast as they can. Reports the cost of one
+     *   update, which is what instrumentation adds to a hot path.
+     */
+    void MetricsBenchmark(void)
+    {
+        const unsigned int threadCounts[] = {1, 4};
+        const unsigned int updatesPerThread = 5000000;
+
+        MetricsRegistry registry;
+        MetricCounter counter = registry.GetCounter(L"benchmark.counter");
+        MetricHistogram histogram = registry.GetHistogram(L"benchmark.histogram");
+
+        for (size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++)
+        {
+            unsigned int threads = threadCounts[t];
+            std::atomic<unsigned long long> counterNanoseconds(0);
+            std::atomic<unsigned long long> histogramNanoseconds(0);
+
+            std::vector<std::thread> workers;
+            for (unsigned int i = 0; i < threads; i++)
+            {
+                workers.push_back(std::thread([&]() {
+                    Clock::time_point start = Clock::now();
+                    for (unsigned int n = 0; n < updatesPerThread; n++)
+                    {
+                        counter.Increment();
+                    }
+                    counterNanoseconds.fetch_add(static_cast<unsigned long long>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count()));
+
+                    start = Clock::now();
+                    for (unsigned int n = 0; n < updatesPerThread; n++)
+                    {
+                        histogram.Record(n & 0xFFF);
+                    }
+                    histogramNanoseconds.fetch_add(static_cast<unsigned long long>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count()));
+                }));
+            }
+            for (size_t i = 0; i < workers.size(); i++)
+            {
+                workers[i].join();
+            }
+
+            double updates = static_cast<double>(threads) * updatesPerThread;
+            double counterCost = counterNanoseconds.load() / updates;
+            double histogramCost = histogramNanoseconds.load() / updates;
+            wprintf(L"metrics: %u thread(s), %.1f ns/increment, %.1f ns/histogram record\n",
+                    threads, counterCost, histogramCost);
+
+            std::wstring prefix = (threads == 1) ? L"threads1" : L"threads4";
+            Record(L"metrics", (prefix + L".increment").c_str(), counterCost, L"ns");
+            Record(L"metrics", (prefix + L".record").c_str(), histogramCost, L"ns");
+        }
+    }
+
+    /**
+     *   Configuration reads while the configuration is reloaded every
+     *   millisecond: reader threads look up a setting through a
+     *   ConfigReader and through Config::Get. Reports the cost of a read
+     *   each way and how many reloads happened meanwhile; every snapshot a
+     *   reader sees must be whole, with its two settings from the same
+     *   load.
+     */
+    void ConfigBenchmark(void)
+    {
+        const unsigned int threadCounts[] = {1, 4};
+        const unsigned int readsPerThread = 1000000;
+
+        Config config(L"");
+        config.LoadText("first = 0\nsecond = 0\n");
+
+        for (size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++)
+        {
+            unsigned int threads = threadCounts[t];
+            std::atomic<unsigned long long> readerNanoseconds(0);
+            std::atomic<unsigned long long> getNanoseconds(0);
+            std::atomic<unsigned int> torn(0);
+            std::atomic<bool> fReading(true);
+            unsigned long long startVersion = config.GetVersion();
+
+            std::thread reloader([&]() {
+                for (unsigned int n = 1; fReading.load(); n++)
+                {
+                    char text[64];
+                    snprintf(text, sizeof(text), "first = %u\nsecond = %u\n", n, n);
+                    config.LoadText(text);
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            });
+
+            std::vector<std::thread> workers;
+            for (unsigned int i = 0; i < threads; i++)
+            {
+                workers.push_back(std::thread([&]() {
+                    ConfigReader reader(config);
+                    unsigned long long sum = 0;
+                    Clock::time_point start = Clock::now();
+                    for (unsigned int n = 0; n < readsPerThread; n++)
+                    {
+                        const ConfigSnapshot &snapshot = reader.Get();
+                        DWORD dwFirst = snapshot.GetDword(L"First", 0);
+                        if (snapshot.GetDword(L"Second", 0) != dwFirst)
+                            torn.fetch_add(1);
+                        sum += dwFirst;
+                    }
+                    readerNanoseconds.fetch_add(static_cast<unsigned long long>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count()));
+
+                    start = Clock::now();
+                    for (unsigned int n = 0; n < readsPerThread; n++)
+                    {
+                        std::shared_ptr<const ConfigSnapshot> snapshot = config.Get();
+                        DWORD dwFirst = snapshot->GetDword(L"First", 0);
+                        if (snapshot->GetDword(L"Second", 0) != dwFirst)
+                            torn.fetch_add(1);
+                        sum += dwFirst;
+                    }
+                    getNanoseconds.fetch_add(static_cast<unsigned long long>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count()));
+
+                    // Keep the reads from being optimized away.
+                    if (sum == 1)
+                        torn.fetch_add(0);
+                }));
+            }
+            for (size_t i = 0; i < workers.size(); i++)
+            {
+                workers[i].join();
+            }
+            fReading = false;
+            reloader.join();
+
+            double reads = static_cast<double>(threads) * readsPerThread;
+            double readerCost = readerNanoseconds.load() / reads;
+            double getCost = getNanoseconds.load() / reads;
+            wprintf(L"config: %u thread(s), %.1f ns/read through a reader, %.1f ns/read through Get, "
+                    L"%llu reloads\n",
+                    threads, readerCost, getCost, config.GetVersion() - startVersion);
+            std::wstring prefix = (threads == 1) ? L"threads1" : L"threads4";
+            Record(L"config", (prefix + L".reader").c_str(), readerCost, L"ns");
+            Record(L"config", (prefix + L".get").c_str(), getCost, L"ns");
+            if (torn.load() != 0)
+            {
+                wprintf(L"config: %u read(s) saw settings from two loads\n", torn.load());
+                s_failed = true;
+            }
+        }
+    }
+
+    // A task that hangs until it is released, long enough to be reported.
+    struct HungTask
+    {
+        std::mutex *lock;
+        std::condition_variable *released;
+        bool *fReleased;
+        Clock::time_point *started;
+
+        void operator()(void)
+        {
+            std::unique_lock<std::mutex> guard(*lock);
+            *started = Clock::now();
+            released->wait_for(guard, std::chrono::seconds(5), [this]() { return *fReleased; });
+        }
+    };
+
+    // A log sink that keeps the messages that reach it.
+    class CaptureLogSink : public LogSink
+    {
+    public:
+        CaptureLogSink(std::mutex &lock, std::vector<std::wstring> &messages)
+            : m_lock(lock), m_messages(messages)
+        {
+        }
+
+        virtual void Write(const LogRecord *records, size_t count)
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            for (size_t i = 0; i < count; i++)
+            {
+                m_messages.push_back(records[i].message);
+            }
+        }
+
+    private:
+        std::mutex &m_lock;
+        std::vector<std::wstring> &m_messages;
+    };
+
+    /**
+     *   Measure what the watchdog costs a task: the stamps a worker makes
+     *   when a task starts and finishes. Then hang a task on a pool and
+     *   report how long the watchdog takes to notice it past its threshold;
+     *   the report must name the task and, where the platform can sample
+     *   stacks, carry the worker's stack. The report is logged to a logger
+     *   of the benchmark's own, which must have a line per frame and, once
+     *   the task is released, the note that it finished.
+     */
+    void WatchdogBenchmark(void)
+    {
+        const unsigned int stamps = 10000000;
+        const DWORD dwThreshold = 200;
+
+        {
+            Watchdog watchdog(INFINITE);
+            WatchdogSlot *slot = watchdog.Register(L"benchmark", 0);
+            Clock::time_point start = Clock::now();
+            for (unsigned int n = 0; n < stamps; n++)
+            {
+                slot->Begin(typeid(HungTask));
+                slot->End();
+            }
+            double stamp = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / stamps;
+            watchdog.Unregister(slot);
+            wprintf(L"watchdog: %.1f ns per task to stamp its start and end\n", stamp);
+            Record(L"watchdog", L"stamp", stamp, L"ns");
+        }
+
+        Watchdog &watchdog = Watchdog::Default();
+        DWORD dwPreviousThreshold = watchdog.GetThreshold();
+
+        std::mutex logLock;
+        std::vector<std::wstring> messages;
+        Logger logger(1024);
+        logger.AddSink(std::unique_ptr<LogSink>(new CaptureLogSink(logLock, messages)));
+        watchdog.SetLogger(logger);
+
+        std::mutex lock;
+        std::condition_variable reported;
+        bool fReported = false;
+        Watchdog::StallReport report;
+        Clock::time_point reportedAt;
+        watchdog.SetStallHandler([&](const Watchdog::StallReport &stall) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!fReported && stall.task.find(L"HungTask") != std::wstring::npos)
+            {
+                report = stall;
+                reportedAt = Clock::now();
+                fReported = true;
+                reported.notify_all();
+            }
+        });
+        watchdog.SetThreshold(dwThreshold);
+
+        std::condition_variable released;
+        bool fReleased = false;
+        Clock::time_point started;
+        {
+            ThreadPool pool(2);
+            HungTask task = {&lock, &released, &fReleased, &started};
+            pool.Submit(task);
+
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                reported.wait_for(guard, std::chrono::seconds(3), [&]() { return fReported; });
+                fReleased = true;
+                released.notify_all();
+            }
+
+            // The watchdog notes that the task finished at its next scan,
+            // as long as the worker is still registered.
+            Clock::time_point releasedAt = Clock::now();
+            while (fReported && SecondsSince(releasedAt) < 3)
+            {
+                logger.Flush(INFINITE);
+                {
+                    std::lock_guard<std::mutex> guard(logLock);
+                    if (!messages.empty() && messages.back().find(L"finished after") != std::wstring::npos)
+                    {
+                        break;
+                    }
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+        watchdog.SetStallHandler(Watchdog::StallHandler());
+        watchdog.SetThreshold(dwPreviousThreshold);
+        watchdog.SetLogger(Logger::Default());
+        logger.Flush(INFINITE);
+
+        if (!fReported)
+        {
+            wprintf(L"watchdog: the hung task was not reported\n");
+            s_failed = true;
+            return;
+        }
+        double detection = std::chrono::duration<double, std::milli>(reportedAt - started).count();
+        wprintf(L"watchdog: a task hung for %lu ms reported after %.0f ms, %lu stack frame(s)\n",
+                dwThreshold, detection, static_cast<unsigned long>(report.stack.size()));
+        Record(L"watchdog", L"detection", detection, L"ms");
+        Record(L"watchdog", L"frames", static_cast<double>(report.stack.size()), L"frames");
+
+        // The warning naming the task, a line per frame, and the end.
+        std::lock_guard<std::mutex> guard(logLock);
+        size_t expected = 1 + std::max<size_t>(report.stack.size(), 1) + 1;
+        if (messages.size() != expected || messages[0].find(L"HungTask") == std::wstring::npos ||
+            messages.back().find(L"finished after") == std::wstring::npos)
+        {
+            wprintf(L"watchdog: the log has %lu line(s) of the report rather than %lu\n",
+                    static_cast<unsigned long>(messages.size()), static_cast<unsigned long>(expected));
+            s_failed = true;
+        }
+#if defined(_WIN32) && !defined(_M_X64)
+        // 32-bit builds sample the current instruction only.
+#else
+        if (report.stack.size() < 2)
+        {
+            wprintf(L"watchdog: the report has no stack sample\n");
+            s_failed = true;
+        }
+#endif
+    }
+
+    /**
+     *   Show the topology of the machine. Then split the CPUs the process
+     *   may use into two made-up nodes, so that placement can be tried on
+     *   any machine, and run bursts of small tasks on a pool placed on
+     *   them: without a locality hint, and with every task hinted to a
+     *   node. Reports the cost of a task and the share of tasks that ran on
+     *   a worker of their node, against an unplaced pool; every task must
+     *   run on a CPU of its worker's node.
+     */
+    void PlacementBenchmark(void)
+    {
+        const unsigned int tasks = 200000;
+        const size_t threads = 4;
+
+        const CpuTopology &machine = CpuTopology::Current();
+        std::string text = machine.ToString();
+        wprintf(L"placement: the machine has %lu node(s): %ls\n", static_cast<unsigned long>(machine.GetNodeCount()),
+                std::wstring(text.begin(), text.end()).c_str());
+
+        // Two nodes of half the CPUs each, or of the same CPU if there is
+        // only one.
+        std::vector<unsigned int> cpus = CpuTopology::GetAllowedCpus();
+        size_t half = (cpus.size() + 1) / 2;
+        std::string lists[2];
+        for (size_t i = 0; i < cpus.size(); i++)
+        {
+            std::string &list = lists[(i < half) ? 0 : 1];
+            list += (list.empty() ? "" : ",") + std::to_string(cpus[i]);
+        }
+        if (lists[1].empty())
+        {
+            lists[1] = lists[0];
+        }
+        CpuTopology topology;
+        topology.Parse(lists[0] + ";" + lists[1]);
+
+        struct Scenario
+        {
+            const wchar_t *name;
+            WorkerAffinity affinity;
+            bool fHinted;
+        };
+        const Scenario scenarios[] = {
+            {L"unplaced", AffinityNone, false},
+            {L"placed", AffinityNode, false},
+            {L"hinted", AffinityNode, true},
+        };
+
+        for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++)
+        {
+            const Scenario &scenario = scenarios[s];
+            PoolPlacement placement;
+            placement.topology = &topology;
+            placement.affinity = scenario.affinity;
+            ThreadPool pool(threads, placement);
+
+            std::atomic<unsigned int> ran(0);
+            std::atomic<unsigned int> local(0);
+            std::atomic<unsigned int> misplaced(0);
+            Clock::time_point start = Clock::now();
+            for (unsigned int n = 0; n < tasks; n++)
+            {
+                size_t node = n % 2;
+                auto task = [&pool, &topology, &ran, &local, &misplaced, node]() {
+                    size_t worker = pool.GetLocality().node;
+                    if (worker == node)
+                        local.fetch_add(1, std::memory_order_relaxed);
+                    if (pool.GetNodeCount() > 1)
+                    {
+                        const std::vector<unsigned int> &nodeCpus = topology.GetNode(worker).cpus;
+                        if (!std::binary_search(nodeCpus.begin(), nodeCpus.end(), CpuTopology::GetCurrentCpu()))
+                            misplaced.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    ran.fetch_add(1, std::memory_order_relaxed);
+                };
+                if (scenario.fHinted)
+                {
+                    Locality locality = {node};
+                    pool.Submit(task, locality);
+                }
+                else
+                {
+                    pool.Submit(task);
+                }
+            }
+            pool.WaitUntilIdle(INFINITE);
+            double nanoseconds = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / tasks;
+
+            double share = 100.0 * local.load() / tasks;
+            wprintf(L"placement: %-8ls %lu node group(s), %.0f ns/task, %.1f%% ran on their node\n", scenario.name,
+                    static_cast<unsigned long>(pool.GetNodeCount()), nanoseconds, share);
+            Record(L"placement", (std::wstring(scenario.name) + L".task").c_str(), nanoseconds, L"ns");
+            Record(L"placement", (std::wstring(scenario.name) + L".local").c_str(), share, L"%");
+            if (ran.load() != tasks || misplaced.load() != 0)
+            {
+                wprintf(L"placement: %ls ran %u of %u tasks, %u on a CPU outside their worker's node\n",
+                        scenario.name, ran.load(), tasks, misplaced.load());
+                s_failed = true;
+            }
+        }
+    }
+
+    /**
+     *   Adaptive sizing under three bursts: tasks that block briefly, tasks
+     *   that block for longer than the controller's interval, and tasks that
+     *   only compute. Each burst runs on a fixed pool of two workers and on
+     *   a pool that may grow from two to 32. Reports how long each burst
+     *   takes and how many workers the adaptive pool peaks at, and checks
+     *   that it beats the fixed pool on blocking work, stays within its
+     *   bounds and is back to two workers once its idle timeout has passed.
+     */
+    void SizingBenchmark(void)
+    {
+        PoolSizing sizing;
+        sizing.minThreads = 2;
+        sizing.maxThreads = 32;
+        sizing.dwInterval = 50;
+        sizing.dwIdleTimeout = 300;
+
+        struct Burst
+        {
+            const wchar_t *name;
+            unsigned int tasks;
+            unsigned int blockMilliseconds;
+            double spinMicroseconds;
+
+            // How much faster the adaptive pool must be, or 0 for no check
+            double speedup;
+        };
+        const Burst bursts[] = {
+            {L"blocking", 200, 20, 0, 1.5},
+            {L"stuck", 16, 300, 0, 1.3},
+            {L"compute", 2000, 0, 500, 0},
+        };
+
+        for (size_t b = 0; b < sizeof(bursts) / sizeof(bursts[0]); b++)
+        {
+            const Burst &burst = bursts[b];
+            auto task = [&burst]() {
+                if (burst.blockMilliseconds != 0)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(burst.blockMilliseconds));
+                else
+                    Spin(burst.spinMicroseconds);
+            };
+
+            double fixed = 0;
+            {
+                ThreadPool pool(2);
+                Clock::time_point start = Clock::now();
+                for (unsigned int n = 0; n < burst.tasks; n++)
+                {
+                    pool.Submit(task);
+                }
+                pool.WaitUntilIdle(INFINITE);
+                fixed = SecondsSince(start) * 1000;
+            }
+
+            ThreadPool pool(sizing);
+            Clock::time_point start = Clock::now();
+            for (unsigned int n = 0; n < burst.tasks; n++)
+            {
+                pool.Submit(task);
+            }
+            size_t peak = pool.GetThreadCount();
+            while (!pool.WaitUntilIdle(5))
+            {
+                peak = std::max(peak, pool.GetThreadCount());
+            }
+            double adaptive = SecondsSince(start) * 1000;
+
+            // The extra workers should retire once they have slept through
+            // the idle timeout.
+            Clock::time_point idleSince = Clock::now();
+            while (pool.GetThreadCount() > sizing.minThreads &&
+                   SecondsSince(idleSince) * 1000 < sizing.dwIdleTimeout * 5)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            size_t after = pool.GetThreadCount();
+
+            wprintf(L"sizing: %-8ls %4u tasks, fixed %6.0f ms, adaptive %6.0f ms, peak %2lu workers, %lu after idle\n",
+                    burst.name, burst.tasks, fixed, adaptive, static_cast<unsigned long>(peak),
+                    static_cast<unsigned long>(after));
+            Record(L"sizing", (std::wstring(burst.name) + L".fixed").c_str(), fixed, L"ms");
+            Record(L"sizing", (std::wstring(burst.name) + L".adaptive").c_str(), adaptive, L"ms");
+            Record(L"sizing", (std::wstring(burst.name) + L".peak").c_str(), static_cast<double>(peak), L"workers");
+            if ((burst.speedup != 0 && adaptive * burst.speedup > fixed) || peak > sizing.maxThreads ||
+                after != sizing.minThreads)
+            {
+                wprintf(L"sizing: %ls did not size as expected\n", burst.name);
+                s_failed = true;
+            }
+        }
+    }
+
+    // A task whose type names its spans in the trace.
+    struct TracedTask
+    {
+        std::atomic<unsigned int> *ran;
+
+        void operator()(void)
+        {
+            Spin(2);
+            ran->fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+
+    // The number of times a piece of text occurs in another.
+    size_t CountOccurrences(const std::string &text, const char *pszPiece)
+    {
+        size_t count = 0;
+        size_t length = strlen(pszPiece);
+        for (size_t at = text.find(pszPiece); at != std::string::npos; at = text.find(pszPiece, at + length))
+        {
+            count++;
+        }
+        return count;
+    }
+
+    /**
+     *   Measure what a TraceSpan costs with tracing off and on. Then run
+     *   small tasks on a pool while tracing, exporting the trace over and
+     *   over while the workers record. Reports the cost of a span, how long
+     *   an export takes and how many events it holds; the last export must
+     *   be a whole document with a span, named after its type, for the
+     *   tasks, and a thread's ring must hold its last RingSize events.
+     */
+    void TraceBenchmark(void)
+    {
+        const unsigned int spans = 5000000;
+        const unsigned int tasks = 100000;
+
+        bool fWasEnabled = Trace::IsEnabled();
+        for (int enabled = 0; enabled < 2; enabled++)
+        {
+            Trace::Enable(enabled != 0);
+            Clock::time_point start = Clock::now();
+            for (unsigned int n = 0; n < spans; n++)
+            {
+                TraceSpan span("benchmark.span", "benchmark");
+            }
+            double cost = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / spans;
+            wprintf(L"trace: %.1f ns per span with tracing %ls\n", cost, enabled ? L"on" : L"off");
+            Record(L"trace", enabled ? L"span.on" : L"span.off", cost, L"ns");
+        }
+        size_t kept = CountOccurrences(Trace::ExportJson(), "\"benchmark.span\"");
+        if (kept != Trace::RingSize)
+        {
+            wprintf(L"trace: the ring kept %lu spans rather than %lu\n", static_cast<unsigned long>(kept),
+                    static_cast<unsigned long>(Trace::RingSize));
+            s_failed = true;
+        }
+
+        Trace::Clear();
+        std::atomic<unsigned int> ran(0);
+        unsigned int exports = 0;
+        double exportMilliseconds = 0;
+        std::string json;
+        {
+            ThreadPool pool(4);
+            for (unsigned int n = 0; n < tasks; n++)
+            {
+                TracedTask task = {&ran};
+                pool.Submit(task);
+            }
+            while (ran.load() < tasks)
+            {
+                Clock::time_point start = Clock::now();
+                json = Trace::ExportJson();
+                exportMilliseconds += SecondsSince(start) * 1000;
+                exports++;
+            }
+            pool.WaitUntilIdle(INFINITE);
+        }
+        Clock::time_point start = Clock::now();
+        json = Trace::ExportJson();
+        exportMilliseconds += SecondsSince(start) * 1000;
+        exports++;
+        Trace::Enable(fWasEnabled);
+        Trace::Clear();
+
+        size_t events = CountOccurrences(json, "\"ph\":\"X\"");
+        size_t taskSpans = CountOccurrences(json, "TracedTask");
+        wprintf(L"trace: %u exports while recording, %.2f ms per export, %lu spans, %lu of them tasks, %lu bytes\n",
+                exports, exportMilliseconds / exports, static_cast<unsigned long>(events),
+                static_cast<unsigned long>(taskSpans), static_cast<unsigned long>(json.size()));
+        Record(L"trace", L"export", exportMilliseconds / exports, L"ms");
+        Record(L"trace", L"events", static_cast<double>(events), L"events");
+        if (json.compare(0, 15, "{\"displayTimeUn") != 0 || json.size() < 4 ||
+            json.compare(json.size() - 4, 4, "\n]}\n") != 0 || taskSpans == 0 || taskSpans > tasks)
+        {
+            wprintf(L"trace: the export is not the trace expected\n");
+            s_failed = true;
+        }
+    }
+
+    /**
+     *   Submit/run round trips on a pool, in bursts: a closure small enough
+     *   to live in the Task and one that takes a block from the closure
+     *   free lists, which the worker frees on another thread than the one
+     *   that submitted. The workers are held while a burst is submitted, so
+     *   that every burst has the same blocks in flight, and its queue is
+     *   reserved for a burst. Each kind runs once to warm the pool and the
+     *   free lists, then again measured, with the submitting thread and the
+     *   workers counting every operator new they make. Reports the cost of a
+     *   task each way, and checks that the measured run allocated nothing.
+     */
+    void TasksBenchmark(void)
+    {
+        const unsigned int bursts = 200;
+        const unsigned int burstSize = 1000;
+
+        ThreadPool pool(1);
+        pool.ReserveQueue(PriorityNormal, burstSize);
+        std::atomic<unsigned long long> ran(0);
+        // The pool keeps at least two workers; each of these tasks holds
+        // its worker until all have started, so every worker runs one.
+        auto countOnWorkers = [&pool](bool fCount) {
+            size_t workers = pool.GetThreadCount();
+            std::atomic<size_t> started(0);
+            for (size_t i = 0; i < workers; i++)
+            {
+                pool.Submit([fCount, workers, &started]() {
+                    t_countAllocations = fCount;
+                    started.fetch_add(1);
+                    while (started.load() < workers)
+                        std::this_thread::yield();
+                });
+            }
+            pool.WaitUntilIdle(INFINITE);
+        };
+
+        for (int pooled = 0; pooled < 2; pooled++)
+        {
+            const wchar_t *pszKind = pooled ? L"pooled" : L"inline";
+            std::array<char, Task::InlineSize * 2> padding = {};
+            size_t allocations = 0;
+            size_t blocks = 0;
+            double nanoseconds = 0;
+            for (int pass = 0; pass < 2; pass++)
+            {
+                bool fMeasured = pass == 1;
+                if (fMeasured)
+                {
+                    countOnWorkers(true);
+                    t_countAllocations = true;
+                }
+                size_t before = s_allocations.load();
+                size_t blocksBefore = Task::GetHeapAllocationCount();
+                Clock::time_point start = Clock::now();
+                for (unsigned int b = 0; b < bursts; b++)
+                {
+                    pool.Pause();
+                    for (unsigned int n = 0; n < burstSize; n++)
+                    {
+                        if (pooled)
+                            pool.Submit([&ran, padding]() { ran.fetch_add(1 + padding[0], std::memory_order_relaxed); });
+                        else
+                            pool.Submit([&ran]() { ran.fetch_add(1, std::memory_order_relaxed); });
+                    }
+                    pool.Resume();
+                    pool.WaitUntilIdle(INFINITE);
+                }
+                nanoseconds = std::chrono::duration<double, std::nano>(Clock::now() - start).count() /
+                              (static_cast<double>(bursts) * burstSize);
+                allocations = s_allocations.load() - before;
+                blocks = Task::GetHeapAllocationCount() - blocksBefore;
+                if (fMeasured)
+                {
+                    t_countAllocations = false;
+                    countOnWorkers(false);
+                }
+            }
+
+            wprintf(L"tasks: %-7ls %.0f ns per task, %lu allocation(s) once warm, %lu of them closure blocks\n",
+                    pszKind, nanoseconds, static_cast<unsigned long>(allocations),
+                    static_cast<unsigned long>(blocks));
+            Record(L"tasks", (std::wstring(pszKind) + L".task").c_str(), nanoseconds, L"ns");
+            Record(L"tasks", (std::wstring(pszKind) + L".allocations").c_str(), static_cast<double>(allocations),
+                   L"allocations");
+            if (allocations != 0)
+            {
+                wprintf(L"tasks: %ls submit/run round trips allocated in steady state\n", pszKind);
+                s_failed = true;
+            }
+        }
+        if (ran.load() != 4ull * bursts * burstSize)
+        {
+            wprintf(L"tasks: %llu of %llu tasks ran\n", ran.load(), 4ull * bursts * burstSize);
+            s_failed = true;
+        }
+    }
+
+    struct Benchmark
+    {
+        const wchar_t *name;
+        void (*run)(void);
+    };
+
+    const Benchmark c_benchmarks[] = {
+        {L"logger", LoggerBenchmark},
+        {L"lifecycle", LifecycleBenchmark},
+        {L"status", StatusBenchmark},
+        {L"controls", ControlsBenchmark},
+        {L"socket", SocketBenchmark},
+        {L"buffers", BuffersBenchmark},
+        {L"priority", PriorityBenchmark},
+        {L"coroutines", CoroutinesBenchmark},
+        {L"pause", PauseBenchmark},
+        {L"drain", DrainBenchmark},
+        {L"metrics", MetricsBenchmark},
+        {L"config", ConfigBenchmark},
+        {L"watchdog", WatchdogBenchmark},
+        {L"placement", PlacementBenchmark},
+        {L"sizing", SizingBenchmark},
+        {L"trace", TraceBenchmark},
+        {L"tasks", TasksBenchmark},
+    };
+}
+
+/**
+ *   Run the named benchmark, or every benchmark when no name is given.
+ *
+ *   @param pszName - the benchmark to run, or NULL for all of them
+ *   @param pszJsonPath - where to write the results as JSON, or NULL
+ *   @return 0 on success, 1 if the name is unknown, a benchmark's
+ *   consistency check failed or the results could not be written
+ */
+int RunBenchmarks(const wchar_t *pszName, const wchar_t *pszJsonPath)
+{
+    bool found = false;
+    for (size_t i = 0; i < sizeof(c_benchmarks) / sizeof(c_benchmarks[0]); i++)
+    {
+        if (pszName == NULL || *pszName == L'\0' || wcscmp(pszName, c_benchmarks[i].name) == 0)
+        {
+            c_benchmarks[i].run();
+            found = true;
+        }
+    }
+
+    if (!found)
+    {
+        wprintf(L"Unknown benchmark %ls.\n", pszName);
+        return 1;
+    }
+
+    if (pszJsonPath != NULL && !WriteResults(pszJsonPath))
+    {
+        wprintf(L"Could not write the results to %ls.\n", pszJsonPath);
+        return 1;
+    }
+    return s_failed ? 1 : 0;
+}
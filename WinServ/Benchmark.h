@@ -0,0 +1,15 @@
+/*
+ * Built-in micro-benchmarks of the framework. They run in-process, without
+ * the service control manager, from "WinServ.exe -benchmark [name]".
+ *
+ */
+
+#pragma once
+
+#include "Platform.h"
+
+// Run the named benchmark, or all of them when pszName is NULL or empty.
+// Results are printed to standard output and, when pszJsonPath is given,
+// written to that file as JSON so runs of different builds can be
+// compared. Returns a process exit code.
+int RunBenchmarks(const wchar_t *pszName, const wchar_t *pszJsonPath = NULL);
@@ -0,0 +1,422 @@
+#pragma region Includes
+#include "BufferPool.h"
+#include <algorithm>
+#include <new>
+#include <unordered_set>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#pragma endregion
+
+namespace
+{
+    // Size of a slab, and of a huge page where the system does not say.
+    const size_t c_slabSize = 1024 * 1024;
+    const size_t c_hugePageSize = 2 * 1024 * 1024;
+
+    // Buffers a thread keeps per pool before handing a batch back to the
+    // depot, and the size of the batches moved between a thread and the
+    // depot.
+    const size_t c_cacheLimit = 64;
+    const size_t c_batchSize = 32;
+
+    std::atomic<uint64_t> g_nextPoolId(1);
+
+    // The ids of the pools that exist. A thread that exits gives its cached
+    // buffers back only to pools that still do; ids are never reused.
+    struct LivePools
+    {
+        std::mutex lock;
+        std::unordered_set<uint64_t> ids;
+
+        static LivePools &Instance(void)
+        {
+            // Never destroyed: thread caches may flush while the process
+            // is exiting.
+            static LivePools *pools = new LivePools();
+            return *pools;
+        }
+    };
+
+    size_t RoundUp(size_t value, size_t multiple)
+    {
+        return (value + multiple - 1) / multiple * multiple;
+    }
+
+    // Allocate zeroed memory for a slab, as huge pages if asked and
+    // possible. Updates size to what was allocated and fHuge to whether it
+    // is huge pages. Returns NULL on failure.
+    void *AllocateSlab(size_t &size, bool fHugePages, bool &fHuge)
+    {
+        fHuge = false;
+#ifdef _WIN32
+        if (fHugePages)
+        {
+            // Needs SeLockMemoryPrivilege; without it fall back to pages
+            // of the normal size.
+            SIZE_T largePage = GetLargePageMinimum();
+            if (largePage != 0)
+            {
+                size_t hugeSize = RoundUp(size, largePage);
+                void *memory = VirtualAlloc(NULL, hugeSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                                            PAGE_READWRITE);
+                if (memory != NULL)
+                {
+                    size = hugeSize;
+                    fHuge = true;
+                    return memory;
+                }
+            }
+        }
+        return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+        if (fHugePages)
+        {
+            // Needs pages reserved in vm.nr_hugepages; without them ask for
+            // transparent huge pages instead.
+            size = RoundUp(size, c_hugePageSize);
+            void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (memory != MAP_FAILED)
+            {
+                fHuge = true;
+                return memory;
+            }
+        }
+        void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (fHugePages)
+        {
+            madvise(memory, size, MADV_HUGEPAGE);
+        }
+#endif
+        return memory;
+#endif
+    }
+
+    void FreeSlab(void *memory, size_t size)
+    {
+#ifdef _WIN32
+        (void)size;
+        VirtualFree(memory, 0, MEM_RELEASE);
+#else
+        munmap(memory, size);
+#endif
+    }
+}
+
+#pragma region Thread Cache
+
+// The free buffers a thread keeps, one list per pool it has used
+struct BufferPool::ThreadCache
+{
+    struct Entry
+    {
+        uint64_t poolId;
+        BufferPool *pool;
+        BufferBlock *head;
+        size_t count;
+
+        // Allocations not yet added to the pool's count
+        unsigned long long allocations;
+    };
+
+    std::vector<Entry> entries;
+    size_t last;
+
+    ThreadCache(void) : last(0) {}
+
+    // Give everything back to the pools that still exist when the thread
+    // exits.
+    ~ThreadCache(void)
+    {
+        LivePools &live = LivePools::Instance();
+        std::lock_guard<std::mutex> guard(live.lock);
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (live.ids.count(entries[i].poolId) != 0)
+            {
+                entries[i].pool->m_allocations.fetch_add(entries[i].allocations, std::memory_order_relaxed);
+                if (entries[i].count != 0)
+                {
+                    entries[i].pool->Release(entries[i].head, entries[i].count);
+                }
+            }
+        }
+    }
+
+    // The list of a pool, created on first use. Lists of pools that no
+    // longer exist are dropped then; their buffers went with the pool.
+    Entry &Find(BufferPool *pool)
+    {
+        if (last < entries.size() && entries[last].poolId == pool->m_id)
+        {
+            return entries[last];
+        }
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (entries[i].poolId == pool->m_id)
+            {
+                last = i;
+                return entries[i];
+            }
+        }
+
+        {
+            LivePools &live = LivePools::Instance();
+            std::lock_guard<std::mutex> guard(live.lock);
+            entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                         [&live](const Entry &entry) {
+                                             return live.ids.count(entry.poolId) == 0;
+                                         }),
+                          entries.end());
+        }
+        Entry entry = {pool->m_id, pool, NULL, 0, 0};
+        entries.push_back(entry);
+        last = entries.size() - 1;
+        return entries[last];
+    }
+};
+
+thread_local BufferPool::ThreadCache BufferPool::t_cache;
+
+#pragma endregion
+
+#pragma region Buffer Pool
+
+/**
+ *   Create a pool. No memory is allocated until the first buffer is.
+ *
+ *   @param bufferSize - the capacity of each buffer in bytes
+ *   @param fHugePages - whether to back the slabs with huge pages
+ */
+BufferPool::BufferPool(size_t bufferSize, bool fHugePages)
+    : m_id(g_nextPoolId.fetch_add(1, std::memory_order_relaxed)),
+      m_bufferSize(bufferSize),
+      m_blockSize(BufferBlock::HeaderSize + RoundUp(bufferSize, 64)),
+      m_fHugePages(fHugePages),
+      m_free(NULL), m_freeCount(0), m_buffers(0),
+      m_allocations(0), m_misses(0), m_inUse(0), m_highWater(0)
+{
+    if (bufferSize == 0 || bufferSize > 0xFFFFFFFF)
+    {
+        throw static_cast<DWORD>(ERROR_INVALID_PARAMETER);
+    }
+
+    LivePools &live = LivePools::Instance();
+    std::lock_guard<std::mutex> guard(live.lock);
+    live.ids.insert(m_id);
+}
+
+/**
+ *   Destroy the pool and give its slabs back to the system. Buffers cached
+ *   by other threads are forgotten along with it.
+ */
+BufferPool::~BufferPool(void)
+{
+    {
+        LivePools &live = LivePools::Instance();
+        std::lock_guard<std::mutex> guard(live.lock);
+        live.ids.erase(m_id);
+    }
+
+    for (size_t i = 0; i < m_slabs.size(); i++)
+    {
+        FreeSlab(m_slabs[i].memory, m_slabs[i].size);
+    }
+}
+
+/**
+ *   Get a buffer from the calling thread's cache, refilled from the depot
+ *   in batches; only an empty depot allocates a new slab. The thread counts
+ *   its allocations itself and adds them to the pool's count on each
+ *   refill, which keeps the fast path down to one shared atomic.
+ *
+ *   @return a handle to an empty buffer
+ */
+Buffer BufferPool::Allocate(void)
+{
+    ThreadCache::Entry &entry = t_cache.Find(this);
+    if (entry.head == NULL)
+    {
+        entry.head = Refill(entry.count);
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+        m_allocations.fetch_add(entry.allocations, std::memory_order_relaxed);
+        entry.allocations = 0;
+    }
+
+    BufferBlock *block = entry.head;
+    entry.head = block->next;
+    entry.count--;
+    entry.allocations++;
+    block->refs.store(1, std::memory_order_relaxed);
+    block->size = 0;
+
+    size_t inUse = m_inUse.fetch_add(1, std::memory_order_relaxed) + 1;
+    size_t highWater = m_highWater.load(std::memory_order_relaxed);
+    while (inUse > highWater &&
+           !m_highWater.compare_exchange_weak(highWater, inUse, std::memory_order_relaxed))
+    {
+    }
+    return Buffer(block);
+}
+
+/**
+ *   Return a buffer to the calling thread's cache, spilling a batch to the
+ *   depot when the cache is full.
+ *
+ *   @param block - the buffer
+ */
+void BufferPool::Free(BufferBlock *block) noexcept
+{
+    m_inUse.fetch_sub(1, std::memory_order_relaxed);
+
+    ThreadCache::Entry *entry;
+    try
+    {
+        entry = &t_cache.Find(this);
+    }
+    catch (...)
+    {
+        block->next = NULL;
+        Release(block, 1);
+        return;
+    }
+    block->next = entry->head;
+    entry->head = block;
+    entry->count++;
+
+    if (entry->count > c_cacheLimit)
+    {
+        BufferBlock *head = entry->head;
+        BufferBlock *tail = head;
+        for (size_t n = 1; n < c_batchSize; n++)
+        {
+            tail = tail->next;
+        }
+        entry->head = tail->next;
+        entry->count -= c_batchSize;
+        tail->next = NULL;
+        Release(head, c_batchSize);
+        m_allocations.fetch_add(entry->allocations, std::memory_order_relaxed);
+        entry->allocations = 0;
+    }
+}
+
+/**
+ *   Take up to c_batchSize buffers from the depot.
+ *
+ *   @param count - set to the number of buffers taken
+ *   @return the list of buffers
+ */
+BufferBlock *BufferPool::Refill(size_t &count)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_free == NULL)
+    {
+        AddSlab();
+    }
+
+    BufferBlock *head = m_free;
+    BufferBlock *tail = head;
+    count = 1;
+    while (count < c_batchSize && tail->next != NULL)
+    {
+        tail = tail->next;
+        count++;
+    }
+    m_free = tail->next;
+    m_freeCount -= count;
+    tail->next = NULL;
+    return head;
+}
+
+/**
+ *   Put a list of buffers back in the depot.
+ *
+ *   @param head - the first buffer of the list
+ *   @param count - the number of buffers in it
+ */
+void BufferPool::Release(BufferBlock *head, size_t count) noexcept
+{
+    BufferBlock *tail = head;
+    while (tail->next != NULL)
+    {
+        tail = tail->next;
+    }
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    tail->next = m_free;
+    m_free = head;
+    m_freeCount += count;
+}
+
+/**
+ *   Allocate a slab and carve it into buffers for the depot. The slab holds
+ *   at least a few buffers however large they are.
+ */
+void BufferPool::AddSlab(void)
+{
+    size_t size = RoundUp(std::max(c_slabSize, 8 * m_blockSize), 64 * 1024);
+    bool fHuge;
+    void *memory = AllocateSlab(size, m_fHugePages, fHuge);
+    if (memory == NULL)
+    {
+        throw static_cast<DWORD>(ERROR_NOT_ENOUGH_MEMORY);
+    }
+
+    Slab slab = {memory, size, fHuge};
+    m_slabs.push_back(slab);
+
+    // Carve from the end so the list starts at the beginning of the slab.
+    char *base = static_cast<char *>(memory);
+    for (size_t n = size / m_blockSize; n > 0; n--)
+    {
+        BufferBlock *block = new (base + (n - 1) * m_blockSize) BufferBlock();
+        block->pool = this;
+        block->capacity = static_cast<uint32_t>(m_bufferSize);
+        block->size = 0;
+        block->refs.store(0, std::memory_order_relaxed);
+        block->next = m_free;
+        m_free = block;
+        m_freeCount++;
+        m_buffers++;
+    }
+}
+
+BufferPool::Statistics BufferPool::GetStatistics(void) const
+{
+    Statistics statistics;
+    unsigned long long misses = m_misses.load(std::memory_order_relaxed);
+    statistics.allocations = m_allocations.load(std::memory_order_relaxed);
+    statistics.cacheHits = (statistics.allocations > misses) ? statistics.allocations - misses : 0;
+    statistics.inUse = m_inUse.load(std::memory_order_relaxed);
+    statistics.highWater = m_highWater.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    statistics.buffers = m_buffers;
+    statistics.slabs = m_slabs.size();
+    statistics.hugePageSlabs = 0;
+    for (size_t i = 0; i < m_slabs.size(); i++)
+    {
+        if (m_slabs[i].huge)
+            statistics.hugePageSlabs++;
+    }
+    return statistics;
+}
+
+/**
+ *   The process-wide pool. Never destroyed, so buffers may be released
+ *   while the process exits.
+ */
+BufferPool &BufferPool::Default(void)
+{
+    static BufferPool *pool = new BufferPool();
+    return *pool;
+}
+
+#pragma endregion
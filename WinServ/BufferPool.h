@@ -0,0 +1,223 @@
+/*
+ * Pooled fixed-size I/O buffers.
+ *
+ * A BufferPool hands out buffers of one size, carved from large slabs that
+ * stay with the pool until it is destroyed; the slabs can be backed by
+ * huge pages. Every thread keeps a cache of free buffers per pool, refilled
+ * from and spilled to the pool's depot in batches, so getting and
+ * releasing a buffer normally takes no lock and never reaches the heap.
+ *
+ * Buffer is a reference-counted handle. Copies share the buffer, so a
+ * stage of a pipeline can hand it to the next without copying the data;
+ * the buffer goes back to the pool when the last handle is released, on
+ * whatever thread that happens.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+#include "Platform.h"
+
+class BufferPool;
+
+// The header in front of every pooled buffer; the data follows it.
+struct BufferBlock
+{
+    static const size_t HeaderSize = 64;
+
+    BufferPool *pool;
+    BufferBlock *next;
+    std::atomic<uint32_t> refs;
+    uint32_t size;
+    uint32_t capacity;
+};
+
+class Buffer
+{
+public:
+    Buffer(void) noexcept : m_block(NULL) {}
+
+    Buffer(const Buffer &other) noexcept : m_block(other.m_block)
+    {
+        if (m_block)
+        {
+            m_block->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    Buffer(Buffer &&other) noexcept : m_block(other.m_block)
+    {
+        other.m_block = NULL;
+    }
+
+    Buffer &operator=(const Buffer &other) noexcept
+    {
+        if (m_block != other.m_block)
+        {
+            Buffer copy(other);
+            Swap(copy);
+        }
+        return *this;
+    }
+
+    Buffer &operator=(Buffer &&other) noexcept
+    {
+        if (this != &other)
+        {
+            Reset();
+            Swap(other);
+        }
+        return *this;
+    }
+
+    ~Buffer(void) { Reset(); }
+
+    // Drop this handle; the last one gives the buffer back to its pool.
+    void Reset(void) noexcept;
+
+    void Swap(Buffer &other) noexcept
+    {
+        BufferBlock *block = m_block;
+        m_block = other.m_block;
+        other.m_block = block;
+    }
+
+    char *GetData(void) const
+    {
+        return reinterpret_cast<char *>(m_block) + BufferBlock::HeaderSize;
+    }
+
+    size_t GetCapacity(void) const { return m_block->capacity; }
+
+    // The number of bytes in use, as set by whoever filled the buffer.
+    size_t GetSize(void) const { return m_block->size; }
+    void SetSize(size_t size)
+    {
+        m_block->size = static_cast<uint32_t>(size < m_block->capacity ? size : m_block->capacity);
+    }
+
+    // True if no other handle shares the buffer, so changing the data
+    // cannot affect another stage.
+    bool IsUnique(void) const
+    {
+        return m_block->refs.load(std::memory_order_acquire) == 1;
+    }
+
+    explicit operator bool(void) const { return m_block != NULL; }
+
+private:
+    friend class BufferPool;
+    explicit Buffer(BufferBlock *block) noexcept : m_block(block) {}
+
+    BufferBlock *m_block;
+};
+
+class BufferPool
+{
+public:
+    // The buffer size of the default pool.
+    static const size_t DefaultBufferSize = 2048;
+
+    // Allocations are counted per thread and added up when a thread visits
+    // the depot or exits, so the counts may lag behind by a batch per
+    // thread; the buffers in use are counted exactly.
+    struct Statistics
+    {
+        // Buffers handed out, and how many of them came from the calling
+        // thread's cache without visiting the depot
+        unsigned long long allocations;
+        unsigned long long cacheHits;
+
+        // Buffers held by handles now, and the most ever held at once
+        size_t inUse;
+        size_t highWater;
+
+        // Buffers carved so far, and the slabs they came from
+        size_t buffers;
+        size_t slabs;
+        size_t hugePageSlabs;
+    };
+
+    // Create a pool of buffers of the given size. With fHugePages the slabs
+    // are allocated as huge pages when the system allows it.
+    explicit BufferPool(size_t bufferSize = DefaultBufferSize, bool fHugePages = false);
+
+    // Every buffer of the pool must have been released.
+    ~BufferPool(void);
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    // Get an empty buffer. Throws ERROR_NOT_ENOUGH_MEMORY if the pool needs
+    // a new slab and none can be allocated.
+    Buffer Allocate(void);
+
+    size_t GetBufferSize(void) const { return m_bufferSize; }
+
+    Statistics GetStatistics(void) const;
+
+    // The process-wide pool of DefaultBufferSize buffers.
+    static BufferPool &Default(void);
+
+private:
+    friend class Buffer;
+    struct ThreadCache;
+
+    struct Slab
+    {
+        void *memory;
+        size_t size;
+        bool huge;
+    };
+
+    // Give a buffer whose last handle was released back to the calling
+    // thread's cache.
+    void Free(BufferBlock *block) noexcept;
+
+    // Move a batch of free buffers from the depot to a thread's cache,
+    // carving a new slab if the depot is empty.
+    BufferBlock *Refill(size_t &count);
+
+    // Move a list of free buffers from a thread's cache to the depot.
+    void Release(BufferBlock *head, size_t count) noexcept;
+
+    // Allocate a slab and carve it into the depot. The lock must be held.
+    void AddSlab(void);
+
+    uint64_t m_id;
+    size_t m_bufferSize;
+    size_t m_blockSize;
+    bool m_fHugePages;
+
+    // The depot and the slabs
+    mutable std::mutex m_lock;
+    BufferBlock *m_free;
+    size_t m_freeCount;
+    std::vector<Slab> m_slabs;
+    size_t m_buffers;
+
+    // Statistics; only m_inUse is updated on every allocation and release
+    std::atomic<unsigned long long> m_allocations;
+    std::atomic<unsigned long long> m_misses;
+    std::atomic<size_t> m_inUse;
+    std::atomic<size_t> m_highWater;
+
+    static thread_local ThreadCache t_cache;
+};
+
+inline void Buffer::Reset(void) noexcept
+{
+    if (m_block)
+    {
+        if (m_block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            m_block->pool->Free(m_block);
+        }
+        m_block = NULL;
+    }
+}
@@ -0,0 +1,360 @@
+#pragma region Includes
+#include "Config.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <cwctype>
+#pragma endregion
+
+namespace
+{
+    // Append the characters of UTF-8 text to a wide string, as UTF-16
+    // where wchar_t is 16 bits wide. Malformed bytes become U+FFFD.
+    void DecodeUtf8(std::wstring &to, const char *from, size_t length)
+    {
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(from);
+        const unsigned char *end = p + length;
+        while (p < end)
+        {
+            unsigned long ch = *p++;
+            int extra = (ch >= 0xF0) ? 3 : (ch >= 0xE0) ? 2 : (ch >= 0xC0) ? 1 : 0;
+            if (ch >= 0x80 && ch < 0xC0)
+            {
+                to += L'\xFFFD';
+                continue;
+            }
+            ch &= (extra == 0) ? 0x7F : (0x3F >> extra);
+            for (; extra > 0 && p < end && (*p & 0xC0) == 0x80; extra--)
+            {
+                ch = (ch << 6) | (*p++ & 0x3F);
+            }
+            if (extra > 0 || ch > 0x10FFFF)
+            {
+                to += L'\xFFFD';
+            }
+            else if (sizeof(wchar_t) == 2 && ch > 0xFFFF)
+            {
+                ch -= 0x10000;
+                to += static_cast<wchar_t>(0xD800 + (ch >> 10));
+                to += static_cast<wchar_t>(0xDC00 + (ch & 0x3FF));
+            }
+            else
+            {
+                to += static_cast<wchar_t>(ch);
+            }
+        }
+    }
+
+    // Strip the white space around a string.
+    std::wstring Trim(const std::wstring &s)
+    {
+        size_t first = 0;
+        size_t last = s.size();
+        while (first < last && iswspace(s[first]))
+            first++;
+        while (last > first && iswspace(s[last - 1]))
+            last--;
+        return s.substr(first, last - first);
+    }
+
+    // Parse a number, decimal or 0x hexadecimal, or "infinite". Returns
+    // false if the text is none of those.
+    bool ParseNumber(const std::wstring &text, DWORD &dwNumber)
+    {
+        if (text.empty() || text[0] == L'-')
+        {
+            return false;
+        }
+        if (_wcsicmp(text.c_str(), L"infinite") == 0)
+        {
+            dwNumber = INFINITE;
+            return true;
+        }
+
+        wchar_t *end = NULL;
+        errno = 0;
+        unsigned long long number = wcstoull(text.c_str(), &end, 0);
+        if (*end != L'\0' || errno != 0 || number > 0xFFFFFFFFull)
+        {
+            return false;
+        }
+        dwNumber = static_cast<DWORD>(number);
+        return true;
+    }
+
+    // Read a whole file. Returns false if it does not exist.
+    bool ReadConfigFile(const std::wstring &path, std::string &contents)
+    {
+        FILE *file = NULL;
+#ifdef _WIN32
+        int error = _wfopen_s(&file, path.c_str(), L"rb");
+#else
+        std::string narrow(wcstombs(NULL, path.c_str(), 0) + 1, '\0');
+        wcstombs(&narrow[0], path.c_str(), narrow.size());
+        file = fopen(narrow.c_str(), "rb");
+        int error = (file == NULL) ? errno : 0;
+#endif
+        if (file == NULL)
+        {
+            if (error == ENOENT)
+            {
+                return false;
+            }
+            throw static_cast<DWORD>(ERROR_READ_FAULT);
+        }
+
+        char buffer[4096];
+        size_t read;
+        contents.clear();
+        while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        {
+            contents.append(buffer, read);
+        }
+        bool fFailed = ferror(file) != 0;
+        fclose(file);
+        if (fFailed)
+        {
+            throw static_cast<DWORD>(ERROR_READ_FAULT);
+        }
+        return true;
+    }
+}
+
+#pragma region Snapshots
+
+ConfigSnapshot::ConfigSnapshot(void)
+    : m_ullVersion(0)
+{
+}
+
+ConfigSnapshot::ConfigSnapshot(Settings settings, unsigned long long ullVersion)
+    : m_ullVersion(ullVersion)
+{
+    for (Settings::iterator it = settings.begin(); it != settings.end(); ++it)
+    {
+        Value value;
+        value.text = std::move(it->second);
+        value.dwNumber = 0;
+        value.fNumber = ParseNumber(value.text, value.dwNumber);
+        m_settings.emplace_hint(m_settings.end(), it->first, std::move(value));
+    }
+}
+
+/**
+ *   Compare two names, folding ASCII letters without consulting the
+ *   locale, which keeps lookups cheap; other characters are folded with
+ *   towlower.
+ *
+ *   @return less than, equal to or greater than 0 as a sorts before, with
+ *   or after b
+ */
+int ConfigSnapshot::NameLess::Compare(const wchar_t *a, const wchar_t *b)
+{
+    for (;; a++, b++)
+    {
+        wint_t ca = *a;
+        wint_t cb = *b;
+        if (ca != cb)
+        {
+            ca = (ca < 0x80) ? ((ca >= L'A' && ca <= L'Z') ? ca + 32 : ca) : towlower(ca);
+            cb = (cb < 0x80) ? ((cb >= L'A' && cb <= L'Z') ? cb + 32 : cb) : towlower(cb);
+            if (ca != cb)
+            {
+                return (ca < cb) ? -1 : 1;
+            }
+        }
+        if (ca == 0)
+        {
+            return 0;
+        }
+    }
+}
+
+/**
+ *   @param pszName - the name of a setting, in any case
+ *   @return its value, or NULL if it is absent
+ */
+const ConfigSnapshot::Value *ConfigSnapshot::Find(const wchar_t *pszName) const
+{
+    std::map<std::wstring, Value, NameLess>::const_iterator it = m_settings.find(pszName);
+    return (it != m_settings.end()) ? &it->second : NULL;
+}
+
+bool ConfigSnapshot::Has(const wchar_t *pszName) const
+{
+    return Find(pszName) != NULL;
+}
+
+/**
+ *   @param pszName - the name of a setting
+ *   @param pszDefault - the value if it is absent
+ *   @return the value of the setting
+ */
+std::wstring ConfigSnapshot::GetString(const wchar_t *pszName, const wchar_t *pszDefault) const
+{
+    const Value *value = Find(pszName);
+    return (value != NULL) ? value->text : std::wstring(pszDefault);
+}
+
+/**
+ *   @param pszName - the name of a setting
+ *   @param dwDefault - the value if it is absent or not a number
+ *   @return the value of the setting
+ */
+DWORD ConfigSnapshot::GetDword(const wchar_t *pszName, DWORD dwDefault) const
+{
+    const Value *value = Find(pszName);
+    return (value != NULL && value->fNumber) ? value->dwNumber : dwDefault;
+}
+
+/**
+ *   @param pszName - the name of a setting
+ *   @param fDefault - the value if it is absent or not a truth value
+ *   @return the value of the setting
+ */
+bool ConfigSnapshot::GetBool(const wchar_t *pszName, bool fDefault) const
+{
+    const Value *value = Find(pszName);
+    if (value == NULL)
+    {
+        return fDefault;
+    }
+    const wchar_t *const truths[] = {L"true", L"yes", L"on", L"1"};
+    const wchar_t *const falsehoods[] = {L"false", L"no", L"off", L"0"};
+    for (size_t i = 0; i < ARRAYSIZE(truths); i++)
+    {
+        if (_wcsicmp(value->text.c_str(), truths[i]) == 0)
+            return true;
+        if (_wcsicmp(value->text.c_str(), falsehoods[i]) == 0)
+            return false;
+    }
+    return fDefault;
+}
+
+#pragma endregion
+
+#pragma region Loading
+
+Config::Config(const wchar_t *pszPath)
+    : m_path(pszPath), m_dwErrorLine(0),
+      m_current(std::make_shared<const ConfigSnapshot>()), m_ullVersion(0)
+{
+}
+
+/**
+ *   Read the file and publish its settings as the current snapshot.
+ *
+ *   @return false if the file does not exist
+ */
+bool Config::Load(void)
+{
+    std::string contents;
+    if (!ReadConfigFile(m_path, contents))
+    {
+        return false;
+    }
+    LoadText(contents);
+    return true;
+}
+
+/**
+ *   Parse settings and publish them as the current snapshot. Nothing is
+ *   published if a line is malformed.
+ *
+ *   @param text - UTF-8 text in the format of the file
+ */
+void Config::LoadText(const std::string &text)
+{
+    std::lock_guard<std::mutex> guard(m_loadLock);
+
+    // Skip a byte order mark.
+    size_t start = (text.compare(0, 3, "\xEF\xBB\xBF") == 0) ? 3 : 0;
+
+    ConfigSnapshot::Settings settings;
+    DWORD dwLine = 0;
+    while (start < text.size())
+    {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos)
+        {
+            end = text.size();
+        }
+        dwLine++;
+
+        std::wstring line;
+        DecodeUtf8(line, text.data() + start, end - start);
+        start = end + 1;
+
+        line = Trim(line);
+        if (line.empty() || line[0] == L'#' || line[0] == L';')
+        {
+            continue;
+        }
+
+        size_t equals = line.find(L'=');
+        std::wstring name = (equals != std::wstring::npos) ? Trim(line.substr(0, equals)) : std::wstring();
+        if (name.empty())
+        {
+            m_dwErrorLine = dwLine;
+            throw static_cast<DWORD>(ERROR_INVALID_DATA);
+        }
+        settings[name] = Trim(line.substr(equals + 1));
+    }
+
+    // Publish the snapshot before its version: a reader who sees the new
+    // version is sure to find it.
+    unsigned long long ullVersion = m_ullVersion.load() + 1;
+    std::shared_ptr<const ConfigSnapshot> snapshot =
+        std::make_shared<const ConfigSnapshot>(std::move(settings), ullVersion);
+    {
+        std::lock_guard<std::mutex> currentGuard(m_currentLock);
+        m_current.swap(snapshot);
+    }
+    m_ullVersion.store(ullVersion);
+    m_dwErrorLine = 0;
+}
+
+/**
+ *   @return the current snapshot
+ */
+std::shared_ptr<const ConfigSnapshot> Config::Get(void) const
+{
+    std::lock_guard<std::mutex> guard(m_currentLock);
+    return m_current;
+}
+
+unsigned long long Config::GetVersion(void) const
+{
+    return m_ullVersion.load();
+}
+
+DWORD Config::GetErrorLine(void) const
+{
+    return m_dwErrorLine.load();
+}
+
+#pragma endregion
+
+#pragma region Readers
+
+ConfigReader::ConfigReader(const Config &config)
+    : m_config(config), m_snapshot(config.Get())
+{
+}
+
+/**
+ *   Get the current snapshot. Takes a new reference only when the version
+ *   of the configuration has moved on from the one held.
+ *
+ *   @return the snapshot
+ */
+const ConfigSnapshot &ConfigReader::Get(void)
+{
+    if (m_config.GetVersion() != m_snapshot->GetVersion())
+    {
+        m_snapshot = m_config.Get();
+    }
+    return *m_snapshot;
+}
+
+#pragma endregion
@@ -0,0 +1,167 @@
+/*
+ * Settings that can change while the service runs.
+ *
+ * A Config reads "name = value" lines from a file: names are not case
+ * sensitive, blank lines and lines starting with '#' or ';' are ignored,
+ * and the last of two lines with the same name wins. Every load publishes
+ * a new immutable ConfigSnapshot behind a shared pointer, the way RCU
+ * publishes a new version of a structure: readers keep the snapshot they
+ * took for as long as they hold it, so a reload never changes a value
+ * under a reader or waits for one, and the old snapshot goes away with its
+ * last reader.
+ *
+ * Hot paths keep a ConfigReader. It holds on to a snapshot and only looks
+ * at the version counter of the Config, a single atomic load, to see
+ * whether there is a newer one; it takes no lock and touches no reference
+ * count until the configuration changes. Config::Get, for the occasional
+ * reader, copies the pointer under a lock held only for that copy.
+ *
+ * ServiceBase::SetConfig loads the file at every start and reloads it on
+ * SERVICE_CONTROL_PARAMCHANGE (SIGHUP on Linux).
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "Platform.h"
+
+class ConfigSnapshot
+{
+public:
+    // Orders names without regard to case, and finds them by pointer
+    // without building a string.
+    struct NameLess
+    {
+        typedef void is_transparent;
+
+        // Compare two names, folding case; like wcscmp.
+        static int Compare(const wchar_t *a, const wchar_t *b);
+
+        bool operator()(const std::wstring &a, const std::wstring &b) const
+        {
+            return Compare(a.c_str(), b.c_str()) < 0;
+        }
+
+        bool operator()(const wchar_t *a, const std::wstring &b) const
+        {
+            return Compare(a, b.c_str()) < 0;
+        }
+
+        bool operator()(const std::wstring &a, const wchar_t *b) const
+        {
+            return Compare(a.c_str(), b) < 0;
+        }
+    };
+
+    typedef std::map<std::wstring, std::wstring, NameLess> Settings;
+
+    // An empty snapshot: every setting has its default.
+    ConfigSnapshot(void);
+
+    // The settings of a load.
+    ConfigSnapshot(Settings settings, unsigned long long ullVersion);
+
+    // Whether the setting is present.
+    bool Has(const wchar_t *pszName) const;
+
+    // The value of a setting, or the default if it is absent.
+    std::wstring GetString(const wchar_t *pszName, const wchar_t *pszDefault = L"") const;
+
+    // A number, decimal or 0x hexadecimal, or "infinite" for INFINITE. The
+    // default if it is absent or not a number.
+    DWORD GetDword(const wchar_t *pszName, DWORD dwDefault) const;
+
+    // true, yes, on or 1; false, no, off or 0. The default if it is absent
+    // or none of those.
+    bool GetBool(const wchar_t *pszName, bool fDefault) const;
+
+    // The number of settings.
+    size_t GetCount(void) const { return m_settings.size(); }
+
+    // The load that produced the snapshot: 0 before the first, then 1, 2...
+    unsigned long long GetVersion(void) const { return m_ullVersion; }
+
+private:
+    // A value, and the number it holds, parsed once when the snapshot is
+    // made rather than on every read
+    struct Value
+    {
+        std::wstring text;
+        bool fNumber;
+        DWORD dwNumber;
+    };
+
+    // The value of a setting, or NULL if it is absent.
+    const Value *Find(const wchar_t *pszName) const;
+
+    std::map<std::wstring, Value, NameLess> m_settings;
+    unsigned long long m_ullVersion;
+};
+
+class Config
+{
+public:
+    // A configuration read from the given file. Until the first load every
+    // setting has its default.
+    explicit Config(const wchar_t *pszPath);
+
+    Config(const Config &) = delete;
+    Config &operator=(const Config &) = delete;
+
+    // Read the file and publish its settings. Returns false, keeping the
+    // current settings, if the file does not exist. Throws
+    // ERROR_INVALID_DATA, keeping them too, if a line is neither a setting
+    // nor a comment (GetErrorLine tells which), or the error that kept the
+    // file from being read.
+    bool Load(void);
+
+    // Parse and publish settings from text in the format of the file.
+    // Throws like Load.
+    void LoadText(const std::string &text);
+
+    // The current snapshot. Callable from any thread; a load holds it up
+    // only for the instant it swaps the pointer.
+    std::shared_ptr<const ConfigSnapshot> Get(void) const;
+
+    // The version of the current snapshot.
+    unsigned long long GetVersion(void) const;
+
+    // The path of the file.
+    const std::wstring &GetPath(void) const { return m_path; }
+
+    // The line of the file that failed the last load, or 0.
+    DWORD GetErrorLine(void) const;
+
+private:
+    std::wstring m_path;
+
+    // Serializes loads, and the line the last one failed on
+    std::mutex m_loadLock;
+    std::atomic<DWORD> m_dwErrorLine;
+
+    // The current snapshot, and its version, stored after it so that a
+    // reader who sees a version finds at least that snapshot
+    mutable std::mutex m_currentLock;
+    std::shared_ptr<const ConfigSnapshot> m_current;
+    std::atomic<unsigned long long> m_ullVersion;
+};
+
+class ConfigReader
+{
+public:
+    explicit ConfigReader(const Config &config);
+
+    // The current snapshot, refreshed if the configuration was reloaded
+    // since the last call. A reader belongs to one thread at a time; the
+    // reference stays valid until the next call.
+    const ConfigSnapshot &Get(void);
+
+private:
+    const Config &m_config;
+    std::shared_ptr<const ConfigSnapshot> m_snapshot;
+};
@@ -0,0 +1,562 @@
+#pragma region Includes
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#endif
+#include "ConnectivityMonitor.h"
+#include <string.h>
+#include <vector>
+#ifndef _WIN32
+#include <errno.h>
+#include <ifaddrs.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#pragma endregion
+
+#ifdef _WIN32
+#pragma comment(lib, "iphlpapi.lib")
+#endif
+
+namespace
+{
+    // Whether an address can reach beyond the machine and its link:
+    // neither loopback nor link-local.
+    bool IsRoutable(const sockaddr *address)
+    {
+        if (address == NULL)
+        {
+            return false;
+        }
+        if (address->sa_family == AF_INET)
+        {
+            const unsigned char *bytes = reinterpret_cast<const unsigned char *>(
+                &reinterpret_cast<const sockaddr_in *>(address)->sin_addr);
+            return bytes[0] != 127 && !(bytes[0] == 169 && bytes[1] == 254) &&
+                   !(bytes[0] == 0 && bytes[1] == 0 && bytes[2] == 0 && bytes[3] == 0);
+        }
+        if (address->sa_family == AF_INET6)
+        {
+            const unsigned char *bytes = reinterpret_cast<const unsigned char *>(
+                &reinterpret_cast<const sockaddr_in6 *>(address)->sin6_addr);
+            static const unsigned char loopback[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+            return memcmp(bytes, loopback, sizeof(loopback)) != 0 &&
+                   !(bytes[0] == 0xFE && (bytes[1] & 0xC0) == 0x80);
+        }
+        return false;
+    }
+
+#ifdef _WIN32
+    VOID NETIOAPI_API_ InterfaceChanged(PVOID context, PMIB_IPINTERFACE_ROW, MIB_NOTIFICATION_TYPE)
+    {
+        static_cast<ConnectivityMonitor *>(context)->Recheck();
+    }
+
+    VOID NETIOAPI_API_ AddressChanged(PVOID context, PMIB_UNICASTIPADDRESS_ROW, MIB_NOTIFICATION_TYPE)
+    {
+        static_cast<ConnectivityMonitor *>(context)->Recheck();
+    }
+#endif
+}
+
+#pragma region Monitor
+
+/**
+ *   Create a monitor. It does nothing until Start.
+ *
+ *   @param dwDebounce - how long, in milliseconds, notifications must be
+ *   quiet before the state is checked
+ *   @param timers - the timer service the debounce and polling timers run on
+ */
+ConnectivityMonitor::ConnectivityMonitor(DWORD dwDebounce, TimerService &timers)
+    : m_timers(timers), m_dwDebounce(dwDebounce), m_fRunning(false), m_fConnected(false),
+      m_settleTimer(0), m_pollTimer(0), m_nextId(1)
+#ifdef _WIN32
+      , m_interfaceNotification(NULL), m_addressNotification(NULL)
+#else
+      , m_netlinkFd(-1), m_wakeFd(-1)
+#endif
+{
+    MetricsRegistry &metrics = MetricsRegistry::Default();
+    m_notifications = metrics.GetCounter(L"connectivity.notifications");
+    m_transitions = metrics.GetCounter(L"connectivity.transitions");
+    m_state = metrics.GetGauge(L"connectivity.connected");
+}
+
+ConnectivityMonitor::~ConnectivityMonitor(void)
+{
+    Stop();
+}
+
+/**
+ *   Check the current state, without telling the subscribers, and start
+ *   watching for changes. If the system's notifications cannot be
+ *   registered the state is polled every PollInterval instead.
+ */
+void ConnectivityMonitor::Start(void)
+{
+    bool fConnected = Probe();
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (m_fRunning)
+        {
+            return;
+        }
+        m_fRunning = true;
+        m_fConnected = fConnected;
+        m_changed.notify_all();
+    }
+    m_state.Set(fConnected ? 1 : 0);
+
+    if (!RegisterNotifications())
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_pollTimer = m_timers.SchedulePeriodic(PollInterval, [this]() { Publish(Probe()); });
+    }
+}
+
+/**
+ *   Stop watching and cancel the pending checks. Returns once no
+ *   subscriber is being called.
+ */
+void ConnectivityMonitor::Stop(void)
+{
+    TimerService::TimerId settleTimer;
+    TimerService::TimerId pollTimer;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (!m_fRunning)
+        {
+            return;
+        }
+        m_fRunning = false;
+        settleTimer = m_settleTimer;
+        pollTimer = m_pollTimer;
+        m_settleTimer = 0;
+        m_pollTimer = 0;
+    }
+
+    UnregisterNotifications();
+    if (settleTimer != 0)
+    {
+        m_timers.Cancel(settleTimer);
+    }
+    if (pollTimer != 0)
+    {
+        m_timers.Cancel(pollTimer);
+    }
+
+    // Wait for a dispatch that was already under way.
+    std::lock_guard<std::mutex> dispatch(m_dispatchLock);
+}
+
+bool ConnectivityMonitor::IsConnected(void) const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_fConnected;
+}
+
+/**
+ *   Add a subscriber. It is not called with the current state; use
+ *   IsConnected for that.
+ *
+ *   @param handler - called with the new state on every change
+ *   @return the id to unsubscribe with
+ */
+ConnectivityMonitor::SubscriptionId ConnectivityMonitor::Subscribe(Handler handler)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    SubscriptionId id = m_nextId++;
+    m_handlers[id] = std::move(handler);
+    return id;
+}
+
+/**
+ *   Remove a subscriber, and wait for a call to it that is under way,
+ *   unless that call is the one removing it.
+ *
+ *   @param id - the id Subscribe returned
+ */
+void ConnectivityMonitor::Unsubscribe(SubscriptionId id)
+{
+    bool fFromHandler;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_handlers.erase(id);
+        fFromHandler = (m_dispatcher == std::this_thread::get_id());
+    }
+    if (!fFromHandler)
+    {
+        std::lock_guard<std::mutex> dispatch(m_dispatchLock);
+    }
+}
+
+/**
+ *   Wait for the network. Meant for retry loops: call it before each
+ *   attempt so that nothing is tried while the machine is offline.
+ *
+ *   @param token - a stop on it ends the wait
+ *   @param dwMilliseconds - the longest wait, or INFINITE
+ *   @return true if the network is connected
+ */
+bool ConnectivityMonitor::WaitUntilConnected(const StopToken &token, DWORD dwMilliseconds)
+{
+    // Registered before taking the lock: it runs at once if the stop was
+    // already requested.
+    StopCallback wake(token, [this]() {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_changed.notify_all();
+    });
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    auto done = [this, &token]() { return m_fConnected || token.StopRequested(); };
+    if (dwMilliseconds == INFINITE)
+    {
+        m_changed.wait(lock, done);
+    }
+    else
+    {
+        m_changed.wait_for(lock, std::chrono::milliseconds(dwMilliseconds), done);
+    }
+    return m_fConnected;
+}
+
+/**
+ *   Note a change reported by the system. The state is checked once no
+ *   further change has come in for the debounce interval, so an interface
+ *   that flaps, or a burst of address and route events, leads to a single
+ *   check.
+ */
+void ConnectivityMonitor::Recheck(void)
+{
+    m_notifications.Increment();
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (!m_fRunning)
+    {
+        return;
+    }
+    m_lastNotification = std::chrono::steady_clock::now();
+    if (m_settleTimer == 0)
+    {
+        m_settleTimer = m_timers.ScheduleOnce(m_dwDebounce, [this]() { Settle(); });
+    }
+}
+
+/**
+ *   The debounce timer: wait again if a notification came in since it was
+ *   scheduled, otherwise check the state.
+ */
+void ConnectivityMonitor::Settle(void)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (!m_fRunning)
+        {
+            return;
+        }
+
+        std::chrono::steady_clock::duration quiet = std::chrono::steady_clock::now() - m_lastNotification;
+        std::chrono::milliseconds debounce(m_dwDebounce);
+        if (quiet < debounce)
+        {
+            DWORD dwRemaining = static_cast<DWORD>(
+                std::chrono::duration_cast<std::chrono::milliseconds>(debounce - quiet).count()) + 1;
+            m_settleTimer = m_timers.ScheduleOnce(dwRemaining, [this]() { Settle(); });
+            return;
+        }
+        m_settleTimer = 0;
+    }
+
+    Publish(Probe());
+}
+
+/**
+ *   Record a newly checked state and, if it differs from the last one,
+ *   call the subscribers with it. Dispatches are serialized, so
+ *   subscribers see the changes one at a time and in order.
+ *
+ *   @param fConnected - the state
+ */
+void ConnectivityMonitor::Publish(bool fConnected)
+{
+    std::lock_guard<std::mutex> dispatch(m_dispatchLock);
+    std::vector<SubscriptionId> ids;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (fConnected == m_fConnected)
+        {
+            return;
+        }
+        m_fConnected = fConnected;
+        m_changed.notify_all();
+        for (auto it = m_handlers.begin(); it != m_handlers.end(); ++it)
+        {
+            ids.push_back(it->first);
+        }
+        m_dispatcher = std::this_thread::get_id();
+    }
+    m_transitions.Increment();
+    m_state.Set(fConnected ? 1 : 0);
+
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        Handler handler;
+        {
+            // Skip a subscriber removed by an earlier one.
+            std::lock_guard<std::mutex> guard(m_lock);
+            auto it = m_handlers.find(ids[i]);
+            if (it == m_handlers.end())
+            {
+                continue;
+            }
+            handler = it->second;
+        }
+        try
+        {
+            handler(fConnected);
+        }
+        catch (...)
+        {
+            // A failing subscriber does not keep the others from hearing
+            // about the change.
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_dispatcher = std::thread::id();
+}
+
+/**
+ *   The process-wide monitor. It is started on first use and lives until
+ *   the process exits.
+ */
+ConnectivityMonitor &ConnectivityMonitor::Default(void)
+{
+    static ConnectivityMonitor *monitor = []() {
+        ConnectivityMonitor *created = new ConnectivityMonitor();
+        created->Start();
+        return created;
+    }();
+    return *monitor;
+}
+
+#pragma endregion
+
+#pragma region Platform
+
+#ifdef _WIN32
+
+/**
+ *   Whether an adapter other than loopback and tunnels is up with a
+ *   routable unicast address.
+ */
+bool ConnectivityMonitor::Probe(void)
+{
+    ULONG size = 16 * 1024;
+    std::vector<unsigned char> buffer;
+    ULONG result;
+    do
+    {
+        buffer.resize(size);
+        result = GetAdaptersAddresses(AF_UNSPEC,
+                                      GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST | GAA_FLAG_SKIP_DNS_SERVER,
+                                      NULL, reinterpret_cast<PIP_ADAPTER_ADDRESSES>(buffer.data()), &size);
+    } while (result == ERROR_BUFFER_OVERFLOW);
+    if (result != NO_ERROR)
+    {
+        return false;
+    }
+
+    for (PIP_ADAPTER_ADDRESSES adapter = reinterpret_cast<PIP_ADAPTER_ADDRESSES>(buffer.data());
+         adapter != NULL; adapter = adapter->Next)
+    {
+        if (adapter->OperStatus != IfOperStatusUp ||
+            adapter->IfType == IF_TYPE_SOFTWARE_LOOPBACK || adapter->IfType == IF_TYPE_TUNNEL)
+        {
+            continue;
+        }
+        for (PIP_ADAPTER_UNICAST_ADDRESS address = adapter->FirstUnicastAddress;
+             address != NULL; address = address->Next)
+        {
+            if (IsRoutable(address->Address.lpSockaddr))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ *   Register for interface and unicast address changes. The callbacks run
+ *   on a system thread and only note the change.
+ */
+bool ConnectivityMonitor::RegisterNotifications(void)
+{
+    if (NotifyIpInterfaceChange(AF_UNSPEC, InterfaceChanged, this, FALSE,
+                                &m_interfaceNotification) != NO_ERROR)
+    {
+        m_interfaceNotification = NULL;
+        return false;
+    }
+    if (NotifyUnicastIpAddressChange(AF_UNSPEC, AddressChanged, this, FALSE,
+                                     &m_addressNotification) != NO_ERROR)
+    {
+        CancelMibChangeNotify2(m_interfaceNotification);
+        m_interfaceNotification = NULL;
+        m_addressNotification = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ *   Cancel the notifications; CancelMibChangeNotify2 waits for callbacks
+ *   in progress.
+ */
+void ConnectivityMonitor::UnregisterNotifications(void)
+{
+    if (m_addressNotification != NULL)
+    {
+        CancelMibChangeNotify2(m_addressNotification);
+        m_addressNotification = NULL;
+    }
+    if (m_interfaceNotification != NULL)
+    {
+        CancelMibChangeNotify2(m_interfaceNotification);
+        m_interfaceNotification = NULL;
+    }
+}
+
+#else
+
+/**
+ *   Whether an interface other than loopback is up and running with a
+ *   routable address.
+ */
+bool ConnectivityMonitor::Probe(void)
+{
+    ifaddrs *addresses = NULL;
+    if (getifaddrs(&addresses) != 0)
+    {
+        return false;
+    }
+
+    bool fConnected = false;
+    for (ifaddrs *entry = addresses; entry != NULL && !fConnected; entry = entry->ifa_next)
+    {
+        if ((entry->ifa_flags & IFF_UP) && (entry->ifa_flags & IFF_RUNNING) &&
+            !(entry->ifa_flags & IFF_LOOPBACK))
+        {
+            fConnected = IsRoutable(entry->ifa_addr);
+        }
+    }
+    freeifaddrs(addresses);
+    return fConnected;
+}
+
+/**
+ *   Open a netlink socket subscribed to link, address and route changes,
+ *   and start the thread that reads it.
+ */
+bool ConnectivityMonitor::RegisterNotifications(void)
+{
+    m_netlinkFd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (m_netlinkFd == -1)
+    {
+        return false;
+    }
+
+    sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+                        RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+    m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakeFd == -1 ||
+        bind(m_netlinkFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        UnregisterNotifications();
+        return false;
+    }
+
+    m_watcher = std::thread(&ConnectivityMonitor::WatchNetlink, this);
+    return true;
+}
+
+void ConnectivityMonitor::UnregisterNotifications(void)
+{
+    if (m_watcher.joinable())
+    {
+        eventfd_write(m_wakeFd, 1);
+        m_watcher.join();
+    }
+    if (m_netlinkFd != -1)
+    {
+        close(m_netlinkFd);
+        m_netlinkFd = -1;
+    }
+    if (m_wakeFd != -1)
+    {
+        close(m_wakeFd);
+        m_wakeFd = -1;
+    }
+}
+
+/**
+ *   The watcher thread: wait for netlink messages and note a change for
+ *   every batch. The messages themselves are not parsed; the check after
+ *   the debounce looks at the interfaces as they are by then. An overrun
+ *   (ENOBUFS) means messages were lost, which is a change too.
+ */
+void ConnectivityMonitor::WatchNetlink(void)
+{
+    std::vector<char> buffer(16 * 1024);
+    pollfd fds[2];
+    fds[0].fd = m_netlinkFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_wakeFd;
+    fds[1].events = POLLIN;
+
+    for (;;)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (fds[1].revents != 0)
+        {
+            return;
+        }
+
+        bool fChanged = false;
+        for (;;)
+        {
+            ssize_t size = recv(m_netlinkFd, buffer.data(), buffer.size(), MSG_DONTWAIT);
+            if (size > 0 || (size == -1 && errno == ENOBUFS))
+            {
+                fChanged = true;
+                continue;
+            }
+            break;
+        }
+        if (fChanged)
+        {
+            Recheck();
+        }
+    }
+}
+
+#endif
+
+#pragma endregion
@@ -0,0 +1,142 @@
+/*
+ * Network connectivity changes, pushed to subscribers.
+ *
+ * The monitor subscribes to the system's change notifications (interface
+ * and address changes through NotifyIpInterfaceChange and
+ * NotifyUnicastIpAddressChange on Windows, link, address and route events
+ * on a netlink socket on Linux) rather than polling. Notifications come in
+ * bursts while an interface goes up or down, so they are debounced: once
+ * they have been quiet for the debounce interval the monitor checks
+ * whether any non-loopback interface is up with a routable address, and
+ * tells the subscribers if the answer changed.
+ *
+ * A service that talks to the network subscribes in OnStart, or waits
+ * with WaitUntilConnected before each reconnect attempt, so that its retry
+ * loops rest while the machine is offline.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "Metrics.h"
+#include "Platform.h"
+#include "StopToken.h"
+#include "TimerService.h"
+
+class ConnectivityMonitor
+{
+public:
+    typedef unsigned long long SubscriptionId;
+    typedef std::function<void(bool fConnected)> Handler;
+
+    // Quiet time, in milliseconds, before a burst of notifications is
+    // acted on.
+    static const DWORD DefaultDebounce = 2000;
+
+    // How often the state is checked when the system's notifications are
+    // not available.
+    static const DWORD PollInterval = 10000;
+
+    explicit ConnectivityMonitor(DWORD dwDebounce = DefaultDebounce,
+                                 TimerService &timers = TimerService::Default());
+
+    // Stops the monitor.
+    ~ConnectivityMonitor(void);
+
+    ConnectivityMonitor(const ConnectivityMonitor &) = delete;
+    ConnectivityMonitor &operator=(const ConnectivityMonitor &) = delete;
+
+    // Check the current state and subscribe to change notifications,
+    // falling back to polling if they are not available.
+    void Start(void);
+
+    // Stop watching. Returns once no subscriber is being called.
+    void Stop(void);
+
+    // The state as of the last check.
+    bool IsConnected(void) const;
+
+    // Call a handler with every change of state, on the thread pool.
+    // Handlers are called one at a time, in the order of the changes.
+    SubscriptionId Subscribe(Handler handler);
+
+    // Remove a handler. Returns once it will not be called again and is
+    // not running, unless called from the handler itself.
+    void Unsubscribe(SubscriptionId id);
+
+    // Block until the network is connected, a stop is requested on the
+    // token or the timeout elapses. Returns true if connected.
+    bool WaitUntilConnected(const StopToken &token, DWORD dwMilliseconds = INFINITE);
+
+    // Check the state again once the debounce interval has passed without
+    // another call. The system's notifications come in here; callers that
+    // saw the network fail may call it too.
+    void Recheck(void);
+
+    // The process-wide monitor, started on first use.
+    static ConnectivityMonitor &Default(void);
+
+private:
+    // Timer callback: once the notifications have settled, check the state
+    // and tell the subscribers if it changed.
+    void Settle(void);
+
+    // Tell the subscribers about a new state.
+    void Publish(bool fConnected);
+
+    // Whether a non-loopback interface is up with a routable address.
+    static bool Probe(void);
+
+    // Register for the system's notifications. Returns false if they are
+    // not available.
+    bool RegisterNotifications(void);
+    void UnregisterNotifications(void);
+
+#ifndef _WIN32
+    // Thread body: read the netlink socket until Stop.
+    void WatchNetlink(void);
+#endif
+
+    TimerService &m_timers;
+    DWORD m_dwDebounce;
+
+    mutable std::mutex m_lock;
+    std::condition_variable m_changed;
+    bool m_fRunning;
+    bool m_fConnected;
+
+    // The debounce timer, if one is pending, and the time of the latest
+    // notification it waits to settle after
+    TimerService::TimerId m_settleTimer;
+    std::chrono::steady_clock::time_point m_lastNotification;
+
+    // The polling timer, when notifications are not available
+    TimerService::TimerId m_pollTimer;
+
+    // The subscribers. m_dispatchLock is held while they are called, by
+    // the thread in m_dispatcher
+    std::map<SubscriptionId, Handler> m_handlers;
+    SubscriptionId m_nextId;
+    std::mutex m_dispatchLock;
+    std::thread::id m_dispatcher;
+
+    // Metrics of the monitor
+    MetricCounter m_notifications;
+    MetricCounter m_transitions;
+    MetricGauge m_state;
+
+#ifdef _WIN32
+    HANDLE m_interfaceNotification;
+    HANDLE m_addressNotification;
+#else
+    int m_netlinkFd;
+    int m_wakeFd;
+    std::thread m_watcher;
+#endif
+};
@@ -0,0 +1,214 @@
+#pragma region Includes
+#include "Coroutine.h"
+#pragma endregion
+
+namespace
+{
+    // A coroutine that starts at once and frees itself when it finishes;
+    // the root of a task started with CoStart.
+    struct CoDetached
+    {
+        struct promise_type
+        {
+            CoDetached get_return_object(void) const noexcept { return CoDetached(); }
+            std::suspend_never initial_suspend(void) const noexcept { return {}; }
+            std::suspend_never final_suspend(void) const noexcept { return {}; }
+            void return_void(void) const noexcept {}
+            void unhandled_exception(void) const noexcept { std::terminate(); }
+        };
+    };
+
+    CoDetached Drive(CoTask<void> task, std::function<void(std::exception_ptr)> onDone)
+    {
+        std::exception_ptr error;
+        try
+        {
+            co_await task;
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        if (onDone)
+        {
+            try
+            {
+                onDone(error);
+            }
+            catch (...)
+            {
+                // Nothing is left to report it to.
+            }
+        }
+    }
+
+    CoTask<void> RunOn(ThreadPool &pool, CoTask<void> task)
+    {
+        co_await CoSchedule(pool);
+        co_await task;
+    }
+}
+
+#pragma region Awaiters
+
+/**
+ *   Queue the coroutine to the pool. If the pool refuses it, the coroutine
+ *   continues on the calling thread and await_resume throws.
+ *
+ *   @param handle - the suspended coroutine
+ *   @return true if the coroutine stays suspended until a worker resumes it
+ */
+bool CoScheduleAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    // Once the work is queued the coroutine may already be running on a
+    // worker, and this awaiter gone; touch nothing after it.
+    if (m_pool.Submit([handle]() { handle.resume(); }, m_priority))
+    {
+        return true;
+    }
+    m_fRefused = true;
+    return false;
+}
+
+void CoScheduleAwaiter::await_resume(void) const
+{
+    if (m_fRefused)
+    {
+        throw static_cast<DWORD>(ERROR_OPERATION_ABORTED);
+    }
+}
+
+/**
+ *   A zero delay and a stop that was already requested complete without
+ *   suspending.
+ */
+bool CoDelayAwaiter::await_ready(void) const
+{
+    return m_dwMilliseconds == 0 || m_token.StopRequested();
+}
+
+/**
+ *   Start the timer and register for the stop, whichever applies. Either
+ *   may fire before both are in place; then the coroutine does not suspend
+ *   at all.
+ *
+ *   @param handle - the suspended coroutine
+ *   @return true if the coroutine stays suspended
+ */
+bool CoDelayAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    m_handle = handle;
+    if (m_dwMilliseconds != INFINITE)
+    {
+        m_timer = m_timers.ScheduleOnce(m_dwMilliseconds, [this]() { Fire(TimerFired); });
+    }
+    if (m_token.StopPossible())
+    {
+        m_stop.reset(new StopCallback(m_token, [this]() { Fire(StopFired); }));
+    }
+
+    // From here on the coroutine may be resumed by the first event.
+    int state = m_state.fetch_or(Armed, std::memory_order_acq_rel);
+    return (state & (TimerFired | StopFired)) == 0;
+}
+
+/**
+ *   Take down whichever of the timer and the stop callback did not fire.
+ *   Both wait for a callback of theirs that is running on another thread,
+ *   so neither can touch this awaiter once it is gone.
+ *
+ *   @return true if the delay elapsed, false if a stop was requested
+ */
+bool CoDelayAwaiter::await_resume(void)
+{
+    int state = m_state.load(std::memory_order_acquire);
+    if (state & StopFired)
+    {
+        if (m_timer != 0)
+        {
+            m_timers.Cancel(m_timer);
+        }
+        m_stop.reset();
+        return false;
+    }
+    if (state & TimerFired)
+    {
+        m_stop.reset();
+        return true;
+    }
+
+    // Completed in await_ready.
+    return !m_token.StopRequested();
+}
+
+/**
+ *   Record the first event and resume the coroutine, unless await_suspend
+ *   is still arming; it sees the event and continues the coroutine itself.
+ *   The timer runs on a worker, which resumes the coroutine directly; a
+ *   stop runs on the thread that requested it, which must not be held up,
+ *   so the coroutine is queued to the pool.
+ *
+ *   @param event - TimerFired or StopFired
+ */
+void CoDelayAwaiter::Fire(int event)
+{
+    int state = m_state.load(std::memory_order_acquire);
+    do
+    {
+        if (state & (TimerFired | StopFired))
+        {
+            return;
+        }
+    } while (!m_state.compare_exchange_weak(state, state | event, std::memory_order_acq_rel));
+
+    if ((state & Armed) == 0)
+    {
+        return;
+    }
+
+    std::coroutine_handle<> handle = m_handle;
+    if (event == TimerFired || !m_timers.GetPool().Submit([handle]() { handle.resume(); }))
+    {
+        handle.resume();
+    }
+}
+
+#pragma endregion
+
+#pragma region Starting Tasks
+
+/**
+ *   Start a task on the calling thread. It runs until its first
+ *   suspension before CoStart returns, and frees itself when it finishes.
+ *
+ *   @param task - the task
+ *   @param onDone - runs when the task has finished, with what it threw,
+ *   or empty
+ */
+void CoStart(CoTask<void> task, std::function<void(std::exception_ptr error)> onDone)
+{
+    Drive(std::move(task), std::move(onDone));
+}
+
+/**
+ *   Start a task on a worker of the pool.
+ *
+ *   @param task - the task
+ *   @param pool - the pool to start it on
+ *   @return a future that is ready when the task has finished
+ */
+std::future<void> CoSpawn(CoTask<void> task, ThreadPool &pool)
+{
+    std::shared_ptr<std::promise<void>> done = std::make_shared<std::promise<void>>();
+    std::future<void> future = done->get_future();
+    CoStart(RunOn(pool, std::move(task)), [done](std::exception_ptr error) {
+        if (error)
+            done->set_exception(error);
+        else
+            done->set_value();
+    });
+    return future;
+}
+
+#pragma endregion
@@ -0,0 +1,260 @@
+/*
+ * C++20 coroutines for service logic.
+ *
+ * A CoTask<T> is a lazily started coroutine that produces a T. A service
+ * writes its main loop as a CoTask and awaits instead of blocking:
+ *
+ *   co_await CoSchedule(pool)          continue on a worker of the pool
+ *   co_await CoDelay(ms, token)        sleep, waking early on a stop
+ *   co_await CoWaitForStop(token)      wait until a stop is requested
+ *   co_await connection->Read()        the next data of a TCP connection
+ *   co_await other                     run another CoTask and get its result
+ *
+ * A suspended coroutine holds no thread: it is resumed on the thread pool
+ * when what it waits for happens, so thousands of them can share a few
+ * workers. CoSpawn starts a task on the pool and returns a future that is
+ * ready when the task has finished.
+ *
+ * A coroutine that hops to the pool must not be in a priority class whose
+ * queue sheds work; a shed hop would never resume it.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
+#include <utility>
+#include "Platform.h"
+#include "StopToken.h"
+#include "ThreadPool.h"
+#include "TimerService.h"
+
+template <typename T = void>
+class CoTask;
+
+// What every CoTask promise has: the coroutine that awaits it, and what it
+// threw.
+class CoPromiseBase
+{
+public:
+    // When the task finishes, resume its awaiter directly (symmetric
+    // transfer, so long chains of tasks do not grow the stack).
+    struct FinalAwaiter
+    {
+        bool await_ready(void) const noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            std::coroutine_handle<> continuation = handle.promise().m_continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume(void) const noexcept {}
+    };
+
+    std::suspend_always initial_suspend(void) const noexcept { return {}; }
+    FinalAwaiter final_suspend(void) const noexcept { return {}; }
+    void unhandled_exception(void) noexcept { m_exception = std::current_exception(); }
+
+    std::coroutine_handle<> m_continuation;
+    std::exception_ptr m_exception;
+};
+
+// The result of a task, kept in its promise until the awaiter takes it.
+template <typename T>
+class CoResult
+{
+public:
+    template <typename U>
+    void return_value(U &&value)
+    {
+        m_value.emplace(std::forward<U>(value));
+    }
+
+    T Take(void) { return std::move(*m_value); }
+
+private:
+    std::optional<T> m_value;
+};
+
+template <>
+class CoResult<void>
+{
+public:
+    void return_void(void) const noexcept {}
+    void Take(void) const noexcept {}
+};
+
+template <typename T>
+class CoTask
+{
+public:
+    class promise_type : public CoPromiseBase, public CoResult<T>
+    {
+    public:
+        CoTask get_return_object(void)
+        {
+            return CoTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+    class Awaiter
+    {
+    public:
+        explicit Awaiter(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+
+        bool await_ready(void) const noexcept { return !m_handle || m_handle.done(); }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            m_handle.promise().m_continuation = awaiting;
+            return m_handle;
+        }
+
+        T await_resume(void)
+        {
+            if (!m_handle)
+            {
+                throw static_cast<DWORD>(ERROR_INVALID_PARAMETER);
+            }
+            if (m_handle.promise().m_exception)
+            {
+                std::rethrow_exception(m_handle.promise().m_exception);
+            }
+            return m_handle.promise().Take();
+        }
+
+    private:
+        std::coroutine_handle<promise_type> m_handle;
+    };
+
+    CoTask(void) noexcept {}
+
+    CoTask(CoTask &&other) noexcept : m_handle(other.m_handle)
+    {
+        other.m_handle = nullptr;
+    }
+
+    CoTask &operator=(CoTask &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (m_handle)
+                m_handle.destroy();
+            m_handle = other.m_handle;
+            other.m_handle = nullptr;
+        }
+        return *this;
+    }
+
+    // Destroys the coroutine, which must not be running.
+    ~CoTask(void)
+    {
+        if (m_handle)
+            m_handle.destroy();
+    }
+
+    CoTask(const CoTask &) = delete;
+    CoTask &operator=(const CoTask &) = delete;
+
+    // Start the task and wait for it from another coroutine. Gives its
+    // result, or rethrows what it threw.
+    Awaiter operator co_await(void) noexcept { return Awaiter(m_handle); }
+
+    explicit operator bool(void) const { return static_cast<bool>(m_handle); }
+
+private:
+    explicit CoTask(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+// Awaiter of CoSchedule.
+class CoScheduleAwaiter
+{
+public:
+    CoScheduleAwaiter(ThreadPool &pool, WorkPriority priority)
+        : m_pool(pool), m_priority(priority), m_fRefused(false) {}
+
+    bool await_ready(void) const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle);
+
+    // Throws ERROR_OPERATION_ABORTED if the pool refused the work.
+    void await_resume(void) const;
+
+private:
+    ThreadPool &m_pool;
+    WorkPriority m_priority;
+    bool m_fRefused;
+};
+
+// Awaiter of CoDelay and CoWaitForStop. Resumes on the pool; gives true if
+// the delay elapsed and false if a stop was requested first.
+class CoDelayAwaiter
+{
+public:
+    CoDelayAwaiter(DWORD dwMilliseconds, const StopToken &token, TimerService &timers)
+        : m_dwMilliseconds(dwMilliseconds), m_token(token), m_timers(timers), m_timer(0), m_state(0) {}
+
+    CoDelayAwaiter(const CoDelayAwaiter &) = delete;
+    CoDelayAwaiter &operator=(const CoDelayAwaiter &) = delete;
+
+    bool await_ready(void) const;
+    bool await_suspend(std::coroutine_handle<> handle);
+    bool await_resume(void);
+
+private:
+    // Bits of m_state: set once everything is armed, and which of the two
+    // events came first.
+    static const int Armed = 1;
+    static const int TimerFired = 2;
+    static const int StopFired = 4;
+
+    // Called by the timer and the stop callback; the first one resumes the
+    // coroutine, or lets await_suspend continue it if it is still arming.
+    void Fire(int event);
+
+    DWORD m_dwMilliseconds;
+    StopToken m_token;
+    TimerService &m_timers;
+    TimerService::TimerId m_timer;
+    std::unique_ptr<StopCallback> m_stop;
+    std::coroutine_handle<> m_handle;
+    std::atomic<int> m_state;
+};
+
+// Continue on a worker of the pool.
+inline CoScheduleAwaiter CoSchedule(ThreadPool &pool = ThreadPool::Default(),
+                                    WorkPriority priority = PriorityNormal)
+{
+    return CoScheduleAwaiter(pool, priority);
+}
+
+// Sleep for dwMilliseconds without holding a thread. A stop requested on
+// the token ends the sleep early; the result says whether it did not.
+inline CoDelayAwaiter CoDelay(DWORD dwMilliseconds, const StopToken &token = StopToken(),
+                              TimerService &timers = TimerService::Default())
+{
+    return CoDelayAwaiter(dwMilliseconds, token, timers);
+}
+
+// Wait, without holding a thread, until a stop is requested on the token.
+inline CoDelayAwaiter CoWaitForStop(const StopToken &token)
+{
+    return CoDelayAwaiter(INFINITE, token, TimerService::Default());
+}
+
+// Start a task on the calling thread and let it finish on its own. onDone
+// runs when it has, with what it threw if it failed.
+void CoStart(CoTask<void> task, std::function<void(std::exception_ptr error)> onDone = nullptr);
+
+// Start a task on a worker of the pool. The future is ready when the task
+// has finished and rethrows what it threw.
+std::future<void> CoSpawn(CoTask<void> task, ThreadPool &pool = ThreadPool::Default());
@@ -0,0 +1,460 @@
+#pragma region Includes
+#include "CpuTopology.h"
+#include <algorithm>
+#include <filesystem>
+#include <iterator>
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <sched.h>
+#endif
+#pragma endregion
+
+namespace
+{
+    // Read the first line of a small file. Returns false if it cannot be
+    // read.
+    bool ReadLine(const std::string &path, std::string &line)
+    {
+        FILE *file = fopen(path.c_str(), "r");
+        if (file == NULL)
+        {
+            return false;
+        }
+        char buffer[4096];
+        bool fRead = fgets(buffer, sizeof(buffer), file) != NULL;
+        fclose(file);
+        if (fRead)
+        {
+            line = buffer;
+        }
+        return fRead;
+    }
+
+    // Parse an unsigned decimal number at the start of the text. Returns
+    // the character after it, or NULL if there is no number.
+    const char *ParseCpu(const char *text, unsigned int &cpu)
+    {
+        if (*text < '0' || *text > '9')
+        {
+            return NULL;
+        }
+        char *end = NULL;
+        unsigned long value = strtoul(text, &end, 10);
+        if (value > 0xFFFFu)
+        {
+            return NULL;
+        }
+        cpu = static_cast<unsigned int>(value);
+        return end;
+    }
+}
+
+#pragma region Topology
+
+CpuTopology::CpuTopology(void)
+{
+    Node node;
+    node.id = 0;
+    node.cpus.push_back(0);
+    m_nodes.push_back(node);
+}
+
+/**
+ *   The topology of the machine, restricted to the CPUs the process may
+ *   run on. It is read on first use.
+ */
+const CpuTopology &CpuTopology::Current(void)
+{
+    static const CpuTopology topology = []() {
+        CpuTopology system;
+        system.LoadSystem();
+        return system;
+    }();
+    return topology;
+}
+
+/**
+ *   Read the topology of the machine. Without NUMA information the whole
+ *   machine is one node.
+ */
+void CpuTopology::LoadSystem(void)
+{
+    std::vector<unsigned int> allowed = GetAllowedCpus();
+    bool fLoaded;
+#ifdef _WIN32
+    std::vector<Node> nodes;
+    ULONG highest = 0;
+    if (GetNumaHighestNodeNumber(&highest))
+    {
+        for (ULONG n = 0; n <= highest; n++)
+        {
+            GROUP_AFFINITY affinity;
+            ZeroMemory(&affinity, sizeof(affinity));
+            if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(n), &affinity))
+            {
+                continue;
+            }
+            Node node;
+            node.id = n;
+            for (unsigned int bit = 0; bit < 64; bit++)
+            {
+                if ((affinity.Mask >> bit) & 1)
+                {
+                    node.cpus.push_back(affinity.Group * 64 + bit);
+                }
+            }
+            if (!node.cpus.empty())
+            {
+                nodes.push_back(node);
+            }
+        }
+    }
+    fLoaded = !nodes.empty();
+    if (fLoaded)
+    {
+        m_nodes.swap(nodes);
+    }
+#else
+    fLoaded = LoadSysfs("/sys/devices/system/node");
+#endif
+    if (!fLoaded)
+    {
+        m_nodes.resize(1);
+        m_nodes[0].id = 0;
+        m_nodes[0].cpus = allowed;
+    }
+    Restrict(allowed);
+}
+
+/**
+ *   Read the topology from a sysfs node directory: a nodeN directory per
+ *   node, each with the CPU list of the node in its cpulist file. Nodes
+ *   without CPUs, which only have memory, are left out.
+ *
+ *   @param root - the directory, "/sys/devices/system/node" on Linux
+ *   @return false, keeping the current topology, if no node with a CPU
+ *   was found
+ */
+bool CpuTopology::LoadSysfs(const std::string &root)
+{
+    std::vector<Node> nodes;
+    std::error_code error;
+    std::filesystem::directory_iterator it(root, error);
+    for (; !error && it != std::filesystem::directory_iterator(); it.increment(error))
+    {
+        std::string name = it->path().filename().string();
+        unsigned int id = 0;
+        if (name.compare(0, 4, "node") != 0)
+        {
+            continue;
+        }
+        const char *end = ParseCpu(name.c_str() + 4, id);
+        if (end == NULL || *end != '\0')
+        {
+            continue;
+        }
+
+        Node node;
+        node.id = id;
+        std::string list;
+        if (ReadLine((it->path() / "cpulist").string(), list) && ParseCpuList(list, node.cpus) &&
+            !node.cpus.empty())
+        {
+            nodes.push_back(node);
+        }
+    }
+    if (nodes.empty())
+    {
+        return false;
+    }
+
+    std::sort(nodes.begin(), nodes.end(), [](const Node &a, const Node &b) { return a.id < b.id; });
+    m_nodes.swap(nodes);
+    return true;
+}
+
+/**
+ *   Build the topology from text.
+ *
+ *   @param text - the CPU list of every node, separated by semicolons; the
+ *   nodes are numbered from 0 in that order
+ *   @return false, keeping the current topology, if a list is malformed or
+ *   empty
+ */
+bool CpuTopology::Parse(const std::string &text)
+{
+    std::vector<Node> nodes;
+    size_t start = 0;
+    for (;;)
+    {
+        size_t end = text.find(';', start);
+        Node node;
+        node.id = static_cast<unsigned int>(nodes.size());
+        if (!ParseCpuList(text.substr(start, end - start), node.cpus) || node.cpus.empty())
+        {
+            return false;
+        }
+        nodes.push_back(node);
+        if (end == std::string::npos)
+        {
+            break;
+        }
+        start = end + 1;
+    }
+    m_nodes.swap(nodes);
+    return true;
+}
+
+/**
+ *   Keep only the given CPUs. If that leaves no node, the topology becomes
+ *   a single node with those CPUs.
+ *
+ *   @param cpus - the CPUs to keep
+ */
+void CpuTopology::Restrict(const std::vector<unsigned int> &cpus)
+{
+    std::vector<unsigned int> keep(cpus);
+    std::sort(keep.begin(), keep.end());
+
+    std::vector<Node> nodes;
+    for (size_t i = 0; i < m_nodes.size(); i++)
+    {
+        Node node;
+        node.id = m_nodes[i].id;
+        std::set_intersection(m_nodes[i].cpus.begin(), m_nodes[i].cpus.end(), keep.begin(), keep.end(),
+                              std::back_inserter(node.cpus));
+        if (!node.cpus.empty())
+        {
+            nodes.push_back(node);
+        }
+    }
+    if (nodes.empty() && !keep.empty())
+    {
+        Node node;
+        node.id = 0;
+        node.cpus = keep;
+        nodes.push_back(node);
+    }
+    if (!nodes.empty())
+    {
+        m_nodes.swap(nodes);
+    }
+}
+
+/**
+ *   @return every CPU of the topology, in ascending order
+ */
+std::vector<unsigned int> CpuTopology::GetCpus(void) const
+{
+    std::vector<unsigned int> cpus;
+    for (size_t i = 0; i < m_nodes.size(); i++)
+    {
+        cpus.insert(cpus.end(), m_nodes[i].cpus.begin(), m_nodes[i].cpus.end());
+    }
+    std::sort(cpus.begin(), cpus.end());
+    return cpus;
+}
+
+/**
+ *   @param cpu - a CPU number
+ *   @return the index of its node, or 0 if no node has it
+ */
+size_t CpuTopology::GetNodeOfCpu(unsigned int cpu) const
+{
+    for (size_t i = 0; i < m_nodes.size(); i++)
+    {
+        if (std::binary_search(m_nodes[i].cpus.begin(), m_nodes[i].cpus.end(), cpu))
+        {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/**
+ *   @return the CPU lists of the nodes, separated by semicolons, with runs
+ *   of CPUs written as ranges
+ */
+std::string CpuTopology::ToString(void) const
+{
+    std::string text;
+    for (size_t i = 0; i < m_nodes.size(); i++)
+    {
+        if (i != 0)
+        {
+            text += ';';
+        }
+        const std::vector<unsigned int> &cpus = m_nodes[i].cpus;
+        for (size_t first = 0; first < cpus.size();)
+        {
+            size_t last = first;
+            while (last + 1 < cpus.size() && cpus[last + 1] == cpus[last] + 1)
+            {
+                last++;
+            }
+            char range[32];
+            if (last == first)
+                snprintf(range, sizeof(range), "%s%u", (first == 0) ? "" : ",", cpus[first]);
+            else
+                snprintf(range, sizeof(range), "%s%u-%u", (first == 0) ? "" : ",", cpus[first], cpus[last]);
+            text += range;
+            first = last + 1;
+        }
+    }
+    return text;
+}
+
+/**
+ *   Parse a CPU list in the Linux format: CPU numbers and ranges separated
+ *   by commas. White space around the list, such as the newline at the end
+ *   of a sysfs file, is ignored.
+ *
+ *   @param text - the list; an empty list has no CPUs
+ *   @param cpus - receives the CPUs, in ascending order
+ *   @return false if the list is malformed
+ */
+bool CpuTopology::ParseCpuList(const std::string &text, std::vector<unsigned int> &cpus)
+{
+    size_t first = text.find_first_not_of(" \t\r\n");
+    size_t last = text.find_last_not_of(" \t\r\n");
+    std::string list = (first == std::string::npos) ? std::string() : text.substr(first, last - first + 1);
+
+    std::vector<unsigned int> parsed;
+    const char *p = list.c_str();
+    while (*p != '\0')
+    {
+        unsigned int low;
+        unsigned int high;
+        p = ParseCpu(p, low);
+        if (p == NULL)
+        {
+            return false;
+        }
+        high = low;
+        if (*p == '-')
+        {
+            p = ParseCpu(p + 1, high);
+            if (p == NULL || high < low)
+            {
+                return false;
+            }
+        }
+        for (unsigned int cpu = low; cpu <= high; cpu++)
+        {
+            parsed.push_back(cpu);
+        }
+        if (*p == ',')
+        {
+            p++;
+            if (*p == '\0')
+            {
+                return false;
+            }
+        }
+        else if (*p != '\0')
+        {
+            return false;
+        }
+    }
+
+    std::sort(parsed.begin(), parsed.end());
+    parsed.erase(std::unique(parsed.begin(), parsed.end()), parsed.end());
+    cpus.swap(parsed);
+    return true;
+}
+
+#pragma endregion
+
+#pragma region Processors
+
+/**
+ *   @return the CPUs the process may run on: its affinity mask on Linux,
+ *   every active processor of every group on Windows
+ */
+std::vector<unsigned int> CpuTopology::GetAllowedCpus(void)
+{
+    std::vector<unsigned int> cpus;
+#ifdef _WIN32
+    WORD groups = GetActiveProcessorGroupCount();
+    for (WORD group = 0; group < groups; group++)
+    {
+        DWORD count = GetActiveProcessorCount(group);
+        for (DWORD i = 0; i < count; i++)
+        {
+            cpus.push_back(group * 64 + i);
+        }
+    }
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (unsigned int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+    if (cpus.empty())
+    {
+        cpus.push_back(0);
+    }
+    return cpus;
+}
+
+unsigned int CpuTopology::GetCurrentCpu(void)
+{
+#ifdef _WIN32
+    PROCESSOR_NUMBER number;
+    GetCurrentProcessorNumberEx(&number);
+    return number.Group * 64 + number.Number;
+#else
+    int cpu = sched_getcpu();
+    return (cpu < 0) ? 0 : static_cast<unsigned int>(cpu);
+#endif
+}
+
+/**
+ *   Restrict the calling thread to a set of CPUs.
+ *
+ *   @param cpus - the CPUs; on Windows, those in the processor group of
+ *   the first
+ *   @return false if the set is empty or the system refused it
+ */
+bool CpuTopology::PinCurrentThread(const std::vector<unsigned int> &cpus)
+{
+    if (cpus.empty())
+    {
+        return false;
+    }
+#ifdef _WIN32
+    GROUP_AFFINITY affinity;
+    ZeroMemory(&affinity, sizeof(affinity));
+    affinity.Group = static_cast<WORD>(cpus[0] / 64);
+    for (size_t i = 0; i < cpus.size(); i++)
+    {
+        if (cpus[i] / 64 == affinity.Group)
+        {
+            affinity.Mask |= static_cast<KAFFINITY>(1) << (cpus[i] % 64);
+        }
+    }
+    return SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL) != FALSE;
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); i++)
+    {
+        if (cpus[i] < CPU_SETSIZE)
+        {
+            CPU_SET(cpus[i], &set);
+        }
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#endif
+}
+
+#pragma endregion
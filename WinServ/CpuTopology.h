@@ -0,0 +1,86 @@
+/*
+ * The NUMA nodes of the machine and the CPUs on each, and pinning threads
+ * to CPUs.
+ *
+ * On Windows the topology comes from GetNumaNodeProcessorMaskEx, and a CPU
+ * is numbered 64 * its processor group + its number within the group. On
+ * Linux it is read from sysfs (the cpulist of every node under
+ * /sys/devices/system/node), as libnuma does, and only the CPUs the process
+ * may run on are kept; a machine without that directory is one node. The
+ * sysfs reader takes any root directory, and a topology can also be given
+ * as text, so placement can be tried out with a made-up topology on
+ * ordinary hardware.
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "Platform.h"
+
+class CpuTopology
+{
+public:
+    struct Node
+    {
+        // The number the system gives the node.
+        unsigned int id;
+
+        // Its CPUs, in ascending order.
+        std::vector<unsigned int> cpus;
+    };
+
+    // A single node with CPU 0.
+    CpuTopology(void);
+
+    // The topology of the machine, read once. Nodes without a CPU the
+    // process may use are left out.
+    static const CpuTopology &Current(void);
+
+    // Read the topology from a sysfs node directory, such as
+    // "/sys/devices/system/node". Returns false if it holds no node with a
+    // CPU.
+    bool LoadSysfs(const std::string &root);
+
+    // Build the topology from the CPU lists of the nodes, separated by
+    // semicolons: "0-3,8-11;4-7,12-15" is two nodes. Returns false if a
+    // list is malformed.
+    bool Parse(const std::string &text);
+
+    // Keep only the given CPUs, dropping nodes left without any.
+    void Restrict(const std::vector<unsigned int> &cpus);
+
+    size_t GetNodeCount(void) const { return m_nodes.size(); }
+    const Node &GetNode(size_t index) const { return m_nodes[index]; }
+
+    // Every CPU of every node, in ascending order.
+    std::vector<unsigned int> GetCpus(void) const;
+
+    // The index of the node a CPU belongs to, or 0 if it is not in the
+    // topology.
+    size_t GetNodeOfCpu(unsigned int cpu) const;
+
+    // The topology as text, in the format Parse reads.
+    std::string ToString(void) const;
+
+    // Parse a CPU list in the Linux format, "0-3,8,10-11".
+    static bool ParseCpuList(const std::string &text, std::vector<unsigned int> &cpus);
+
+    // The CPUs the process may run on.
+    static std::vector<unsigned int> GetAllowedCpus(void);
+
+    // The CPU the calling thread is running on.
+    static unsigned int GetCurrentCpu(void);
+
+    // Restrict the calling thread to the given CPUs. On Windows they must
+    // be in one processor group; CPUs outside the group of the first are
+    // ignored. Returns false if the system refused.
+    static bool PinCurrentThread(const std::vector<unsigned int> &cpus);
+
+private:
+    // Read the topology of the machine.
+    void LoadSystem(void);
+
+    std::vector<Node> m_nodes;
+};
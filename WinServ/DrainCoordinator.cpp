@@ -0,0 +1,218 @@
+#pragma region Includes
+#include "DrainCoordinator.h"
+#include <exception>
+#include <thread>
+#pragma endregion
+
+DrainCoordinator::DrainCoordinator(void)
+    : m_fDeadline(false), m_started(0), m_fFinished(true)
+{
+}
+
+#pragma region Adding Steps
+
+/**
+ *   Add a step at the end of the drain.
+ *
+ *   @param pszName - the name of the step, used when it runs out of time
+ *   @param step - the work of the step
+ *   @param abort - the quick substitute for the step on the abort path, or
+ *   an empty function
+ */
+void DrainCoordinator::Add(const wchar_t *pszName, Step step, Abort abort)
+{
+    Entry entry;
+    entry.name = pszName;
+    entry.step = std::move(step);
+    entry.abort = std::move(abort);
+    m_steps.push_back(std::move(entry));
+}
+
+/**
+ *   Add the steps of another drain at the end of this one.
+ *
+ *   @param steps - the drain whose steps to add
+ */
+void DrainCoordinator::Add(const DrainCoordinator &steps)
+{
+    m_steps.insert(m_steps.end(), steps.m_steps.begin(), steps.m_steps.end());
+}
+
+/**
+ *   Forget the steps.
+ */
+void DrainCoordinator::Clear(void)
+{
+    m_steps.clear();
+}
+
+#pragma endregion
+
+#pragma region Running the Drain
+
+/**
+ *   Run the steps in order on the calling thread. Each step may take the
+ *   time left before the abort path starts. When a step returns false, or
+ *   none of that time is left when the next one is due, the abort actions
+ *   of the remaining steps run instead, starting with the step that ran out
+ *   of time.
+ *
+ *   @param dwDeadline - milliseconds the whole drain may take, or INFINITE
+ *   @param progress - receives the progress; may be empty
+ *   @return true if every step finished
+ */
+bool DrainCoordinator::Run(DWORD dwDeadline, const Progress &progress)
+{
+    Clock::time_point started = Clock::now();
+    m_fDeadline = (dwDeadline != INFINITE);
+    if (m_fDeadline)
+    {
+        m_deadline = started + std::chrono::milliseconds(dwDeadline);
+        m_stepsEnd = m_deadline - std::chrono::milliseconds(dwDeadline / ReserveDivisor);
+    }
+    m_abortedStep.clear();
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_started = 0;
+        m_fFinished = false;
+    }
+
+    std::thread reporter;
+    if (progress)
+    {
+        reporter = std::thread(&DrainCoordinator::ReportProgress, this, std::cref(progress));
+    }
+
+    bool fDone = true;
+    std::exception_ptr error;
+    try
+    {
+        size_t i = 0;
+        for (; i < m_steps.size(); i++)
+        {
+            NextStep();
+            DWORD dwTimeLeft = GetTimeLeft();
+            if (dwTimeLeft == 0 || !m_steps[i].step(dwTimeLeft))
+            {
+                break;
+            }
+        }
+
+        if (i < m_steps.size())
+        {
+            fDone = false;
+            m_abortedStep = m_steps[i].name;
+            for (; i < m_steps.size(); i++)
+            {
+                if (m_steps[i].abort)
+                {
+                    NextStep();
+                    m_steps[i].abort(m_fDeadline ? MillisecondsUntil(m_deadline) : INFINITE);
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_fFinished = true;
+        m_changed.notify_all();
+    }
+    if (reporter.joinable())
+    {
+        reporter.join();
+    }
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+    return fDone;
+}
+
+/**
+ *   @return the milliseconds the running step has left before the abort
+ *   path would start, or INFINITE
+ */
+DWORD DrainCoordinator::GetTimeLeft(void) const
+{
+    return m_fDeadline ? MillisecondsUntil(m_stepsEnd) : INFINITE;
+}
+
+/**
+ *   @return the name of the step that ran out of time in the last run, or
+ *   an empty string
+ */
+std::wstring DrainCoordinator::GetAbortedStep(void) const
+{
+    return m_abortedStep;
+}
+
+/**
+ *   @param until - a point in time
+ *   @return the milliseconds until then, rounded up, or 0 once it has
+ *   passed
+ */
+DWORD DrainCoordinator::MillisecondsUntil(Clock::time_point until)
+{
+    Clock::time_point now = Clock::now();
+    if (until <= now)
+    {
+        return 0;
+    }
+    return static_cast<DWORD>(std::chrono::ceil<std::chrono::milliseconds>(until - now).count());
+}
+
+/**
+ *   Count another step as started and wake the progress thread, so that
+ *   the checkpoint moves with every step.
+ */
+void DrainCoordinator::NextStep(void)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_started++;
+    m_changed.notify_all();
+}
+
+/**
+ *   The body of the progress thread. Reports the time left before the
+ *   deadline at once, whenever a step starts, and every ProgressInterval
+ *   ms, never less than ProgressInterval so that the abort path still gets
+ *   a checkpoint's worth of time. Without a deadline the hint is twice the
+ *   interval: the next report is due well within it.
+ *
+ *   @param progress - receives the progress
+ */
+void DrainCoordinator::ReportProgress(const Progress &progress)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    while (!m_fFinished)
+    {
+        size_t reported = m_started;
+        DWORD dwWaitHint = m_fDeadline ? MillisecondsUntil(m_deadline) : 2 * ProgressInterval;
+        if (dwWaitHint < ProgressInterval)
+        {
+            dwWaitHint = ProgressInterval;
+        }
+
+        guard.unlock();
+        try
+        {
+            progress(dwWaitHint);
+        }
+        catch (...)
+        {
+            // A report that fails must not end the drain.
+        }
+        guard.lock();
+
+        m_changed.wait_for(guard, std::chrono::milliseconds(ProgressInterval),
+                           [this, reported]() { return m_fFinished || m_started != reported; });
+    }
+}
+
+#pragma endregion
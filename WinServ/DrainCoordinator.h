@@ -0,0 +1,116 @@
+/*
+ * Draining a service within a deadline when it stops.
+ *
+ * A drain is a list of named steps run one after the other on the stopping
+ * thread: stop taking new work, wait for the work in flight, write out the
+ * metrics and the log. Each step may take the time left before the
+ * deadline, less a reserve kept back for the end. While the drain runs, a
+ * progress thread reports the time left at a steady interval and whenever
+ * a step starts, so the caller can keep the control manager's checkpoint
+ * moving with a wait hint it can trust.
+ *
+ * A step that runs out of time switches the drain to its abort path: the
+ * steps still to come do not run, and their abort actions, which must be
+ * quick, run instead within the reserve. That way what can still be saved
+ * (the last log records, above all) is saved before the deadline.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Platform.h"
+
+class DrainCoordinator
+{
+public:
+    // A step. Receives the milliseconds it may take (INFINITE without a
+    // deadline) and returns true if it finished within them.
+    typedef std::function<bool(DWORD dwMilliseconds)> Step;
+
+    // What runs instead of a step on the abort path. Receives the
+    // milliseconds left before the deadline.
+    typedef std::function<void(DWORD dwMilliseconds)> Abort;
+
+    // Called on the progress thread when the drain starts, whenever a step
+    // starts and every ProgressInterval ms in between, with the wait hint:
+    // the milliseconds left before the deadline.
+    typedef std::function<void(DWORD dwWaitHint)> Progress;
+
+    // How often progress is reported while a step runs, in milliseconds.
+    static const DWORD ProgressInterval = 500;
+
+    // The part of the deadline kept back for the abort path is
+    // 1 / ReserveDivisor of it.
+    static const DWORD ReserveDivisor = 5;
+
+    DrainCoordinator(void);
+
+    // Add a step at the end of the drain. abort may be empty if the step
+    // can simply be skipped.
+    void Add(const wchar_t *pszName, Step step, Abort abort = Abort());
+
+    // Add the steps of another drain at the end of this one.
+    void Add(const DrainCoordinator &steps);
+
+    // Run the steps within dwDeadline milliseconds, or INFINITE. Returns
+    // true if every step finished, false if the drain took the abort path.
+    // If a step throws, the steps after it are skipped and the exception is
+    // rethrown once progress reporting has stopped.
+    bool Run(DWORD dwDeadline, const Progress &progress);
+
+    // The milliseconds the running step has left before the abort path
+    // would start, or INFINITE without a deadline. Call from a step.
+    DWORD GetTimeLeft(void) const;
+
+    // The name of the step that ran out of time in the last run, or an
+    // empty string if none did.
+    std::wstring GetAbortedStep(void) const;
+
+    // True if no step has been added.
+    bool Empty(void) const { return m_steps.empty(); }
+
+    // Forget the steps.
+    void Clear(void);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry
+    {
+        std::wstring name;
+        Step step;
+        Abort abort;
+    };
+
+    // The milliseconds until the given time, 0 once it has passed.
+    static DWORD MillisecondsUntil(Clock::time_point until);
+
+    // Mark the start of another step and wake the progress thread.
+    void NextStep(void);
+
+    // Progress thread body: report until the drain has finished.
+    void ReportProgress(const Progress &progress);
+
+    std::vector<Entry> m_steps;
+
+    // Whether the running drain has a deadline, the deadline, and when the
+    // abort path starts
+    bool m_fDeadline;
+    Clock::time_point m_deadline;
+    Clock::time_point m_stepsEnd;
+
+    std::wstring m_abortedStep;
+
+    // The number of steps started so far and whether the drain has
+    // finished; the progress thread waits on m_changed for either
+    std::mutex m_lock;
+    std::condition_variable m_changed;
+    size_t m_started;
+    bool m_fFinished;
+};
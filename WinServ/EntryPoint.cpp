@@ -1,8 +1,18 @@
 #pragma region Includes
 #include <stdio.h>
-#include <windows.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "Platform.h"
+#include "Benchmark.h"
+#include "Metrics.h"
 #include "ServiceBase.h"
+#include "Trace.h"
 #include "WinService.h"
+#ifndef _WIN32
+#include <unistd.h>
+#include "PosixServiceHost.h"
+#endif
 #pragma endregion
 
 // Settings of the service
@@ -16,6 +26,11 @@
 // Service start options.
 #define SERVICE_START_TYPE SERVICE_DEMAND_START
 
+// Service type: SERVICE_WIN32_OWN_PROCESS for the one service this process
+// runs, SERVICE_WIN32_SHARE_PROCESS for each service when it runs several,
+// which is how ServiceBase::Run registers them
+#define SERVICE_TYPE SERVICE_WIN32_OWN_PROCESS
+
 // List of service dependencies
 #define SERVICE_DEPENDENCIES L""
 
@@ -25,6 +40,16 @@
 // The password to the service account name
 #define SERVICE_PASSWORD NULL
 
+// The file the settings that can change while the service runs are read
+// from, in the directory of the executable
+#define SERVICE_CONFIG_FILE L"WinServ.conf"
+
+// The file the trace is written to when the service runs with -trace, in
+// the directory of the executable
+#define SERVICE_TRACE_FILE L"WinServ.trace.json"
+
+#ifdef _WIN32
+
 /*
  *   Install the current application as a service to the local service
  *   control manager database. If the function fails to install the
@@ -32,6 +57,8 @@
  *
  *   @param pszServiceName - the name of the service to be installed
  *   @param pszDisplayName - the display name of the service
+ *   @param dwServiceType - SERVICE_WIN32_OWN_PROCESS, or
+ *   SERVICE_WIN32_SHARE_PROCESS if the process runs several services.
  *   @param dwStartType - the service start option. This parameter can be one of
  *   the following values: SERVICE_AUTO_START, SERVICE_BOOT_START,
  *   SERVICE_DEMAND_START, SERVICE_DISABLED, SERVICE_SYSTEM_START.
@@ -43,6 +70,7 @@
  */
 void InstallService(PWSTR pszServiceName,
                     PWSTR pszDisplayName,
+                    DWORD dwServiceType,
                     DWORD dwStartType,
                     PWSTR pszDependencies,
                     PWSTR pszAccount,
@@ -72,7 +100,7 @@ void InstallService(PWSTR pszServiceName,
         pszServiceName,            // Name of service
         pszDisplayName,            // Name to display
         SERVICE_QUERY_STATUS,      // Desired access
-        SERVICE_WIN32_OWN_PROCESS, // Service type
+        dwServiceType,             // Service type
         dwStartType,               // Service start type
         SERVICE_ERROR_NORMAL,      // Error control type
         szPath,                    // Service's binary
@@ -88,7 +116,7 @@ void InstallService(PWSTR pszServiceName,
         goto Cleanup;
     }
 
-    wprintf(L"%s is installed.\n", pszServiceName);
+    wprintf(L"%ls is installed.\n", pszServiceName);
 
 Cleanup:
     // Centralized cleanup for all allocated resources.
@@ -136,7 +164,7 @@ void UninstallService(PWSTR pszServiceName)
     // Try to stop the service
     if (ControlService(schService, SERVICE_CONTROL_STOP, &ssSvcStatus))
     {
-        wprintf(L"Stopping %s.", pszServiceName);
+        wprintf(L"Stopping %ls.", pszServiceName);
         Sleep(1000);
 
         while (QueryServiceStatus(schService, &ssSvcStatus))
@@ -152,11 +180,11 @@ void UninstallService(PWSTR pszServiceName)
 
         if (ssSvcStatus.dwCurrentState == SERVICE_STOPPED)
         {
-            wprintf(L"\n%s is stopped.\n", pszServiceName);
+            wprintf(L"\n%ls is stopped.\n", pszServiceName);
         }
         else
         {
-            wprintf(L"\n%s failed to stop.\n", pszServiceName);
+            wprintf(L"\n%ls failed to stop.\n", pszServiceName);
         }
     }
 
@@ -167,7 +195,7 @@ void UninstallService(PWSTR pszServiceName)
         goto Cleanup;
     }
 
-    wprintf(L"%s is removed.\n", pszServiceName);
+    wprintf(L"%ls is removed.\n", pszServiceName);
 
 Cleanup:
     // Centralized cleanup for all allocated resources.
@@ -183,6 +211,93 @@ Cleanup:
     }
 }
 
+#else
+
+// There is no service control manager to register with outside Windows;
+// the service manager (systemd, a supervisor) starts the binary directly.
+void InstallService(PWSTR pszServiceName, PWSTR, DWORD, DWORD, PWSTR, PWSTR, PWSTR)
+{
+    wprintf(L"Installing %ls is not supported on this platform.\n", pszServiceName);
+}
+
+void UninstallService(PWSTR pszServiceName)
+{
+    wprintf(L"Removing %ls is not supported on this platform.\n", pszServiceName);
+}
+
+#endif
+
+/**
+ *   Get the path of a file of the service: the file in the directory of
+ *   the executable, or in the current directory if that cannot be found.
+ *
+ *   @param pszFile - the name of the file
+ *   @return the path
+ */
+std::wstring GetServiceFilePath(const wchar_t *pszFile)
+{
+    std::wstring path;
+#ifdef _WIN32
+    wchar_t szPath[MAX_PATH];
+    DWORD dwLength = GetModuleFileName(NULL, szPath, ARRAYSIZE(szPath));
+    if (dwLength > 0 && dwLength < ARRAYSIZE(szPath))
+    {
+        path.assign(szPath, dwLength);
+    }
+#else
+    char szPath[4096];
+    ssize_t length = readlink("/proc/self/exe", szPath, sizeof(szPath) - 1);
+    if (length > 0)
+    {
+        szPath[length] = '\0';
+        size_t converted = mbstowcs(NULL, szPath, 0);
+        if (converted != static_cast<size_t>(-1))
+        {
+            path.resize(converted);
+            mbstowcs(&path[0], szPath, converted + 1);
+        }
+    }
+#endif
+    size_t slash = path.find_last_of(L"\\/");
+    path = (slash != std::wstring::npos) ? path.substr(0, slash + 1) : std::wstring();
+    return path + pszFile;
+}
+
+/**
+ *   Run the service until it stops.
+ *
+ *   @param fTrace - record a trace from the start, written to
+ *   SERVICE_TRACE_FILE on ControlDumpTrace and once the service has stopped
+ */
+void RunService(bool fTrace)
+{
+    std::wstring configPath = GetServiceFilePath(SERVICE_CONFIG_FILE);
+    std::wstring tracePath = GetServiceFilePath(SERVICE_TRACE_FILE);
+    if (fTrace)
+    {
+        Trace::Enable(true);
+    }
+
+    WinService service(const_cast<PWSTR>(SERVICE_NAME), &configPath[0]);
+    service.SetTraceFile(tracePath.c_str());
+    if (!ServiceBase::Run(service))
+    {
+        wprintf(L"Service failed to run w/err 0x%08lx\n", GetLastError());
+    }
+
+    if (fTrace)
+    {
+        try
+        {
+            Trace::Export(tracePath.c_str());
+        }
+        catch (DWORD dwError)
+        {
+            wprintf(L"Writing the trace failed w/err 0x%08lx\n", dwError);
+        }
+    }
+}
+
 /**
  *   Entrypoint for the application.
  *
@@ -201,6 +316,7 @@ int wmain(int argc, wchar_t *argv[])
             InstallService(
                 const_cast<PWSTR>(SERVICE_NAME),         // Name of service
                 const_cast<PWSTR>(SERVICE_DISPLAY_NAME), // Name to display
+                SERVICE_TYPE,                            // Service type
                 SERVICE_START_TYPE,                      // Service start type
                 const_cast<PWSTR>(SERVICE_DEPENDENCIES), // Dependencies
                 const_cast<PWSTR>(SERVICE_ACCOUNT),      // Service running account
@@ -213,19 +329,81 @@ int wmain(int argc, wchar_t *argv[])
             // "-remove" or "/remove".
             UninstallService(const_cast<PWSTR>(SERVICE_NAME));
         }
+        else if (_wcsicmp(L"benchmark", argv[1] + 1) == 0)
+        {
+            // Run the built-in benchmarks when the command is
+            // "-benchmark [name] [-json file]" or "/benchmark [name] [/json file]".
+            wchar_t *pszName = NULL;
+            wchar_t *pszJsonPath = NULL;
+            for (int i = 2; i < argc; i++)
+            {
+                if ((*argv[i] == L'-' || *argv[i] == L'/') &&
+                    _wcsicmp(L"json", argv[i] + 1) == 0 && i + 1 < argc)
+                {
+                    pszJsonPath = argv[++i];
+                }
+                else
+                {
+                    pszName = argv[i];
+                }
+            }
+            return RunBenchmarks(pszName, pszJsonPath);
+        }
+        else if (_wcsicmp(L"metrics", argv[1] + 1) == 0 && argc > 2)
+        {
+            // Print the metrics of a running service when the command is
+            // "-metrics <pid>" or "/metrics <pid>".
+            return PrintMetrics(static_cast<DWORD>(wcstoul(argv[2], NULL, 10)));
+        }
+        else if (_wcsicmp(L"trace", argv[1] + 1) == 0)
+        {
+            // Run the service, recording a trace from the start, when the
+            // command is "-trace" or "/trace".
+            RunService(true);
+        }
     }
     else
     {
         wprintf(L"Parameters:\n");
         wprintf(L" -install  to install the service.\n");
         wprintf(L" -remove   to remove the service.\n");
+        wprintf(L" -benchmark [name] [-json file] to run the built-in benchmarks.\n");
+        wprintf(L" -metrics <pid> to print the metrics of a running service.\n");
+        wprintf(L" -trace    to run the service recording a trace.\n");
+
+        RunService(false);
+    }
 
-        WinService service(const_cast<PWSTR>(SERVICE_NAME));
-        if (!ServiceBase::Run(service))
+    return 0;
+}
+
+#ifndef _WIN32
+
+/**
+ *   Entrypoint for the application on POSIX systems. Blocks the control
+ *   signals before any thread starts, then converts the arguments to wide
+ *   strings and continues in wmain.
+ *
+ *   @param  argc: number of command line arguments
+ *   @param  argv: array of command line arguments
+ */
+int main(int argc, char *argv[])
+{
+    PosixServiceHost::BlockSignals();
+
+    std::vector<std::wstring> args(argc);
+    std::vector<wchar_t *> wargv(argc + 1, static_cast<wchar_t *>(NULL));
+    for (int i = 0; i < argc; i++)
+    {
+        size_t length = mbstowcs(NULL, argv[i], 0);
+        if (length != static_cast<size_t>(-1))
         {
-            wprintf(L"Service failed to run w/err 0x%08lx\n", GetLastError());
+            args[i].resize(length);
+            mbstowcs(&args[i][0], argv[i], length + 1);
         }
+        wargv[i] = &args[i][0];
     }
+    return wmain(argc, &wargv[0]);
+}
 
-    return 0;
-}
\ No newline at end of file
+#endif
@@ -0,0 +1,844 @@
+#pragma region Includes
+#include "EpollEventLoop.h"
+#pragma endregion
+
+#ifndef _WIN32
+
+#pragma region Includes
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <future>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#pragma endregion
+
+namespace
+{
+    // Size of the datagram buffer of a loop, the largest UDP payload.
+    const size_t DatagramBufferSize = 64 * 1024;
+
+    // Reads a level-triggered connection gets per wakeup, so one busy
+    // connection cannot starve the others of the loop.
+    const int ReadsPerWakeup = 16;
+
+    // How long a socket the loop could not serve, for want of descriptors
+    // or buffers, stays out of the epoll set before it is tried again.
+    const long RetryDelayMs = 50;
+
+    // Fill a sockaddr from an address string and port. NULL or an empty
+    // string means every IPv4 address.
+    bool ParseAddress(const char *pszAddress, unsigned short port,
+                      sockaddr_storage *address, socklen_t *length)
+    {
+        memset(address, 0, sizeof(*address));
+        sockaddr_in6 *v6 = reinterpret_cast<sockaddr_in6 *>(address);
+        if (pszAddress != NULL && inet_pton(AF_INET6, pszAddress, &v6->sin6_addr) == 1)
+        {
+            v6->sin6_family = AF_INET6;
+            v6->sin6_port = htons(port);
+            *length = sizeof(sockaddr_in6);
+            return true;
+        }
+
+        sockaddr_in *v4 = reinterpret_cast<sockaddr_in *>(address);
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(port);
+        *length = sizeof(sockaddr_in);
+        if (pszAddress == NULL || *pszAddress == '\0')
+        {
+            v4->sin_addr.s_addr = htonl(INADDR_ANY);
+            return true;
+        }
+        return inet_pton(AF_INET, pszAddress, &v4->sin_addr) == 1;
+    }
+
+    // The port of a bound socket.
+    unsigned short GetBoundPort(int fd)
+    {
+        sockaddr_storage address;
+        socklen_t length = sizeof(address);
+        if (getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length) != 0)
+        {
+            return 0;
+        }
+        return (address.ss_family == AF_INET6)
+                   ? ntohs(reinterpret_cast<sockaddr_in6 *>(&address)->sin6_port)
+                   : ntohs(reinterpret_cast<sockaddr_in *>(&address)->sin_port);
+    }
+}
+
+#pragma region Loop
+
+EpollEventLoop::EpollEventLoop(SocketServer &server)
+    : m_server(server), m_epollFd(-1), m_wakeFd(-1), m_retryFd(-1), m_stop(false),
+      m_acceptPaused(false), m_buffer(DatagramBufferSize)
+{
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_retryFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_epollFd == -1 || m_wakeFd == -1 || m_retryFd == -1)
+    {
+        DWORD dwError = GetLastError();
+        if (m_epollFd != -1)
+            close(m_epollFd);
+        if (m_wakeFd != -1)
+            close(m_wakeFd);
+        if (m_retryFd != -1)
+            close(m_retryFd);
+        throw dwError;
+    }
+    try
+    {
+        AddWatch(WakeWatch, m_wakeFd, 0, SocketConnectionPtr());
+        AddWatch(RetryWatch, m_retryFd, 0, SocketConnectionPtr());
+    }
+    catch (DWORD)
+    {
+        close(m_retryFd);
+        close(m_wakeFd);
+        close(m_epollFd);
+        throw;
+    }
+}
+
+EpollEventLoop::~EpollEventLoop(void)
+{
+    Stop();
+    close(m_retryFd);
+    close(m_wakeFd);
+    close(m_epollFd);
+}
+
+/**
+ *   Open this loop's socket for every endpoint: a non-blocking listening
+ *   or datagram socket with SO_REUSEPORT, so that each loop binds the same
+ *   port and the kernel spreads the traffic across them. When an endpoint
+ *   asks for port 0 the first loop's bind picks the port, and it is
+ *   written back to the endpoint for the other loops.
+ *
+ *   @param endpoints - the endpoints of the server
+ *   @param fPrimary - whether this is the first loop (unused: every loop
+ *   has its own sockets)
+ */
+void EpollEventLoop::Open(std::vector<SocketServer::Endpoint> &endpoints, bool fPrimary)
+{
+    (void)fPrimary;
+    for (size_t i = 0; i < endpoints.size(); i++)
+    {
+        SocketServer::Endpoint &endpoint = endpoints[i];
+        sockaddr_storage address;
+        socklen_t length;
+        if (!ParseAddress(endpoint.address.empty() ? NULL : endpoint.address.c_str(),
+                          endpoint.port, &address, &length))
+        {
+            throw static_cast<DWORD>(ERROR_INVALID_PARAMETER);
+        }
+
+        int fd = socket(address.ss_family,
+                        (endpoint.tcp ? SOCK_STREAM : SOCK_DGRAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+        {
+            throw GetLastError();
+        }
+
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        if (bind(fd, reinterpret_cast<sockaddr *>(&address), length) != 0 ||
+            (endpoint.tcp && listen(fd, SOMAXCONN) != 0))
+        {
+            DWORD dwError = GetLastError();
+            close(fd);
+            throw dwError;
+        }
+
+        if (endpoint.port == 0)
+        {
+            endpoint.port = GetBoundPort(fd);
+        }
+        if (endpoint.tcp)
+        {
+            AddWatch(ListenWatch, fd, i, SocketConnectionPtr());
+        }
+        else
+        {
+            m_datagramFds.push_back(fd);
+            AddWatch(DatagramWatch, fd, i, SocketConnectionPtr());
+        }
+    }
+}
+
+void EpollEventLoop::Start(void)
+{
+    m_thread = std::thread(&EpollEventLoop::Loop, this);
+}
+
+/**
+ *   Close the listening sockets of the loop and take its datagram sockets
+ *   out of the epoll set. The datagram sockets stay open until Stop, so
+ *   callbacks still running can reply.
+ */
+void EpollEventLoop::StopAccepting(void)
+{
+    RunOnLoop([this]() {
+        std::vector<int> fds;
+        for (auto it = m_watches.begin(); it != m_watches.end(); ++it)
+        {
+            if (it->second->type == ListenWatch || it->second->type == DatagramWatch)
+            {
+                fds.push_back(it->first);
+            }
+        }
+        for (size_t i = 0; i < fds.size(); i++)
+        {
+            bool fDatagram = m_watches[fds[i]]->type == DatagramWatch;
+            epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fds[i], NULL);
+            m_watches.erase(fds[i]);
+            if (!fDatagram)
+            {
+                close(fds[i]);
+            }
+        }
+    });
+}
+
+/**
+ *   Leave new connections in the backlog of the listening sockets, and
+ *   datagrams in the buffers of the datagram sockets, until
+ *   ResumeAccepting. Open connections are not affected.
+ */
+void EpollEventLoop::PauseAccepting(void)
+{
+    RunOnLoop([this]() { WatchListeners(false); });
+}
+
+/**
+ *   Accept connections and read datagrams again, starting with those that
+ *   waited while the loop was paused. Returns without waiting for the loop
+ *   thread; a later pause is queued behind it.
+ */
+void EpollEventLoop::ResumeAccepting(void)
+{
+    PostToLoop([this]() { WatchListeners(true); });
+}
+
+/**
+ *   Close every connection of the loop, whether or not its output has
+ *   been written.
+ */
+void EpollEventLoop::CloseConnections(void)
+{
+    RunOnLoop([this]() {
+        std::vector<SocketConnectionPtr> connections;
+        for (auto it = m_watches.begin(); it != m_watches.end(); ++it)
+        {
+            if (it->second->type == ConnectionWatch)
+            {
+                connections.push_back(it->second->connection);
+            }
+        }
+        for (size_t i = 0; i < connections.size(); i++)
+        {
+            CloseConnection(connections[i]);
+        }
+    });
+}
+
+/**
+ *   Stop the loop thread, then close whatever sockets are left.
+ */
+void EpollEventLoop::Stop(void)
+{
+    if (m_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_commandLock);
+            m_commands.push_back([this]() { m_stop = true; });
+        }
+        eventfd_write(m_wakeFd, 1);
+        m_thread.join();
+    }
+
+    std::vector<SocketConnectionPtr> connections;
+    for (auto it = m_watches.begin(); it != m_watches.end(); ++it)
+    {
+        if (it->second->type == ConnectionWatch)
+            connections.push_back(it->second->connection);
+    }
+    for (size_t i = 0; i < connections.size(); i++)
+    {
+        CloseConnection(connections[i]);
+    }
+
+    std::vector<int> fds;
+    for (auto it = m_watches.begin(); it != m_watches.end(); ++it)
+    {
+        if (it->second->type == ListenWatch)
+            fds.push_back(it->first);
+    }
+    for (size_t i = 0; i < fds.size(); i++)
+    {
+        RemoveWatch(fds[i]);
+    }
+    for (size_t i = 0; i < m_datagramFds.size(); i++)
+    {
+        if (m_watches.count(m_datagramFds[i]) != 0)
+        {
+            epoll_ctl(m_epollFd, EPOLL_CTL_DEL, m_datagramFds[i], NULL);
+            m_watches.erase(m_datagramFds[i]);
+        }
+        close(m_datagramFds[i]);
+    }
+    m_datagramFds.clear();
+}
+
+/**
+ *   The loop thread: wait for readiness and handle it until Stop.
+ */
+void EpollEventLoop::Loop(void)
+{
+    epoll_event events[64];
+    while (!m_stop)
+    {
+        int count = epoll_wait(m_epollFd, events, ARRAYSIZE(events), -1);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (int i = 0; i < count && !m_stop; i++)
+        {
+            auto it = m_watches.find(events[i].data.fd);
+            if (it == m_watches.end())
+            {
+                // Closed by an earlier event of this batch.
+                continue;
+            }
+
+            Watch &watch = *it->second;
+            switch (watch.type)
+            {
+            case WakeWatch:
+            {
+                eventfd_t value;
+                eventfd_read(m_wakeFd, &value);
+                std::vector<std::function<void(void)>> commands;
+                {
+                    std::lock_guard<std::mutex> guard(m_commandLock);
+                    commands.swap(m_commands);
+                }
+                for (size_t c = 0; c < commands.size(); c++)
+                {
+                    commands[c]();
+                }
+                break;
+            }
+            case RetryWatch:
+                ResumeInput();
+                break;
+            case ListenWatch:
+                AcceptConnections(watch);
+                break;
+            case DatagramWatch:
+                ReceiveDatagrams(watch);
+                break;
+            case ConnectionWatch:
+            {
+                SocketConnectionPtr connection = watch.connection;
+                if (events[i].events & EPOLLOUT)
+                {
+                    Flush(*connection);
+                }
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLRDHUP))
+                {
+                    Receive(watch);
+                }
+                break;
+            }
+            }
+        }
+    }
+}
+
+#pragma endregion
+
+#pragma region Connections
+
+/**
+ *   Write to a connection from the calling thread while nothing is
+ *   queued ahead of the data; queue what the socket does not take and
+ *   let the loop write it once the socket is writable.
+ *
+ *   @param connection - the connection
+ *   @param data - the data
+ *   @param size - its size in bytes
+ *   @return false if the connection is closing
+ */
+bool EpollEventLoop::Send(SocketConnection &connection, const void *data, size_t size)
+{
+    std::lock_guard<std::mutex> guard(connection.m_lock);
+    if (connection.m_closed || connection.m_closing)
+    {
+        return false;
+    }
+
+    const char *bytes = static_cast<const char *>(data);
+    if (connection.m_output.empty())
+    {
+        ssize_t written = send(connection.m_socket, bytes, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                // The loop sees the error and closes the connection.
+                return false;
+            }
+            written = 0;
+        }
+        m_server.OnSent(static_cast<size_t>(written));
+        bytes += written;
+        size -= static_cast<size_t>(written);
+        if (size == 0)
+        {
+            return true;
+        }
+    }
+
+    connection.m_output.push_back(std::vector<char>(bytes, bytes + size));
+    if (!connection.m_writing)
+    {
+        connection.m_writing = true;
+        epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+        event.data.fd = connection.m_socket;
+        epoll_ctl(m_epollFd, EPOLL_CTL_MOD, connection.m_socket, &event);
+    }
+    return true;
+}
+
+/**
+ *   Close a connection once its output is written. Shutting the socket
+ *   down wakes the loop, which then closes it.
+ *
+ *   @param connection - the connection
+ */
+void EpollEventLoop::Close(SocketConnection &connection)
+{
+    std::lock_guard<std::mutex> guard(connection.m_lock);
+    if (connection.m_closed || connection.m_closing)
+    {
+        return;
+    }
+    connection.m_closing = true;
+    if (!connection.m_writing)
+    {
+        shutdown(connection.m_socket, SHUT_RDWR);
+    }
+}
+
+/**
+ *   Accept the pending connections of a listening socket.
+ *
+ *   @param watch - the listening socket
+ */
+void EpollEventLoop::AcceptConnections(Watch &watch)
+{
+    for (;;)
+    {
+        sockaddr_storage address;
+        socklen_t length = sizeof(address);
+        int fd = accept4(watch.fd, reinterpret_cast<sockaddr *>(&address), &length,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+            {
+                continue;
+            }
+
+            // Out of descriptors or memory: the listening socket stays
+            // readable, so stop watching it for a moment rather than spin.
+            HoldInput(watch);
+            return;
+        }
+
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        SocketConnectionPtr connection = std::make_shared<SocketConnection>(
+            m_server, *this, watch.endpoint, fd, FormatAddress(&address));
+        try
+        {
+            AddWatch(ConnectionWatch, fd, watch.endpoint, connection);
+        }
+        catch (DWORD)
+        {
+            // The epoll set is full; AddWatch has closed the socket.
+            HoldInput(watch);
+            return;
+        }
+        m_server.OnAccepted(connection);
+    }
+}
+
+/**
+ *   Read the pending datagrams of a datagram socket.
+ *
+ *   @param watch - the datagram socket
+ */
+void EpollEventLoop::ReceiveDatagrams(Watch &watch)
+{
+    for (int i = 0; i < ReadsPerWakeup * 4; i++)
+    {
+        sockaddr_storage address;
+        socklen_t length = sizeof(address);
+        ssize_t size = recvfrom(watch.fd, m_buffer.data(), m_buffer.size(), MSG_DONTWAIT,
+                                reinterpret_cast<sockaddr *>(&address), &length);
+        if (size < 0)
+        {
+            return;
+        }
+        m_server.OnDatagram(std::unique_ptr<SocketDatagram>(new SocketDatagram(
+            m_server, watch.endpoint, watch.fd, &address, static_cast<int>(length),
+            m_buffer.data(), static_cast<size_t>(size))));
+    }
+}
+
+/**
+ *   Read from a connection into pooled buffers, which are handed to the
+ *   callbacks as they are, and close it at the end of the stream or on an
+ *   error.
+ *
+ *   @param watch - the connection
+ */
+void EpollEventLoop::Receive(Watch &watch)
+{
+    SocketConnectionPtr connection = watch.connection;
+    for (int i = 0; i < ReadsPerWakeup; i++)
+    {
+        Buffer buffer;
+        try
+        {
+            buffer = m_server.m_buffers.Allocate();
+        }
+        catch (DWORD)
+        {
+            // Out of memory: leave the data in the socket, and stop
+            // watching it for a moment rather than spin on it.
+            HoldInput(watch);
+            return;
+        }
+
+        ssize_t size = recv(watch.fd, buffer.GetData(), buffer.GetCapacity(), MSG_DONTWAIT);
+        if (size > 0)
+        {
+            buffer.SetSize(static_cast<size_t>(size));
+            m_server.OnReceived(connection, std::move(buffer));
+            if (static_cast<size_t>(size) < SocketServer::ReceiveBufferSize)
+            {
+                return;
+            }
+            continue;
+        }
+        if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return;
+        }
+        CloseConnection(connection);
+        return;
+    }
+}
+
+/**
+ *   Write the queued output of a connection. Once it is all written,
+ *   EPOLLOUT is disarmed, and a connection that is closing is shut down.
+ *
+ *   @param connection - the connection
+ */
+void EpollEventLoop::Flush(SocketConnection &connection)
+{
+    std::lock_guard<std::mutex> guard(connection.m_lock);
+    while (!connection.m_closed && !connection.m_output.empty())
+    {
+        std::vector<char> &buffer = connection.m_output.front();
+        ssize_t written = send(connection.m_socket, buffer.data() + connection.m_outputOffset,
+                               buffer.size() - connection.m_outputOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written < 0)
+        {
+            // On EAGAIN wait for the next EPOLLOUT; on an error the read
+            // side reports it and closes the connection.
+            return;
+        }
+        m_server.OnSent(static_cast<size_t>(written));
+        connection.m_outputOffset += static_cast<size_t>(written);
+        if (connection.m_outputOffset == buffer.size())
+        {
+            connection.m_output.pop_front();
+            connection.m_outputOffset = 0;
+        }
+    }
+
+    if (connection.m_closed)
+    {
+        return;
+    }
+    connection.m_writing = false;
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.fd = connection.m_socket;
+    epoll_ctl(m_epollFd, EPOLL_CTL_MOD, connection.m_socket, &event);
+    if (connection.m_closing)
+    {
+        shutdown(connection.m_socket, SHUT_RDWR);
+    }
+}
+
+/**
+ *   Close a connection now and tell the server. Loop thread only, or the
+ *   thread that stopped the loop.
+ *
+ *   @param connection - the connection
+ */
+void EpollEventLoop::CloseConnection(const SocketConnectionPtr &connection)
+{
+    int fd;
+    {
+        std::lock_guard<std::mutex> guard(connection->m_lock);
+        if (connection->m_closed)
+        {
+            return;
+        }
+        connection->m_closed = true;
+        connection->m_output.clear();
+        fd = connection->m_socket;
+        RemoveWatch(fd);
+    }
+    m_server.OnClosed(connection);
+}
+
+#pragma endregion
+
+#pragma region Helper Functions
+
+/**
+ *   Queue a function for the loop thread and wait until it has run. Runs
+ *   it directly if the loop is not running.
+ *
+ *   @param function - the function
+ */
+void EpollEventLoop::RunOnLoop(std::function<void(void)> function)
+{
+    if (!m_thread.joinable())
+    {
+        function();
+        return;
+    }
+
+    std::promise<void> done;
+    {
+        std::lock_guard<std::mutex> guard(m_commandLock);
+        m_commands.push_back([&function, &done]() {
+            function();
+            done.set_value();
+        });
+    }
+    eventfd_write(m_wakeFd, 1);
+    done.get_future().wait();
+}
+
+/**
+ *   Queue a function for the loop thread and return. Runs it directly if
+ *   the loop is not running.
+ *
+ *   @param function - the function
+ */
+void EpollEventLoop::PostToLoop(std::function<void(void)> function)
+{
+    if (!m_thread.joinable())
+    {
+        function();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(m_commandLock);
+        m_commands.push_back(std::move(function));
+    }
+    eventfd_write(m_wakeFd, 1);
+}
+
+void EpollEventLoop::AddWatch(WatchType type, int fd, size_t endpoint, const SocketConnectionPtr &connection)
+{
+    std::unique_ptr<Watch> watch(new Watch());
+    watch->type = type;
+    watch->fd = fd;
+    watch->endpoint = endpoint;
+    watch->connection = connection;
+
+    epoll_event event;
+    event.events = (type == ConnectionWatch) ? (EPOLLIN | EPOLLRDHUP) : EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+    {
+        DWORD dwError = GetLastError();
+        if (type != WakeWatch)
+            close(fd);
+        throw dwError;
+    }
+    m_watches[fd] = std::move(watch);
+}
+
+void EpollEventLoop::RemoveWatch(int fd)
+{
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, NULL);
+    m_watches.erase(fd);
+    close(fd);
+}
+
+/**
+ *   Watch the listening and datagram sockets still in the epoll set for
+ *   input, or keep them in the set without watching for anything.
+ *
+ *   @param fWatch - whether to watch them
+ */
+void EpollEventLoop::WatchListeners(bool fWatch)
+{
+    m_acceptPaused = !fWatch;
+    for (auto it = m_watches.begin(); it != m_watches.end(); ++it)
+    {
+        if (it->second->type == ListenWatch || it->second->type == DatagramWatch)
+        {
+            epoll_event event;
+            event.events = fWatch ? static_cast<uint32_t>(EPOLLIN) : 0;
+            event.data.fd = it->first;
+            epoll_ctl(m_epollFd, EPOLL_CTL_MOD, it->first, &event);
+        }
+    }
+}
+
+/**
+ *   Take a listening socket or connection out of the epoll set, which
+ *   keeps it from waking the loop while it stays readable, and arm the
+ *   retry timer to put it back. Its watch stays, so it is still closed as
+ *   usual; a Send while it is held leaves it to the retry to watch for
+ *   output.
+ *
+ *   @param watch - the socket
+ */
+void EpollEventLoop::HoldInput(Watch &watch)
+{
+    if (std::find(m_heldFds.begin(), m_heldFds.end(), watch.fd) != m_heldFds.end())
+    {
+        return;
+    }
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, watch.fd, NULL);
+    m_heldFds.push_back(watch.fd);
+    if (m_heldFds.size() == 1)
+    {
+        itimerspec delay = {};
+        delay.it_value.tv_nsec = RetryDelayMs * 1000000;
+        timerfd_settime(m_retryFd, 0, &delay, NULL);
+    }
+}
+
+/**
+ *   Put the held sockets that are still open back into the epoll set,
+ *   watching them as they were before: a listening socket not while
+ *   accepting is paused, and a connection for output while it has some.
+ */
+void EpollEventLoop::ResumeInput(void)
+{
+    uint64_t expirations;
+    if (read(m_retryFd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    {
+        // The timer has not expired.
+        return;
+    }
+
+    std::vector<int> fds;
+    fds.swap(m_heldFds);
+    for (size_t i = 0; i < fds.size(); i++)
+    {
+        auto it = m_watches.find(fds[i]);
+        if (it == m_watches.end())
+        {
+            continue;
+        }
+
+        epoll_event event;
+        event.data.fd = fds[i];
+        if (it->second->type == ConnectionWatch)
+        {
+            SocketConnection &connection = *it->second->connection;
+            std::lock_guard<std::mutex> guard(connection.m_lock);
+            if (connection.m_closed)
+            {
+                continue;
+            }
+            event.events = EPOLLIN | EPOLLRDHUP | (connection.m_writing ? static_cast<uint32_t>(EPOLLOUT) : 0);
+            epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fds[i], &event);
+        }
+        else
+        {
+            event.events = m_acceptPaused ? 0 : static_cast<uint32_t>(EPOLLIN);
+            epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fds[i], &event);
+        }
+    }
+}
+
+/**
+ *   Send a datagram on a socket of the loop.
+ *
+ *   @param socket - the datagram socket
+ *   @param to - the destination sockaddr
+ *   @param toLength - its length
+ *   @param data - the payload
+ *   @param size - its size in bytes
+ *   @return true if the datagram was sent
+ */
+bool EpollEventLoop::SendTo(SocketHandle socket, const void *to, int toLength,
+                            const void *data, size_t size)
+{
+    return sendto(socket, data, size, MSG_NOSIGNAL | MSG_DONTWAIT,
+                  static_cast<const sockaddr *>(to), static_cast<socklen_t>(toLength)) ==
+           static_cast<ssize_t>(size);
+}
+
+std::string EpollEventLoop::FormatAddress(const void *address)
+{
+    const sockaddr *generic = static_cast<const sockaddr *>(address);
+    char szAddress[INET6_ADDRSTRLEN] = "";
+    char szResult[INET6_ADDRSTRLEN + 16];
+    if (generic->sa_family == AF_INET6)
+    {
+        const sockaddr_in6 *v6 = static_cast<const sockaddr_in6 *>(address);
+        inet_ntop(AF_INET6, &v6->sin6_addr, szAddress, sizeof(szAddress));
+        snprintf(szResult, sizeof(szResult), "[%s]:%u", szAddress, static_cast<unsigned int>(ntohs(v6->sin6_port)));
+    }
+    else
+    {
+        const sockaddr_in *v4 = static_cast<const sockaddr_in *>(address);
+        inet_ntop(AF_INET, &v4->sin_addr, szAddress, sizeof(szAddress));
+        snprintf(szResult, sizeof(szResult), "%s:%u", szAddress, static_cast<unsigned int>(ntohs(v4->sin_port)));
+    }
+    return szResult;
+}
+
+#pragma endregion
+
+#endif
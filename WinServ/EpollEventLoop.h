@@ -0,0 +1,155 @@
+/*
+ * The Linux event loop of SocketServer.
+ *
+ * Each loop is a thread waiting on its own epoll set, which holds the
+ * loop's listening and datagram sockets (bound with SO_REUSEPORT, so every
+ * loop has its own), the connections it accepted, and an eventfd that
+ * wakes it for commands from other threads. Connections are level
+ * triggered; EPOLLOUT is only armed while output is pending. A socket the
+ * loop cannot serve for want of descriptors or buffers is taken out of the
+ * set for a moment and put back from a timerfd, so the loop does not spin.
+ *
+ */
+
+#pragma once
+
+#ifndef _WIN32
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "SocketServer.h"
+
+class EpollEventLoop
+{
+public:
+    explicit EpollEventLoop(SocketServer &server);
+    ~EpollEventLoop(void);
+
+    EpollEventLoop(const EpollEventLoop &) = delete;
+    EpollEventLoop &operator=(const EpollEventLoop &) = delete;
+
+    // Open this loop's sockets for the endpoints. Every loop binds its
+    // own, so fPrimary makes no difference; an endpoint with port 0 is
+    // given the port the first loop was bound to.
+    void Open(std::vector<SocketServer::Endpoint> &endpoints, bool fPrimary);
+
+    // Start the loop thread.
+    void Start(void);
+
+    // Close the listening sockets and stop reading datagrams. Returns once
+    // the loop has done so.
+    void StopAccepting(void);
+
+    // Stop watching the listening and datagram sockets, so that new
+    // connections wait in the backlog and datagrams in the socket buffer,
+    // or watch them again. PauseAccepting returns once the loop has done
+    // so; ResumeAccepting only queues it.
+    void PauseAccepting(void);
+    void ResumeAccepting(void);
+
+    // Close every connection of the loop. Returns once the loop has done
+    // so.
+    void CloseConnections(void);
+
+    // Stop the loop thread and close its sockets.
+    void Stop(void);
+
+    // Write to a connection, or queue the data until the socket is
+    // writable. Called by SocketConnection::Send on any thread.
+    bool Send(SocketConnection &connection, const void *data, size_t size);
+
+    // Close a connection once its output is written. Called by
+    // SocketConnection::Close on any thread.
+    void Close(SocketConnection &connection);
+
+    // Send a datagram.
+    static bool SendTo(SocketHandle socket, const void *to, int toLength,
+                       const void *data, size_t size);
+
+    // Format a sockaddr as "address:port".
+    static std::string FormatAddress(const void *address);
+
+private:
+    enum WatchType
+    {
+        WakeWatch,
+        RetryWatch,
+        ListenWatch,
+        DatagramWatch,
+        ConnectionWatch
+    };
+
+    // What a descriptor in the epoll set is
+    struct Watch
+    {
+        WatchType type;
+        int fd;
+        size_t endpoint;
+        SocketConnectionPtr connection;
+    };
+
+    // Thread body.
+    void Loop(void);
+
+    // Run a function on the loop thread and wait until it has, or queue it
+    // for the loop thread and return.
+    void RunOnLoop(std::function<void(void)> function);
+    void PostToLoop(std::function<void(void)> function);
+
+    // Add a descriptor to the epoll set.
+    void AddWatch(WatchType type, int fd, size_t endpoint, const SocketConnectionPtr &connection);
+
+    // Remove a descriptor from the epoll set, and close it.
+    void RemoveWatch(int fd);
+
+    // Watch the listening and datagram sockets for input, or not.
+    void WatchListeners(bool fWatch);
+
+    // Take a socket out of the epoll set until the retry timer fires, or
+    // put back the sockets taken out.
+    void HoldInput(Watch &watch);
+    void ResumeInput(void);
+
+    // Handle readiness of each kind of descriptor.
+    void AcceptConnections(Watch &watch);
+    void ReceiveDatagrams(Watch &watch);
+    void Receive(Watch &watch);
+    void Flush(SocketConnection &connection);
+
+    // Close a connection now. Loop thread only.
+    void CloseConnection(const SocketConnectionPtr &connection);
+
+    SocketServer &m_server;
+    int m_epollFd;
+    int m_wakeFd;
+    int m_retryFd;
+    std::thread m_thread;
+    bool m_stop;
+
+    // Whether the listening sockets are paused, and the sockets held out
+    // of the epoll set until the retry timer fires; loop thread only
+    bool m_acceptPaused;
+    std::vector<int> m_heldFds;
+
+    // The descriptors in the epoll set, by descriptor; loop thread only
+    // once the loop has started
+    std::unordered_map<int, std::unique_ptr<Watch>> m_watches;
+
+    // The datagram sockets; they stay open until Stop so that replies can
+    // still be sent
+    std::vector<int> m_datagramFds;
+
+    // Functions queued for the loop thread
+    std::mutex m_commandLock;
+    std::vector<std::function<void(void)>> m_commands;
+
+    // Datagram buffer of the loop thread; connections are read into
+    // pooled buffers instead
+    std::vector<char> m_buffer;
+};
+
+#endif
@@ -0,0 +1,228 @@
+#pragma region Includes
+#include "InProcessServiceHost.h"
+#include <chrono>
+#include <string.h>
+#pragma endregion
+
+#pragma region Host
+
+InProcessServiceHost::InProcessServiceHost(void)
+    : m_started(false)
+{
+}
+
+/**
+ *   Execute the requests sent to the services, in order, on the calling
+ *   thread. Returns once a service has been started and every service has
+ *   reported SERVICE_STOPPED, whether because of a stop control, a failed
+ *   start or a stop a service requested itself. Requests still queued then
+ *   fail.
+ *
+ *   @param services - the services to run
+ *   @param dwCount - the number of services
+ *   @return TRUE
+ */
+BOOL InProcessServiceHost::Run(ServiceBase *const *services, DWORD dwCount)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    m_services.assign(services, services + dwCount);
+
+    SERVICE_STATUS status;
+    memset(&status, 0, sizeof(status));
+    status.dwCurrentState = SERVICE_STOPPED;
+    m_status.assign(dwCount, status);
+    m_started = false;
+
+    for (;;)
+    {
+        m_changed.wait(guard, [this]() { return !m_requests.empty() || AllStopped(); });
+        if (m_requests.empty())
+        {
+            break;
+        }
+
+        Request *request = m_requests.front();
+        m_requests.pop_front();
+        if (request->dwService >= m_services.size())
+        {
+            request->done = true;
+            m_changed.notify_all();
+            continue;
+        }
+        ServiceBase &service = *m_services[request->dwService];
+        if (request->start)
+        {
+            m_started = true;
+        }
+
+        guard.unlock();
+        DWORD dwError = NO_ERROR;
+        if (request->start)
+        {
+            Start(service, request->dwArgc, request->pszArgv);
+        }
+        else
+        {
+            dwError = Control(service, request->dwCtrl);
+        }
+        guard.lock();
+
+        request->done = true;
+        request->fResult = (dwError == NO_ERROR) ? TRUE : FALSE;
+        request->dwError = dwError;
+        m_changed.notify_all();
+    }
+
+    while (!m_requests.empty())
+    {
+        m_requests.front()->done = true;
+        m_requests.pop_front();
+    }
+    m_services.clear();
+    m_changed.notify_all();
+    return TRUE;
+}
+
+/**
+ *   Record the status of a service and wake Run and WaitForState.
+ *
+ *   @param service - the service that changed state
+ *   @param status - its new status
+ */
+void InProcessServiceHost::ReportStatus(ServiceBase &service, const SERVICE_STATUS &status)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    for (size_t i = 0; i < m_services.size(); i++)
+    {
+        if (m_services[i] == &service)
+        {
+            m_status[i] = status;
+        }
+    }
+    m_changed.notify_all();
+}
+
+/**
+ *   Start a service and wait until its Start method has returned.
+ *
+ *   @param dwArgc - number of start arguments
+ *   @param pszArgv - the start arguments; they must stay valid until the
+ *   call returns
+ *   @param dwService - the index of the service
+ *   @return TRUE if the start request was executed
+ */
+BOOL InProcessServiceHost::SendStart(DWORD dwArgc, PWSTR *pszArgv, DWORD dwService)
+{
+    Request request = {true, dwService, 0, dwArgc, pszArgv, false, FALSE, NO_ERROR};
+    return Send(request);
+}
+
+/**
+ *   Send a control code to a service and wait until it has been accepted.
+ *
+ *   @param dwCtrl - the control code
+ *   @param dwService - the index of the service
+ *   @return TRUE if the control was accepted, FALSE if the service is not
+ *   running under the host (ERROR_SERVICE_NOT_ACTIVE) or rejected it
+ */
+BOOL InProcessServiceHost::SendControl(DWORD dwCtrl, DWORD dwService)
+{
+    Request request = {false, dwService, dwCtrl, 0, NULL, false, FALSE, ERROR_SERVICE_NOT_ACTIVE};
+    BOOL fResult = Send(request);
+    if (!fResult)
+    {
+        SetLastError(request.dwError);
+    }
+    return fResult;
+}
+
+/**
+ *   Wait until a service reports a state, such as the outcome of a
+ *   transition requested with SendControl.
+ *
+ *   @param dwState - the state
+ *   @param dwService - the index of the service
+ *   @param dwMilliseconds - how long to wait, or INFINITE
+ *   @return TRUE once the service is in the state, FALSE on timeout
+ */
+BOOL InProcessServiceHost::WaitForState(DWORD dwState, DWORD dwService, DWORD dwMilliseconds)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    auto reached = [this, dwState, dwService]() {
+        return dwService < m_status.size() && m_status[dwService].dwCurrentState == dwState;
+    };
+    if (dwMilliseconds == INFINITE)
+    {
+        m_changed.wait(guard, reached);
+        return TRUE;
+    }
+    return m_changed.wait_for(guard, std::chrono::milliseconds(dwMilliseconds), reached) ? TRUE : FALSE;
+}
+
+/**
+ *   Get the last status a service reported.
+ *
+ *   @param dwService - the index of the service
+ */
+SERVICE_STATUS InProcessServiceHost::GetStatus(DWORD dwService) const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (dwService < m_status.size())
+    {
+        return m_status[dwService];
+    }
+
+    SERVICE_STATUS status;
+    memset(&status, 0, sizeof(status));
+    status.dwCurrentState = SERVICE_STOPPED;
+    return status;
+}
+
+#pragma endregion
+
+#pragma region Helper Functions
+
+/**
+ *   Queue a request for Run and wait until it has been executed, or has
+ *   failed because Run returned.
+ *
+ *   @param request - the request; it lives on the caller's stack
+ *   @return TRUE if the request was executed
+ */
+BOOL InProcessServiceHost::Send(Request &request)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    if (!request.start &&
+        (request.dwService >= m_status.size() ||
+         m_status[request.dwService].dwCurrentState == SERVICE_STOPPED))
+    {
+        return FALSE;
+    }
+
+    m_requests.push_back(&request);
+    m_changed.notify_all();
+    m_changed.wait(guard, [&request]() { return request.done; });
+    return request.fResult;
+}
+
+/**
+ *   Check whether the current Run is over: a service has been started and
+ *   every service has stopped. Called with the lock held.
+ */
+bool InProcessServiceHost::AllStopped(void) const
+{
+    if (!m_started)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < m_status.size(); i++)
+    {
+        if (m_status[i].dwCurrentState != SERVICE_STOPPED)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+#pragma endregion
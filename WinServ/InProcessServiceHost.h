@@ -0,0 +1,84 @@
+/*
+ * An in-process stand-in for the service control manager.
+ *
+ * Run blocks like the real dispatcher and executes the start requests and
+ * control codes that other threads send with SendStart and SendControl,
+ * one at a time and in order. SendStart returns once Start has returned.
+ * Like ControlService, SendControl returns once the service has accepted
+ * the control; the transition itself completes on the service's control
+ * thread, and WaitForState waits for its outcome. Services are addressed by their
+ * index in the array passed to Run. Used to exercise and benchmark the
+ * service lifecycle without installing the service.
+ *
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "ServiceHost.h"
+
+class InProcessServiceHost : public ServiceHost
+{
+public:
+    InProcessServiceHost(void);
+
+    InProcessServiceHost(const InProcessServiceHost &) = delete;
+    InProcessServiceHost &operator=(const InProcessServiceHost &) = delete;
+
+    using ServiceHost::Run;
+
+    // Execute requests until a service has been started and every service
+    // has stopped.
+    BOOL Run(ServiceBase *const *services, DWORD dwCount);
+
+    void ReportStatus(ServiceBase &service, const SERVICE_STATUS &status);
+
+    // Start a service and wait until its Start has returned. May be called
+    // before Run; the request waits for it.
+    BOOL SendStart(DWORD dwArgc, PWSTR *pszArgv, DWORD dwService = 0);
+
+    // Send a control code and wait until the service has accepted it.
+    // Returns FALSE if the service is not running under the host or
+    // rejected the control; call GetLastError for the reason.
+    BOOL SendControl(DWORD dwCtrl, DWORD dwService = 0);
+
+    // Wait until a service reports the given state. Returns FALSE if it
+    // has not within dwMilliseconds (INFINITE to wait indefinitely).
+    BOOL WaitForState(DWORD dwState, DWORD dwService = 0, DWORD dwMilliseconds = INFINITE);
+
+    // The last status a service reported.
+    SERVICE_STATUS GetStatus(DWORD dwService = 0) const;
+
+private:
+    struct Request
+    {
+        bool start;
+        DWORD dwService;
+        DWORD dwCtrl;
+        DWORD dwArgc;
+        PWSTR *pszArgv;
+        bool done;
+        BOOL fResult;
+        DWORD dwError;
+    };
+
+    // Queue a request and wait until Run has executed it.
+    BOOL Send(Request &request);
+
+    // True once a service has been started and all of them have stopped.
+    bool AllStopped(void) const;
+
+    mutable std::mutex m_lock;
+    std::condition_variable m_changed;
+    std::deque<Request *> m_requests;
+
+    // The services of the current Run and the status each last reported
+    std::vector<ServiceBase *> m_services;
+    std::vector<SERVICE_STATUS> m_status;
+
+    // Whether the current Run has started a service
+    bool m_started;
+};
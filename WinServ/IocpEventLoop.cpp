@@ -0,0 +1,817 @@
+#pragma region Includes
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mswsock.h>
+#endif
+#include "IocpEventLoop.h"
+#pragma endregion
+
+#ifdef _WIN32
+
+#pragma region Includes
+#include <future>
+#include <stdio.h>
+#include <string.h>
+#pragma endregion
+
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "mswsock.lib")
+
+namespace
+{
+    // Size of the buffer of a posted datagram receive, the largest UDP
+    // payload.
+    const size_t DatagramBufferSize = 64 * 1024;
+
+    // Accepts kept posted on each listening socket, and receives on each
+    // datagram socket, so that bursts do not wait for a repost.
+    const int AcceptsPosted = 16;
+    const int DatagramReceivesPosted = 4;
+
+    // Space AcceptEx needs for each of the two addresses it writes.
+    const DWORD AcceptAddressSize = sizeof(sockaddr_storage) + 16;
+
+    // Completion key of the commands posted to a loop.
+    const ULONG_PTR CommandKey = 1;
+
+    // Fill a sockaddr from an address string and port. NULL or an empty
+    // string means every IPv4 address.
+    bool ParseAddress(const char *pszAddress, unsigned short port,
+                      sockaddr_storage *address, int *length)
+    {
+        memset(address, 0, sizeof(*address));
+        sockaddr_in6 *v6 = reinterpret_cast<sockaddr_in6 *>(address);
+        if (pszAddress != NULL && InetPtonA(AF_INET6, pszAddress, &v6->sin6_addr) == 1)
+        {
+            v6->sin6_family = AF_INET6;
+            v6->sin6_port = htons(port);
+            *length = sizeof(sockaddr_in6);
+            return true;
+        }
+
+        sockaddr_in *v4 = reinterpret_cast<sockaddr_in *>(address);
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(port);
+        *length = sizeof(sockaddr_in);
+        if (pszAddress == NULL || *pszAddress == '\0')
+        {
+            v4->sin_addr.s_addr = htonl(INADDR_ANY);
+            return true;
+        }
+        return InetPtonA(AF_INET, pszAddress, &v4->sin_addr) == 1;
+    }
+
+    // The port of a bound socket.
+    unsigned short GetBoundPort(SOCKET socket)
+    {
+        sockaddr_storage address;
+        int length = sizeof(address);
+        if (getsockname(socket, reinterpret_cast<sockaddr *>(&address), &length) != 0)
+        {
+            return 0;
+        }
+        return (address.ss_family == AF_INET6)
+                   ? ntohs(reinterpret_cast<sockaddr_in6 *>(&address)->sin6_port)
+                   : ntohs(reinterpret_cast<sockaddr_in *>(&address)->sin_port);
+    }
+}
+
+// An overlapped request posted to a completion port
+struct IocpEventLoop::IoRequest
+{
+    enum Operation
+    {
+        AcceptOperation,
+        ReceiveOperation,
+        ReceiveFromOperation,
+        SendOperation
+    };
+
+    explicit IoRequest(Operation op)
+        : operation(op), listener(0), socket(INVALID_SOCKET), fromLength(sizeof(from)), flags(0)
+    {
+        memset(&overlapped, 0, sizeof(overlapped));
+        buffer.buf = NULL;
+        buffer.len = 0;
+    }
+
+    OVERLAPPED overlapped;
+    Operation operation;
+
+    // The listening or datagram socket, for accepts and datagrams
+    size_t listener;
+
+    // The socket being accepted
+    SOCKET socket;
+
+    // The connection, for receives and sends
+    SocketConnectionPtr connection;
+
+    // The datagram received, or the accepted addresses
+    std::vector<char> data;
+
+    // The pooled buffer a connection is read into
+    Buffer received;
+    WSABUF buffer;
+
+    // The sender of a datagram
+    sockaddr_storage from;
+    INT fromLength;
+    DWORD flags;
+};
+
+#pragma region Loop
+
+IocpEventLoop::IocpEventLoop(SocketServer &server)
+    : m_server(server), m_port(NULL), m_stop(false), m_accepting(true), m_paused(false), m_outstanding(0)
+{
+    WSADATA data;
+    int error = WSAStartup(MAKEWORD(2, 2), &data);
+    if (error != 0)
+    {
+        throw static_cast<DWORD>(error);
+    }
+
+    m_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    if (m_port == NULL)
+    {
+        DWORD dwError = GetLastError();
+        WSACleanup();
+        throw dwError;
+    }
+}
+
+IocpEventLoop::~IocpEventLoop(void)
+{
+    Stop();
+    CloseHandle(m_port);
+    WSACleanup();
+}
+
+/**
+ *   Open the sockets of the endpoints on the primary loop: listening
+ *   sockets that AcceptEx is posted on, and datagram sockets. The other
+ *   loops open nothing; they get connections from the primary one.
+ *
+ *   @param endpoints - the endpoints of the server
+ *   @param fPrimary - whether this is the first loop
+ */
+void IocpEventLoop::Open(std::vector<SocketServer::Endpoint> &endpoints, bool fPrimary)
+{
+    if (!fPrimary)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < endpoints.size(); i++)
+    {
+        SocketServer::Endpoint &endpoint = endpoints[i];
+        sockaddr_storage address;
+        int length;
+        if (!ParseAddress(endpoint.address.empty() ? NULL : endpoint.address.c_str(),
+                          endpoint.port, &address, &length))
+        {
+            throw static_cast<DWORD>(ERROR_INVALID_PARAMETER);
+        }
+
+        SOCKET socket = WSASocketW(address.ss_family, endpoint.tcp ? SOCK_STREAM : SOCK_DGRAM,
+                                   endpoint.tcp ? IPPROTO_TCP : IPPROTO_UDP, NULL, 0,
+                                   WSA_FLAG_OVERLAPPED | WSA_FLAG_NO_HANDLE_INHERIT);
+        if (socket == INVALID_SOCKET)
+        {
+            throw static_cast<DWORD>(WSAGetLastError());
+        }
+
+        if (bind(socket, reinterpret_cast<sockaddr *>(&address), length) != 0 ||
+            (endpoint.tcp && listen(socket, SOMAXCONN) != 0) ||
+            CreateIoCompletionPort(reinterpret_cast<HANDLE>(socket), m_port, 0, 0) == NULL)
+        {
+            DWORD dwError = static_cast<DWORD>(WSAGetLastError());
+            closesocket(socket);
+            throw dwError;
+        }
+
+        if (endpoint.port == 0)
+        {
+            endpoint.port = GetBoundPort(socket);
+        }
+
+        Listener listener;
+        listener.socket = socket;
+        listener.endpoint = i;
+        listener.family = address.ss_family;
+        listener.tcp = endpoint.tcp;
+        m_listeners.push_back(listener);
+        m_parked.push_back(0);
+    }
+}
+
+/**
+ *   Start the loop thread, then post the accepts and datagram receives of
+ *   the listening sockets.
+ */
+void IocpEventLoop::Start(void)
+{
+    m_thread = std::thread(&IocpEventLoop::Loop, this);
+    for (size_t i = 0; i < m_listeners.size(); i++)
+    {
+        for (int p = 0; p < (m_listeners[i].tcp ? AcceptsPosted : DatagramReceivesPosted); p++)
+        {
+            if (m_listeners[i].tcp)
+                PostAccept(i);
+            else
+                PostReceiveFrom(i);
+        }
+    }
+}
+
+/**
+ *   Stop reposting accepts and datagram receives, and close the listening
+ *   sockets, which completes their pending accepts. The datagram sockets
+ *   stay open until Stop, so callbacks still running can reply.
+ */
+void IocpEventLoop::StopAccepting(void)
+{
+    RunOnLoop([this]() {
+        m_accepting = false;
+        for (size_t i = 0; i < m_listeners.size(); i++)
+        {
+            if (m_listeners[i].tcp && m_listeners[i].socket != INVALID_SOCKET)
+            {
+                closesocket(m_listeners[i].socket);
+                m_listeners[i].socket = INVALID_SOCKET;
+            }
+        }
+    });
+}
+
+/**
+ *   Stop reposting accepts and datagram receives, and cancel the ones
+ *   posted; they complete with an error and are parked until
+ *   ResumeAccepting. New connections wait in the backlog of the listening
+ *   sockets meanwhile.
+ */
+void IocpEventLoop::PauseAccepting(void)
+{
+    RunOnLoop([this]() {
+        m_paused = true;
+        for (size_t i = 0; i < m_listeners.size(); i++)
+        {
+            if (m_listeners[i].socket != INVALID_SOCKET)
+            {
+                CancelIoEx(reinterpret_cast<HANDLE>(m_listeners[i].socket), NULL);
+            }
+        }
+    });
+}
+
+/**
+ *   Post again the accepts and datagram receives that were held back
+ *   while the loop was paused. Returns without waiting for the loop
+ *   thread; a later pause is queued behind it.
+ */
+void IocpEventLoop::ResumeAccepting(void)
+{
+    PostToLoop([this]() {
+        m_paused = false;
+        for (size_t i = 0; i < m_listeners.size(); i++)
+        {
+            for (; m_parked[i] > 0; m_parked[i]--)
+            {
+                if (!m_accepting || m_listeners[i].socket == INVALID_SOCKET)
+                    continue;
+                if (m_listeners[i].tcp)
+                    PostAccept(i);
+                else
+                    PostReceiveFrom(i);
+            }
+        }
+    });
+}
+
+/**
+ *   Close every connection of the loop, whether or not its output has
+ *   been written. Their pending requests complete with an error.
+ */
+void IocpEventLoop::CloseConnections(void)
+{
+    std::vector<SocketConnectionPtr> connections;
+    {
+        std::lock_guard<std::mutex> guard(m_connectionLock);
+        for (auto it = m_connections.begin(); it != m_connections.end(); ++it)
+        {
+            connections.push_back(it->second);
+        }
+    }
+    for (size_t i = 0; i < connections.size(); i++)
+    {
+        CloseConnection(connections[i]);
+    }
+}
+
+/**
+ *   Close the sockets left, then stop the loop thread once every request
+ *   posted to the port has completed, so none of them is freed while the
+ *   system may still write to it.
+ */
+void IocpEventLoop::Stop(void)
+{
+    CloseConnections();
+    RunOnLoop([this]() {
+        m_accepting = false;
+        for (size_t i = 0; i < m_listeners.size(); i++)
+        {
+            if (m_listeners[i].socket != INVALID_SOCKET)
+            {
+                closesocket(m_listeners[i].socket);
+                m_listeners[i].socket = INVALID_SOCKET;
+            }
+        }
+    });
+
+    if (m_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_commandLock);
+            m_commands.push_back([this]() { m_stop = true; });
+        }
+        PostQueuedCompletionStatus(m_port, 0, CommandKey, NULL);
+        m_thread.join();
+    }
+    m_listeners.clear();
+    m_parked.clear();
+}
+
+/**
+ *   The loop thread: handle completions and commands until Stop has been
+ *   asked for and no request is outstanding.
+ */
+void IocpEventLoop::Loop(void)
+{
+    while (!m_stop || m_outstanding.load() != 0)
+    {
+        DWORD dwBytes = 0;
+        ULONG_PTR key = 0;
+        OVERLAPPED *overlapped = NULL;
+        BOOL fOk = GetQueuedCompletionStatus(m_port, &dwBytes, &key, &overlapped, INFINITE);
+        if (overlapped != NULL)
+        {
+            Complete(CONTAINING_RECORD(overlapped, IoRequest, overlapped), dwBytes, fOk != FALSE);
+        }
+        else if (!fOk)
+        {
+            // The port itself failed.
+            break;
+        }
+        else if (key == CommandKey)
+        {
+            std::vector<std::function<void(void)>> commands;
+            {
+                std::lock_guard<std::mutex> guard(m_commandLock);
+                commands.swap(m_commands);
+            }
+            for (size_t c = 0; c < commands.size(); c++)
+            {
+                commands[c]();
+            }
+        }
+    }
+}
+
+/**
+ *   Handle a completed request, post the next one in its place, and free
+ *   it.
+ *
+ *   @param request - the request
+ *   @param dwBytes - the bytes transferred
+ *   @param fOk - whether it succeeded
+ */
+void IocpEventLoop::Complete(IoRequest *request, DWORD dwBytes, bool fOk)
+{
+    switch (request->operation)
+    {
+    case IoRequest::AcceptOperation:
+    {
+        Listener &listener = m_listeners[request->listener];
+        if (fOk && m_accepting)
+        {
+            SOCKET listenSocket = listener.socket;
+            setsockopt(request->socket, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT,
+                       reinterpret_cast<const char *>(&listenSocket), sizeof(listenSocket));
+            BOOL on = TRUE;
+            setsockopt(request->socket, IPPROTO_TCP, TCP_NODELAY,
+                       reinterpret_cast<const char *>(&on), sizeof(on));
+
+            sockaddr_storage address;
+            int length = sizeof(address);
+            getpeername(request->socket, reinterpret_cast<sockaddr *>(&address), &length);
+
+            // Hand the connection to the next loop; its requests complete
+            // on that loop's port.
+            IocpEventLoop &loop = m_server.NextLoop();
+            SocketConnectionPtr connection = std::make_shared<SocketConnection>(
+                m_server, loop, listener.endpoint, request->socket, FormatAddress(&address));
+            request->socket = INVALID_SOCKET;
+            loop.Adopt(connection);
+        }
+        if (request->socket != INVALID_SOCKET)
+        {
+            closesocket(request->socket);
+        }
+        if (m_accepting && listener.socket != INVALID_SOCKET)
+        {
+            if (m_paused)
+                m_parked[request->listener]++;
+            else
+                PostAccept(request->listener);
+        }
+        break;
+    }
+    case IoRequest::ReceiveFromOperation:
+    {
+        Listener &listener = m_listeners[request->listener];
+        if (fOk && m_accepting)
+        {
+            m_server.OnDatagram(std::unique_ptr<SocketDatagram>(new SocketDatagram(
+                m_server, listener.endpoint, listener.socket, &request->from, request->fromLength,
+                request->data.data(), dwBytes)));
+        }
+        // A failure is usually the ICMP error of an earlier reply, which
+        // does not stop the socket from receiving.
+        if (m_accepting && listener.socket != INVALID_SOCKET)
+        {
+            if (m_paused)
+                m_parked[request->listener]++;
+            else
+                PostReceiveFrom(request->listener);
+        }
+        break;
+    }
+    case IoRequest::ReceiveOperation:
+        if (fOk && dwBytes != 0)
+        {
+            request->received.SetSize(dwBytes);
+            m_server.OnReceived(request->connection, std::move(request->received));
+            PostReceive(request->connection);
+        }
+        else
+        {
+            CloseConnection(request->connection);
+        }
+        break;
+    case IoRequest::SendOperation:
+    {
+        SocketConnection &connection = *request->connection;
+        bool fClose = !fOk;
+        {
+            std::lock_guard<std::mutex> guard(connection.m_lock);
+            if (fOk && !connection.m_closed)
+            {
+                m_server.OnSent(dwBytes);
+                connection.m_outputOffset += dwBytes;
+                if (connection.m_outputOffset == connection.m_output.front().size())
+                {
+                    connection.m_output.pop_front();
+                    connection.m_outputOffset = 0;
+                }
+                if (connection.m_output.empty() || !PostSend(connection))
+                {
+                    connection.m_writing = false;
+                    fClose = connection.m_closing || !connection.m_output.empty();
+                }
+            }
+        }
+        if (fClose)
+        {
+            CloseConnection(request->connection);
+        }
+        break;
+    }
+    }
+
+    delete request;
+    m_outstanding--;
+}
+
+#pragma endregion
+
+#pragma region Connections
+
+/**
+ *   Queue data for a connection, and post a send unless one is already
+ *   outstanding; each send completion posts the next, so the output goes
+ *   out in order.
+ *
+ *   @param connection - the connection
+ *   @param data - the data
+ *   @param size - its size in bytes
+ *   @return false if the connection is closing
+ */
+bool IocpEventLoop::Send(SocketConnection &connection, const void *data, size_t size)
+{
+    std::lock_guard<std::mutex> guard(connection.m_lock);
+    if (connection.m_closed || connection.m_closing)
+    {
+        return false;
+    }
+
+    const char *bytes = static_cast<const char *>(data);
+    connection.m_output.push_back(std::vector<char>(bytes, bytes + size));
+    if (!connection.m_writing)
+    {
+        connection.m_writing = PostSend(connection);
+        return connection.m_writing;
+    }
+    return true;
+}
+
+/**
+ *   Close a connection once its output is written: now if nothing is
+ *   being sent, otherwise when the last send completes.
+ *
+ *   @param connection - the connection
+ */
+void IocpEventLoop::Close(SocketConnection &connection)
+{
+    {
+        std::lock_guard<std::mutex> guard(connection.m_lock);
+        if (connection.m_closed || connection.m_closing)
+        {
+            return;
+        }
+        connection.m_closing = true;
+        if (connection.m_writing)
+        {
+            return;
+        }
+    }
+    CloseConnection(connection.shared_from_this());
+}
+
+/**
+ *   Take a connection accepted by the primary loop: associate its socket
+ *   with this loop's port, tell the server, and post the first receive.
+ *
+ *   @param connection - the connection
+ */
+void IocpEventLoop::Adopt(const SocketConnectionPtr &connection)
+{
+    if (CreateIoCompletionPort(reinterpret_cast<HANDLE>(connection->m_socket), m_port, 0, 0) == NULL)
+    {
+        closesocket(connection->m_socket);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(m_connectionLock);
+        m_connections[connection.get()] = connection;
+    }
+    m_server.OnAccepted(connection);
+    PostReceive(connection);
+}
+
+/**
+ *   Close a connection now and tell the server. Its pending requests
+ *   complete with an error and do nothing more.
+ *
+ *   @param connection - the connection
+ */
+void IocpEventLoop::CloseConnection(const SocketConnectionPtr &connection)
+{
+    {
+        std::lock_guard<std::mutex> guard(connection->m_lock);
+        if (connection->m_closed)
+        {
+            return;
+        }
+        connection->m_closed = true;
+        closesocket(connection->m_socket);
+    }
+    {
+        std::lock_guard<std::mutex> guard(m_connectionLock);
+        m_connections.erase(connection.get());
+    }
+    m_server.OnClosed(connection);
+}
+
+#pragma endregion
+
+#pragma region Requests
+
+bool IocpEventLoop::PostAccept(size_t listener)
+{
+    const Listener &entry = m_listeners[listener];
+    SOCKET socket = WSASocketW(entry.family, SOCK_STREAM, IPPROTO_TCP, NULL, 0,
+                               WSA_FLAG_OVERLAPPED | WSA_FLAG_NO_HANDLE_INHERIT);
+    if (socket == INVALID_SOCKET)
+    {
+        return false;
+    }
+
+    IoRequest *request = new IoRequest(IoRequest::AcceptOperation);
+    request->listener = listener;
+    request->socket = socket;
+    request->data.resize(2 * AcceptAddressSize);
+
+    m_outstanding++;
+    DWORD dwBytes = 0;
+    if (!AcceptEx(entry.socket, socket, request->data.data(), 0, AcceptAddressSize, AcceptAddressSize,
+                  &dwBytes, &request->overlapped) &&
+        WSAGetLastError() != ERROR_IO_PENDING)
+    {
+        m_outstanding--;
+        closesocket(socket);
+        delete request;
+        return false;
+    }
+    return true;
+}
+
+bool IocpEventLoop::PostReceiveFrom(size_t listener)
+{
+    IoRequest *request = new IoRequest(IoRequest::ReceiveFromOperation);
+    request->listener = listener;
+    request->data.resize(DatagramBufferSize);
+    request->buffer.buf = request->data.data();
+    request->buffer.len = static_cast<ULONG>(request->data.size());
+
+    m_outstanding++;
+    if (WSARecvFrom(m_listeners[listener].socket, &request->buffer, 1, NULL, &request->flags,
+                    reinterpret_cast<sockaddr *>(&request->from), &request->fromLength,
+                    &request->overlapped, NULL) != 0 &&
+        WSAGetLastError() != WSA_IO_PENDING)
+    {
+        m_outstanding--;
+        delete request;
+        return false;
+    }
+    return true;
+}
+
+/**
+ *   Post a receive into a pooled buffer on a connection; a connection that
+ *   cannot take one is closed.
+ *
+ *   @param connection - the connection
+ */
+bool IocpEventLoop::PostReceive(const SocketConnectionPtr &connection)
+{
+    IoRequest *request = new IoRequest(IoRequest::ReceiveOperation);
+    request->connection = connection;
+    bool fPosted = false;
+    try
+    {
+        request->received = m_server.m_buffers.Allocate();
+    }
+    catch (DWORD)
+    {
+        delete request;
+        CloseConnection(connection);
+        return false;
+    }
+    request->buffer.buf = request->received.GetData();
+    request->buffer.len = static_cast<ULONG>(request->received.GetCapacity());
+
+    {
+        // Posting under the lock keeps the socket from being closed and
+        // reused in between.
+        std::lock_guard<std::mutex> guard(connection->m_lock);
+        if (!connection->m_closed)
+        {
+            m_outstanding++;
+            fPosted = WSARecv(connection->m_socket, &request->buffer, 1, NULL, &request->flags,
+                              &request->overlapped, NULL) == 0 ||
+                      WSAGetLastError() == WSA_IO_PENDING;
+            if (!fPosted)
+            {
+                m_outstanding--;
+            }
+        }
+    }
+
+    if (!fPosted)
+    {
+        delete request;
+        CloseConnection(connection);
+    }
+    return fPosted;
+}
+
+/**
+ *   Post a send of the rest of the first output buffer. The connection
+ *   lock must be held.
+ *
+ *   @param connection - the connection
+ */
+bool IocpEventLoop::PostSend(SocketConnection &connection)
+{
+    std::vector<char> &buffer = connection.m_output.front();
+    IoRequest *request = new IoRequest(IoRequest::SendOperation);
+    request->connection = connection.shared_from_this();
+    request->buffer.buf = buffer.data() + connection.m_outputOffset;
+    request->buffer.len = static_cast<ULONG>(buffer.size() - connection.m_outputOffset);
+
+    m_outstanding++;
+    if (WSASend(connection.m_socket, &request->buffer, 1, NULL, 0, &request->overlapped, NULL) != 0 &&
+        WSAGetLastError() != WSA_IO_PENDING)
+    {
+        m_outstanding--;
+        delete request;
+        return false;
+    }
+    return true;
+}
+
+#pragma endregion
+
+#pragma region Helper Functions
+
+/**
+ *   Queue a function for the loop thread and wait until it has run. Runs
+ *   it directly if the loop is not running.
+ *
+ *   @param function - the function
+ */
+void IocpEventLoop::RunOnLoop(std::function<void(void)> function)
+{
+    if (!m_thread.joinable())
+    {
+        function();
+        return;
+    }
+
+    std::promise<void> done;
+    {
+        std::lock_guard<std::mutex> guard(m_commandLock);
+        m_commands.push_back([&function, &done]() {
+            function();
+            done.set_value();
+        });
+    }
+    PostQueuedCompletionStatus(m_port, 0, CommandKey, NULL);
+    done.get_future().wait();
+}
+
+/**
+ *   Queue a function for the loop thread and return. Runs it directly if
+ *   the loop is not running.
+ *
+ *   @param function - the function
+ */
+void IocpEventLoop::PostToLoop(std::function<void(void)> function)
+{
+    if (!m_thread.joinable())
+    {
+        function();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(m_commandLock);
+        m_commands.push_back(std::move(function));
+    }
+    PostQueuedCompletionStatus(m_port, 0, CommandKey, NULL);
+}
+
+/**
+ *   Send a datagram.
+ *
+ *   @param socket - the datagram socket
+ *   @param to - the destination sockaddr
+ *   @param toLength - its length
+ *   @param data - the payload
+ *   @param size - its size in bytes
+ *   @return true if the datagram was sent
+ */
+bool IocpEventLoop::SendTo(SocketHandle socket, const void *to, int toLength,
+                           const void *data, size_t size)
+{
+    return sendto(static_cast<SOCKET>(socket), static_cast<const char *>(data), static_cast<int>(size), 0,
+                  static_cast<const sockaddr *>(to), toLength) == static_cast<int>(size);
+}
+
+std::string IocpEventLoop::FormatAddress(const void *address)
+{
+    const sockaddr *generic = static_cast<const sockaddr *>(address);
+    char szAddress[INET6_ADDRSTRLEN] = "";
+    char szResult[INET6_ADDRSTRLEN + 16];
+    if (generic->sa_family == AF_INET6)
+    {
+        const sockaddr_in6 *v6 = static_cast<const sockaddr_in6 *>(address);
+        InetNtopA(AF_INET6, &v6->sin6_addr, szAddress, sizeof(szAddress));
+        _snprintf_s(szResult, sizeof(szResult), _TRUNCATE, "[%s]:%u", szAddress,
+                    static_cast<unsigned int>(ntohs(v6->sin6_port)));
+    }
+    else
+    {
+        const sockaddr_in *v4 = static_cast<const sockaddr_in *>(address);
+        InetNtopA(AF_INET, &v4->sin_addr, szAddress, sizeof(szAddress));
+        _snprintf_s(szResult, sizeof(szResult), _TRUNCATE, "%s:%u", szAddress,
+                    static_cast<unsigned int>(ntohs(v4->sin_port)));
+    }
+    return szResult;
+}
+
+#pragma endregion
+
+#endif
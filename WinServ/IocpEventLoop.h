@@ -0,0 +1,136 @@
+/*
+ * The Windows event loop of SocketServer.
+ *
+ * Each loop is a thread waiting on its own I/O completion port. Windows
+ * has no SO_REUSEPORT, so the first loop owns the listening and datagram
+ * sockets and keeps several AcceptEx and WSARecvFrom requests posted on
+ * them; every accepted connection is associated with the port of the next
+ * loop, round robin, and its receives and sends complete there.
+ *
+ */
+
+#pragma once
+
+#ifdef _WIN32
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "SocketServer.h"
+
+class IocpEventLoop
+{
+public:
+    explicit IocpEventLoop(SocketServer &server);
+    ~IocpEventLoop(void);
+
+    IocpEventLoop(const IocpEventLoop &) = delete;
+    IocpEventLoop &operator=(const IocpEventLoop &) = delete;
+
+    // Open the sockets of the endpoints if fPrimary is set; the other
+    // loops only take connections. An endpoint with port 0 is given the
+    // port it was bound to.
+    void Open(std::vector<SocketServer::Endpoint> &endpoints, bool fPrimary);
+
+    // Start the loop thread and post the first accepts and receives.
+    void Start(void);
+
+    // Close the listening sockets and stop reading datagrams. Returns once
+    // the loop has done so.
+    void StopAccepting(void);
+
+    // Cancel the posted accepts and datagram receives and stop reposting
+    // them, so that new connections wait in the backlog, or post them
+    // again. PauseAccepting returns once the loop has done so;
+    // ResumeAccepting only queues it.
+    void PauseAccepting(void);
+    void ResumeAccepting(void);
+
+    // Close every connection of the loop.
+    void CloseConnections(void);
+
+    // Stop the loop thread once every posted request has completed, and
+    // close its sockets.
+    void Stop(void);
+
+    // Queue data for a connection and start sending it. Called by
+    // SocketConnection::Send on any thread.
+    bool Send(SocketConnection &connection, const void *data, size_t size);
+
+    // Close a connection once its output is written. Called by
+    // SocketConnection::Close on any thread.
+    void Close(SocketConnection &connection);
+
+    // Send a datagram.
+    static bool SendTo(SocketHandle socket, const void *to, int toLength,
+                       const void *data, size_t size);
+
+    // Format a sockaddr as "address:port".
+    static std::string FormatAddress(const void *address);
+
+private:
+    struct IoRequest;
+
+    // A listening or datagram socket of the primary loop
+    struct Listener
+    {
+        SocketHandle socket;
+        size_t endpoint;
+        int family;
+        bool tcp;
+    };
+
+    // Thread body.
+    void Loop(void);
+
+    // Run a function on the loop thread and wait until it has, or queue it
+    // for the loop thread and return.
+    void RunOnLoop(std::function<void(void)> function);
+    void PostToLoop(std::function<void(void)> function);
+
+    // Handle a completed request and free it.
+    void Complete(IoRequest *request, DWORD dwBytes, bool fOk);
+
+    // Post overlapped requests.
+    bool PostAccept(size_t listener);
+    bool PostReceiveFrom(size_t listener);
+    bool PostReceive(const SocketConnectionPtr &connection);
+    bool PostSend(SocketConnection &connection);
+
+    // Take an accepted connection: its requests complete on this loop.
+    void Adopt(const SocketConnectionPtr &connection);
+
+    // Close a connection now and tell the server.
+    void CloseConnection(const SocketConnectionPtr &connection);
+
+    SocketServer &m_server;
+    HANDLE m_port;
+    std::thread m_thread;
+    bool m_stop;
+    std::atomic<bool> m_accepting;
+
+    // The sockets of the endpoints, on the primary loop
+    std::vector<Listener> m_listeners;
+
+    // Whether accepts and datagram receives are held, and how many of each
+    // listener's were not reposted while they were; loop thread only
+    bool m_paused;
+    std::vector<int> m_parked;
+
+    // The connections of the loop
+    std::mutex m_connectionLock;
+    std::unordered_map<SocketConnection *, SocketConnectionPtr> m_connections;
+
+    // Requests posted to this loop's port and not yet completed; the loop
+    // thread exits only when none are left
+    std::atomic<size_t> m_outstanding;
+
+    // Functions queued for the loop thread
+    std::mutex m_commandLock;
+    std::vector<std::function<void(void)>> m_commands;
+};
+
+#endif
@@ -0,0 +1,657 @@
+#pragma region Includes
+#include "Logger.h"
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <cwchar>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#pragma endregion
+
+namespace
+{
+    // Records handed to the sinks in one call.
+    const size_t c_batchSize = 64;
+
+    // How long the flusher sleeps when nobody wakes it.
+    const std::chrono::milliseconds c_flushInterval(50);
+
+    // The short name of an event type.
+    const char *TypeName(WORD type)
+    {
+        switch (type)
+        {
+        case EVENTLOG_ERROR_TYPE:
+            return "ERROR";
+        case EVENTLOG_WARNING_TYPE:
+            return "WARNING";
+        case EVENTLOG_INFORMATION_TYPE:
+            return "INFO";
+        case EVENTLOG_AUDIT_SUCCESS:
+            return "AUDIT_SUCCESS";
+        case EVENTLOG_AUDIT_FAILURE:
+            return "AUDIT_FAILURE";
+        default:
+            return "SUCCESS";
+        }
+    }
+
+    // Append a wide string to a buffer as UTF-8. Returns the new length.
+    size_t AppendUtf8(char *buffer, size_t length, size_t size, const wchar_t *text)
+    {
+        for (; *text; text++)
+        {
+            unsigned long c = static_cast<unsigned long>(*text);
+
+            // Combine UTF-16 surrogate pairs (wchar_t is 16 bits on Windows).
+            if (c >= 0xD800 && c <= 0xDBFF && text[1] >= 0xDC00 && text[1] <= 0xDFFF)
+            {
+                c = 0x10000 + ((c - 0xD800) << 10) + (static_cast<unsigned long>(text[1]) - 0xDC00);
+                text++;
+            }
+
+            char encoded[4];
+            size_t n;
+            if (c < 0x80)
+            {
+                encoded[0] = static_cast<char>(c);
+                n = 1;
+            }
+            else if (c < 0x800)
+            {
+                encoded[0] = static_cast<char>(0xC0 | (c >> 6));
+                encoded[1] = static_cast<char>(0x80 | (c & 0x3F));
+                n = 2;
+            }
+            else if (c < 0x10000)
+            {
+                encoded[0] = static_cast<char>(0xE0 | (c >> 12));
+                encoded[1] = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+                encoded[2] = static_cast<char>(0x80 | (c & 0x3F));
+                n = 3;
+            }
+            else
+            {
+                encoded[0] = static_cast<char>(0xF0 | (c >> 18));
+                encoded[1] = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+                encoded[2] = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+                encoded[3] = static_cast<char>(0x80 | (c & 0x3F));
+                n = 4;
+            }
+
+            if (length + n >= size)
+                break;
+            for (size_t i = 0; i < n; i++)
+                buffer[length++] = encoded[i];
+        }
+        buffer[length] = '\0';
+        return length;
+    }
+
+    // Format a record as one UTF-8 line:
+    // 2024-01-31T12:00:00.000Z INFO [source] message
+    size_t FormatRecord(const LogRecord &record, char *buffer, size_t size)
+    {
+        time_t seconds = static_cast<time_t>(record.timestamp / 1000);
+        struct tm utc;
+#ifdef _WIN32
+        gmtime_s(&utc, &seconds);
+#else
+        gmtime_r(&seconds, &utc);
+#endif
+        int length = snprintf(buffer, size, "%04d-%02d-%02dT%02d:%02d:%02d.%03uZ %s [",
+                              utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
+                              utc.tm_hour, utc.tm_min, utc.tm_sec,
+                              static_cast<unsigned>(record.timestamp % 1000),
+                              TypeName(record.type));
+        size_t n = (length > 0) ? static_cast<size_t>(length) : 0;
+        n = AppendUtf8(buffer, n, size, record.source);
+        n = AppendUtf8(buffer, n, size, L"] ");
+        n = AppendUtf8(buffer, n, size, record.message);
+        return AppendUtf8(buffer, n, size, L"\n");
+    }
+
+    // File operations on UTF-8 (POSIX) or UTF-16 (Windows) paths.
+#ifdef _WIN32
+    FILE *OpenLogFile(const std::wstring &path)
+    {
+        FILE *file = NULL;
+        if (_wfopen_s(&file, path.c_str(), L"ab") != 0)
+            return NULL;
+        return file;
+    }
+
+    void RenameLogFile(const std::wstring &from, const std::wstring &to)
+    {
+        _wrename(from.c_str(), to.c_str());
+    }
+
+    void RemoveLogFile(const std::wstring &path)
+    {
+        _wremove(path.c_str());
+    }
+#else
+    std::string NarrowPath(const std::wstring &path)
+    {
+        std::string narrow(path.size() * 4 + 1, '\0');
+        narrow.resize(AppendUtf8(&narrow[0], 0, narrow.size(), path.c_str()));
+        return narrow;
+    }
+
+    FILE *OpenLogFile(const std::wstring &path)
+    {
+        return fopen(NarrowPath(path).c_str(), "ab");
+    }
+
+    void RenameLogFile(const std::wstring &from, const std::wstring &to)
+    {
+        rename(NarrowPath(from).c_str(), NarrowPath(to).c_str());
+    }
+
+    void RemoveLogFile(const std::wstring &path)
+    {
+        remove(NarrowPath(path).c_str());
+    }
+#endif
+
+    // Copy a string into a fixed buffer. Returns false if it was cut short.
+    bool CopyTruncated(wchar_t *to, size_t size, const wchar_t *from)
+    {
+        size_t i = 0;
+        for (; from[i] && i + 1 < size; i++)
+            to[i] = from[i];
+        to[i] = L'\0';
+        return from[i] == L'\0';
+    }
+}
+
+#pragma region Sinks
+
+#ifdef _WIN32
+
+EventLogSink::EventLogSink(void)
+{
+}
+
+/**
+ *   Deregister every event source opened by the sink.
+ */
+EventLogSink::~EventLogSink(void)
+{
+    for (size_t i = 0; i < m_sources.size(); i++)
+    {
+        DeregisterEventSource(m_sources[i].second);
+    }
+}
+
+/**
+ *   Get the event source handle of a service, registering it the first
+ *   time the service logs.
+ *
+ *   @param source - the name of the service
+ *   @return the handle, or NULL if the source could not be registered
+ */
+HANDLE EventLogSink::GetEventSource(const wchar_t *source)
+{
+    for (size_t i = 0; i < m_sources.size(); i++)
+    {
+        if (m_sources[i].first == source)
+            return m_sources[i].second;
+    }
+
+    HANDLE hEventSource = RegisterEventSource(NULL, source);
+    if (hEventSource)
+    {
+        m_sources.push_back(std::make_pair(std::wstring(source), hEventSource));
+    }
+    return hEventSource;
+}
+
+/**
+ *   Report a batch of records to the Application event log.
+ */
+void EventLogSink::Write(const LogRecord *records, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        HANDLE hEventSource = GetEventSource(records[i].source);
+        if (hEventSource == NULL)
+            continue;
+
+        LPCWSTR lpszStrings[2] = {records[i].source, records[i].message};
+        ReportEvent(hEventSource,    // Event log handle
+                    records[i].type, // Event type
+                    0,               // Event category
+                    0,               // Event identifier
+                    NULL,            // No security identifier
+                    2,               // Size of lpszStrings array
+                    0,               // No binary data
+                    lpszStrings,     // Array of strings
+                    NULL             // No binary data
+        );
+    }
+}
+
+#endif
+
+/**
+ *   Write a batch of records to standard output.
+ */
+void ConsoleLogSink::Write(const LogRecord *records, size_t count)
+{
+    char line[1024];
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t length = FormatRecord(records[i], line, sizeof(line));
+#ifdef _WIN32
+        fwrite(line, 1, length, stdout);
+#else
+        // Bypass stdio: the rest of the program prints wide text, and a
+        // stream cannot mix byte and wide output on POSIX.
+        if (write(STDOUT_FILENO, line, length) < 0)
+            return;
+#endif
+    }
+}
+
+void ConsoleLogSink::Flush(void)
+{
+    fflush(stdout);
+}
+
+/**
+ *   Open (or create) the log file for appending.
+ *
+ *   @param path - the log file
+ *   @param maxBytes - size at which the file is rotated
+ *   @param maxFiles - number of rotated files to keep
+ */
+FileLogSink::FileLogSink(const std::wstring &path,
+                         unsigned long long maxBytes,
+                         unsigned int maxFiles)
+    : m_path(path), m_maxBytes(maxBytes), m_maxFiles(maxFiles), m_size(0), m_file(NULL)
+{
+    Open();
+}
+
+FileLogSink::~FileLogSink(void)
+{
+    if (m_file)
+    {
+        fclose(m_file);
+        m_file = NULL;
+    }
+}
+
+/**
+ *   Open the current log file and pick up its size.
+ */
+void FileLogSink::Open(void)
+{
+    m_file = OpenLogFile(m_path);
+    m_size = 0;
+    if (m_file && fseek(m_file, 0, SEEK_END) == 0)
+    {
+        long size = ftell(m_file);
+        m_size = (size > 0) ? static_cast<unsigned long long>(size) : 0;
+    }
+}
+
+/**
+ *   Append a batch of records, rotating the file when it is full.
+ */
+void FileLogSink::Write(const LogRecord *records, size_t count)
+{
+    char line[1024];
+    for (size_t i = 0; i < count; i++)
+    {
+        if (m_size >= m_maxBytes)
+        {
+            Rotate();
+        }
+        if (m_file == NULL)
+            return;
+
+        size_t length = FormatRecord(records[i], line, sizeof(line));
+        m_size += fwrite(line, 1, length, m_file);
+    }
+}
+
+void FileLogSink::Flush(void)
+{
+    if (m_file)
+    {
+        fflush(m_file);
+    }
+}
+
+/**
+ *   Shift <path>.N to <path>.N+1 (dropping the oldest), move the current
+ *   file to <path>.1 and start a new one.
+ */
+void FileLogSink::Rotate(void)
+{
+    if (m_file)
+    {
+        fclose(m_file);
+        m_file = NULL;
+    }
+
+    if (m_maxFiles > 0)
+    {
+        RemoveLogFile(m_path + L"." + std::to_wstring(m_maxFiles));
+        for (unsigned int i = m_maxFiles - 1; i >= 1; i--)
+        {
+            RenameLogFile(m_path + L"." + std::to_wstring(i),
+                       m_path + L"." + std::to_wstring(i + 1));
+        }
+        RenameLogFile(m_path, m_path + L".1");
+    }
+    else
+    {
+        RemoveLogFile(m_path);
+    }
+
+    Open();
+}
+
+#pragma endregion
+
+#pragma region Logger
+
+/**
+ *   The process-wide logger, created on first use. It writes to the
+ *   Application event log on Windows and to standard output elsewhere.
+ */
+Logger &Logger::Default(void)
+{
+#ifdef _WIN32
+    typedef EventLogSink DefaultSink;
+#else
+    typedef ConsoleLogSink DefaultSink;
+#endif
+    static Logger logger;
+    static bool initialized = (logger.AddSink(std::unique_ptr<LogSink>(new DefaultSink())), true);
+    (void)initialized;
+    return logger;
+}
+
+/**
+ *   Create the ring and start the flusher thread.
+ *
+ *   @param capacity - number of pending records, rounded up to a power of two
+ */
+Logger::Logger(size_t capacity)
+    : m_enqueuePos(0), m_dequeuePos(0), m_wakePending(false), m_dropped(0), m_truncated(0),
+      m_written(0), m_batches(0), m_flushRequests(0), m_flushesDone(0),
+      m_wakeRequested(false), m_rotateRequested(false), m_stopping(false)
+{
+    size_t size = 2;
+    while (size < capacity)
+        size <<= 1;
+
+    m_slots.reset(new Slot[size]);
+    m_mask = size - 1;
+    for (size_t i = 0; i < size; i++)
+    {
+        m_slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    m_batch.resize(c_batchSize);
+    m_flusher = std::thread(&Logger::FlushLoop, this);
+}
+
+/**
+ *   Write out everything queued, flush the sinks and stop the flusher.
+ */
+Logger::~Logger(void)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stopping = true;
+    }
+    m_wake.notify_one();
+    if (m_flusher.joinable())
+    {
+        m_flusher.join();
+    }
+}
+
+/**
+ *   Register a sink for all records written from now on.
+ */
+void Logger::AddSink(std::unique_ptr<LogSink> sink)
+{
+    std::lock_guard<std::mutex> guard(m_sinkLock);
+    m_sinks.push_back(std::move(sink));
+}
+
+/**
+ *   Queue a message. This never blocks: if the ring is full the message is
+ *   dropped and counted.
+ *
+ *   @param source - the name of the logging service
+ *   @param message - the message text
+ *   @param type - one of the EVENTLOG_* types
+ *   @return false if the message was dropped
+ */
+bool Logger::Write(const wchar_t *source, const wchar_t *message, WORD type)
+{
+    size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+    Slot *slot;
+    for (;;)
+    {
+        slot = &m_slots[pos & m_mask];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        ptrdiff_t diff = static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(pos);
+        if (diff == 0)
+        {
+            if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // The flusher has not caught up with this slot: the ring is full.
+            // Make sure it is on its way rather than leave the ring full
+            // until its next periodic pass.
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            WakeFlusher();
+            return false;
+        }
+        else
+        {
+            pos = m_enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    LogRecord &record = slot->record;
+    record.timestamp = static_cast<unsigned long long>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count());
+    record.type = type;
+    CopyTruncated(record.source, LogRecord::MaxSourceLength, source ? source : L"");
+    if (!CopyTruncated(record.message, LogRecord::MaxMessageLength, message ? message : L""))
+    {
+        m_truncated.fetch_add(1, std::memory_order_relaxed);
+    }
+    slot->sequence.store(pos + 1, std::memory_order_release);
+
+    // Wake the flusher early once the ring is half full; otherwise it picks
+    // the record up on its next periodic pass.
+    if (pos + 1 - m_dequeuePos.load(std::memory_order_acquire) >= (m_mask + 1) / 2)
+    {
+        WakeFlusher();
+    }
+    return true;
+}
+
+/**
+ *   Wake the flusher, unless a wake is already pending since it last
+ *   woke, so that producers take its lock at most once per pass. The
+ *   request is recorded under the lock, so a flusher about to wait sees
+ *   it and does not sleep through it.
+ */
+void Logger::WakeFlusher(void)
+{
+    if (m_wakePending.load(std::memory_order_relaxed) ||
+        m_wakePending.exchange(true, std::memory_order_acq_rel))
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_wakeRequested = true;
+    }
+    m_wake.notify_one();
+}
+
+/**
+ *   Block until everything queued before the call has been written and the
+ *   sinks have been flushed.
+ */
+void Logger::Flush(void)
+{
+    Flush(INFINITE);
+}
+
+/**
+ *   Block until everything queued before the call has been written and the
+ *   sinks have been flushed, or until the time is up.
+ *
+ *   @param dwMilliseconds - the longest wait, or INFINITE
+ *   @return true if the flush finished
+ */
+bool Logger::Flush(DWORD dwMilliseconds)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    unsigned long long ticket = ++m_flushRequests;
+    m_wake.notify_one();
+    auto flushed = [this, ticket]() { return m_flushesDone >= ticket || m_stopping; };
+    if (dwMilliseconds == INFINITE)
+    {
+        m_flushed.wait(guard, flushed);
+        return true;
+    }
+    return m_flushed.wait_for(guard, std::chrono::milliseconds(dwMilliseconds), flushed);
+}
+
+/**
+ *   Ask the sinks to start new output files. Records queued before the
+ *   call end up in the old files.
+ */
+void Logger::Rotate(void)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_rotateRequested = true;
+    }
+    m_wake.notify_one();
+}
+
+/**
+ *   Get the logger counters.
+ */
+Logger::Statistics Logger::GetStatistics(void) const
+{
+    Statistics statistics;
+    statistics.written = m_written.load(std::memory_order_relaxed);
+    statistics.dropped = m_dropped.load(std::memory_order_relaxed);
+    statistics.truncated = m_truncated.load(std::memory_order_relaxed);
+    statistics.batches = m_batches.load(std::memory_order_relaxed);
+    return statistics;
+}
+
+/**
+ *   Move up to one batch of published records from the ring to the sinks.
+ *   Only the flusher thread calls this.
+ *
+ *   @return the number of records written
+ */
+size_t Logger::Drain(void)
+{
+    size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+    size_t count = 0;
+    while (count < c_batchSize)
+    {
+        Slot &slot = m_slots[pos & m_mask];
+        if (slot.sequence.load(std::memory_order_acquire) != pos + 1)
+            break;
+
+        m_batch[count++] = slot.record;
+        slot.sequence.store(pos + m_mask + 1, std::memory_order_release);
+        pos++;
+    }
+    m_dequeuePos.store(pos, std::memory_order_release);
+
+    if (count > 0)
+    {
+        std::lock_guard<std::mutex> guard(m_sinkLock);
+        for (size_t i = 0; i < m_sinks.size(); i++)
+        {
+            m_sinks[i]->Write(&m_batch[0], count);
+        }
+        m_written.fetch_add(count, std::memory_order_relaxed);
+        m_batches.fetch_add(1, std::memory_order_relaxed);
+    }
+    return count;
+}
+
+/**
+ *   The flusher thread. Drains the ring until it is empty, then sleeps
+ *   until woken or until the flush interval elapses.
+ */
+void Logger::FlushLoop(void)
+{
+    for (;;)
+    {
+        while (Drain() == c_batchSize)
+        {
+        }
+
+        std::unique_lock<std::mutex> guard(m_lock);
+        bool rotate = m_rotateRequested;
+        unsigned long long requests = m_flushRequests;
+        bool stopping = m_stopping;
+        m_rotateRequested = false;
+
+        if (rotate || requests != m_flushesDone || stopping)
+        {
+            guard.unlock();
+
+            // Pick up anything that raced with the last pass.
+            while (Drain() > 0)
+            {
+            }
+
+            {
+                std::lock_guard<std::mutex> sinkGuard(m_sinkLock);
+                for (size_t i = 0; i < m_sinks.size(); i++)
+                {
+                    m_sinks[i]->Flush();
+                    if (rotate)
+                        m_sinks[i]->Rotate();
+                }
+            }
+
+            guard.lock();
+            m_flushesDone = requests;
+            m_flushed.notify_all();
+            if (stopping)
+                break;
+            continue;
+        }
+
+        m_wake.wait_for(guard, c_flushInterval, [this]() {
+            return m_wakeRequested || m_rotateRequested || m_flushRequests != m_flushesDone || m_stopping;
+        });
+
+        // Producers may ask for the next pass from now on; whatever they
+        // published before this is picked up by the pass about to start.
+        m_wakeRequested = false;
+        m_wakePending.store(false, std::memory_order_release);
+    }
+}
+
+#pragma endregion
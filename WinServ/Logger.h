@@ -0,0 +1,213 @@
+/*
+ * Asynchronous, batched logging.
+ *
+ * Callers only copy their message into a slot of a bounded lock-free
+ * multi-producer ring; a single flusher thread drains the ring in batches
+ * and hands them to the registered sinks. When the ring is full the message
+ * is dropped and counted rather than blocking the caller, so logging is
+ * safe from the control handler thread.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Platform.h"
+
+// One log message as seen by the sinks.
+struct LogRecord
+{
+    // Longer messages are truncated (and counted) when they are queued.
+    static const size_t MaxMessageLength = 260;
+    static const size_t MaxSourceLength = 64;
+
+    // Milliseconds since the Unix epoch.
+    unsigned long long timestamp;
+
+    // One of the EVENTLOG_* types.
+    WORD type;
+
+    wchar_t source[MaxSourceLength];
+    wchar_t message[MaxMessageLength];
+};
+
+// A destination for log records. Sinks are only called from the flusher
+// thread, so they need no locking of their own.
+class LogSink
+{
+public:
+    virtual ~LogSink(void) {}
+
+    // Write a batch of records.
+    virtual void Write(const LogRecord *records, size_t count) = 0;
+
+    // Push buffered output to its destination.
+    virtual void Flush(void) {}
+
+    // Start a new output file, for sinks that have one.
+    virtual void Rotate(void) {}
+};
+
+#ifdef _WIN32
+
+// Writes to the Windows Application event log. The event source of each
+// service is registered once and kept open until the sink is destroyed.
+class EventLogSink : public LogSink
+{
+public:
+    EventLogSink(void);
+    virtual ~EventLogSink(void);
+
+    virtual void Write(const LogRecord *records, size_t count);
+
+private:
+    HANDLE GetEventSource(const wchar_t *source);
+
+    std::vector<std::pair<std::wstring, HANDLE>> m_sources;
+};
+
+#endif
+
+// Writes UTF-8 lines to standard output.
+class ConsoleLogSink : public LogSink
+{
+public:
+    virtual void Write(const LogRecord *records, size_t count);
+    virtual void Flush(void);
+};
+
+// Writes UTF-8 lines to a file. When the file grows past maxBytes it is
+// renamed to <path>.1 (shifting older files up to <path>.<maxFiles>) and a
+// new file is started.
+class FileLogSink : public LogSink
+{
+public:
+    FileLogSink(const std::wstring &path,
+                unsigned long long maxBytes = 10 * 1024 * 1024,
+                unsigned int maxFiles = 5);
+    virtual ~FileLogSink(void);
+
+    virtual void Write(const LogRecord *records, size_t count);
+    virtual void Flush(void);
+    virtual void Rotate(void);
+
+private:
+    void Open(void);
+
+    std::wstring m_path;
+    unsigned long long m_maxBytes;
+    unsigned int m_maxFiles;
+    unsigned long long m_size;
+    FILE *m_file;
+};
+
+class Logger
+{
+public:
+    struct Statistics
+    {
+        // Records handed to the sinks.
+        unsigned long long written;
+
+        // Records discarded because the ring was full.
+        unsigned long long dropped;
+
+        // Records whose message was cut to MaxMessageLength.
+        unsigned long long truncated;
+
+        // Batches handed to the sinks.
+        unsigned long long batches;
+    };
+
+    // Create a logger with room for the given number of pending records
+    // (rounded up to a power of two) and start its flusher thread.
+    explicit Logger(size_t capacity = 1024);
+
+    // Write out everything queued and stop the flusher.
+    ~Logger(void);
+
+    Logger(const Logger &) = delete;
+    Logger &operator=(const Logger &) = delete;
+
+    // Register a sink. Records queued from now on are written to it.
+    void AddSink(std::unique_ptr<LogSink> sink);
+
+    // Queue a message without blocking. Returns false if the ring was full
+    // and the message was dropped.
+    bool Write(const wchar_t *source, const wchar_t *message, WORD type);
+
+    // Block until everything queued before the call has been written and
+    // the sinks have been flushed.
+    void Flush(void);
+
+    // The same, giving up after dwMilliseconds (or INFINITE). Returns false
+    // if the flush had not finished by then; it still completes later.
+    bool Flush(DWORD dwMilliseconds);
+
+    // Ask the sinks to start new output files.
+    void Rotate(void);
+
+    Statistics GetStatistics(void) const;
+
+    // The process-wide logger. It writes to the Application event log on
+    // Windows and to standard output elsewhere.
+    static Logger &Default(void);
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        LogRecord record;
+    };
+
+    // Flusher thread body.
+    void FlushLoop(void);
+
+    // Move up to one batch of records from the ring to the sinks. Returns
+    // the number of records written.
+    size_t Drain(void);
+
+    // Wake the flusher early, once per pass.
+    void WakeFlusher(void);
+
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_mask;
+
+    // Producers claim positions here; cache-line separated from the
+    // consumer position to avoid false sharing.
+    alignas(64) std::atomic<size_t> m_enqueuePos;
+    alignas(64) std::atomic<size_t> m_dequeuePos;
+
+    // Set by the producer that asks for the next flusher pass, cleared by
+    // the flusher when the pass starts
+    alignas(64) std::atomic<bool> m_wakePending;
+
+    std::atomic<unsigned long long> m_dropped;
+    std::atomic<unsigned long long> m_truncated;
+    std::atomic<unsigned long long> m_written;
+    std::atomic<unsigned long long> m_batches;
+
+    // Guards the sink list.
+    std::mutex m_sinkLock;
+    std::vector<std::unique_ptr<LogSink>> m_sinks;
+
+    // Flusher wake-ups and flush/rotate requests.
+    std::mutex m_lock;
+    std::condition_variable m_wake;
+    std::condition_variable m_flushed;
+    unsigned long long m_flushRequests;
+    unsigned long long m_flushesDone;
+    bool m_wakeRequested;
+    bool m_rotateRequested;
+    bool m_stopping;
+
+    std::vector<LogRecord> m_batch;
+    std::thread m_flusher;
+};
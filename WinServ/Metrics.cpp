@@ -0,0 +1,522 @@
+#pragma region Includes
+#include "Metrics.h"
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <strsafe.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#pragma endregion
+
+namespace
+{
+    // Metric names are stored as ASCII; anything else becomes '?'.
+    void CopyName(char *pszDest, const wchar_t *pszName)
+    {
+        size_t i = 0;
+        for (; pszName[i] != L'\0' && i < MetricsRegistry::MaxNameLength; i++)
+        {
+            pszDest[i] = (pszName[i] > 0 && pszName[i] < 0x7F) ? static_cast<char>(pszName[i]) : '?';
+        }
+        pszDest[i] = '\0';
+    }
+
+    DWORD GetCurrentProcessIdentifier(void)
+    {
+#ifdef _WIN32
+        return GetCurrentProcessId();
+#else
+        return static_cast<DWORD>(getpid());
+#endif
+    }
+
+#ifndef _WIN32
+    // The shm_open name of a region: its name, narrowed, with a leading '/'.
+    std::string GetShmName(const wchar_t *pszRegionName)
+    {
+        std::string name("/");
+        for (; *pszRegionName != L'\0'; pszRegionName++)
+        {
+            name += (*pszRegionName > 0 && *pszRegionName < 0x7F) ? static_cast<char>(*pszRegionName) : '_';
+        }
+        return name;
+    }
+#endif
+}
+
+#pragma region Registry
+
+thread_local size_t MetricsRegistry::t_shard = static_cast<size_t>(-1);
+
+/**
+ *   The process-wide registry. Its region is named after the process id
+ *   so that a reader can find it. It is created on first use and lives
+ *   until the process exits.
+ */
+MetricsRegistry &MetricsRegistry::Default(void)
+{
+    static MetricsRegistry registry(GetRegionName(GetCurrentProcessIdentifier()).c_str());
+    return registry;
+}
+
+/**
+ *   The name of the shared region of a process's default registry. On
+ *   Windows it lives in the global namespace so that a reader in another
+ *   session (a service runs in session 0) can open it.
+ *
+ *   @param dwProcessId - the process id
+ */
+std::wstring MetricsRegistry::GetRegionName(DWORD dwProcessId)
+{
+    wchar_t szName[64];
+#ifdef _WIN32
+    StringCchPrintf(szName, ARRAYSIZE(szName), L"Global\\WinServ.metrics.%lu", dwProcessId);
+#else
+    StringCchPrintf(szName, ARRAYSIZE(szName), L"WinServ.metrics.%lu", dwProcessId);
+#endif
+    return szName;
+}
+
+/**
+ *   Create the region and initialize its header.
+ *
+ *   @param pszRegionName - the name of the shared region, or NULL to keep
+ *   the metrics in private memory
+ */
+MetricsRegistry::MetricsRegistry(const wchar_t *pszRegionName)
+    : m_header(NULL), m_descriptors(NULL), m_cells(NULL), m_nextCell(0),
+      m_shared(false), m_region(NULL)
+{
+#ifdef _WIN32
+    m_mapping = NULL;
+    if (pszRegionName != NULL)
+    {
+        m_mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+                                       static_cast<DWORD>(RegionSize), pszRegionName);
+        if (m_mapping == NULL && wcsncmp(pszRegionName, L"Global\\", 7) == 0)
+        {
+            // Creating global objects needs SeCreateGlobalPrivilege, which
+            // services have but interactive processes may not.
+            std::wstring local = std::wstring(L"Local\\") + (pszRegionName + 7);
+            m_mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+                                           static_cast<DWORD>(RegionSize), local.c_str());
+        }
+        if (m_mapping != NULL)
+        {
+            m_region = MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, RegionSize);
+            if (m_region == NULL)
+            {
+                CloseHandle(m_mapping);
+                m_mapping = NULL;
+            }
+        }
+    }
+#else
+    if (pszRegionName != NULL)
+    {
+        m_shmName = GetShmName(pszRegionName);
+        int fd = shm_open(m_shmName.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd != -1)
+        {
+            if (ftruncate(fd, static_cast<off_t>(RegionSize)) == 0)
+            {
+                void *region = mmap(NULL, RegionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (region != MAP_FAILED)
+                {
+                    m_region = region;
+                }
+            }
+            close(fd);
+        }
+        if (m_region == NULL)
+        {
+            shm_unlink(m_shmName.c_str());
+            m_shmName.clear();
+        }
+    }
+#endif
+
+    m_shared = (m_region != NULL);
+    if (!m_shared)
+    {
+        // Zeroed, like a fresh mapping.
+        m_region = new uint64_t[RegionSize / sizeof(uint64_t)]();
+    }
+
+    char *base = static_cast<char *>(m_region);
+    m_header = reinterpret_cast<Header *>(base);
+    m_descriptors = reinterpret_cast<Descriptor *>(base + sizeof(Header));
+    m_cells = reinterpret_cast<std::atomic<uint64_t> *>(
+        base + sizeof(Header) + MaxMetrics * sizeof(Descriptor));
+
+    m_header->shardCount = ShardCount;
+    m_header->cellsPerShard = CellsPerShard;
+    m_header->maxMetrics = MaxMetrics;
+    m_header->processId = GetCurrentProcessIdentifier();
+    m_header->version = Version;
+    m_header->metricCount.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_header->magic = Magic;
+}
+
+/**
+ *   Unmap and remove the region.
+ */
+MetricsRegistry::~MetricsRegistry(void)
+{
+    if (!m_shared)
+    {
+        delete[] static_cast<uint64_t *>(m_region);
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(m_region);
+    CloseHandle(m_mapping);
+#else
+    munmap(m_region, RegionSize);
+    shm_unlink(m_shmName.c_str());
+#endif
+}
+
+MetricCounter MetricsRegistry::GetCounter(const wchar_t *pszName)
+{
+    return MetricCounter(Register(pszName, MetricCounterType, 1));
+}
+
+MetricGauge MetricsRegistry::GetGauge(const wchar_t *pszName)
+{
+    return MetricGauge(Register(pszName, MetricGaugeType, 1));
+}
+
+MetricHistogram MetricsRegistry::GetHistogram(const wchar_t *pszName)
+{
+    return MetricHistogram(Register(pszName, MetricHistogramType, MetricHistogram::BucketCount + 1));
+}
+
+bool MetricsRegistry::IsShared(void) const
+{
+    return m_shared;
+}
+
+/**
+ *   Find a metric by name or register a new one. The descriptor is
+ *   written before the metric count is published, so a reader never sees
+ *   a half-written entry.
+ *
+ *   @param pszName - the name of the metric
+ *   @param type - the type of the metric
+ *   @param cells - the number of cells it needs in each shard
+ *   @return its first cell in shard 0, or NULL
+ */
+std::atomic<uint64_t> *MetricsRegistry::Register(const wchar_t *pszName, MetricType type, size_t cells)
+{
+    char szName[MaxNameLength + 1];
+    CopyName(szName, pszName);
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    uint32_t count = m_header->metricCount.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (strcmp(m_descriptors[i].name, szName) == 0)
+        {
+            return (m_descriptors[i].type == static_cast<uint32_t>(type))
+                       ? m_cells + m_descriptors[i].cell
+                       : NULL;
+        }
+    }
+
+    if (count == MaxMetrics || m_nextCell + cells > CellsPerShard)
+    {
+        return NULL;
+    }
+
+    Descriptor &descriptor = m_descriptors[count];
+    memcpy(descriptor.name, szName, sizeof(szName));
+    descriptor.type = type;
+    descriptor.cell = static_cast<uint32_t>(m_nextCell);
+    m_nextCell += cells;
+    m_header->metricCount.store(count + 1, std::memory_order_release);
+    return m_cells + descriptor.cell;
+}
+
+/**
+ *   Give the calling thread its shard. Threads are spread round robin, so
+ *   up to ShardCount threads update without sharing a cache line.
+ */
+size_t MetricsRegistry::AssignShard(void)
+{
+    static std::atomic<size_t> s_nextShard(0);
+    t_shard = s_nextShard.fetch_add(1, std::memory_order_relaxed) % ShardCount;
+    return t_shard;
+}
+
+/**
+ *   Read every metric of this registry, as a reader in another process
+ *   would see them.
+ */
+std::vector<MetricValue> MetricsRegistry::Read(void) const
+{
+    return ReadRegion(m_header);
+}
+
+/**
+ *   Read every metric, summing the shards of counters and histograms. The
+ *   values are read while the service keeps updating them, so a metric is
+ *   consistent on its own but not with the others.
+ *
+ *   @param region - the start of a mapped region
+ */
+std::vector<MetricValue> MetricsRegistry::ReadRegion(const void *region)
+{
+    std::vector<MetricValue> metrics;
+    const char *base = static_cast<const char *>(region);
+    const MetricsRegistry::Header *header = reinterpret_cast<const MetricsRegistry::Header *>(base);
+    const MetricsRegistry::Descriptor *descriptors =
+        reinterpret_cast<const MetricsRegistry::Descriptor *>(base + sizeof(MetricsRegistry::Header));
+    const std::atomic<uint64_t> *cells = reinterpret_cast<const std::atomic<uint64_t> *>(
+        base + sizeof(MetricsRegistry::Header) +
+        MetricsRegistry::MaxMetrics * sizeof(MetricsRegistry::Descriptor));
+
+    uint32_t count = header->metricCount.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < count && i < MetricsRegistry::MaxMetrics; i++)
+    {
+        const MetricsRegistry::Descriptor &descriptor = descriptors[i];
+        MetricValue metric;
+        metric.name.assign(descriptor.name, strnlen(descriptor.name, sizeof(descriptor.name)));
+        metric.type = static_cast<MetricType>(descriptor.type);
+        metric.value = 0;
+        metric.sum = 0;
+
+        switch (metric.type)
+        {
+        case MetricCounterType:
+            for (size_t shard = 0; shard < MetricsRegistry::ShardCount; shard++)
+            {
+                metric.value += static_cast<long long>(
+                    cells[shard * MetricsRegistry::CellsPerShard + descriptor.cell].load(std::memory_order_relaxed));
+            }
+            break;
+        case MetricGaugeType:
+            metric.value = static_cast<long long>(cells[descriptor.cell].load(std::memory_order_relaxed));
+            break;
+        case MetricHistogramType:
+            metric.buckets.assign(MetricHistogram::BucketCount, 0);
+            for (size_t shard = 0; shard < MetricsRegistry::ShardCount; shard++)
+            {
+                const std::atomic<uint64_t> *shardCells =
+                    cells + shard * MetricsRegistry::CellsPerShard + descriptor.cell;
+                for (size_t b = 0; b < MetricHistogram::BucketCount; b++)
+                {
+                    metric.buckets[b] += shardCells[b].load(std::memory_order_relaxed);
+                }
+                metric.sum += shardCells[MetricHistogram::BucketCount].load(std::memory_order_relaxed);
+            }
+            for (size_t b = 0; b < MetricHistogram::BucketCount; b++)
+            {
+                metric.value += static_cast<long long>(metric.buckets[b]);
+            }
+            break;
+        default:
+            continue;
+        }
+        metrics.push_back(metric);
+    }
+    return metrics;
+}
+
+#pragma endregion
+
+#pragma region Reader
+
+/**
+ *   Open and map the region of another process's default registry, read
+ *   only.
+ *
+ *   @param dwProcessId - the process id
+ */
+MetricsReader::MetricsReader(DWORD dwProcessId)
+    : m_header(NULL), m_region(NULL), m_size(0)
+{
+    std::wstring name = MetricsRegistry::GetRegionName(dwProcessId);
+    const void *region = NULL;
+#ifdef _WIN32
+    m_mapping = OpenFileMappingW(FILE_MAP_READ, FALSE, name.c_str());
+    if (m_mapping == NULL)
+    {
+        std::wstring local = std::wstring(L"Local\\") + (name.c_str() + 7);
+        m_mapping = OpenFileMappingW(FILE_MAP_READ, FALSE, local.c_str());
+    }
+    if (m_mapping == NULL)
+    {
+        return;
+    }
+    region = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (region == NULL)
+    {
+        return;
+    }
+    MEMORY_BASIC_INFORMATION info;
+    m_size = VirtualQuery(region, &info, sizeof(info)) ? info.RegionSize : 0;
+#else
+    int fd = shm_open(GetShmName(name.c_str()).c_str(), O_RDONLY, 0);
+    if (fd == -1)
+    {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void *mapped = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped != MAP_FAILED)
+        {
+            region = mapped;
+            m_size = static_cast<size_t>(st.st_size);
+        }
+    }
+    close(fd);
+    if (region == NULL)
+    {
+        return;
+    }
+#endif
+    m_region = region;
+
+    const MetricsRegistry::Header *header = static_cast<const MetricsRegistry::Header *>(region);
+    if (m_size >= MetricsRegistry::RegionSize &&
+        header->magic == MetricsRegistry::Magic &&
+        header->version == MetricsRegistry::Version &&
+        header->shardCount == MetricsRegistry::ShardCount &&
+        header->cellsPerShard == MetricsRegistry::CellsPerShard &&
+        header->maxMetrics == MetricsRegistry::MaxMetrics)
+    {
+        m_header = header;
+    }
+}
+
+MetricsReader::~MetricsReader(void)
+{
+    if (m_region == NULL)
+    {
+#ifdef _WIN32
+        if (m_mapping != NULL)
+            CloseHandle(m_mapping);
+#endif
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(m_region);
+    CloseHandle(m_mapping);
+#else
+    munmap(const_cast<void *>(m_region), m_size);
+#endif
+}
+
+std::vector<MetricValue> MetricsReader::Read(void) const
+{
+    if (m_header == NULL)
+    {
+        return std::vector<MetricValue>();
+    }
+    return MetricsRegistry::ReadRegion(m_region);
+}
+
+/**
+ *   Estimate a percentile of a histogram: the upper bound of the bucket
+ *   that holds it, so the true value is at most this and more than half
+ *   of it.
+ *
+ *   @param metric - a histogram
+ *   @param percentile - the percentile, 0 to 100
+ */
+unsigned long long MetricsReader::GetPercentile(const MetricValue &metric, double percentile)
+{
+    if (metric.value <= 0)
+    {
+        return 0;
+    }
+
+    unsigned long long rank = static_cast<unsigned long long>(percentile / 100.0 * metric.value + 0.5);
+    if (rank == 0)
+        rank = 1;
+
+    unsigned long long seen = 0;
+    for (size_t b = 0; b < metric.buckets.size(); b++)
+    {
+        seen += metric.buckets[b];
+        if (seen >= rank)
+        {
+            return (b == 0) ? 0 : (b >= 64) ? ~0ULL : (1ULL << b) - 1;
+        }
+    }
+    return ~0ULL;
+}
+
+/**
+ *   Describe a metric in one line: counters and gauges with their value,
+ *   histograms with their count, mean and estimated percentiles.
+ *
+ *   @param metric - the metric
+ *   @param pszBuffer - receives the line
+ *   @param cchBuffer - the size of the buffer, in characters
+ */
+void MetricsReader::Format(const MetricValue &metric, wchar_t *pszBuffer, size_t cchBuffer)
+{
+    std::wstring name(metric.name.begin(), metric.name.end());
+    switch (metric.type)
+    {
+    case MetricCounterType:
+        StringCchPrintf(pszBuffer, cchBuffer, L"%-40ls counter   %lld", name.c_str(), metric.value);
+        break;
+    case MetricGaugeType:
+        StringCchPrintf(pszBuffer, cchBuffer, L"%-40ls gauge     %lld", name.c_str(), metric.value);
+        break;
+    case MetricHistogramType:
+        StringCchPrintf(pszBuffer, cchBuffer,
+                        L"%-40ls histogram count %lld, mean %.1f, p50 <= %llu, p99 <= %llu, max <= %llu",
+                        name.c_str(), metric.value,
+                        (metric.value > 0) ? static_cast<double>(metric.sum) / metric.value : 0.0,
+                        GetPercentile(metric, 50),
+                        GetPercentile(metric, 99),
+                        GetPercentile(metric, 100));
+        break;
+    default:
+        StringCchPrintf(pszBuffer, cchBuffer, L"%-40ls", name.c_str());
+        break;
+    }
+}
+
+#pragma endregion
+
+#pragma region Command Line
+
+/**
+ *   Print the metrics of a process: counters and gauges with their value,
+ *   histograms with their count, mean and estimated percentiles.
+ *
+ *   @param dwProcessId - the process id
+ *   @return 0 on success, 1 if the process has no metrics region
+ */
+int PrintMetrics(DWORD dwProcessId)
+{
+    MetricsReader reader(dwProcessId);
+    if (!reader.IsOpen())
+    {
+        wprintf(L"No metrics found for process %lu.\n", dwProcessId);
+        return 1;
+    }
+
+    std::vector<MetricValue> metrics = reader.Read();
+    for (size_t i = 0; i < metrics.size(); i++)
+    {
+        wchar_t szLine[256];
+        MetricsReader::Format(metrics[i], szLine, ARRAYSIZE(szLine));
+        wprintf(L"%ls\n", szLine);
+    }
+    return 0;
+}
+
+#pragma endregion
@@ -0,0 +1,291 @@
+/*
+ * Counters, gauges and latency histograms in shared memory.
+ *
+ * The registry lays its metrics out in one memory region: a header, a
+ * table of metric descriptors and a number of shards of 64-bit cells. Each
+ * thread updates the cells of its own shard with relaxed atomic adds, so an
+ * update costs a few nanoseconds, takes no lock and makes no system call;
+ * threads in different shards never share a cache line. The process-wide
+ * registry maps the region as named shared memory, so another process
+ * (see MetricsReader, or "WinServ.exe -metrics <pid>") can read the
+ * metrics while the service runs, summing the shards as it goes.
+ *
+ * Registering a metric takes a lock and is meant to happen once, with the
+ * handle kept for the hot path. Asking for a name that already exists
+ * returns the same metric.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "Platform.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+class MetricsRegistry;
+
+enum MetricType
+{
+    MetricCounterType = 1,
+    MetricGaugeType = 2,
+    MetricHistogramType = 3
+};
+
+// The value of one metric, with its shards summed.
+struct MetricValue
+{
+    std::string name;
+    MetricType type;
+
+    // The count of a counter, the value of a gauge, or the number of values
+    // recorded by a histogram
+    long long value;
+
+    // For histograms: the bucket counts and the sum of the values
+    std::vector<unsigned long long> buckets;
+    unsigned long long sum;
+};
+
+// A monotonically increasing count. Sharded per thread.
+class MetricCounter
+{
+public:
+    MetricCounter(void) : m_cell(NULL) {}
+
+    void Increment(unsigned long long value = 1) const;
+
+private:
+    friend class MetricsRegistry;
+    explicit MetricCounter(std::atomic<uint64_t> *cell) : m_cell(cell) {}
+
+    std::atomic<uint64_t> *m_cell;
+};
+
+// A value that goes up and down, such as a queue length. A single cell
+// shared by all threads.
+class MetricGauge
+{
+public:
+    MetricGauge(void) : m_cell(NULL) {}
+
+    void Set(long long value) const;
+    void Add(long long value) const;
+
+private:
+    friend class MetricsRegistry;
+    explicit MetricGauge(std::atomic<uint64_t> *cell) : m_cell(cell) {}
+
+    std::atomic<uint64_t> *m_cell;
+};
+
+// The distribution of a value, typically a latency in microseconds, in
+// power-of-two buckets: bucket 0 counts zeros and bucket b counts values in
+// [2^(b-1), 2^b). Sharded per thread.
+class MetricHistogram
+{
+public:
+    static const size_t BucketCount = 65;
+
+    MetricHistogram(void) : m_cells(NULL) {}
+
+    void Record(unsigned long long value) const;
+
+private:
+    friend class MetricsRegistry;
+    explicit MetricHistogram(std::atomic<uint64_t> *cells) : m_cells(cells) {}
+
+    // BucketCount buckets followed by the sum of the values
+    std::atomic<uint64_t> *m_cells;
+};
+
+class MetricsRegistry
+{
+public:
+    static const size_t ShardCount = 16;
+    static const size_t CellsPerShard = 4096;
+    static const size_t MaxMetrics = 512;
+    static const size_t MaxNameLength = 55;
+
+    // Create a registry. With a region name the metrics are placed in named
+    // shared memory; without one, or if the region cannot be created, in
+    // private memory.
+    explicit MetricsRegistry(const wchar_t *pszRegionName = NULL);
+    ~MetricsRegistry(void);
+
+    MetricsRegistry(const MetricsRegistry &) = delete;
+    MetricsRegistry &operator=(const MetricsRegistry &) = delete;
+
+    // Find or register a metric. When the registry is full, or the name is
+    // taken by a metric of another type, the handle does nothing.
+    MetricCounter GetCounter(const wchar_t *pszName);
+    MetricGauge GetGauge(const wchar_t *pszName);
+    MetricHistogram GetHistogram(const wchar_t *pszName);
+
+    // True if the metrics can be read from other processes.
+    bool IsShared(void) const;
+
+    // Read every metric of this registry.
+    std::vector<MetricValue> Read(void) const;
+
+    // The process-wide registry, shared as GetRegionName(current process).
+    static MetricsRegistry &Default(void);
+
+    // The name of the shared region of a process's default registry.
+    static std::wstring GetRegionName(DWORD dwProcessId);
+
+    // The first cell of the calling thread's shard for a cell of shard 0.
+    static std::atomic<uint64_t> *GetLocalCell(std::atomic<uint64_t> *cell)
+    {
+        size_t shard = t_shard;
+        if (shard == static_cast<size_t>(-1))
+        {
+            shard = AssignShard();
+        }
+        return cell + shard * CellsPerShard;
+    }
+
+private:
+    friend class MetricsReader;
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t shardCount;
+        uint32_t cellsPerShard;
+        uint32_t maxMetrics;
+        uint32_t processId;
+        std::atomic<uint32_t> metricCount;
+        uint32_t reserved[9];
+    };
+
+    struct Descriptor
+    {
+        char name[MaxNameLength + 1];
+        uint32_t type;
+        uint32_t cell;
+    };
+
+    static const uint32_t Magic = 0x4D535657; // "WVSM"
+    static const uint32_t Version = 1;
+    static const size_t RegionSize =
+        sizeof(Header) + MaxMetrics * sizeof(Descriptor) +
+        ShardCount * CellsPerShard * sizeof(uint64_t);
+
+    // Read the metrics of a mapped region.
+    static std::vector<MetricValue> ReadRegion(const void *region);
+
+    // Find or register a metric, returning its first cell in shard 0.
+    std::atomic<uint64_t> *Register(const wchar_t *pszName, MetricType type, size_t cells);
+
+    // Give the calling thread the next shard, round robin.
+    static size_t AssignShard(void);
+
+    Header *m_header;
+    Descriptor *m_descriptors;
+    std::atomic<uint64_t> *m_cells;
+    size_t m_nextCell;
+    bool m_shared;
+    std::mutex m_lock;
+
+    // The memory behind the region
+    void *m_region;
+#ifdef _WIN32
+    HANDLE m_mapping;
+#else
+    std::string m_shmName;
+#endif
+
+    static thread_local size_t t_shard;
+};
+
+// Reads the metrics of another process from its shared region.
+class MetricsReader
+{
+public:
+    // Open the region of the default registry of a process.
+    explicit MetricsReader(DWORD dwProcessId);
+    ~MetricsReader(void);
+
+    MetricsReader(const MetricsReader &) = delete;
+    MetricsReader &operator=(const MetricsReader &) = delete;
+
+    // True if the region was found.
+    bool IsOpen(void) const { return m_header != NULL; }
+
+    // Read every metric.
+    std::vector<MetricValue> Read(void) const;
+
+    // The upper bound of the bucket that holds the given percentile.
+    static unsigned long long GetPercentile(const MetricValue &metric, double percentile);
+
+    // Describe a metric in one line: its name, type and value, or for a
+    // histogram its count, mean and percentiles.
+    static void Format(const MetricValue &metric, wchar_t *pszBuffer, size_t cchBuffer);
+
+private:
+    const MetricsRegistry::Header *m_header;
+    const void *m_region;
+    size_t m_size;
+#ifdef _WIN32
+    HANDLE m_mapping;
+#endif
+};
+
+// Print the metrics of a process to standard output. Returns a process
+// exit code.
+int PrintMetrics(DWORD dwProcessId);
+
+inline void MetricCounter::Increment(unsigned long long value) const
+{
+    if (m_cell != NULL)
+    {
+        MetricsRegistry::GetLocalCell(m_cell)->fetch_add(value, std::memory_order_relaxed);
+    }
+}
+
+inline void MetricGauge::Set(long long value) const
+{
+    if (m_cell != NULL)
+    {
+        m_cell->store(static_cast<uint64_t>(value), std::memory_order_relaxed);
+    }
+}
+
+inline void MetricGauge::Add(long long value) const
+{
+    if (m_cell != NULL)
+    {
+        m_cell->fetch_add(static_cast<uint64_t>(value), std::memory_order_relaxed);
+    }
+}
+
+inline void MetricHistogram::Record(unsigned long long value) const
+{
+    if (m_cells == NULL)
+    {
+        return;
+    }
+
+    size_t bucket = 0;
+    if (value != 0)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, value);
+        bucket = static_cast<size_t>(index) + 1;
+#else
+        bucket = 64 - static_cast<size_t>(__builtin_clzll(value));
+#endif
+    }
+
+    std::atomic<uint64_t> *cells = MetricsRegistry::GetLocalCell(m_cells);
+    cells[bucket].fetch_add(1, std::memory_order_relaxed);
+    cells[BucketCount].fetch_add(value, std::memory_order_relaxed);
+}
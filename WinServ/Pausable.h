@@ -0,0 +1,37 @@
+/*
+ * Something that can hold its work still while a service is paused.
+ *
+ * Pause stops it taking new work without tearing anything down: threads,
+ * connections and queued work stay where they are. Work that had already
+ * started runs on, and WaitUntilQuiet waits for it to finish. Resume picks
+ * up where it left off, starting with what was held back.
+ *
+ * ThreadPool, TimerService and SocketServer are pausable; a service hands
+ * the ones it wants held still to ServiceBase::AddPausable. Pauses nest,
+ * since services that share a process may share a pausable, such as the
+ * default thread pool: it stays paused until each Pause has had its
+ * Resume.
+ *
+ */
+
+#pragma once
+
+#include "Platform.h"
+
+class Pausable
+{
+public:
+    virtual ~Pausable(void) {}
+
+    // Stop taking new work. Returns at once; calling it again while paused
+    // only counts another pause.
+    virtual void Pause(void) = 0;
+
+    // Wait until the work started before Pause has finished. Returns false
+    // if it has not within dwMilliseconds (INFINITE to wait indefinitely).
+    virtual bool WaitUntilQuiet(DWORD dwMilliseconds) = 0;
+
+    // End one pause. Once every pause has ended, take new work again,
+    // starting with what was held back. Does nothing if not paused.
+    virtual void Resume(void) = 0;
+};
@@ -0,0 +1,130 @@
+/*
+ * Maps the Win32 types, constants and helpers used by the framework onto
+ * standard ones when building with a POSIX toolchain, so the service
+ * lifecycle can run outside Windows. On Windows this simply pulls in
+ * <windows.h>.
+ *
+ */
+
+#pragma once
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+#else
+
+#include <errno.h>
+#include <stdint.h>
+#include <wchar.h>
+
+typedef unsigned long DWORD;
+typedef unsigned short WORD;
+typedef unsigned long ULONG;
+typedef int BOOL;
+typedef void *HANDLE;
+typedef wchar_t *PWSTR;
+typedef wchar_t *LPWSTR;
+typedef const wchar_t *LPCWSTR;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define WINAPI
+
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+// The closest POSIX equivalents of the Win32 string helpers used here.
+#define StringCchPrintf swprintf
+#define _wcsicmp wcscasecmp
+
+// The last error of the calling thread.
+inline DWORD GetLastError(void)
+{
+    return static_cast<DWORD>(errno);
+}
+
+// Set the last error of the calling thread.
+inline void SetLastError(DWORD dwError)
+{
+    errno = static_cast<int>(dwError);
+}
+
+// Event types accepted by WriteEventLogEntry, with their Windows values.
+#define EVENTLOG_SUCCESS 0x0000
+#define EVENTLOG_ERROR_TYPE 0x0001
+#define EVENTLOG_WARNING_TYPE 0x0002
+#define EVENTLOG_INFORMATION_TYPE 0x0004
+#define EVENTLOG_AUDIT_SUCCESS 0x0008
+#define EVENTLOG_AUDIT_FAILURE 0x0010
+
+// Service types.
+#define SERVICE_WIN32_OWN_PROCESS 0x00000010
+#define SERVICE_WIN32_SHARE_PROCESS 0x00000020
+
+// Service start types.
+#define SERVICE_AUTO_START 0x00000002
+#define SERVICE_DEMAND_START 0x00000003
+#define SERVICE_DISABLED 0x00000004
+
+// Service states.
+#define SERVICE_STOPPED 0x00000001
+#define SERVICE_START_PENDING 0x00000002
+#define SERVICE_STOP_PENDING 0x00000003
+#define SERVICE_RUNNING 0x00000004
+#define SERVICE_CONTINUE_PENDING 0x00000005
+#define SERVICE_PAUSE_PENDING 0x00000006
+#define SERVICE_PAUSED 0x00000007
+
+// Controls accepted by a service.
+#define SERVICE_ACCEPT_STOP 0x00000001
+#define SERVICE_ACCEPT_PAUSE_CONTINUE 0x00000002
+#define SERVICE_ACCEPT_SHUTDOWN 0x00000004
+#define SERVICE_ACCEPT_PARAMCHANGE 0x00000008
+
+// Control codes sent to a service.
+#define SERVICE_CONTROL_STOP 0x00000001
+#define SERVICE_CONTROL_PAUSE 0x00000002
+#define SERVICE_CONTROL_CONTINUE 0x00000003
+#define SERVICE_CONTROL_INTERROGATE 0x00000004
+#define SERVICE_CONTROL_SHUTDOWN 0x00000005
+#define SERVICE_CONTROL_PARAMCHANGE 0x00000006
+#define SERVICE_CONTROL_NETBINDADD 0x00000007
+#define SERVICE_CONTROL_NETBINDREMOVE 0x00000008
+#define SERVICE_CONTROL_NETBINDENABLE 0x00000009
+#define SERVICE_CONTROL_NETBINDDISABLE 0x0000000A
+
+typedef struct _SERVICE_STATUS
+{
+    DWORD dwServiceType;
+    DWORD dwCurrentState;
+    DWORD dwControlsAccepted;
+    DWORD dwWin32ExitCode;
+    DWORD dwServiceSpecificExitCode;
+    DWORD dwCheckPoint;
+    DWORD dwWaitHint;
+} SERVICE_STATUS;
+
+// Win32 error codes used by the framework, with their Windows values.
+#define NO_ERROR 0L
+#define ERROR_NOT_ENOUGH_MEMORY 8L
+#define ERROR_INVALID_DATA 13L
+#define ERROR_WRITE_FAULT 29L
+#define ERROR_READ_FAULT 30L
+#define ERROR_INVALID_PARAMETER 87L
+#define ERROR_CALL_NOT_IMPLEMENTED 120L
+#define ERROR_OPERATION_ABORTED 995L
+#define ERROR_INVALID_SERVICE_CONTROL 1052L
+#define ERROR_SERVICE_CANNOT_ACCEPT_CTRL 1061L
+#define ERROR_SERVICE_NOT_ACTIVE 1062L
+#define ERROR_TIMEOUT 1460L
+
+// A timeout that never expires.
+#define INFINITE 0xFFFFFFFF
+
+#endif
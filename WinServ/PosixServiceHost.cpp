@@ -0,0 +1,469 @@
+#pragma region Includes
+#include "PosixServiceHost.h"
+#pragma endregion
+
+#ifndef _WIN32
+
+#pragma region Includes
+#include <chrono>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "Logger.h"
+#pragma endregion
+
+namespace
+{
+    // The signals the host turns into control codes.
+    void FillSignalSet(sigset_t *signals)
+    {
+        sigemptyset(signals);
+        sigaddset(signals, SIGTERM);
+        sigaddset(signals, SIGINT);
+        sigaddset(signals, SIGHUP);
+        sigaddset(signals, SIGUSR1);
+        sigaddset(signals, SIGUSR2);
+        sigaddset(signals, SIGRTMIN);
+    }
+
+    // The sd_notify STATUS= text for a service state.
+    const char *GetStateText(DWORD dwState)
+    {
+        switch (dwState)
+        {
+        case SERVICE_STOPPED:
+            return "Stopped";
+        case SERVICE_START_PENDING:
+            return "Starting";
+        case SERVICE_STOP_PENDING:
+            return "Stopping";
+        case SERVICE_RUNNING:
+            return "Running";
+        case SERVICE_CONTINUE_PENDING:
+            return "Continuing";
+        case SERVICE_PAUSE_PENDING:
+            return "Pausing";
+        case SERVICE_PAUSED:
+            return "Paused";
+        default:
+            return "Unknown";
+        }
+    }
+}
+
+#pragma region Host Constructor and Destructor
+
+PosixServiceHost::PosixServiceHost(void)
+    : m_dwCount(0), m_ready(false), m_stopping(false),
+      m_wakeFd(-1), m_notifyFd(-1)
+{
+}
+
+PosixServiceHost::~PosixServiceHost(void)
+{
+    CloseDescriptors();
+}
+
+#pragma endregion
+
+#pragma region Host
+
+/**
+ *   Block the signals the host handles in the calling thread. Threads
+ *   inherit the mask of the thread that creates them, so calling this at the
+ *   top of main, before the thread pool, logger or timer threads start,
+ *   leaves the signals to the signalfd read by Run.
+ */
+void PosixServiceHost::BlockSignals(void)
+{
+    sigset_t signals;
+    FillSignalSet(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+/**
+ *   Start the services on the calling thread, one after the other, and
+ *   then turn the signals the process receives into control codes until
+ *   every service has stopped. Between signals the loop sends the
+ *   watchdog keep-alives, so that they keep going while the services are
+ *   paused or the thread pool is saturated.
+ *
+ *   @param services - the services to run
+ *   @param dwCount - the number of services
+ *
+ *   @return If the function succeeds, the return value is TRUE. If the
+ *   function fails, the return value is FALSE. To get extended error
+ *   information, call GetLastError.
+ */
+BOOL PosixServiceHost::Run(ServiceBase *const *services, DWORD dwCount)
+{
+    m_entries.reset(new Entry[dwCount]);
+    m_dwCount = dwCount;
+    for (DWORD i = 0; i < dwCount; i++)
+    {
+        m_entries[i].service = services[i];
+        m_entries[i].dwCurrentState.store(SERVICE_STOPPED);
+        m_entries[i].dwControlsAccepted.store(0);
+    }
+    m_ready.store(false);
+    m_stopping.store(false);
+
+    sigset_t signals;
+    FillSignalSet(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    int signalFd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if (signalFd == -1)
+    {
+        return FALSE;
+    }
+
+    m_wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_wakeFd == -1)
+    {
+        int error = errno;
+        close(signalFd);
+        errno = error;
+        return FALSE;
+    }
+
+    OpenNotifySocket();
+
+    DWORD dwWatchdog = GetWatchdogInterval();
+    bool fWatchdog = dwWatchdog != 0 && m_notifyFd != -1;
+    std::chrono::milliseconds keepAliveInterval(dwWatchdog / 2);
+    std::chrono::steady_clock::time_point nextKeepAlive =
+        std::chrono::steady_clock::now() + keepAliveInterval;
+
+    // Start each service with its name as the only argument, as the SCM
+    // does when no start parameters are given.
+    for (DWORD i = 0; i < dwCount; i++)
+    {
+        PWSTR pszArgv[] = {GetName(*services[i]), NULL};
+        Start(*services[i], 1, pszArgv);
+    }
+
+    while (!AllInState(SERVICE_STOPPED))
+    {
+        int timeout = -1;
+        if (fWatchdog)
+        {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now >= nextKeepAlive)
+            {
+                Notify("WATCHDOG=1");
+                nextKeepAlive = now + keepAliveInterval;
+            }
+            // Round up, so that the loop does not wake just short of the
+            // deadline and spin until it passes.
+            timeout = static_cast<int>(
+                std::chrono::duration_cast<std::chrono::milliseconds>(nextKeepAlive - now).count() + 1);
+        }
+
+        pollfd fds[2] = {{signalFd, POLLIN, 0}, {m_wakeFd, POLLIN, 0}};
+        int count = poll(fds, 2, timeout);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if (count == 0)
+        {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            signalfd_siginfo info;
+            if (read(signalFd, &info, sizeof(info)) == sizeof(info))
+            {
+                for (DWORD i = 0; i < dwCount; i++)
+                {
+                    DWORD dwCtrl = MapSignal(m_entries[i], static_cast<int>(info.ssi_signo), info.ssi_int);
+                    if (dwCtrl != 0)
+                    {
+                        Control(*services[i], dwCtrl);
+                    }
+                }
+            }
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            eventfd_t value;
+            eventfd_read(m_wakeFd, &value);
+        }
+    }
+
+    close(signalFd);
+    CloseDescriptors();
+    return TRUE;
+}
+
+/**
+ *   Close the wake eventfd and the notify socket. A report that is
+ *   writing to one is waited for, and later ones find them closed.
+ */
+void PosixServiceHost::CloseDescriptors(void)
+{
+    std::lock_guard<std::mutex> guard(m_fdLock);
+    int wakeFd = m_wakeFd.exchange(-1);
+    if (wakeFd != -1)
+    {
+        close(wakeFd);
+    }
+    int notifyFd = m_notifyFd.exchange(-1);
+    if (notifyFd != -1)
+    {
+        close(notifyFd);
+    }
+}
+
+/**
+ *   Record the state of a service, pass it on to the service manager and
+ *   wake the control loop when a service has stopped. Services may report
+ *   from any thread, for example when one stops itself.
+ *
+ *   @param service - the service that changed state
+ *   @param status - its new status
+ */
+void PosixServiceHost::ReportStatus(ServiceBase &service, const SERVICE_STATUS &status)
+{
+    Entry *entry = FindEntry(service);
+    if (entry == NULL)
+    {
+        return;
+    }
+    entry->dwControlsAccepted.store(status.dwControlsAccepted);
+    entry->dwCurrentState.store(status.dwCurrentState);
+
+    if (m_notifyFd != -1)
+    {
+        // The process is ready once all of its services are running, and
+        // stopping as soon as any of them is.
+        const char *pszPrefix = "";
+        if (status.dwCurrentState == SERVICE_RUNNING && AllInState(SERVICE_RUNNING) &&
+            !m_ready.exchange(true))
+        {
+            pszPrefix = "READY=1\n";
+        }
+        else if (status.dwCurrentState == SERVICE_STOP_PENDING && !m_stopping.exchange(true))
+        {
+            pszPrefix = "STOPPING=1\n";
+        }
+
+        char szMessage[256];
+        int length = snprintf(szMessage, sizeof(szMessage), "%sSTATUS=%ls: %s", pszPrefix,
+                              GetName(service), GetStateText(status.dwCurrentState));
+
+        // Ask for more time when a pending operation says it needs it.
+        if (status.dwWaitHint != 0 && length > 0 && length < static_cast<int>(sizeof(szMessage)))
+        {
+            snprintf(szMessage + length, sizeof(szMessage) - length,
+                     "\nEXTEND_TIMEOUT_USEC=%llu",
+                     static_cast<unsigned long long>(status.dwWaitHint) * 1000);
+        }
+        Notify(szMessage);
+    }
+
+    if (status.dwCurrentState == SERVICE_STOPPED)
+    {
+        std::lock_guard<std::mutex> guard(m_fdLock);
+        int wakeFd = m_wakeFd.load();
+        if (wakeFd != -1)
+        {
+            eventfd_write(wakeFd, 1);
+        }
+    }
+}
+
+#pragma endregion
+
+#pragma region Helper Functions
+
+/**
+ *   Map a signal to the control code it stands for, taking into account
+ *   the controls a service accepts in its current state.
+ *
+ *   @param entry - the service
+ *   @param signal - the signal number
+ *   @param value - the value queued with the signal, if any
+ *   @return the control code, or 0 if the signal should be ignored
+ */
+DWORD PosixServiceHost::MapSignal(const Entry &entry, int signal, int value)
+{
+    DWORD dwAccepted = entry.dwControlsAccepted.load();
+    DWORD dwState = entry.dwCurrentState.load();
+
+    // User-defined controls reach a service only while it runs or is
+    // paused, as with the SCM.
+    if (signal == SIGUSR2 || signal == SIGRTMIN)
+    {
+        if (dwState != SERVICE_RUNNING && dwState != SERVICE_PAUSED)
+        {
+            return 0;
+        }
+        if (signal == SIGUSR2)
+        {
+            return ServiceBase::ControlDumpMetrics;
+        }
+        return (value >= static_cast<int>(ServiceBase::FirstUserControl) &&
+                value <= static_cast<int>(ServiceBase::LastUserControl))
+                   ? static_cast<DWORD>(value)
+                   : 0;
+    }
+
+    switch (signal)
+    {
+    case SIGTERM:
+    case SIGINT:
+        return (dwAccepted & SERVICE_ACCEPT_STOP) ? SERVICE_CONTROL_STOP : 0;
+    case SIGHUP:
+        return (dwAccepted & SERVICE_ACCEPT_PARAMCHANGE) ? SERVICE_CONTROL_PARAMCHANGE : 0;
+    case SIGUSR1:
+        if ((dwAccepted & SERVICE_ACCEPT_PAUSE_CONTINUE) == 0)
+        {
+            return 0;
+        }
+        return (dwState == SERVICE_PAUSED) ? SERVICE_CONTROL_CONTINUE
+                                           : SERVICE_CONTROL_PAUSE;
+    default:
+        return 0;
+    }
+}
+
+/**
+ *   Check whether every service has reached a state.
+ *
+ *   @param dwState - the state
+ */
+bool PosixServiceHost::AllInState(DWORD dwState) const
+{
+    for (DWORD i = 0; i < m_dwCount; i++)
+    {
+        if (m_entries[i].dwCurrentState.load() != dwState)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ *   Find the entry of a service.
+ *
+ *   @param service - the service
+ *   @return its entry, or NULL if it does not run under this host
+ */
+PosixServiceHost::Entry *PosixServiceHost::FindEntry(const ServiceBase &service)
+{
+    for (DWORD i = 0; i < m_dwCount; i++)
+    {
+        if (m_entries[i].service == &service)
+        {
+            return &m_entries[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ *   Send a message to the service manager. Failures are ignored: the
+ *   protocol is advisory and the service runs the same without it. The
+ *   send does not wait for room, since it holds the lock the control loop
+ *   needs to be woken.
+ *
+ *   @param pszMessage - newline-separated VARIABLE=value assignments
+ */
+void PosixServiceHost::Notify(const char *pszMessage)
+{
+    std::lock_guard<std::mutex> guard(m_fdLock);
+    int notifyFd = m_notifyFd.load();
+    if (notifyFd != -1)
+    {
+        send(notifyFd, pszMessage, strlen(pszMessage), MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+}
+
+/**
+ *   Connect a datagram socket to the address in NOTIFY_SOCKET. A leading
+ *   '@' names a socket in the abstract namespace.
+ */
+void PosixServiceHost::OpenNotifySocket(void)
+{
+    const char *pszPath = getenv("NOTIFY_SOCKET");
+    if (pszPath == NULL || (pszPath[0] != '/' && pszPath[0] != '@'))
+    {
+        return;
+    }
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    size_t length = strlen(pszPath);
+    if (length >= sizeof(address.sun_path))
+    {
+        return;
+    }
+    memcpy(address.sun_path, pszPath, length);
+    if (address.sun_path[0] == '@')
+    {
+        address.sun_path[0] = '\0';
+    }
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return;
+    }
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address),
+                static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + length)) == -1)
+    {
+        close(fd);
+        return;
+    }
+    m_notifyFd = fd;
+}
+
+/**
+ *   Read the keep-alive interval from WATCHDOG_USEC. It only applies to
+ *   this process if WATCHDOG_PID is unset or names it.
+ *
+ *   @return the interval in milliseconds, or 0 if there is no watchdog
+ */
+DWORD PosixServiceHost::GetWatchdogInterval(void)
+{
+    const char *pszUsec = getenv("WATCHDOG_USEC");
+    if (pszUsec == NULL)
+    {
+        return 0;
+    }
+
+    const char *pszPid = getenv("WATCHDOG_PID");
+    if (pszPid != NULL && strtol(pszPid, NULL, 10) != static_cast<long>(getpid()))
+    {
+        return 0;
+    }
+
+    unsigned long long usec = strtoull(pszUsec, NULL, 10);
+    if (usec < 2000)
+    {
+        return 0;
+    }
+    return static_cast<DWORD>(usec / 1000);
+}
+
+#pragma endregion
+
+#endif
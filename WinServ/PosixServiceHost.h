@@ -0,0 +1,112 @@
+/*
+ * Runs services as a plain Linux process.
+ *
+ * Signals stand in for the control codes of the Service Control Manager:
+ *
+ *   SIGTERM, SIGINT  SERVICE_CONTROL_STOP
+ *   SIGHUP           SERVICE_CONTROL_PARAMCHANGE
+ *   SIGUSR1          SERVICE_CONTROL_PAUSE, or SERVICE_CONTROL_CONTINUE
+ *                    when the service is paused
+ *   SIGUSR2          ServiceBase::ControlDumpMetrics
+ *   SIGRTMIN         the user-defined control code (128 to 255) queued
+ *                    with the signal, as in "kill -q 129 -s RTMIN <pid>"
+ *
+ * A signal is delivered to every service that runs in the process;
+ * services that do not accept the control ignore it, as with the SCM. The
+ * signals are read from a signalfd on the thread that calls Run, so every
+ * control is handled on that one thread, in order. Call BlockSignals first
+ * thing in main, before any thread is created, so that no other thread
+ * receives them.
+ *
+ * When the process is started by systemd with Type=notify, the host also
+ * speaks the sd_notify protocol: READY=1 once every service is running,
+ * STOPPING=1 when one starts to stop, a STATUS= line for every state,
+ * EXTEND_TIMEOUT_USEC= for pending states with a wait hint, and
+ * WATCHDOG=1 keep-alives at half the WatchdogSec= interval. The
+ * keep-alives are sent by the control loop itself, not by the shared
+ * timer service or thread pool, so that a paused or busy service still
+ * sends them.
+ *
+ */
+
+#pragma once
+
+#ifndef _WIN32
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include "ServiceHost.h"
+
+class PosixServiceHost : public ServiceHost
+{
+public:
+    PosixServiceHost(void);
+    ~PosixServiceHost(void);
+
+    PosixServiceHost(const PosixServiceHost &) = delete;
+    PosixServiceHost &operator=(const PosixServiceHost &) = delete;
+
+    // Block the signals the host handles in the calling thread, and so in
+    // every thread it creates later.
+    static void BlockSignals(void);
+
+    using ServiceHost::Run;
+
+    BOOL Run(ServiceBase *const *services, DWORD dwCount);
+
+    void ReportStatus(ServiceBase &service, const SERVICE_STATUS &status);
+
+private:
+    struct Entry
+    {
+        ServiceBase *service;
+
+        // The last reported state and the controls accepted in it
+        std::atomic<DWORD> dwCurrentState;
+        std::atomic<DWORD> dwControlsAccepted;
+    };
+
+    // Turn a signal into a control code for a service, or 0 to ignore it.
+    static DWORD MapSignal(const Entry &entry, int signal, int value);
+
+    // True once every service has reached the given state.
+    bool AllInState(DWORD dwState) const;
+
+    // Find the entry of a service, or NULL.
+    Entry *FindEntry(const ServiceBase &service);
+
+    // Send a message to the service manager, if there is one.
+    void Notify(const char *pszMessage);
+
+    // Connect to the socket named by NOTIFY_SOCKET, if it is set.
+    void OpenNotifySocket(void);
+
+    // Close the wake eventfd and the notify socket, once no report is
+    // writing to them.
+    void CloseDescriptors(void);
+
+    // The interval at which the service manager expects keep-alives, in
+    // milliseconds, or 0 if it does not watch the process.
+    static DWORD GetWatchdogInterval(void);
+
+    // The services
+    std::unique_ptr<Entry[]> m_entries;
+    DWORD m_dwCount;
+
+    // Whether READY=1 and STOPPING=1 have been sent
+    std::atomic<bool> m_ready;
+    std::atomic<bool> m_stopping;
+
+    // Wakes the control loop when the service has stopped
+    std::atomic<int> m_wakeFd;
+
+    // The datagram socket to the service manager, or -1
+    std::atomic<int> m_notifyFd;
+
+    // Held while a descriptor above is written to, and while Run closes
+    // them: services and timers may still report as it does
+    std::mutex m_fdLock;
+};
+
+#endif
@@ -0,0 +1,168 @@
+#pragma region Includes
+#include "ScmServiceHost.h"
+#pragma endregion
+
+#ifdef _WIN32
+
+#pragma region Static Members
+
+// Initialize the running host.
+ScmServiceHost *ScmServiceHost::s_host = NULL;
+
+/**
+ *   Entry point for a service. The SCM passes the name of the service
+ *   as the first argument; it is used to find the service, register its
+ *   handler function and start it.
+ *
+ *   @param dwArgc: number of command line arguments
+ *   @param lpszArgv: array of command line arguments
+ */
+void WINAPI ScmServiceHost::ServiceMain(DWORD dwArgc, PWSTR *pszArgv)
+{
+    Entry *entry = (dwArgc > 0) ? s_host->FindEntry(pszArgv[0]) : NULL;
+    if (entry == NULL)
+    {
+        if (s_host->m_entries.size() != 1)
+        {
+            throw static_cast<DWORD>(ERROR_INVALID_PARAMETER);
+        }
+        entry = &s_host->m_entries[0];
+    }
+
+    // Register the handler function for the service, with the service as
+    // its context so that controls reach the right one.
+    SERVICE_STATUS_HANDLE statusHandle = RegisterServiceCtrlHandlerEx(
+        GetName(*entry->service), ServiceCtrlHandler, entry->service);
+    if (statusHandle == NULL)
+    {
+        throw GetLastError();
+    }
+    {
+        std::lock_guard<std::mutex> guard(s_host->m_lock);
+        entry->statusHandle = statusHandle;
+    }
+
+    // Start the service.
+    Start(*entry->service, dwArgc, pszArgv);
+}
+
+/**
+ *   This function is called by the SCM whenever a control code is
+ *   sent to a service. It hands the code to the service it was
+ *   registered for and returns without waiting for it to be applied, so
+ *   the dispatcher thread stays free for the other services.
+ *
+ *   @param dwCtrl: the control code
+ *   @param dwEventType: the type of event, for device and session controls
+ *   @param lpEventData: additional event data
+ *   @param lpContext: the service
+ *   @return NO_ERROR once the service has accepted the control, which it
+ *   does without waiting for the transition, or the reason it was rejected
+ */
+DWORD WINAPI ScmServiceHost::ServiceCtrlHandler(DWORD dwCtrl,
+                                                DWORD dwEventType,
+                                                LPVOID lpEventData,
+                                                LPVOID lpContext)
+{
+    return Control(*static_cast<ServiceBase *>(lpContext), dwCtrl);
+}
+
+#pragma endregion
+
+#pragma region Host
+
+/**
+ *   Register the executable for the services with the Service Control
+ *   Manager (SCM). After you call Run, the SCM issues a Start command for
+ *   each service that is started, which results in a call to the OnStart
+ *   method of that service. This method blocks until every service has
+ *   stopped.
+ *
+ *   @param services - the services to run
+ *   @param dwCount - the number of services
+ *
+ *   @return If the function succeeds, the return value is TRUE. If the
+ *   function fails, the return value is FALSE. To get extended error
+ *   information, call GetLastError.
+ */
+BOOL ScmServiceHost::Run(ServiceBase *const *services, DWORD dwCount)
+{
+    m_entries.clear();
+    std::vector<SERVICE_TABLE_ENTRY> serviceTable;
+    for (DWORD i = 0; i < dwCount; i++)
+    {
+        Entry entry = {services[i], NULL};
+        m_entries.push_back(entry);
+
+        SERVICE_TABLE_ENTRY tableEntry = {GetName(*services[i]), ServiceMain};
+        serviceTable.push_back(tableEntry);
+    }
+    SERVICE_TABLE_ENTRY last = {NULL, NULL};
+    serviceTable.push_back(last);
+
+    s_host = this;
+
+    // Connects the main thread of a service process to the service control
+    // manager, which causes the thread to be the service control dispatcher
+    // thread for the calling process. This call returns when the services
+    // have stopped. The process should simply terminate when the call
+    // returns.
+    BOOL fResult = StartServiceCtrlDispatcher(&serviceTable[0]);
+
+    s_host = NULL;
+    return fResult;
+}
+
+/**
+ *   Report the status of a service to the SCM through its own status
+ *   handle.
+ *
+ *   @param service - the service that changed state
+ *   @param status - its new status
+ */
+void ScmServiceHost::ReportStatus(ServiceBase &service, const SERVICE_STATUS &status)
+{
+    SERVICE_STATUS_HANDLE statusHandle = NULL;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        for (size_t i = 0; i < m_entries.size(); i++)
+        {
+            if (m_entries[i].service == &service)
+            {
+                statusHandle = m_entries[i].statusHandle;
+                break;
+            }
+        }
+    }
+    if (statusHandle != NULL)
+    {
+        ::SetServiceStatus(statusHandle, const_cast<SERVICE_STATUS *>(&status));
+    }
+}
+
+#pragma endregion
+
+#pragma region Helper Functions
+
+/**
+ *   Find the entry of a service by name. Service names are not case
+ *   sensitive.
+ *
+ *   @param pszName - the name of the service
+ *   @return the entry, or NULL if no service has that name
+ */
+ScmServiceHost::Entry *ScmServiceHost::FindEntry(const wchar_t *pszName)
+{
+    for (size_t i = 0; i < m_entries.size(); i++)
+    {
+        if (_wcsicmp(GetName(*m_entries[i].service), pszName) == 0)
+        {
+            return &m_entries[i];
+        }
+    }
+    return NULL;
+}
+
+#pragma endregion
+
+#endif
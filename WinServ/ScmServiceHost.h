@@ -0,0 +1,61 @@
+/*
+ * Runs services under the Windows Service Control Manager (SCM).
+ *
+ * The main thread becomes the service control dispatcher; the SCM calls
+ * ServiceMain on a thread of its own to start each service and the control
+ * handler for every control code it sends. Each service registers its own
+ * handler, with the service as its context, and gets its own status
+ * handle, so any number of services can share the process.
+ *
+ */
+
+#pragma once
+
+#ifdef _WIN32
+
+#include <mutex>
+#include <vector>
+#include "ServiceHost.h"
+
+class ScmServiceHost : public ServiceHost
+{
+public:
+    using ServiceHost::Run;
+
+    BOOL Run(ServiceBase *const *services, DWORD dwCount);
+
+    void ReportStatus(ServiceBase &service, const SERVICE_STATUS &status);
+
+private:
+    struct Entry
+    {
+        ServiceBase *service;
+        SERVICE_STATUS_HANDLE statusHandle;
+    };
+
+    // Entry point for a service. It registers the handler function for the
+    // service and starts the service.
+    static void WINAPI ServiceMain(DWORD dwArgc, LPWSTR *lpszArgv);
+
+    // The function is called by the SCM whenever a control code is sent to
+    // a service. The context is the service.
+    static DWORD WINAPI ServiceCtrlHandler(DWORD dwCtrl,
+                                           DWORD dwEventType,
+                                           LPVOID lpEventData,
+                                           LPVOID lpContext);
+
+    // Find the entry of a service by name, or NULL.
+    Entry *FindEntry(const wchar_t *pszName);
+
+    // The host that is running. ServiceMain carries no context, so there
+    // can be only one per process.
+    static ScmServiceHost *s_host;
+
+    // The services, with their status handles once registered. Each
+    // ServiceMain thread sets its handle while other services report
+    // status, so the handles are read and written under m_lock.
+    std::vector<Entry> m_entries;
+    std::mutex m_lock;
+};
+
+#endif
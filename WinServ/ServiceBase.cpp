@@ -1,22 +1,28 @@
 #pragma region Includes
 #include "ServiceBase.h"
-#include <assert.h>
+#include "Logger.h"
+#include "ServiceHost.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+#include <string.h>
+#ifdef _WIN32
 #include <strsafe.h>
+#include "ScmServiceHost.h"
+#else
+#include "PosixServiceHost.h"
+#endif
 #pragma endregion
 
 #pragma region Static Members
 
-// Initialize the singleton service instance.
-ServiceBase *ServiceBase::s_service = NULL;
-
 /**
- *   Register the executable for a service with the Service Control
- *   Manager (SCM). After you call Run(ServiceBase), the SCM issues a Start
- *   command, which results in a call to the OnStart method in the service.
- *   This method blocks until the service has stopped.
+ *   Run the service under the default host for the platform: the Service
+ *   Control Manager (SCM) on Windows, signals on POSIX systems. After you
+ *   call Run(ServiceBase), the host issues a Start command, which results
+ *   in a call to the OnStart method in the service. This method blocks
+ *   until the service has stopped.
  *
- *   @param service the reference to a ServiceBase object. It will become the
- *   singleton service instance of this service application.
+ *   @param service the reference to a ServiceBase object.
  *
  *   @return If the function succeeds, the return value is TRUE. If the
  *   function fails, the return value is FALSE. To get extended error
@@ -24,84 +30,467 @@ ServiceBase *ServiceBase::s_service = NULL;
  */
 BOOL ServiceBase::Run(ServiceBase &service)
 {
-    s_service = &service;
+    ServiceBase *services[] = {&service};
+    return Run(services, 1);
+}
 
-    SERVICE_TABLE_ENTRY serviceTable[] =
-        {
-            {service.m_name, ServiceMain},
-            {NULL, NULL}};
+/**
+ *   Run the service under the given host. This method blocks until the
+ *   service has stopped.
+ *
+ *   @param service - the service to run
+ *   @param host - the host that starts, controls and observes the service
+ *
+ *   @return TRUE if the service ran, FALSE on failure (see GetLastError).
+ */
+BOOL ServiceBase::Run(ServiceBase &service, ServiceHost &host)
+{
+    ServiceBase *services[] = {&service};
+    return Run(services, 1, host);
+}
 
-    // Connects the main thread of a service process to the service control
-    // manager, which causes the thread to be the service control dispatcher
-    // thread for the calling process. This call returns when the service has
-    // stopped. The process should simply terminate when the call returns.
-    return StartServiceCtrlDispatcher(serviceTable);
+/**
+ *   Run several services in this process under the default host for the
+ *   platform. Each service is started, controlled and reports its status
+ *   on its own; they share the process-wide thread pool, timer service
+ *   and logger. This method blocks until every service has stopped.
+ *
+ *   @param services - the services to run
+ *   @param dwCount - the number of services
+ *
+ *   @return TRUE if the services ran, FALSE on failure (see GetLastError).
+ */
+BOOL ServiceBase::Run(ServiceBase *const *services, DWORD dwCount)
+{
+#ifdef _WIN32
+    ScmServiceHost host;
+#else
+    PosixServiceHost host;
+#endif
+    return Run(services, dwCount, host);
 }
 
 /**
- *   Entry point for the service. It registers the handler function
- *   for the service and starts the service.
+ *   Run several services in this process under the given host. With more
+ *   than one service they are registered as sharing the process
+ *   (SERVICE_WIN32_SHARE_PROCESS). This method blocks until every service
+ *   has stopped.
  *
- *   @param dwArgc: number of command line arguments
- *   @param lpszArgv: array of command line arguments
+ *   @param services - the services to run
+ *   @param dwCount - the number of services
+ *   @param host - the host that starts, controls and observes the services
+ *
+ *   @return TRUE if the services ran, FALSE on failure (see GetLastError).
  */
-void WINAPI ServiceBase::ServiceMain(DWORD dwArgc, PWSTR *pszArgv)
+BOOL ServiceBase::Run(ServiceBase *const *services, DWORD dwCount, ServiceHost &host)
 {
-    assert(s_service != NULL);
+    if (services == NULL || dwCount == 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
 
-    // Register the handler function for the service
-    s_service->m_statusHandle = RegisterServiceCtrlHandler(
-        s_service->m_name, ServiceCtrlHandler);
-    if (s_service->m_statusHandle == NULL)
+    for (DWORD i = 0; i < dwCount; i++)
     {
-        throw GetLastError();
+        std::lock_guard<std::mutex> guard(services[i]->m_statusLock);
+        services[i]->m_host = &host;
+        services[i]->m_fReported = false;
+        services[i]->m_status.dwServiceType =
+            (dwCount > 1) ? SERVICE_WIN32_SHARE_PROCESS : SERVICE_WIN32_OWN_PROCESS;
+        services[i]->m_statusSnapshot.Store(services[i]->m_status);
     }
 
-    // Start the service.
-    s_service->Start(dwArgc, pszArgv);
+    BOOL fResult = host.Run(services, dwCount);
+
+    for (DWORD i = 0; i < dwCount; i++)
+    {
+        services[i]->JoinControlThread();
+
+        std::lock_guard<std::mutex> guard(services[i]->m_statusLock);
+        services[i]->m_host = NULL;
+        services[i]->m_fReportPending = false;
+    }
+    return fResult;
 }
 
+#pragma endregion
+
+#pragma region Service Control
+
 /**
- *   This function is called by the SCM whenever a control code is
- *   sent to the service.
+ *   Accept a control code sent to the service by its host. Stop, pause,
+ *   continue and shutdown are queued to the control thread, which applies
+ *   them one at a time, so the thread that delivers controls (the SCM
+ *   dispatcher, or the signal loop of the POSIX host) returns at once
+ *   instead of waiting for OnStop or OnPause.
  *
- *   @param dwCtrlCode: the control code. This parameter can be one of the
+ *   @param dwCtrl: the control code. This parameter can be one of the
  *   following values:
  *
  *     SERVICE_CONTROL_CONTINUE
  *     SERVICE_CONTROL_INTERROGATE
- *     SERVICE_CONTROL_NETBINDADD
- *     SERVICE_CONTROL_NETBINDDISABLE
- *     SERVICE_CONTROL_NETBINDREMOVE
  *     SERVICE_CONTROL_PARAMCHANGE
  *     SERVICE_CONTROL_PAUSE
  *     SERVICE_CONTROL_SHUTDOWN
  *     SERVICE_CONTROL_STOP
  *
  *   This parameter can also be a user-defined control code ranges from 128
- *   to 255.
+ *   to 255; its registered handler runs on the thread pool.
+ *
+ *   @return NO_ERROR if the control was accepted, ERROR_CALL_NOT_IMPLEMENTED
+ *   if the service does not handle it, or the error from QueueTransition.
  */
-void WINAPI ServiceBase::ServiceCtrlHandler(DWORD dwCtrl)
+DWORD ServiceBase::Control(DWORD dwCtrl)
 {
+    m_controls.Increment();
+    Trace::Instant("Control", "control", "code", dwCtrl);
+
+    DWORD dwError = ERROR_CALL_NOT_IMPLEMENTED;
     switch (dwCtrl)
     {
     case SERVICE_CONTROL_STOP:
-        s_service->Stop();
-        break;
     case SERVICE_CONTROL_PAUSE:
-        s_service->Pause();
-        break;
     case SERVICE_CONTROL_CONTINUE:
-        s_service->Continue();
-        break;
     case SERVICE_CONTROL_SHUTDOWN:
-        s_service->Shutdown();
+        dwError = QueueTransition(dwCtrl);
         break;
     case SERVICE_CONTROL_INTERROGATE:
+        // The host reports the current status itself.
+        dwError = NO_ERROR;
+        break;
+    case SERVICE_CONTROL_PARAMCHANGE:
+        dwError = DispatchParamChange();
         break;
     default:
+        if (dwCtrl >= FirstUserControl && dwCtrl <= LastUserControl)
+        {
+            dwError = DispatchUserControl(dwCtrl);
+        }
         break;
     }
+
+    if (dwError != NO_ERROR)
+    {
+        m_controlsRejected.Increment();
+    }
+    return dwError;
+}
+
+/**
+ *   Queue the handler of a user-defined control code to the thread pool,
+ *   so that the thread that delivers controls (the SCM dispatcher, or the
+ *   signal loop of the POSIX host) is never held up by it. Handlers that
+ *   are still queued when the service is asked to stop are skipped.
+ *
+ *   @param dwCtrl - a control code from FirstUserControl to LastUserControl
+ *   @return NO_ERROR, or ERROR_CALL_NOT_IMPLEMENTED if the code has no
+ *   handler
+ */
+DWORD ServiceBase::DispatchUserControl(DWORD dwCtrl)
+{
+    ControlHandler handler;
+    {
+        std::lock_guard<std::mutex> guard(m_controlLock);
+        handler = m_controlHandlers[dwCtrl - FirstUserControl];
+        if (!handler)
+        {
+            return ERROR_CALL_NOT_IMPLEMENTED;
+        }
+    }
+
+    m_userControls.Increment();
+    QueueControl(dwCtrl, std::move(handler));
+    return NO_ERROR;
+}
+
+/**
+ *   Queue a reload of the configuration to the thread pool. A change
+ *   notification that arrives while a reload is still queued is merged into
+ *   it: the queued reload reads the file as it is by then.
+ *
+ *   @return NO_ERROR, or ERROR_CALL_NOT_IMPLEMENTED if the service has no
+ *   configuration
+ */
+DWORD ServiceBase::DispatchParamChange(void)
+{
+    if (m_config == NULL)
+    {
+        return ERROR_CALL_NOT_IMPLEMENTED;
+    }
+
+    if (m_fReloadQueued.exchange(true))
+    {
+        m_controlsCoalesced.Increment();
+        return NO_ERROR;
+    }
+    QueueControl(SERVICE_CONTROL_PARAMCHANGE, [this](DWORD) { ReloadConfig(); });
+    return NO_ERROR;
+}
+
+/**
+ *   Queue the handler of a control code to the thread pool. Handlers that
+ *   are still queued when the service is asked to stop are skipped.
+ *
+ *   @param dwCtrl - the control code
+ *   @param handler - its handler
+ */
+void ServiceBase::QueueControl(DWORD dwCtrl, ControlHandler handler)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_controlLock);
+        m_controlsInFlight++;
+    }
+
+    StopToken token = GetStopToken();
+
+    // The control ends when the queued work is destroyed: after it ran, or
+    // when the pool refused or shed it.
+    std::shared_ptr<void> inFlight(nullptr, [this](void *) {
+        std::lock_guard<std::mutex> guard(m_controlLock);
+        if (--m_controlsInFlight == 0)
+        {
+            m_controlsIdle.notify_all();
+        }
+    });
+
+    // High priority, so that controls are handled promptly while the pool
+    // is saturated with other work.
+    ThreadPool::Default().Submit([this, dwCtrl, handler, token, inFlight]() {
+        if (!token.StopRequested())
+        {
+            HandleUserControl(dwCtrl, handler);
+        }
+    }, PriorityHigh);
+}
+
+/**
+ *   Run the handler of a control code, logging what it throws.
+ *
+ *   @param dwCtrl - the control code
+ *   @param handler - its handler
+ */
+void ServiceBase::HandleUserControl(DWORD dwCtrl, const ControlHandler &handler)
+{
+    TraceSpan span("HandleControl", "control", "code", dwCtrl);
+    try
+    {
+        handler(dwCtrl);
+    }
+    catch (DWORD dwError)
+    {
+        // Log the error.
+        WriteErrorLogEntry(L"Service Control", dwError);
+    }
+    catch (...)
+    {
+        // Log the error.
+        WriteEventLogEntry(L"Service failed to handle a control.", EVENTLOG_ERROR_TYPE);
+    }
+}
+
+/**
+ *   Handle a user-defined control code with the given function.
+ *
+ *   @param dwCtrl - a control code from FirstUserControl to LastUserControl
+ *   @param handler - the function to run on the thread pool when the code
+ *   is received, or an empty function to ignore the code
+ */
+void ServiceBase::RegisterControlHandler(DWORD dwCtrl, ControlHandler handler)
+{
+    if (dwCtrl < FirstUserControl || dwCtrl > LastUserControl)
+    {
+        throw static_cast<DWORD>(ERROR_INVALID_PARAMETER);
+    }
+
+    std::lock_guard<std::mutex> guard(m_controlLock);
+    m_controlHandlers[dwCtrl - FirstUserControl] = std::move(handler);
+}
+
+#pragma endregion
+
+#pragma region Control Thread
+
+/**
+ *   Queue a transition for the control thread. The control is checked
+ *   against the state the service will be in once the transitions already
+ *   queued are applied: one that leads where the service is already
+ *   heading (a second stop, a pause of a service that is pausing) is
+ *   coalesced into it, and one that cannot follow (a pause while
+ *   stopping) is rejected. A stop or shutdown signals the stop token at
+ *   once, so a start or transition in progress winds down early, and
+ *   supersedes the pauses and continues still queued.
+ *
+ *   @param dwCtrl - SERVICE_CONTROL_STOP, SERVICE_CONTROL_SHUTDOWN,
+ *   SERVICE_CONTROL_PAUSE or SERVICE_CONTROL_CONTINUE
+ *   @return NO_ERROR if the control was queued or coalesced,
+ *   ERROR_INVALID_SERVICE_CONTROL if the service does not accept it,
+ *   ERROR_SERVICE_CANNOT_ACCEPT_CTRL if it cannot follow the current or
+ *   queued transitions, or ERROR_SERVICE_NOT_ACTIVE if the service has
+ *   stopped
+ */
+DWORD ServiceBase::QueueTransition(DWORD dwCtrl)
+{
+    std::chrono::steady_clock::time_point requested = std::chrono::steady_clock::now();
+    SERVICE_STATUS status = GetStatus();
+    bool fStop = (dwCtrl == SERVICE_CONTROL_STOP || dwCtrl == SERVICE_CONTROL_SHUTDOWN);
+    DWORD dwRequired = (dwCtrl == SERVICE_CONTROL_STOP) ? SERVICE_ACCEPT_STOP
+                       : (dwCtrl == SERVICE_CONTROL_SHUTDOWN) ? SERVICE_ACCEPT_SHUTDOWN
+                                                              : SERVICE_ACCEPT_PAUSE_CONTINUE;
+    if ((status.dwControlsAccepted & dwRequired) == 0)
+    {
+        return ERROR_INVALID_SERVICE_CONTROL;
+    }
+
+    std::lock_guard<std::mutex> guard(m_queueLock);
+    DWORD dwTargetState = GetTargetState();
+    if (dwTargetState == SERVICE_STOPPED)
+    {
+        if (!m_fTransitioning && status.dwCurrentState == SERVICE_STOPPED)
+        {
+            return ERROR_SERVICE_NOT_ACTIVE;
+        }
+        if (!fStop)
+        {
+            return ERROR_SERVICE_CANNOT_ACCEPT_CTRL;
+        }
+        m_controlsCoalesced.Increment();
+        return NO_ERROR;
+    }
+
+    if (fStop)
+    {
+        for (size_t i = 0; i < m_queuedControls.size(); i++)
+        {
+            m_controlsCoalesced.Increment();
+        }
+        m_queuedControls.clear();
+        m_stopSource.RequestStop();
+        m_dwTargetState = SERVICE_STOPPED;
+    }
+    else
+    {
+        DWORD dwNewState = (dwCtrl == SERVICE_CONTROL_PAUSE) ? SERVICE_PAUSED : SERVICE_RUNNING;
+        if (dwTargetState == dwNewState)
+        {
+            m_controlsCoalesced.Increment();
+            return NO_ERROR;
+        }
+        if (dwTargetState != SERVICE_RUNNING && dwTargetState != SERVICE_PAUSED)
+        {
+            return ERROR_SERVICE_CANNOT_ACCEPT_CTRL;
+        }
+        m_dwTargetState = dwNewState;
+    }
+
+    QueuedControl control = {dwCtrl, requested};
+    m_queuedControls.push_back(control);
+    m_fTransitioning = true;
+    if (!m_controlThread.joinable())
+    {
+        m_fControlThreadExit = false;
+        m_controlThread = std::thread(&ServiceBase::ControlLoop, this);
+    }
+    m_queueChanged.notify_all();
+    return NO_ERROR;
+}
+
+/**
+ *   The state the service is heading for: where the queued transitions
+ *   lead, or else where the current state settles. Called with
+ *   m_queueLock held.
+ */
+DWORD ServiceBase::GetTargetState(void) const
+{
+    if (m_fTransitioning)
+    {
+        return m_dwTargetState;
+    }
+
+    DWORD dwState = GetStatus().dwCurrentState;
+    switch (dwState)
+    {
+    case SERVICE_STOP_PENDING:
+        return SERVICE_STOPPED;
+    case SERVICE_PAUSE_PENDING:
+        return SERVICE_PAUSED;
+    case SERVICE_CONTINUE_PENDING:
+        return SERVICE_RUNNING;
+    default:
+        return dwState;
+    }
+}
+
+/**
+ *   The body of the control thread. It applies the queued transitions in
+ *   order, one at a time and never while Start is running. A transition
+ *   that no longer fits the state the service is in, such as a continue
+ *   after a pause that failed, is skipped.
+ */
+void ServiceBase::ControlLoop(void)
+{
+    Trace::SetThreadName("service control");
+    std::unique_lock<std::mutex> lock(m_queueLock);
+    for (;;)
+    {
+        m_queueChanged.wait(lock, [this]() {
+            return m_fControlThreadExit || (!m_queuedControls.empty() && !m_fStarting);
+        });
+        if (m_fControlThreadExit)
+        {
+            break;
+        }
+
+        QueuedControl control = m_queuedControls.front();
+        m_queuedControls.pop_front();
+        lock.unlock();
+
+        DWORD dwState = GetStatus().dwCurrentState;
+        switch (control.dwCtrl)
+        {
+        case SERVICE_CONTROL_STOP:
+            if (dwState != SERVICE_STOPPED)
+                Stop(control.requested);
+            break;
+        case SERVICE_CONTROL_SHUTDOWN:
+            if (dwState != SERVICE_STOPPED)
+                Shutdown(control.requested);
+            break;
+        case SERVICE_CONTROL_PAUSE:
+            if (dwState == SERVICE_RUNNING)
+                Pause();
+            break;
+        case SERVICE_CONTROL_CONTINUE:
+            if (dwState == SERVICE_PAUSED)
+                Continue();
+            break;
+        }
+
+        lock.lock();
+        if (m_queuedControls.empty())
+        {
+            m_fTransitioning = false;
+        }
+    }
+
+    m_queuedControls.clear();
+    m_fTransitioning = false;
+}
+
+/**
+ *   Stop the control thread, dropping anything still queued. Called once
+ *   the host has returned, when every service has stopped.
+ */
+void ServiceBase::JoinControlThread(void)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_queueLock);
+        m_fControlThreadExit = true;
+        m_queueChanged.notify_all();
+    }
+    if (m_controlThread.joinable())
+    {
+        m_controlThread.join();
+    }
 }
 
 #pragma endregion
@@ -128,7 +517,9 @@ ServiceBase::ServiceBase(PWSTR pszServiceName,
     // Service name must be a valid string and cannot be NULL.
     m_name = (pszServiceName == NULL) ? const_cast<PWSTR>(L"") : pszServiceName;
 
-    m_statusHandle = NULL;
+    m_host = NULL;
+    m_logger = &Logger::Default();
+    m_tracePath = std::wstring(m_name) + L".trace.json";
 
     // The service runs in its own process.
     m_status.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
@@ -150,6 +541,53 @@ ServiceBase::ServiceBase(PWSTR pszServiceName,
     m_status.dwServiceSpecificExitCode = 0;
     m_status.dwCheckPoint = 0;
     m_status.dwWaitHint = 0;
+    m_statusSnapshot.Store(m_status);
+    m_dwCheckPoint = 1;
+
+    m_reportedStatus = m_status;
+    m_fReported = false;
+    m_fReportPending = false;
+    m_statusFlushTimer = 0;
+
+    // Metrics, named after the service.
+    MetricsRegistry &metrics = MetricsRegistry::Default();
+    std::wstring prefix = std::wstring(m_name) + L".";
+    m_controls = metrics.GetCounter((prefix + L"controls").c_str());
+    m_userControls = metrics.GetCounter((prefix + L"user_controls").c_str());
+    m_controlsCoalesced = metrics.GetCounter((prefix + L"controls_coalesced").c_str());
+    m_controlsRejected = metrics.GetCounter((prefix + L"controls_rejected").c_str());
+    m_statusReports = metrics.GetCounter((prefix + L"status_reports").c_str());
+    m_statusCoalesced = metrics.GetCounter((prefix + L"status_coalesced").c_str());
+    m_drainsAborted = metrics.GetCounter((prefix + L"drains_aborted").c_str());
+    m_configReloads = metrics.GetCounter((prefix + L"config_reloads").c_str());
+    m_state = metrics.GetGauge((prefix + L"state").c_str());
+    m_startLatency = metrics.GetHistogram((prefix + L"start_us").c_str());
+    m_stopLatency = metrics.GetHistogram((prefix + L"stop_us").c_str());
+    m_pauseLatency = metrics.GetHistogram((prefix + L"pause_us").c_str());
+
+    m_dwStopLatencyBudget = 100;
+    m_dwLastStopLatency = 0;
+
+    m_fPaused = false;
+    m_dwPauseTimeout = 30000;
+
+    m_dwStopDeadline = 20000;
+    m_dwShutdownDeadline = 5000;
+
+    m_config = NULL;
+    m_fReloadQueued = false;
+
+    m_dwTargetState = SERVICE_STOPPED;
+    m_fTransitioning = false;
+    m_fStarting = false;
+    m_fControlThreadExit = false;
+
+    // The built-in user-defined controls.
+    m_controlsInFlight = 0;
+    m_controlHandlers[ControlFlushCaches - FirstUserControl] = [this](DWORD) { OnFlushCaches(); };
+    m_controlHandlers[ControlRotateLogs - FirstUserControl] = [this](DWORD) { m_logger->Rotate(); };
+    m_controlHandlers[ControlDumpMetrics - FirstUserControl] = [this](DWORD) { DumpMetrics(); };
+    m_controlHandlers[ControlDumpTrace - FirstUserControl] = [this](DWORD) { DumpTrace(); };
 }
 
 /**
@@ -157,6 +595,24 @@ ServiceBase::ServiceBase(PWSTR pszServiceName,
  */
 ServiceBase::~ServiceBase(void)
 {
+    // Make sure a held-back status report does not fire on a destroyed
+    // service.
+    TimerService::TimerId timer;
+    {
+        std::lock_guard<std::mutex> guard(m_statusLock);
+        timer = m_statusFlushTimer;
+        m_fReportPending = false;
+    }
+    if (timer != 0)
+    {
+        TimerService::Default().Cancel(timer);
+    }
+
+    JoinControlThread();
+
+    // Wait for the handlers of user-defined controls that are still
+    // queued or running.
+    WaitForControls(INFINITE);
 }
 
 #pragma endregion
@@ -175,16 +631,56 @@ ServiceBase::~ServiceBase(void)
  */
 void ServiceBase::Start(DWORD dwArgc, PWSTR *pszArgv)
 {
+    TraceSpan span("Start", "service");
+    std::chrono::steady_clock::time_point requested = std::chrono::steady_clock::now();
+    {
+        // Hold back queued transitions until Start returns. A service
+        // started again after a stop gets a fresh stop token.
+        std::lock_guard<std::mutex> guard(m_queueLock);
+        m_fStarting = true;
+        if (m_stopSource.StopRequested())
+        {
+            m_stopSource = StopSource();
+        }
+    }
+
     try
     {
         // Tell SCM that the service is starting.
         SetServiceStatus(SERVICE_START_PENDING);
 
+        // Read the configuration, so that OnStart sees the current
+        // settings. A malformed file fails the start.
+        if (m_config != NULL)
+        {
+            TraceSpan loadSpan("LoadConfig", "service");
+            m_fReloadQueued = false;
+            if (!LoadConfig())
+            {
+                wchar_t szMessage[260];
+                StringCchPrintf(szMessage, ARRAYSIZE(szMessage),
+                                L"Configuration file %ls not found; using the defaults",
+                                m_config->GetPath().c_str());
+                WriteEventLogEntry(szMessage, EVENTLOG_INFORMATION_TYPE);
+            }
+        }
+
         // Perform service-specific initialization.
-        OnStart(dwArgc, pszArgv);
+        m_startupStages.Clear();
+        {
+            TraceSpan startSpan("OnStart", "service");
+            OnStart(dwArgc, pszArgv);
+        }
+
+        // Run the startup stages OnStart declared, reporting progress.
+        RunStartupStages();
 
         // Tell SCM that the service is started.
         SetServiceStatus(SERVICE_RUNNING);
+        m_startLatency.Record(static_cast<unsigned long long>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - requested)
+                .count()));
     }
     catch (DWORD dwError)
     {
@@ -202,16 +698,20 @@ void ServiceBase::Start(DWORD dwArgc, PWSTR *pszArgv)
         // Set the service status to be stopped.
         SetServiceStatus(SERVICE_STOPPED);
     }
+
+    std::lock_guard<std::mutex> guard(m_queueLock);
+    m_fStarting = false;
+    m_queueChanged.notify_all();
 }
 
 /**
  *   When implemented in a derived class, executes when a Start
  *   command is sent to the service by the SCM or when the operating system
  *   starts (for a service that starts automatically). Specifies actions to
- *   take when the service starts. Be sure to periodically call
- *   ServiceBase::SetServiceStatus() with SERVICE_START_PENDING if the
- *   procedure is going to take long time. You may also consider spawning a
- *   new thread in OnStart to perform time-consuming initialization tasks.
+ *   take when the service starts. Time-consuming initialization is best
+ *   declared as startup stages with AddStartupStage(): they run in
+ *   parallel where their dependencies allow, and the start pending status
+ *   is kept up to date for you.
  *
  *   @param dwArgc   - number of command line arguments
  *   @param lpszArgv - array of command line arguments
@@ -221,24 +721,37 @@ void ServiceBase::OnStart(DWORD dwArgc, PWSTR *pszArgv)
 }
 
 /**
- *   This function stops the service. It calls the OnStop virtual
- *   function in which you can specify the actions to take when the service
- *   stops. If an error occurs, the error will be logged in the Application
- *   event log, and the service will be restored to the original state.
+ *   This function stops the service. It signals the stop token and then
+ *   calls the OnStop virtual function in which you can specify the actions
+ *   to take when the service stops, followed by the drain steps, all within
+ *   the stop deadline (see Drain). If an error occurs, the error will be
+ *   logged in the Application event log, and the service will be restored
+ *   to the original state (the stop token stays signalled).
  */
 void ServiceBase::Stop()
 {
-    DWORD dwOriginalState = m_status.dwCurrentState;
+    Stop(std::chrono::steady_clock::now());
+}
+
+/**
+ *   Stop the service for a stop control.
+ *
+ *   @param requested - when the control was accepted; the stop latency is
+ *   measured from then to SERVICE_STOPPED
+ */
+void ServiceBase::Stop(std::chrono::steady_clock::time_point requested)
+{
+    TraceSpan span("Stop", "service");
+    DWORD dwOriginalState = GetStatus().dwCurrentState;
     try
     {
-        // Tell SCM that the service is stopping.
-        SetServiceStatus(SERVICE_STOP_PENDING);
-
-        // Perform service-specific stop operations.
-        OnStop();
+        // Stop taking work, perform service-specific stop operations and
+        // write out the metrics and the log, reporting progress to SCM.
+        Drain(false);
 
         // Tell SCM that the service is stopped.
         SetServiceStatus(SERVICE_STOPPED);
+        ReportStopLatency(requested);
     }
     catch (DWORD dwError)
     {
@@ -272,14 +785,18 @@ void ServiceBase::OnStop()
 /**
  *   This function pauses the service if the service supports pause
  *   and continue. It calls the OnPause virtual function in which you can
- *   specify the actions to take when the service pauses. If an error occurs,
- *   the error will be logged in the Application event log, and the service
- *   will become running.
+ *   specify the actions to take when the service pauses, then pauses the
+ *   pausables and reports SERVICE_PAUSED once their work in flight has
+ *   finished. If an error occurs, or the work does not finish within the
+ *   pause timeout, the error will be logged in the Application event log,
+ *   and the service will become running.
  *
  *   @param: none
  */
 void ServiceBase::Pause()
 {
+    TraceSpan span("Pause", "service");
+    std::chrono::steady_clock::time_point requested = std::chrono::steady_clock::now();
     try
     {
         // Tell SCM that the service is pausing.
@@ -288,6 +805,19 @@ void ServiceBase::Pause()
         // Perform service-specific pause operations.
         OnPause();
 
+        // Hold the pausables still and wait for their work in flight.
+        if (!PausePausables())
+        {
+            // Carry on running rather than report a pause that has not
+            // happened.
+            OnContinue();
+            throw static_cast<DWORD>(ERROR_TIMEOUT);
+        }
+        m_pauseLatency.Record(static_cast<unsigned long long>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - requested)
+                .count()));
+
         // Tell SCM that the service is paused.
         SetServiceStatus(SERVICE_PAUSED);
     }
@@ -324,13 +854,18 @@ void ServiceBase::OnPause()
  *   This function resumes normal functioning after being paused if
  *   the service supports pause and continue. It calls the OnContinue virtual
  *   function in which you can specify the actions to take when the service
- *   continues. If an error occurs, the error will be logged in the
- *   Application event log, and the service will still be paused.
+ *   continues, reports SERVICE_RUNNING and then resumes the pausables.
+ *   Their threads never stopped, so the held work starts at once. Resuming
+ *   cannot fail or block, so it follows the report: otherwise the workers
+ *   it wakes would hold up the report on a busy machine. If an error
+ *   occurs, the error will be logged in the Application event log, and the
+ *   service will still be paused.
  *
  *   @param: none
  */
 void ServiceBase::Continue()
 {
+    TraceSpan span("Continue", "service");
     try
     {
         // Tell SCM that the service is resuming.
@@ -341,6 +876,9 @@ void ServiceBase::Continue()
 
         // Tell SCM that the service is running.
         SetServiceStatus(SERVICE_RUNNING);
+
+        // Let the pausables take work again.
+        ResumePausables();
     }
     catch (DWORD dwError)
     {
@@ -371,23 +909,204 @@ void ServiceBase::OnContinue()
 {
 }
 
+/**
+ *   Pause every pausable, then wait for each in turn to finish its work
+ *   in flight. The wait is cut into slices, and the service reports
+ *   SERVICE_PAUSE_PENDING with a new checkpoint after each one, so that the
+ *   host can tell a slow pause from a hung one.
+ *
+ *   @return true if the work finished within the pause timeout
+ */
+bool ServiceBase::PausePausables(void)
+{
+    std::vector<Pausable *> pausables;
+    {
+        // Marked paused first, so that a stop arriving meanwhile resumes
+        // whatever has been paused so far.
+        std::lock_guard<std::mutex> guard(m_pauseLock);
+        pausables = m_pausables;
+        m_pausedPausables = pausables;
+        m_fPaused = true;
+    }
+    for (size_t i = 0; i < pausables.size(); i++)
+    {
+        pausables[i]->Pause();
+    }
+
+    DWORD dwTimeout = m_dwPauseTimeout;
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(dwTimeout);
+    for (size_t i = 0; i < pausables.size(); i++)
+    {
+        for (;;)
+        {
+            DWORD dwSlice = PauseProgressInterval;
+            if (dwTimeout != INFINITE)
+            {
+                long long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+                if (remaining <= 0)
+                {
+                    ResumePausables();
+                    return false;
+                }
+                if (remaining < static_cast<long long>(dwSlice))
+                {
+                    dwSlice = static_cast<DWORD>(remaining);
+                }
+            }
+
+            if (pausables[i]->WaitUntilQuiet(dwSlice))
+            {
+                break;
+            }
+            SetServiceStatus(SERVICE_PAUSE_PENDING, NO_ERROR, 2 * PauseProgressInterval);
+        }
+    }
+    return true;
+}
+
+/**
+ *   Resume the pausables the service paused, in the reverse of the order
+ *   they were paused, if it has paused them. Pauses nest, so each gets one
+ *   Resume for its one Pause, and one added since is left alone.
+ */
+void ServiceBase::ResumePausables(void)
+{
+    std::vector<Pausable *> pausables;
+    {
+        std::lock_guard<std::mutex> guard(m_pauseLock);
+        if (!m_fPaused)
+        {
+            return;
+        }
+        m_fPaused = false;
+        pausables.swap(m_pausedPausables);
+    }
+    for (size_t i = pausables.size(); i > 0; i--)
+    {
+        pausables[i - 1]->Resume();
+    }
+}
+
+/**
+ *   Drain the service when it stops or the system shuts down, reporting
+ *   SERVICE_STOP_PENDING with the time left before the deadline as the
+ *   wait hint, at every step and every DrainCoordinator::ProgressInterval
+ *   ms. The steps: stop the intake (signal the stop token and resume the
+ *   pausables, so that held work sees the stop), OnStop or OnShutdown, the
+ *   steps added with AddDrainStep, the handlers of user-defined controls,
+ *   the metrics of the service and the log. Past the point where only the
+ *   reserve is left, the drain takes the abort path: the intake and OnStop
+ *   or OnShutdown still run, if they had not yet, the metrics are skipped,
+ *   and the log gets what is left of the time. The stop latency is
+ *   recorded by the caller once SERVICE_STOPPED has been reported.
+ *
+ *   @param fShutdown - true if the system is shutting down
+ */
+void ServiceBase::Drain(bool fShutdown)
+{
+    DWORD dwDeadline = fShutdown ? m_dwShutdownDeadline.load() : m_dwStopDeadline.load();
+
+    // Tell SCM that the service is stopping, and how long it may take.
+    SetServiceStatus(SERVICE_STOP_PENDING, NO_ERROR, (dwDeadline != INFINITE) ? dwDeadline : 0);
+
+    auto stopIntake = [this](DWORD) {
+        // Tell worker code to wind down, interrupting its waits. A paused
+        // service stops too; the held work has to see the stop and drain.
+        // The source is copied under the lock so that its callbacks do not
+        // run with it held.
+        StopSource source;
+        {
+            std::lock_guard<std::mutex> guard(m_queueLock);
+            source = m_stopSource;
+        }
+        source.RequestStop();
+        ResumePausables();
+    };
+    auto stopService = [this, fShutdown](DWORD) {
+        // Perform service-specific stop or shutdown operations.
+        if (fShutdown)
+            OnShutdown();
+        else
+            OnStop();
+    };
+
+    m_drain.Clear();
+    m_drain.Add(L"intake", [stopIntake](DWORD dwMilliseconds) { stopIntake(dwMilliseconds); return true; },
+                stopIntake);
+    m_drain.Add(fShutdown ? L"OnShutdown" : L"OnStop",
+                [stopService](DWORD dwMilliseconds) { stopService(dwMilliseconds); return true; },
+                stopService);
+    m_drain.Add(m_drainSteps);
+    m_drain.Add(L"control handlers", [this](DWORD dwMilliseconds) { return WaitForControls(dwMilliseconds); });
+    m_drain.Add(L"metrics", [this](DWORD) {
+        DumpMetrics(true);
+        return true;
+    });
+    m_drain.Add(L"log", [this](DWORD dwMilliseconds) { return m_logger->Flush(dwMilliseconds); },
+                [this](DWORD dwMilliseconds) {
+                    // Say what was cut short, then write out what the
+                    // reserve allows.
+                    wchar_t szMessage[260];
+                    StringCchPrintf(szMessage, ARRAYSIZE(szMessage),
+                                    L"Service drain ran out of time in step %ls; the steps left were aborted",
+                                    m_drain.GetAbortedStep().c_str());
+                    WriteEventLogEntry(szMessage, EVENTLOG_WARNING_TYPE);
+                    m_logger->Flush(dwMilliseconds);
+                });
+
+    bool fDrained = m_drain.Run(dwDeadline, [this](DWORD dwWaitHint) {
+        SetServiceStatus(SERVICE_STOP_PENDING, NO_ERROR, dwWaitHint);
+    });
+    if (!fDrained)
+    {
+        m_drainsAborted.Increment();
+    }
+}
+
+/**
+ *   Wait for the handlers of user-defined controls that are queued or
+ *   running.
+ *
+ *   @param dwMilliseconds - the longest wait, or INFINITE
+ *   @return true if none is left
+ */
+bool ServiceBase::WaitForControls(DWORD dwMilliseconds)
+{
+    std::unique_lock<std::mutex> lock(m_controlLock);
+    auto idle = [this]() { return m_controlsInFlight == 0; };
+    if (dwMilliseconds == INFINITE)
+    {
+        m_controlsIdle.wait(lock, idle);
+        return true;
+    }
+    return m_controlsIdle.wait_for(lock, std::chrono::milliseconds(dwMilliseconds), idle);
+}
+
 /**
  *   This function executes when the system is shutting down. It
  *   calls the OnShutdown virtual function in which you can specify what
- *   should occur immediately prior to the system shutting down. If an error
- *   occurs, the error will be logged in the Application event log.
+ *   should occur immediately prior to the system shutting down, followed by
+ *   the drain steps, all within the shutdown deadline (see Drain). If an
+ *   error occurs, the error will be logged in the Application event log.
  *
- *   @param: none
+ *   @param requested - when the control was accepted; the stop latency is
+ *   measured from then to SERVICE_STOPPED
  */
-void ServiceBase::Shutdown()
+void ServiceBase::Shutdown(std::chrono::steady_clock::time_point requested)
 {
+    TraceSpan span("Shutdown", "service");
     try
     {
-        // Perform service-specific shutdown operations.
-        OnShutdown();
+        // Stop taking work, perform service-specific shutdown operations
+        // and write out the metrics and the log before the system goes
+        // down, reporting progress to SCM.
+        Drain(true);
 
         // Tell SCM that the service is stopped.
         SetServiceStatus(SERVICE_STOPPED);
+        ReportStopLatency(requested);
     }
     catch (DWORD dwError)
     {
@@ -412,13 +1131,103 @@ void ServiceBase::OnShutdown()
 {
 }
 
+/**
+ *   When implemented in a derived class, executes on the thread pool when
+ *   the ControlFlushCaches control is sent to the service. Specifies which
+ *   caches to drop or write back.
+ *
+ *   @param: none
+ */
+void ServiceBase::OnFlushCaches()
+{
+}
+
+/**
+ *   When implemented in a derived class, executes on the thread pool once
+ *   the configuration has been reloaded on a SERVICE_CONTROL_PARAMCHANGE.
+ *   Specifies how to apply the new settings.
+ *
+ *   @param: none
+ */
+void ServiceBase::OnParamChange()
+{
+}
+
+/**
+ *   Load the configuration, logging why it could not be.
+ *
+ *   @return false if the file does not exist
+ */
+bool ServiceBase::LoadConfig(void)
+{
+    try
+    {
+        return m_config->Load();
+    }
+    catch (DWORD dwError)
+    {
+        if (dwError == ERROR_INVALID_DATA)
+        {
+            wchar_t szMessage[260];
+            StringCchPrintf(szMessage, ARRAYSIZE(szMessage),
+                            L"Configuration file %ls, line %lu: not a setting",
+                            m_config->GetPath().c_str(), m_config->GetErrorLine());
+            WriteEventLogEntry(szMessage, EVENTLOG_ERROR_TYPE);
+        }
+        else
+        {
+            WriteErrorLogEntry(L"Configuration load", dwError);
+        }
+        throw;
+    }
+}
+
+/**
+ *   Reload the configuration on a SERVICE_CONTROL_PARAMCHANGE and let the
+ *   service apply it. If the file is missing or malformed, the service
+ *   keeps the settings it has.
+ */
+void ServiceBase::ReloadConfig(void)
+{
+    // A change notified from here on queues another reload.
+    m_fReloadQueued = false;
+
+    wchar_t szMessage[260];
+    try
+    {
+        if (!LoadConfig())
+        {
+            StringCchPrintf(szMessage, ARRAYSIZE(szMessage),
+                            L"Configuration file %ls not found; the settings are unchanged",
+                            m_config->GetPath().c_str());
+            WriteEventLogEntry(szMessage, EVENTLOG_WARNING_TYPE);
+            return;
+        }
+    }
+    catch (DWORD)
+    {
+        // Logged; the settings are unchanged.
+        return;
+    }
+
+    m_configReloads.Increment();
+    StringCchPrintf(szMessage, ARRAYSIZE(szMessage),
+                    L"Configuration reloaded (version %llu, %lu settings)",
+                    m_config->GetVersion(), static_cast<DWORD>(m_config->Get()->GetCount()));
+    WriteEventLogEntry(szMessage, EVENTLOG_INFORMATION_TYPE);
+
+    OnParamChange();
+}
+
 #pragma endregion
 
 #pragma region Helper Functions
 
 /**
  *   This function sets the service status and reports the status to
- *   the SCM.
+ *   the host (the SCM on Windows). It may be called from any thread; the
+ *   updates are serialized, published for lock-free readers and, when
+ *   they only report progress, coalesced before they reach the host.
  *
  *   @param dwCurrentState - the state of the service
  *   @param dwWin32ExitCode - error code to report
@@ -428,7 +1237,7 @@ void ServiceBase::SetServiceStatus(DWORD dwCurrentState,
                                    DWORD dwWin32ExitCode,
                                    DWORD dwWaitHint)
 {
-    static DWORD dwCheckPoint = 1;
+    std::lock_guard<std::mutex> guard(m_statusLock);
 
     // Fill in the SERVICE_STATUS structure of the service.
 
@@ -440,14 +1249,108 @@ void ServiceBase::SetServiceStatus(DWORD dwCurrentState,
         ((dwCurrentState == SERVICE_RUNNING) ||
          (dwCurrentState == SERVICE_STOPPED))
             ? 0
-            : dwCheckPoint++;
+            : m_dwCheckPoint++;
 
-    // Report the status of the service to the SCM.
-    ::SetServiceStatus(m_statusHandle, &m_status);
+    m_statusSnapshot.Store(m_status);
+    m_state.Set(dwCurrentState);
+
+    // Report the status of the service to the host.
+    ReportStatus();
+}
+
+/**
+ *   Get a consistent copy of the current status without taking a lock.
+ */
+SERVICE_STATUS ServiceBase::GetStatus(void) const
+{
+    return m_statusSnapshot.Load();
+}
+
+/**
+ *   Report the status to the host. A status identical to the last one
+ *   reported is dropped. One that only moves the checkpoint or wait hint
+ *   on within StatusCoalesceWindow of the last report is held back; a
+ *   one-shot timer reports the latest such status when the window closes.
+ *   While the timer service or its pool is paused, or when the timer is
+ *   refused, the flush could come late or never, so the update is
+ *   reported at once.
+ *   Anything else, such as a change of state, is reported at once and
+ *   replaces a held-back update. Called with m_statusLock held, so the
+ *   host sees the updates in order.
+ */
+void ServiceBase::ReportStatus(void)
+{
+    if (m_host == NULL)
+    {
+        return;
+    }
+
+    if (m_fReported && memcmp(&m_status, &m_reportedStatus, sizeof(m_status)) == 0)
+    {
+        m_fReportPending = false;
+        m_statusCoalesced.Increment();
+        return;
+    }
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::milliseconds window(StatusCoalesceWindow);
+    bool fProgressOnly =
+        m_fReported &&
+        m_status.dwCurrentState == m_reportedStatus.dwCurrentState &&
+        m_status.dwWin32ExitCode == m_reportedStatus.dwWin32ExitCode &&
+        m_status.dwServiceSpecificExitCode == m_reportedStatus.dwServiceSpecificExitCode &&
+        m_status.dwControlsAccepted == m_reportedStatus.dwControlsAccepted &&
+        m_status.dwServiceType == m_reportedStatus.dwServiceType;
+    TimerService &timers = TimerService::Default();
+    if (fProgressOnly && now - m_lastReport < window && !timers.IsPaused() && !timers.GetPool().IsPaused())
+    {
+        if (m_statusFlushTimer == 0)
+        {
+            DWORD dwDelay = static_cast<DWORD>(
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    m_lastReport + window - now)
+                    .count()) +
+                1;
+            m_statusFlushTimer = timers.ScheduleOnce(dwDelay, [this]() { FlushStatus(); });
+        }
+        if (m_statusFlushTimer != 0)
+        {
+            m_fReportPending = true;
+            m_statusCoalesced.Increment();
+            return;
+        }
+    }
+
+    m_host->ReportStatus(*this, m_status);
+    m_statusReports.Increment();
+    m_reportedStatus = m_status;
+    m_lastReport = now;
+    m_fReported = true;
+    m_fReportPending = false;
+}
+
+/**
+ *   Report the held-back status update, unless a later report already
+ *   replaced it. Runs on the thread pool when the flush timer fires.
+ */
+void ServiceBase::FlushStatus(void)
+{
+    std::lock_guard<std::mutex> guard(m_statusLock);
+    m_statusFlushTimer = 0;
+    if (m_fReportPending && m_host != NULL)
+    {
+        m_host->ReportStatus(*this, m_status);
+        m_statusReports.Increment();
+        m_reportedStatus = m_status;
+        m_lastReport = std::chrono::steady_clock::now();
+        m_fReportPending = false;
+    }
 }
 
 /**
- *   Log a message to the Application event log.
+ *   Log a message to the Application event log. The message is only
+ *   queued to the process-wide logger; its flusher thread reports it, so
+ *   this never blocks the calling thread.
  *
  *   @param pszMessage: string message to be logged.
  *   @param wType: the type of event to be logged. The parameter can be
@@ -462,28 +1365,322 @@ void ServiceBase::SetServiceStatus(DWORD dwCurrentState,
  */
 void ServiceBase::WriteEventLogEntry(const wchar_t pszMessage[], WORD wType)
 {
-    HANDLE hEventSource = NULL;
-    LPCWSTR lpszStrings[2] = {NULL, NULL};
+    m_logger->Write(m_name, pszMessage, wType);
+}
+
+/**
+ *   Send the log messages of the service to the given logger instead of
+ *   the process-wide one.
+ *
+ *   @param logger - the logger to use; it must outlive the service
+ */
+void ServiceBase::SetLogger(Logger &logger)
+{
+    m_logger = &logger;
+}
+
+/**
+ *   Set the file ControlDumpTrace writes the trace to.
+ *
+ *   @param pszPath - the path of the file; it is replaced at every dump
+ */
+void ServiceBase::SetTraceFile(const wchar_t *pszPath)
+{
+    std::lock_guard<std::mutex> guard(m_controlLock);
+    m_tracePath = pszPath;
+}
+
+/**
+ *   Declare a startup stage. Call it from OnStart; the stages run once
+ *   OnStart returns.
+ *
+ *   @param pszName - the name of the stage
+ *   @param action - the work of the stage; it may throw a DWORD error code
+ *   to fail the start
+ *   @param dependencies - the names of the stages that must finish first
+ *   @param dwWaitHint - the expected duration in milliseconds, or 0 for the
+ *   default of 30 seconds
+ */
+void ServiceBase::AddStartupStage(const wchar_t *pszName,
+                                  StartupStages::Action action,
+                                  const std::vector<std::wstring> &dependencies,
+                                  DWORD dwWaitHint)
+{
+    m_startupStages.Add(pszName, std::move(action), dependencies, dwWaitHint);
+}
+
+/**
+ *   Get the timings of the stages of the last start, in milliseconds
+ *   from the start of the first stage.
+ */
+std::vector<StartupStages::Timing> ServiceBase::GetStartupTimings(void) const
+{
+    return m_startupStages.GetTimings();
+}
+
+/**
+ *   Run the startup stages declared by OnStart on the default thread pool.
+ *   Every finished stage moves the checkpoint on, with a wait hint that
+ *   covers the stages still to come. When the stages are done their
+ *   timings are logged; a failing stage fails the start with its error.
+ */
+void ServiceBase::RunStartupStages(void)
+{
+    if (m_startupStages.Empty())
+    {
+        return;
+    }
+
+    TraceSpan span("StartupStages", "service");
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    try
+    {
+        m_startupStages.Run(ThreadPool::Default(), [this](size_t, size_t, DWORD dwWaitHint) {
+            SetServiceStatus(SERVICE_START_PENDING, NO_ERROR, dwWaitHint);
+        });
+    }
+    catch (...)
+    {
+        LogStartupTimings(started);
+        throw;
+    }
+    LogStartupTimings(started);
+}
+
+/**
+ *   Log how long each startup stage took, and the whole startup compared
+ *   with running the stages one after the other.
+ *
+ *   @param started - when the stages started
+ */
+void ServiceBase::LogStartupTimings(std::chrono::steady_clock::time_point started)
+{
+    DWORD dwElapsed = static_cast<DWORD>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - started)
+            .count());
+
+    wchar_t szMessage[260];
+    DWORD dwSerial = 0;
+    std::vector<StartupStages::Timing> timings = m_startupStages.GetTimings();
+    for (size_t i = 0; i < timings.size(); i++)
+    {
+        StringCchPrintf(szMessage, ARRAYSIZE(szMessage),
+                        L"Startup stage %ls took %lu ms, starting at +%lu ms",
+                        timings[i].name.c_str(), timings[i].dwDuration, timings[i].dwStarted);
+        WriteEventLogEntry(szMessage, EVENTLOG_INFORMATION_TYPE);
+        dwSerial += timings[i].dwDuration;
+    }
+
+    StringCchPrintf(szMessage, ARRAYSIZE(szMessage),
+                    L"Startup stages took %lu ms (%lu ms one after the other)",
+                    dwElapsed, dwSerial);
+    WriteEventLogEntry(szMessage, EVENTLOG_INFORMATION_TYPE);
+}
+
+/**
+ *   Get the token that is signalled when the service is asked to stop.
+ */
+StopToken ServiceBase::GetStopToken(void) const
+{
+    std::lock_guard<std::mutex> guard(m_queueLock);
+    return m_stopSource.GetToken();
+}
+
+/**
+ *   Set the stop latency budget. Stops that take longer are logged as
+ *   warnings.
+ *
+ *   @param dwMilliseconds - the budget, in milliseconds
+ */
+void ServiceBase::SetStopLatencyBudget(DWORD dwMilliseconds)
+{
+    m_dwStopLatencyBudget = dwMilliseconds;
+}
+
+/**
+ *   Hold a pausable still while the service is paused. Adding the same
+ *   one twice has no effect.
+ *
+ *   @param pausable - the thread pool, timer service or socket server
+ */
+void ServiceBase::AddPausable(Pausable &pausable)
+{
+    std::lock_guard<std::mutex> guard(m_pauseLock);
+    for (size_t i = 0; i < m_pausables.size(); i++)
+    {
+        if (m_pausables[i] == &pausable)
+        {
+            return;
+        }
+    }
+    m_pausables.push_back(&pausable);
+}
+
+/**
+ *   Load the settings of the service from a configuration at every start
+ *   and reload them on SERVICE_CONTROL_PARAMCHANGE.
+ *
+ *   @param config - the configuration; it must outlive the service
+ */
+void ServiceBase::SetConfig(Config &config)
+{
+    m_config = &config;
+
+    std::lock_guard<std::mutex> guard(m_statusLock);
+    m_status.dwControlsAccepted |= SERVICE_ACCEPT_PARAMCHANGE;
+    m_statusSnapshot.Store(m_status);
+}
+
+/**
+ *   Add a step to the drain of a stop or shutdown, after OnStop or
+ *   OnShutdown and the steps added before it.
+ *
+ *   @param pszName - the name of the step, logged if it runs out of time
+ *   @param step - the work of the step
+ *   @param abort - what runs instead on the abort path, or an empty
+ *   function to skip the step
+ */
+void ServiceBase::AddDrainStep(const wchar_t *pszName,
+                               DrainCoordinator::Step step,
+                               DrainCoordinator::Abort abort)
+{
+    m_drainSteps.Add(pszName, std::move(step), std::move(abort));
+}
+
+/**
+ *   Set how long a stop and a shutdown may take.
+ *
+ *   @param dwStopMilliseconds - the stop deadline, in milliseconds, or
+ *   INFINITE
+ *   @param dwShutdownMilliseconds - the shutdown deadline, in
+ *   milliseconds, or INFINITE
+ */
+void ServiceBase::SetDrainDeadlines(DWORD dwStopMilliseconds, DWORD dwShutdownMilliseconds)
+{
+    m_dwStopDeadline = dwStopMilliseconds;
+    m_dwShutdownDeadline = dwShutdownMilliseconds;
+}
+
+/**
+ *   @return how long a stop may take, in milliseconds, or INFINITE
+ */
+DWORD ServiceBase::GetStopDeadline(void) const
+{
+    return m_dwStopDeadline;
+}
+
+/**
+ *   @return the milliseconds OnStop, OnShutdown or a drain step has left
+ *   before the drain takes the abort path, or INFINITE
+ */
+DWORD ServiceBase::GetDrainTimeLeft(void) const
+{
+    return m_drain.GetTimeLeft();
+}
+
+/**
+ *   Set how long a pause may wait for the work in flight.
+ *
+ *   @param dwMilliseconds - the timeout, in milliseconds, or INFINITE
+ */
+void ServiceBase::SetPauseTimeout(DWORD dwMilliseconds)
+{
+    m_dwPauseTimeout = dwMilliseconds;
+}
+
+/**
+ *   Get the time from the last stop request to SERVICE_STOPPED, in
+ *   milliseconds.
+ */
+DWORD ServiceBase::GetLastStopLatency(void) const
+{
+    return m_dwLastStopLatency;
+}
+
+/**
+ *   Record how long the stop took from the control being accepted to
+ *   SERVICE_STOPPED and log it, as a warning if it exceeded the budget.
+ *   The logger writes the message out after the drain's flush, before the
+ *   process exits.
+ *
+ *   @param requested - when the stop control was accepted
+ */
+void ServiceBase::ReportStopLatency(std::chrono::steady_clock::time_point requested)
+{
+    std::chrono::microseconds elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - requested);
+    m_stopLatency.Record(static_cast<unsigned long long>(elapsed.count()));
+    DWORD dwLatency = static_cast<DWORD>(elapsed.count() / 1000);
+    m_dwLastStopLatency = dwLatency;
+
+    wchar_t szMessage[260];
+    DWORD dwBudget = m_dwStopLatencyBudget;
+    if (dwLatency > dwBudget)
+    {
+        StringCchPrintf(szMessage, ARRAYSIZE(szMessage),
+                        L"Service stop took %lu ms, over the %lu ms budget",
+                        dwLatency, dwBudget);
+        WriteEventLogEntry(szMessage, EVENTLOG_WARNING_TYPE);
+    }
+    else
+    {
+        StringCchPrintf(szMessage, ARRAYSIZE(szMessage),
+                        L"Service stop took %lu ms", dwLatency);
+        WriteEventLogEntry(szMessage, EVENTLOG_INFORMATION_TYPE);
+    }
+}
+
+/**
+ *   Log every metric of the process, one message per metric, as
+ *   "WinServ -metrics <pid>" would print them.
+ *
+ *   @param fServiceOnly - log only the metrics named after the service
+ */
+void ServiceBase::DumpMetrics(bool fServiceOnly)
+{
+    // Metric names are stored narrowed, one character per character.
+    std::string prefix;
+    if (fServiceOnly)
+    {
+        for (const wchar_t *pch = m_name; *pch != L'\0'; pch++)
+        {
+            prefix += (*pch > 0 && *pch < 0x7F) ? static_cast<char>(*pch) : '?';
+        }
+        prefix += '.';
+    }
 
-    hEventSource = RegisterEventSource(NULL, m_name);
-    if (hEventSource)
+    std::vector<MetricValue> metrics = MetricsRegistry::Default().Read();
+    for (size_t i = 0; i < metrics.size(); i++)
     {
-        lpszStrings[0] = m_name;
-        lpszStrings[1] = pszMessage;
+        if (metrics[i].name.compare(0, prefix.size(), prefix) != 0)
+        {
+            continue;
+        }
 
-        ReportEvent(hEventSource, // Event log handle
-                    wType,        // Event type
-                    0,            // Event category
-                    0,            // Event identifier
-                    NULL,         // No security identifier
-                    2,            // Size of lpszStrings array
-                    0,            // No binary data
-                    lpszStrings,  // Array of strings
-                    NULL          // No binary data
-        );
+        wchar_t szMessage[256];
+        MetricsReader::Format(metrics[i], szMessage, ARRAYSIZE(szMessage));
+        WriteEventLogEntry(szMessage, EVENTLOG_INFORMATION_TYPE);
+    }
+}
 
-        DeregisterEventSource(hEventSource);
+/**
+ *   Write the trace of the process, as Chrome trace-event JSON, to the
+ *   trace file. Errors are thrown to the control handler, which logs them.
+ */
+void ServiceBase::DumpTrace(void)
+{
+    std::wstring path;
+    {
+        std::lock_guard<std::mutex> guard(m_controlLock);
+        path = m_tracePath;
     }
+    Trace::Export(path.c_str());
+
+    wchar_t szMessage[260];
+    StringCchPrintf(szMessage, ARRAYSIZE(szMessage), L"Trace written to %ls%ls", path.c_str(),
+                    Trace::IsEnabled() ? L"" : L" (tracing is not enabled)");
+    WriteEventLogEntry(szMessage, EVENTLOG_INFORMATION_TYPE);
 }
 
 /**
@@ -496,7 +1693,7 @@ void ServiceBase::WriteErrorLogEntry(const wchar_t pszFunction[], DWORD dwError)
 {
     wchar_t szMessage[260];
     StringCchPrintf(szMessage, ARRAYSIZE(szMessage),
-                    L"%s failed w/err 0x%08lx", pszFunction, dwError);
+                    L"%ls failed w/err 0x%08lx", pszFunction, dwError);
     WriteEventLogEntry(szMessage, EVENTLOG_ERROR_TYPE);
 }
 
@@ -1,16 +1,62 @@
 #pragma once
 
-#include <windows.h>
+#include "Platform.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Config.h"
+#include "DrainCoordinator.h"
+#include "Metrics.h"
+#include "Pausable.h"
+#include "StartupStages.h"
+#include "StatusSnapshot.h"
+#include "StopToken.h"
+#include "TimerService.h"
+
+class Logger;
+class ServiceHost;
 
 class ServiceBase
 {
 public:
+    // User-defined control codes with built-in handlers. Send them with
+    // "sc control <service> <code>" on Windows, or as described in
+    // PosixServiceHost.h.
+    static const DWORD ControlFlushCaches = 128;
+    static const DWORD ControlRotateLogs = 129;
+    static const DWORD ControlDumpMetrics = 130;
+    static const DWORD ControlDumpTrace = 131;
+
+    // The range of user-defined control codes.
+    static const DWORD FirstUserControl = 128;
+    static const DWORD LastUserControl = 255;
+
+    // Handles a user-defined control code; receives the code.
+    typedef std::function<void(DWORD dwCtrl)> ControlHandler;
+
     /**
      *   Register the executable for a service with the Service Control Manager
-     *   (SCM).This method blocks until the service has stopped.
+     *   (SCM), or with the POSIX host outside Windows. This method blocks
+     *   until the service has stopped.
      */
     static BOOL Run(ServiceBase &service);
 
+    // Run the service under the given host. This method blocks until the
+    // service has stopped.
+    static BOOL Run(ServiceBase &service, ServiceHost &host);
+
+    // Run several services in one process. They share the process-wide
+    // thread pool, timer service and logger, while each keeps its own
+    // status and receives its own controls. This method blocks until all
+    // of them have stopped.
+    static BOOL Run(ServiceBase *const *services, DWORD dwCount);
+    static BOOL Run(ServiceBase *const *services, DWORD dwCount, ServiceHost &host);
+
     // Service object constructor. The optional parameters (fCanStop,
     // fCanShutdown and fCanPauseContinue) allow you to specify whether the
     // service can be stopped, paused and continued, or be notified when
@@ -22,8 +68,34 @@ public:
 
     virtual ~ServiceBase(void);
 
+    // Stop the service on the calling thread and return once it has
+    // stopped. Stop controls from the host go through the control thread
+    // instead.
     void Stop();
 
+    // A consistent copy of the current status. Lock-free; callable from any
+    // thread.
+    SERVICE_STATUS GetStatus(void) const;
+
+    // The time from the last stop request to SERVICE_STOPPED, in
+    // milliseconds.
+    DWORD GetLastStopLatency(void) const;
+
+    // Send the log messages of the service to the given logger instead of
+    // the process-wide one. The logger must outlive the service.
+    void SetLogger(Logger &logger);
+
+    // Write the trace to the given file on ControlDumpTrace, instead of
+    // "<service name>.trace.json" in the current directory.
+    void SetTraceFile(const wchar_t *pszPath);
+
+    // Handle a user-defined control code (FirstUserControl to
+    // LastUserControl) with the given function, replacing the handler it
+    // has. Handlers run on the thread pool, never on the thread that
+    // delivered the control, so they may block. An empty function makes
+    // the service ignore the code.
+    void RegisterControlHandler(DWORD dwCtrl, ControlHandler handler);
+
 protected:
     // When implemented in a derived class, executes when a Start command is
     // sent to the service by the SCM or when the operating system starts
@@ -38,12 +110,13 @@ protected:
 
     // When implemented in a derived class, executes when a Pause command is
     // sent to the service by the SCM. Specifies actions to take when a
-    // service pauses.
+    // service pauses. Runs before the pausables are paused.
     virtual void OnPause();
 
     // When implemented in a derived class, OnContinue runs when a Continue
     // command is sent to the service by the SCM. Specifies actions to take
-    // when a service resumes normal functioning after being paused.
+    // when a service resumes normal functioning after being paused. Runs
+    // before the pausables are resumed.
     virtual void OnContinue();
 
     // When implemented in a derived class, executes when the system is
@@ -51,12 +124,95 @@ protected:
     // system shutting down.
     virtual void OnShutdown();
 
-    // Set the service status and report the status to the SCM.
+    // When implemented in a derived class, executes on the thread pool when
+    // the ControlFlushCaches control is sent to the service. Specifies
+    // which caches to drop or write back.
+    virtual void OnFlushCaches();
+
+    // When implemented in a derived class, executes on the thread pool
+    // once the configuration set with SetConfig has been reloaded on a
+    // SERVICE_CONTROL_PARAMCHANGE. Specifies how to apply the new
+    // settings; the stop latency budget, pause timeout and drain deadlines
+    // may be changed from here.
+    virtual void OnParamChange();
+
+    // Declare a startup stage from OnStart. Once OnStart returns, the
+    // stages run on the thread pool, each as soon as the stages named in
+    // dependencies have finished; the service reports SERVICE_START_PENDING
+    // with a new checkpoint and wait hint after every stage, and
+    // SERVICE_RUNNING when all are done. dwWaitHint is the expected
+    // duration of the stage, in milliseconds.
+    void AddStartupStage(const wchar_t *pszName,
+                         StartupStages::Action action,
+                         const std::vector<std::wstring> &dependencies = std::vector<std::wstring>(),
+                         DWORD dwWaitHint = 0);
+
+    // The timings of the stages of the last start.
+    std::vector<StartupStages::Timing> GetStartupTimings(void) const;
+
+    // Set the service status and report the status to the host. Safe to
+    // call from any thread. Updates that only move the checkpoint or wait
+    // hint of the reported state within StatusCoalesceWindow ms of the last
+    // report are coalesced: only the latest reaches the host, at the end of
+    // the window.
     void SetServiceStatus(DWORD dwCurrentState,
                           DWORD dwWin32ExitCode = NO_ERROR,
                           DWORD dwWaitHint = 0);
 
-    // Log a message to the Application event log.
+    // The token that is signalled when the service is asked to stop or the
+    // system shuts down. Worker code can poll it, wait on it instead of
+    // sleeping, or register a StopCallback to interrupt a blocking call.
+    StopToken GetStopToken(void) const;
+
+    // Stops that take longer than this (in milliseconds, 100 by default)
+    // are logged as warnings.
+    void SetStopLatencyBudget(DWORD dwMilliseconds);
+
+    // Hold a thread pool, timer service or socket server still while the
+    // service is paused. A pause pauses them in the order they were added
+    // (so add what produces work before what runs it) and reports
+    // SERVICE_PAUSED once the work they had in flight has finished; a
+    // continue resumes them. Threads, connections and queued work survive
+    // the pause. Call from the constructor; the pausable must outlive the
+    // service.
+    void AddPausable(Pausable &pausable);
+
+    // How long a pause may wait for the work in flight, in milliseconds
+    // (30000 by default, or INFINITE). A pause that takes longer fails and
+    // the service keeps running.
+    void SetPauseTimeout(DWORD dwMilliseconds);
+
+    // Add a step to the drain that runs when the service stops or the
+    // system shuts down: after OnStop or OnShutdown, before the user
+    // control handlers are waited for and the metrics and the log are
+    // written out. The step receives the milliseconds it may take and
+    // returns false if it ran out of time; the drain then runs the abort
+    // actions of the steps left instead. Call from the constructor.
+    void AddDrainStep(const wchar_t *pszName,
+                      DrainCoordinator::Step step,
+                      DrainCoordinator::Abort abort = DrainCoordinator::Abort());
+
+    // How long a stop and a shutdown may take, in milliseconds (20000 and
+    // 5000 by default, or INFINITE). A fifth of the time is kept back for
+    // the abort path.
+    void SetDrainDeadlines(DWORD dwStopMilliseconds, DWORD dwShutdownMilliseconds);
+
+    // How long a stop may take, in milliseconds, or INFINITE.
+    DWORD GetStopDeadline(void) const;
+
+    // The milliseconds OnStop, OnShutdown or a drain step has left before
+    // the drain takes the abort path, or INFINITE. Bound their waits with
+    // it.
+    DWORD GetDrainTimeLeft(void) const;
+
+    // Load the settings of the service from config at every start, before
+    // OnStart, and reload them on SERVICE_CONTROL_PARAMCHANGE (SIGHUP on
+    // Linux), which the service then accepts. A reload that fails keeps
+    // the settings the service has. Call from the constructor; the config
+    // must outlive the service.
+    void SetConfig(Config &config);
+
+    // Queue a message for the Application event log.
     void WriteEventLogEntry(const wchar_t pszMessage[], WORD wType);
 
     // Log an error message to the Application event log.
@@ -64,13 +220,27 @@ protected:
                             DWORD dwError = GetLastError());
 
 private:
-    // Entry point for the service. It registers the handler function for the
-    // service and starts the service.
-    static void WINAPI ServiceMain(DWORD dwArgc, LPWSTR *lpszArgv);
+    // The host drives the lifecycle through Start and Control.
+    friend class ServiceHost;
 
-    // The function is called by the SCM whenever a control code is sent to
-    // the service.
-    static void WINAPI ServiceCtrlHandler(DWORD dwCtrl);
+    // Accept a control code sent to the service by its host. Transitions
+    // are queued to the control thread; returns NO_ERROR once accepted, or
+    // the reason the control was rejected.
+    DWORD Control(DWORD dwCtrl);
+
+    // Queue a stop, shutdown, pause or continue for the control thread,
+    // coalescing it with the ones already queued.
+    DWORD QueueTransition(DWORD dwCtrl);
+
+    // The state the service is heading for once the queued transitions
+    // are applied. Called with m_queueLock held.
+    DWORD GetTargetState(void) const;
+
+    // Control thread body: apply queued transitions one at a time.
+    void ControlLoop(void);
+
+    // Stop the control thread once the service has stopped.
+    void JoinControlThread(void);
 
     // Start the service.
     void Start(DWORD dwArgc, PWSTR *pszArgv);
@@ -81,18 +251,180 @@ private:
     // Resume the service after being paused.
     void Continue();
 
-    // Execute when the system is shutting down.
-    void Shutdown();
+    // Stop the service for a stop control queued at the given time.
+    void Stop(std::chrono::steady_clock::time_point requested);
+
+    // Execute when the system is shutting down, for a shutdown control
+    // queued at the given time.
+    void Shutdown(std::chrono::steady_clock::time_point requested);
+
+    // Pause the pausables and wait for their work in flight, reporting
+    // progress. Returns false, with them resumed, if the work did not
+    // finish within the pause timeout.
+    bool PausePausables(void);
+
+    // Resume the pausables if they are paused.
+    void ResumePausables(void);
 
-    // The singleton service instance.
-    static ServiceBase *s_service;
+    // Report SERVICE_STOP_PENDING and drain the service within the deadline
+    // of a stop or a shutdown.
+    void Drain(bool fShutdown);
+
+    // Wait for the handlers of user-defined controls that are queued or
+    // running. Returns false if they are still running after dwMilliseconds.
+    bool WaitForControls(DWORD dwMilliseconds);
+
+    // Queue the handler of a user-defined control code to the thread pool.
+    DWORD DispatchUserControl(DWORD dwCtrl);
+
+    // Queue a reload of the configuration to the thread pool, unless one is
+    // queued already.
+    DWORD DispatchParamChange(void);
+
+    // Queue the handler of a control code to the thread pool, counting it
+    // in m_controlsInFlight until it has run or been dropped.
+    void QueueControl(DWORD dwCtrl, ControlHandler handler);
+
+    // Run the handler of a control code.
+    void HandleUserControl(DWORD dwCtrl, const ControlHandler &handler);
+
+    // Load the configuration, logging an error. Returns false if the file
+    // does not exist.
+    bool LoadConfig(void);
+
+    // Reload the configuration and call OnParamChange.
+    void ReloadConfig(void);
+
+    // Log every metric of the process, or only those of the service.
+    void DumpMetrics(bool fServiceOnly = false);
+
+    // Write the trace of the process to the trace file.
+    void DumpTrace(void);
+
+    // Run the declared startup stages and log their timings.
+    void RunStartupStages(void);
+
+    // Log the timings of the startup stages.
+    void LogStartupTimings(std::chrono::steady_clock::time_point started);
+
+    // Report the status to the host unless the update can be coalesced.
+    // Called with m_statusLock held.
+    void ReportStatus(void);
+
+    // Report an update that was held back, if it still is.
+    void FlushStatus(void);
+
+    // Record and log how long a stop took, once SERVICE_STOPPED has been
+    // reported.
+    void ReportStopLatency(std::chrono::steady_clock::time_point requested);
 
     // The name of the service
     PWSTR m_name;
 
-    // The status of the service
+    // Updates within this many milliseconds of the last report that only
+    // make progress in the same state are coalesced.
+    static const DWORD StatusCoalesceWindow = 50;
+
+    // Serializes status updates and reports
+    std::mutex m_statusLock;
+
+    // The status of the service, the copy readers see, and the checkpoint
+    // of its next pending update
     SERVICE_STATUS m_status;
+    StatusSnapshot m_statusSnapshot;
+    DWORD m_dwCheckPoint;
+
+    // The last status reported to the host, when, and whether a newer one
+    // is being held back until the flush timer fires
+    SERVICE_STATUS m_reportedStatus;
+    std::chrono::steady_clock::time_point m_lastReport;
+    bool m_fReported;
+    bool m_fReportPending;
+    TimerService::TimerId m_statusFlushTimer;
+
+    // The host the service is running under, while it runs
+    ServiceHost *m_host;
+
+    // The handlers of the user-defined control codes, and the number of
+    // them queued or running; the destructor waits for that to drop to 0
+    std::mutex m_controlLock;
+    std::condition_variable m_controlsIdle;
+    ControlHandler m_controlHandlers[LastUserControl - FirstUserControl + 1];
+    size_t m_controlsInFlight;
+
+    // Where ControlDumpTrace writes the trace, under m_controlLock
+    std::wstring m_tracePath;
+
+    // A transition waiting for the control thread, and when its control
+    // was accepted
+    struct QueuedControl
+    {
+        DWORD dwCtrl;
+        std::chrono::steady_clock::time_point requested;
+    };
+
+    // Transitions waiting for the control thread, the state they lead to,
+    // and whether one is queued or being applied or Start is running; the
+    // control thread waits for Start to return before applying anything
+    mutable std::mutex m_queueLock;
+    std::condition_variable m_queueChanged;
+    std::deque<QueuedControl> m_queuedControls;
+    DWORD m_dwTargetState;
+    bool m_fTransitioning;
+    bool m_fStarting;
+    bool m_fControlThreadExit;
+    std::thread m_controlThread;
+
+    // The stages declared by OnStart
+    StartupStages m_startupStages;
+
+    // The logger that receives the messages of the service
+    Logger *m_logger;
+
+    // Signalled when the service is asked to stop. Replaced by a start
+    // after a stop, so it is read and written under m_queueLock.
+    StopSource m_stopSource;
+
+    // Stop latency budget and the last measured stop latency, in ms
+    std::atomic<DWORD> m_dwStopLatencyBudget;
+    std::atomic<DWORD> m_dwLastStopLatency;
+
+    // While a pause waits for the work in flight, progress is reported
+    // this often, in milliseconds.
+    static const DWORD PauseProgressInterval = 1000;
+
+    // What is held still while the service is paused, whether it is and
+    // what it paused, and how long a pause may wait for it to finish its
+    // work in flight
+    std::mutex m_pauseLock;
+    std::vector<Pausable *> m_pausables;
+    std::vector<Pausable *> m_pausedPausables;
+    bool m_fPaused;
+    std::atomic<DWORD> m_dwPauseTimeout;
+
+    // The configuration of the service, if it has one, and whether a
+    // reload is queued
+    Config *m_config;
+    std::atomic<bool> m_fReloadQueued;
+
+    // The drain steps added by the service, the drain of the stop or
+    // shutdown under way, and the deadlines of both
+    DrainCoordinator m_drainSteps;
+    DrainCoordinator m_drain;
+    std::atomic<DWORD> m_dwStopDeadline;
+    std::atomic<DWORD> m_dwShutdownDeadline;
 
-    // The service status handle
-    SERVICE_STATUS_HANDLE m_statusHandle;
+    // Metrics of the service, published as "<service name>.<metric>"
+    MetricCounter m_controls;
+    MetricCounter m_userControls;
+    MetricCounter m_controlsCoalesced;
+    MetricCounter m_controlsRejected;
+    MetricCounter m_statusReports;
+    MetricCounter m_statusCoalesced;
+    MetricCounter m_drainsAborted;
+    MetricCounter m_configReloads;
+    MetricGauge m_state;
+    MetricHistogram m_startLatency;
+    MetricHistogram m_stopLatency;
+    MetricHistogram m_pauseLatency;
 };
@@ -0,0 +1,58 @@
+/*
+ * The environment a service runs in.
+ *
+ * A host delivers the service lifecycle: it starts the service, turns the
+ * platform's control requests into control codes, and publishes the status
+ * the service reports. ScmServiceHost does this through the Windows service
+ * control manager; PosixServiceHost does it with signals (and optionally the
+ * systemd notification protocol) so the same service runs under Linux.
+ *
+ */
+
+#pragma once
+
+#include "Platform.h"
+#include "ServiceBase.h"
+
+class ServiceHost
+{
+public:
+    virtual ~ServiceHost(void) {}
+
+    // Run the services until all of them have stopped. Returns FALSE if
+    // they could not be run; call GetLastError for the reason.
+    virtual BOOL Run(ServiceBase *const *services, DWORD dwCount) = 0;
+
+    // Run a single service until it has stopped.
+    BOOL Run(ServiceBase &service)
+    {
+        ServiceBase *services[] = {&service};
+        return Run(services, 1);
+    }
+
+    // Publish the status of a service. Called by each service when its
+    // status changes, one call at a time and in order, on whichever thread
+    // changed it (progress-only updates may be coalesced). Must not call
+    // back into the service's status functions.
+    virtual void ReportStatus(ServiceBase &service, const SERVICE_STATUS &status) = 0;
+
+protected:
+    // Start a service: runs OnStart and reports the resulting state.
+    static void Start(ServiceBase &service, DWORD dwArgc, PWSTR *pszArgv)
+    {
+        service.Start(dwArgc, pszArgv);
+    }
+
+    // Deliver a control code to a service. Returns as soon as the service
+    // has accepted it: NO_ERROR, or the reason it was rejected.
+    static DWORD Control(ServiceBase &service, DWORD dwCtrl)
+    {
+        return service.Control(dwCtrl);
+    }
+
+    // The name of a service.
+    static PWSTR GetName(ServiceBase &service)
+    {
+        return service.m_name;
+    }
+};
@@ -0,0 +1,620 @@
+#pragma region Includes
+#include "SocketServer.h"
+#include <chrono>
+#include <string.h>
+#ifdef _WIN32
+#include "IocpEventLoop.h"
+#else
+#include "EpollEventLoop.h"
+#endif
+#pragma endregion
+
+namespace
+{
+    // Events of one connection handled by a callback task before it makes
+    // way for other work.
+    const size_t EventsPerTask = 16;
+}
+
+#pragma region Connection
+
+SocketConnection::SocketConnection(SocketServer &server, SocketEventLoop &loop, size_t endpoint,
+                                   SocketHandle socket, const std::string &peer)
+    : m_server(server), m_loop(loop), m_endpoint(endpoint), m_socket(socket),
+      m_id(server.m_nextId.fetch_add(1, std::memory_order_relaxed)), m_peer(peer),
+      m_outputOffset(0), m_writing(false), m_closing(false), m_closed(false),
+      m_dispatching(false), m_inputClosed(false), m_reader(NULL)
+{
+}
+
+/**
+ *   Queue data to send on the connection. The data is copied; the call
+ *   does not wait for it to be written.
+ *
+ *   @param data - the data
+ *   @param size - its size in bytes
+ *   @return false if the connection is closing or closed
+ */
+bool SocketConnection::Send(const void *data, size_t size)
+{
+    return m_loop.Send(*this, data, size);
+}
+
+/**
+ *   Close the connection once the data queued so far has been sent. The
+ *   close callback runs after the callbacks already queued.
+ */
+void SocketConnection::Close(void)
+{
+    m_loop.Close(*this);
+}
+
+/**
+ *   Give the next received data to the coroutine of the connection, or
+ *   wait for it. Only one read may wait at a time.
+ *
+ *   @param handle - the coroutine
+ *   @return false if data or the close was already there
+ */
+bool SocketConnection::ReadAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    std::lock_guard<std::mutex> guard(m_connection.m_lock);
+    if (!m_connection.m_input.empty())
+    {
+        m_data = std::move(m_connection.m_input.front());
+        m_connection.m_input.pop_front();
+        return false;
+    }
+    if (m_connection.m_inputClosed)
+    {
+        return false;
+    }
+    m_handle = handle;
+    m_connection.m_reader = this;
+    return true;
+}
+
+/**
+ *   Resume the read that waits for data, on the calling thread, or keep
+ *   the data until the next read. Runs in the task that drains the events
+ *   of the connection, so the coroutine sees the data in order.
+ *
+ *   @param data - the data, or an empty Buffer for the close
+ */
+void SocketConnection::Deliver(Buffer data)
+{
+    ReadAwaiter *reader;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (!data)
+        {
+            m_inputClosed = true;
+        }
+        reader = m_reader;
+        m_reader = NULL;
+        if (reader == NULL)
+        {
+            if (data)
+            {
+                m_input.push_back(std::move(data));
+            }
+            return;
+        }
+    }
+    reader->m_data = std::move(data);
+    reader->m_handle.resume();
+}
+
+#pragma endregion
+
+#pragma region Datagram
+
+SocketDatagram::SocketDatagram(SocketServer &server, size_t endpoint, SocketHandle socket,
+                               const void *from, int fromLength, const char *data, size_t size)
+    : m_server(server), m_endpoint(endpoint), m_socket(socket),
+      m_fromLength(fromLength), m_data(data, data + size)
+{
+    if (m_fromLength < 0 || static_cast<size_t>(m_fromLength) > sizeof(m_from))
+    {
+        m_fromLength = sizeof(m_from);
+    }
+    memcpy(m_from, from, m_fromLength);
+}
+
+std::string SocketDatagram::GetPeerAddress(void) const
+{
+    return SocketEventLoop::FormatAddress(m_from);
+}
+
+/**
+ *   Send a datagram back to the sender of this one, from the socket it
+ *   arrived on.
+ *
+ *   @param data - the payload
+ *   @param size - its size in bytes
+ *   @return true if the datagram was sent
+ */
+bool SocketDatagram::Reply(const void *data, size_t size)
+{
+    if (!SocketEventLoop::SendTo(m_socket, m_from, m_fromLength, data, size))
+    {
+        return false;
+    }
+    m_server.OnSent(size);
+    return true;
+}
+
+#pragma endregion
+
+#pragma region Server
+
+/**
+ *   Create a server. Nothing is bound until Start.
+ *
+ *   @param pool - the pool the callbacks run on
+ */
+SocketServer::SocketServer(ThreadPool &pool)
+    : m_pool(pool), m_buffers(ReceiveBufferSize), m_nextLoop(0), m_nextId(1), m_running(false), m_pauseCount(0),
+      m_connections(0), m_callbacks(0)
+{
+    MetricsRegistry &metrics = MetricsRegistry::Default();
+    m_accepted = metrics.GetCounter(L"socketserver.accepted");
+    m_bytesReceived = metrics.GetCounter(L"socketserver.bytes_received");
+    m_bytesSent = metrics.GetCounter(L"socketserver.bytes_sent");
+    m_datagrams = metrics.GetCounter(L"socketserver.datagrams");
+    m_open = metrics.GetGauge(L"socketserver.connections");
+}
+
+SocketServer::~SocketServer(void)
+{
+    Stop(0);
+}
+
+/**
+ *   Add a TCP endpoint.
+ *
+ *   @param pszAddress - the local address, or NULL for every IPv4 address
+ *   @param port - the port, or 0 for any free one (see GetPort)
+ *   @param onReceive - runs with the data of a connection as it arrives
+ *   @param onAccept - runs first for every connection, or empty
+ *   @param onClose - runs last for every connection, or empty
+ *   @return the index of the endpoint
+ */
+size_t SocketServer::ListenTcp(const char *pszAddress, unsigned short port,
+                               ReceiveHandler onReceive,
+                               ConnectionHandler onAccept,
+                               ConnectionHandler onClose)
+{
+    Endpoint endpoint;
+    endpoint.tcp = true;
+    endpoint.address = (pszAddress == NULL) ? "" : pszAddress;
+    endpoint.port = port;
+    endpoint.onReceive = std::move(onReceive);
+    endpoint.onAccept = std::move(onAccept);
+    endpoint.onClose = std::move(onClose);
+    m_endpoints.push_back(std::move(endpoint));
+    return m_endpoints.size() - 1;
+}
+
+/**
+ *   Add a TCP endpoint whose connections are each handled by a coroutine.
+ *
+ *   @param pszAddress - the local address, or NULL for every IPv4 address
+ *   @param port - the port, or 0 for any free one (see GetPort)
+ *   @param coroutine - creates the coroutine of an accepted connection
+ *   @return the index of the endpoint
+ */
+size_t SocketServer::ListenTcp(const char *pszAddress, unsigned short port, ConnectionCoroutine coroutine)
+{
+    Endpoint endpoint;
+    endpoint.tcp = true;
+    endpoint.address = (pszAddress == NULL) ? "" : pszAddress;
+    endpoint.port = port;
+    endpoint.coroutine = std::move(coroutine);
+    m_endpoints.push_back(std::move(endpoint));
+    return m_endpoints.size() - 1;
+}
+
+/**
+ *   Add a UDP endpoint.
+ *
+ *   @param pszAddress - the local address, or NULL for every IPv4 address
+ *   @param port - the port, or 0 for any free one (see GetPort)
+ *   @param onDatagram - runs for every datagram received
+ *   @return the index of the endpoint
+ */
+size_t SocketServer::BindUdp(const char *pszAddress, unsigned short port, DatagramHandler onDatagram)
+{
+    Endpoint endpoint;
+    endpoint.tcp = false;
+    endpoint.address = (pszAddress == NULL) ? "" : pszAddress;
+    endpoint.port = port;
+    endpoint.onDatagram = std::move(onDatagram);
+    m_endpoints.push_back(std::move(endpoint));
+    return m_endpoints.size() - 1;
+}
+
+/**
+ *   Bind the endpoints and start the event loops. Call it from OnStart: if
+ *   an endpoint cannot be bound nothing is left running and the error
+ *   code is thrown, which fails the start.
+ *
+ *   @param loopCount - the number of event loops, 0 for one per hardware
+ *   thread
+ */
+void SocketServer::Start(size_t loopCount)
+{
+    if (m_running)
+    {
+        return;
+    }
+
+    if (loopCount == 0)
+    {
+        loopCount = std::thread::hardware_concurrency();
+        if (loopCount == 0)
+            loopCount = 1;
+    }
+
+    std::lock_guard<std::mutex> guard(m_pauseLock);
+    try
+    {
+        for (size_t i = 0; i < loopCount; i++)
+        {
+            m_loops.push_back(std::unique_ptr<SocketEventLoop>(new SocketEventLoop(*this)));
+            m_loops[i]->Open(m_endpoints, i == 0);
+        }
+        for (size_t i = 0; i < loopCount; i++)
+        {
+            m_loops[i]->Start();
+            if (m_pauseCount != 0)
+            {
+                m_loops[i]->PauseAccepting();
+            }
+        }
+    }
+    catch (...)
+    {
+        m_loops.clear();
+        throw;
+    }
+    m_running = true;
+}
+
+/**
+ *   Stop accepting connections and reading datagrams, without closing
+ *   anything, until every pause has been resumed. Connections arriving
+ *   meanwhile wait in the listen backlog.
+ */
+void SocketServer::Pause(void)
+{
+    std::lock_guard<std::mutex> guard(m_pauseLock);
+    if (m_pauseCount++ != 0)
+    {
+        return;
+    }
+    for (size_t i = 0; i < m_loops.size(); i++)
+    {
+        m_loops[i]->PauseAccepting();
+    }
+}
+
+/**
+ *   The loops stopped accepting before Pause returned, so there is nothing
+ *   to wait for.
+ *
+ *   @param dwMilliseconds - unused
+ *   @return true
+ */
+bool SocketServer::WaitUntilQuiet(DWORD dwMilliseconds)
+{
+    (void)dwMilliseconds;
+    return true;
+}
+
+/**
+ *   End a pause. After the last one, accept connections and read
+ *   datagrams again, starting with those that waited while the server was
+ *   paused. The loops are only told to, so that a continue is not held up
+ *   by loop threads that have to wait for a CPU.
+ */
+void SocketServer::Resume(void)
+{
+    std::lock_guard<std::mutex> guard(m_pauseLock);
+    if (m_pauseCount == 0 || --m_pauseCount != 0)
+    {
+        return;
+    }
+    for (size_t i = 0; i < m_loops.size(); i++)
+    {
+        m_loops[i]->ResumeAccepting();
+    }
+}
+
+/**
+ *   Stop the server. Call it from OnStop. New connections and datagrams
+ *   are refused at once; open connections get dwMilliseconds to finish
+ *   and close on their own, then the rest are closed. Returns once every
+ *   close callback and every other callback still running has returned.
+ *
+ *   @param dwMilliseconds - how long open connections may take to close,
+ *   or INFINITE
+ */
+void SocketServer::Stop(DWORD dwMilliseconds)
+{
+    if (!m_running)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < m_loops.size(); i++)
+    {
+        m_loops[i]->StopAccepting();
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        auto closed = [this]() { return m_connections == 0; };
+        if (dwMilliseconds == INFINITE)
+        {
+            m_idle.wait(lock, closed);
+        }
+        else
+        {
+            m_idle.wait_for(lock, std::chrono::milliseconds(dwMilliseconds), closed);
+        }
+    }
+
+    for (size_t i = 0; i < m_loops.size(); i++)
+    {
+        m_loops[i]->CloseConnections();
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_idle.wait(lock, [this]() { return m_connections == 0 && m_callbacks == 0; });
+    }
+
+    for (size_t i = 0; i < m_loops.size(); i++)
+    {
+        m_loops[i]->Stop();
+    }
+    m_loops.clear();
+    m_running = false;
+}
+
+/**
+ *   The port an endpoint is bound to: the one it was given, or the one
+ *   picked for it once the server has started.
+ *
+ *   @param endpoint - the index of the endpoint
+ */
+unsigned short SocketServer::GetPort(size_t endpoint) const
+{
+    return (endpoint < m_endpoints.size()) ? m_endpoints[endpoint].port : 0;
+}
+
+size_t SocketServer::GetConnectionCount(void) const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_connections;
+}
+
+#pragma endregion
+
+#pragma region Event Dispatch
+
+void SocketServer::OnAccepted(const SocketConnectionPtr &connection)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_connections++;
+    }
+    m_accepted.Increment();
+    m_open.Add(1);
+    Endpoint &endpoint = m_endpoints[connection->m_endpoint];
+    if (endpoint.onAccept || endpoint.coroutine)
+    {
+        Dispatch(connection, SocketConnection::AcceptEvent, Buffer());
+    }
+}
+
+void SocketServer::OnReceived(const SocketConnectionPtr &connection, Buffer data)
+{
+    m_bytesReceived.Increment(data.GetSize());
+    Dispatch(connection, SocketConnection::ReceiveEvent, std::move(data));
+}
+
+void SocketServer::OnClosed(const SocketConnectionPtr &connection)
+{
+    Endpoint &endpoint = m_endpoints[connection->m_endpoint];
+    if (endpoint.onClose || endpoint.coroutine)
+    {
+        Dispatch(connection, SocketConnection::CloseEvent, Buffer());
+    }
+    m_open.Add(-1);
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_connections--;
+    m_idle.notify_all();
+}
+
+void SocketServer::OnSent(size_t size)
+{
+    m_bytesSent.Increment(size);
+}
+
+/**
+ *   Hand a datagram to its callback on the thread pool. Datagrams are
+ *   independent, so they are handled in parallel.
+ *
+ *   @param datagram - the datagram
+ */
+void SocketServer::OnDatagram(std::unique_ptr<SocketDatagram> datagram)
+{
+    m_datagrams.Increment();
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_callbacks++;
+    }
+
+    std::shared_ptr<SocketDatagram> shared(std::move(datagram));
+    DatagramHandler &handler = m_endpoints[shared->m_endpoint].onDatagram;
+    auto run = [this, shared, &handler]() {
+        try
+        {
+            handler(*shared);
+        }
+        catch (...)
+        {
+            // A failing callback loses its datagram, nothing more.
+        }
+        CallbackDone();
+    };
+    if (!m_pool.Submit(run))
+    {
+        run();
+    }
+}
+
+SocketEventLoop &SocketServer::NextLoop(void)
+{
+    return *m_loops[m_nextLoop.fetch_add(1, std::memory_order_relaxed) % m_loops.size()];
+}
+
+/**
+ *   Queue an event of a connection and make sure a task is draining the
+ *   events of that connection. At most one task per connection runs at a
+ *   time, which keeps its callbacks in order.
+ *
+ *   @param connection - the connection
+ *   @param type - the event
+ *   @param data - the buffer the data was received into, for a receive
+ *   event; it is queued as it is, without a copy
+ */
+void SocketServer::Dispatch(const SocketConnectionPtr &connection, SocketConnection::EventType type, Buffer data)
+{
+    {
+        std::lock_guard<std::mutex> guard(connection->m_lock);
+        SocketConnection::Event event;
+        event.type = type;
+        event.data = std::move(data);
+        connection->m_events.push_back(std::move(event));
+        if (connection->m_dispatching)
+        {
+            return;
+        }
+        connection->m_dispatching = true;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_callbacks++;
+    }
+    if (!m_pool.Submit([this, connection]() { DrainEvents(connection); }))
+    {
+        // The pool is shutting down; run the callbacks here.
+        DrainEvents(connection);
+    }
+}
+
+/**
+ *   Run the queued callbacks of a connection in order. After
+ *   EventsPerTask events the task queues itself again, so one busy
+ *   connection does not hold a worker. A callback that throws closes its
+ *   connection.
+ *
+ *   @param connection - the connection
+ */
+void SocketServer::DrainEvents(const SocketConnectionPtr &connection)
+{
+    Endpoint &endpoint = m_endpoints[connection->m_endpoint];
+    for (size_t count = 0;; count++)
+    {
+        SocketConnection::Event event;
+        {
+            std::lock_guard<std::mutex> guard(connection->m_lock);
+            if (connection->m_events.empty())
+            {
+                connection->m_dispatching = false;
+                break;
+            }
+            if (count == EventsPerTask)
+            {
+                {
+                    std::lock_guard<std::mutex> callbacks(m_lock);
+                    m_callbacks++;
+                }
+                if (m_pool.Submit([this, connection]() { DrainEvents(connection); }))
+                {
+                    break;
+                }
+                CallbackDone();
+                count = 0;
+            }
+            event = std::move(connection->m_events.front());
+            connection->m_events.pop_front();
+        }
+
+        try
+        {
+            if (endpoint.coroutine)
+            {
+                if (event.type == SocketConnection::AcceptEvent)
+                    StartCoroutine(connection);
+                else
+                    connection->Deliver(std::move(event.data));
+                continue;
+            }
+
+            switch (event.type)
+            {
+            case SocketConnection::AcceptEvent:
+                endpoint.onAccept(connection);
+                break;
+            case SocketConnection::ReceiveEvent:
+                endpoint.onReceive(connection, event.data.GetData(), event.data.GetSize());
+                break;
+            case SocketConnection::CloseEvent:
+                endpoint.onClose(connection);
+                break;
+            }
+        }
+        catch (...)
+        {
+            connection->Close();
+        }
+    }
+    CallbackDone();
+}
+
+/**
+ *   Create the coroutine of a connection and run it up to its first
+ *   suspension. It counts as a running callback until it returns, and the
+ *   connection is closed then, whether it returned or threw.
+ *
+ *   @param connection - the connection
+ */
+void SocketServer::StartCoroutine(const SocketConnectionPtr &connection)
+{
+    CoTask<void> task = m_endpoints[connection->m_endpoint].coroutine(connection);
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_callbacks++;
+    }
+    CoStart(std::move(task), [this, connection](std::exception_ptr) {
+        connection->Close();
+        CallbackDone();
+    });
+}
+
+void SocketServer::CallbackDone(void)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (--m_callbacks == 0)
+    {
+        m_idle.notify_all();
+    }
+}
+
+#pragma endregion
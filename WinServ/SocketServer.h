@@ -0,0 +1,325 @@
+/*
+ * An event-driven TCP and UDP server engine for network services.
+ *
+ * The server runs one event loop per core. On Linux every loop owns its
+ * own listening sockets, bound to the same port with SO_REUSEPORT, so the
+ * kernel spreads new connections and datagrams across the loops, and each
+ * loop waits on its own epoll set. On Windows the loops are I/O completion
+ * ports; accepted connections are handed to the loops round robin.
+ *
+ * The loops only move bytes. Every callback runs on the thread pool: the
+ * callbacks of one connection run one at a time and in order (accept,
+ * then data, then close), while different connections and datagrams are
+ * handled in parallel. Send may be called from any thread.
+ *
+ * Instead of callbacks, a TCP endpoint can run a coroutine per connection
+ * that reads with co_await connection->Read(); it is resumed in the same
+ * order the callbacks would run.
+ *
+ * Start the server from OnStart and stop it from OnStop: Start throws the
+ * error code if a port cannot be bound, which fails the start, and Stop
+ * stops accepting, lets open connections finish within a deadline and
+ * waits for the callbacks still running.
+ *
+ * Pausing the server stops it accepting connections and reading datagrams,
+ * which wait in the socket buffers until it is resumed; open connections
+ * stay open.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "BufferPool.h"
+#include "Coroutine.h"
+#include "Metrics.h"
+#include "Pausable.h"
+#include "Platform.h"
+#include "ThreadPool.h"
+
+#ifdef _WIN32
+class IocpEventLoop;
+typedef IocpEventLoop SocketEventLoop;
+typedef uintptr_t SocketHandle;
+#else
+class EpollEventLoop;
+typedef EpollEventLoop SocketEventLoop;
+typedef int SocketHandle;
+#endif
+
+class SocketServer;
+
+// A TCP connection accepted by a SocketServer.
+class SocketConnection : public std::enable_shared_from_this<SocketConnection>
+{
+public:
+    // Awaiter of Read.
+    class ReadAwaiter
+    {
+    public:
+        explicit ReadAwaiter(SocketConnection &connection) : m_connection(connection) {}
+
+        bool await_ready(void) const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> handle);
+        Buffer await_resume(void) { return std::move(m_data); }
+
+    private:
+        friend class SocketConnection;
+
+        SocketConnection &m_connection;
+        std::coroutine_handle<> m_handle;
+        Buffer m_data;
+    };
+
+    SocketConnection(SocketServer &server, SocketEventLoop &loop, size_t endpoint,
+                     SocketHandle socket, const std::string &peer);
+
+    SocketConnection(const SocketConnection &) = delete;
+    SocketConnection &operator=(const SocketConnection &) = delete;
+
+    // Queue data to send. Safe to call from any thread; returns false if
+    // the connection is closing.
+    bool Send(const void *data, size_t size);
+
+    // Close the connection once the data queued so far has been sent.
+    void Close(void);
+
+    // Wait for the next data received, from the coroutine of a connection
+    // accepted by an endpoint with a ConnectionCoroutine. Gives an empty
+    // Buffer once the connection has closed.
+    ReadAwaiter Read(void) { return ReadAwaiter(*this); }
+
+    // A number that identifies the connection within the process.
+    unsigned long long GetId(void) const { return m_id; }
+
+    // The address and port of the peer, such as "127.0.0.1:50312".
+    const std::string &GetPeerAddress(void) const { return m_peer; }
+
+private:
+    friend class SocketServer;
+    friend class EpollEventLoop;
+    friend class IocpEventLoop;
+
+    enum EventType
+    {
+        AcceptEvent,
+        ReceiveEvent,
+        CloseEvent
+    };
+
+    struct Event
+    {
+        EventType type;
+        Buffer data;
+    };
+
+    // Hand received data, or the close when data is empty, to the
+    // coroutine of the connection.
+    void Deliver(Buffer data);
+
+    SocketServer &m_server;
+    SocketEventLoop &m_loop;
+    size_t m_endpoint;
+    SocketHandle m_socket;
+    unsigned long long m_id;
+    std::string m_peer;
+
+    // Guards the output and the state below
+    std::mutex m_lock;
+
+    // Data not yet written, and how much of the first buffer has been
+    std::deque<std::vector<char>> m_output;
+    size_t m_outputOffset;
+
+    // Whether the loop is writing the output, whether the connection
+    // closes once it has, and whether the socket is closed
+    bool m_writing;
+    bool m_closing;
+    bool m_closed;
+
+    // Events waiting for the thread pool, and whether a task is draining
+    // them
+    std::deque<Event> m_events;
+    bool m_dispatching;
+
+    // Data not yet read by the coroutine of the connection, whether the
+    // close has been delivered, and the read waiting for data
+    std::deque<Buffer> m_input;
+    bool m_inputClosed;
+    ReadAwaiter *m_reader;
+};
+
+typedef std::shared_ptr<SocketConnection> SocketConnectionPtr;
+
+// A datagram received by a SocketServer.
+class SocketDatagram
+{
+public:
+    SocketDatagram(SocketServer &server, size_t endpoint, SocketHandle socket,
+                   const void *from, int fromLength, const char *data, size_t size);
+
+    const char *GetData(void) const { return m_data.data(); }
+    size_t GetSize(void) const { return m_data.size(); }
+
+    // The address and port of the sender.
+    std::string GetPeerAddress(void) const;
+
+    // Send a datagram back to the sender.
+    bool Reply(const void *data, size_t size);
+
+private:
+    friend class SocketServer;
+
+    SocketServer &m_server;
+    size_t m_endpoint;
+    SocketHandle m_socket;
+
+    // The sender, as a sockaddr of m_fromLength bytes
+    unsigned char m_from[128];
+    int m_fromLength;
+
+    std::vector<char> m_data;
+};
+
+class SocketServer : public Pausable
+{
+public:
+    typedef std::function<void(const SocketConnectionPtr &connection)> ConnectionHandler;
+    typedef std::function<void(const SocketConnectionPtr &connection, const char *data, size_t size)> ReceiveHandler;
+    typedef std::function<void(SocketDatagram &datagram)> DatagramHandler;
+    typedef std::function<CoTask<void>(SocketConnectionPtr connection)> ConnectionCoroutine;
+
+    // Create a server whose callbacks run on the given pool.
+    explicit SocketServer(ThreadPool &pool = ThreadPool::Default());
+
+    // Stops the server without waiting for connections to finish.
+    ~SocketServer(void);
+
+    SocketServer(const SocketServer &) = delete;
+    SocketServer &operator=(const SocketServer &) = delete;
+
+    // Accept TCP connections on an address ("0.0.0.0", "::1", or NULL for
+    // every IPv4 address) and port, 0 for any free one. onReceive gets the
+    // data as it arrives; onAccept and onClose are optional. Call before
+    // Start. Returns the index of the endpoint.
+    size_t ListenTcp(const char *pszAddress, unsigned short port,
+                     ReceiveHandler onReceive,
+                     ConnectionHandler onAccept = ConnectionHandler(),
+                     ConnectionHandler onClose = ConnectionHandler());
+
+    // Accept TCP connections on an address and port and run a coroutine for
+    // each one, which reads with co_await connection->Read(). The
+    // connection is closed when the coroutine returns. Call before Start.
+    // Returns the index of the endpoint.
+    size_t ListenTcp(const char *pszAddress, unsigned short port, ConnectionCoroutine coroutine);
+
+    // Receive UDP datagrams on an address and port. Call before Start.
+    // Returns the index of the endpoint.
+    size_t BindUdp(const char *pszAddress, unsigned short port, DatagramHandler onDatagram);
+
+    // Bind the endpoints and start the event loops, one per hardware
+    // thread when loopCount is 0. Throws the error code if an endpoint
+    // cannot be bound.
+    void Start(size_t loopCount = 0);
+
+    // Stop accepting connections and datagrams, give open connections up
+    // to dwMilliseconds to close, close the rest and wait for the running
+    // callbacks and the connection coroutines. Must not be called from a
+    // callback or a connection coroutine.
+    void Stop(DWORD dwMilliseconds = 0);
+
+    // Stop accepting connections and reading datagrams until every Pause
+    // has had its Resume. The loops have stopped by the time Pause
+    // returns; the callbacks already queued are the business of the
+    // thread pool. Resume does not wait for the loops to start again.
+    virtual void Pause(void);
+    virtual bool WaitUntilQuiet(DWORD dwMilliseconds);
+    virtual void Resume(void);
+
+    // The port an endpoint is bound to, once started.
+    unsigned short GetPort(size_t endpoint) const;
+
+    // The number of open connections.
+    size_t GetConnectionCount(void) const;
+
+private:
+    friend class SocketConnection;
+    friend class SocketDatagram;
+    friend class EpollEventLoop;
+    friend class IocpEventLoop;
+
+    // Capacity of the pooled buffers connections are read into.
+    static const size_t ReceiveBufferSize = 16 * 1024;
+
+    struct Endpoint
+    {
+        bool tcp;
+        std::string address;
+        unsigned short port;
+        ReceiveHandler onReceive;
+        ConnectionHandler onAccept;
+        ConnectionHandler onClose;
+        ConnectionCoroutine coroutine;
+        DatagramHandler onDatagram;
+    };
+
+    // Called by the event loops.
+    void OnAccepted(const SocketConnectionPtr &connection);
+    void OnReceived(const SocketConnectionPtr &connection, Buffer data);
+    void OnClosed(const SocketConnectionPtr &connection);
+    void OnDatagram(std::unique_ptr<SocketDatagram> datagram);
+    void OnSent(size_t size);
+
+    // The loop that takes the next accepted connection.
+    SocketEventLoop &NextLoop(void);
+
+    // Queue an event of a connection for its callbacks.
+    void Dispatch(const SocketConnectionPtr &connection, SocketConnection::EventType type, Buffer data);
+
+    // Run the queued callbacks of a connection, in order.
+    void DrainEvents(const SocketConnectionPtr &connection);
+
+    // Start the coroutine of a newly accepted connection.
+    void StartCoroutine(const SocketConnectionPtr &connection);
+
+    // Account for a callback task that has finished.
+    void CallbackDone(void);
+
+    ThreadPool &m_pool;
+    std::vector<Endpoint> m_endpoints;
+
+    // The buffers the loops read connections into; they are handed to the
+    // callbacks without a copy
+    BufferPool m_buffers;
+
+    std::vector<std::unique_ptr<SocketEventLoop>> m_loops;
+    std::atomic<size_t> m_nextLoop;
+    std::atomic<unsigned long long> m_nextId;
+    bool m_running;
+
+    // The pauses that hold accepting still; a server started while paused
+    // starts paused
+    std::mutex m_pauseLock;
+    size_t m_pauseCount;
+
+    // Open connections, and callback tasks queued or running and connection
+    // coroutines that have not returned; Stop waits for both to drop to 0
+    mutable std::mutex m_lock;
+    std::condition_variable m_idle;
+    size_t m_connections;
+    size_t m_callbacks;
+
+    // Metrics of the server
+    MetricCounter m_accepted;
+    MetricCounter m_bytesReceived;
+    MetricCounter m_bytesSent;
+    MetricCounter m_datagrams;
+    MetricGauge m_open;
+};
@@ -0,0 +1,276 @@
+#pragma region Includes
+#include "StartupStages.h"
+#include <algorithm>
+#include "Trace.h"
+#pragma endregion
+
+#pragma region Declaring Stages
+
+/**
+ *   Declare a stage.
+ *
+ *   @param pszName - the name of the stage, unique within the service
+ *   @param action - the work of the stage; it may throw a DWORD error code
+ *   @param dependencies - the names of the stages that must finish first
+ *   @param dwWaitHint - the expected duration in milliseconds, or 0 for the
+ *   default
+ */
+void StartupStages::Add(const wchar_t *pszName,
+                        Action action,
+                        const std::vector<std::wstring> &dependencies,
+                        DWORD dwWaitHint)
+{
+    Stage stage;
+    stage.name = pszName;
+    stage.action = std::move(action);
+    stage.dependencies = dependencies;
+    stage.dwWaitHint = (dwWaitHint != 0) ? dwWaitHint : DefaultWaitHint;
+    stage.waiting = 0;
+    stage.ran = false;
+    m_stages.push_back(std::move(stage));
+}
+
+/**
+ *   Forget the declared stages and their timings.
+ */
+void StartupStages::Clear(void)
+{
+    m_stages.clear();
+}
+
+#pragma endregion
+
+#pragma region Running Stages
+
+/**
+ *   Run every stage, each as soon as its dependencies have finished, and
+ *   wait until all of them are done. Progress is reported on the calling
+ *   thread, once before the first stage starts and again after each stage
+ *   finishes.
+ *
+ *   @param pool - the pool that runs the stages
+ *   @param progress - receives the progress; may be empty
+ */
+void StartupStages::Run(ThreadPool &pool, const Progress &progress)
+{
+    // Resolve the dependencies by name.
+    for (size_t i = 0; i < m_stages.size(); i++)
+    {
+        m_stages[i].dependents.clear();
+        m_stages[i].ran = false;
+    }
+    for (size_t i = 0; i < m_stages.size(); i++)
+    {
+        Stage &stage = m_stages[i];
+        stage.waiting = stage.dependencies.size();
+        for (size_t d = 0; d < stage.dependencies.size(); d++)
+        {
+            size_t j = 0;
+            while (j < m_stages.size() && m_stages[j].name != stage.dependencies[d])
+                j++;
+            if (j == m_stages.size() || j == i)
+            {
+                throw static_cast<DWORD>(ERROR_INVALID_PARAMETER);
+            }
+            m_stages[j].dependents.push_back(i);
+        }
+    }
+
+    // Every stage must be reachable from the ones without dependencies;
+    // otherwise there is a cycle and Run would never finish.
+    std::vector<size_t> waiting(m_stages.size());
+    std::vector<size_t> order;
+    for (size_t i = 0; i < m_stages.size(); i++)
+    {
+        waiting[i] = m_stages[i].waiting;
+        if (waiting[i] == 0)
+            order.push_back(i);
+    }
+    for (size_t n = 0; n < order.size(); n++)
+    {
+        const std::vector<size_t> &dependents = m_stages[order[n]].dependents;
+        for (size_t d = 0; d < dependents.size(); d++)
+        {
+            if (--waiting[dependents[d]] == 0)
+                order.push_back(dependents[d]);
+        }
+    }
+    if (order.size() != m_stages.size())
+    {
+        throw static_cast<DWORD>(ERROR_INVALID_PARAMETER);
+    }
+
+    std::unique_lock<std::mutex> guard(m_lock);
+    m_started = Clock::now();
+    m_finished = 0;
+    m_running = 0;
+    m_error = std::exception_ptr();
+
+    std::vector<size_t> ready;
+    for (size_t i = 0; i < m_stages.size(); i++)
+    {
+        if (m_stages[i].waiting == 0)
+            ready.push_back(i);
+    }
+    m_running = ready.size();
+    DWORD dwWaitHint = GetWaitHint();
+    guard.unlock();
+
+    if (progress)
+    {
+        progress(0, m_stages.size(), dwWaitHint);
+    }
+    for (size_t i = 0; i < ready.size(); i++)
+    {
+        Schedule(pool, ready[i]);
+    }
+
+    guard.lock();
+    size_t reported = 0;
+    for (;;)
+    {
+        m_changed.wait(guard, [this, reported]() {
+            return m_finished != reported || m_running == 0;
+        });
+        if (m_running == 0 && (m_error || m_finished == m_stages.size()))
+        {
+            break;
+        }
+
+        reported = m_finished;
+        dwWaitHint = GetWaitHint();
+        guard.unlock();
+        if (progress)
+        {
+            progress(reported, m_stages.size(), dwWaitHint);
+        }
+        guard.lock();
+    }
+
+    if (m_error)
+    {
+        std::exception_ptr error = m_error;
+        m_error = std::exception_ptr();
+        std::rethrow_exception(error);
+    }
+}
+
+/**
+ *   Get the timings of the stages that ran.
+ */
+std::vector<StartupStages::Timing> StartupStages::GetTimings(void) const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    std::vector<Timing> timings;
+    for (size_t i = 0; i < m_stages.size(); i++)
+    {
+        const Stage &stage = m_stages[i];
+        if (!stage.ran)
+            continue;
+
+        Timing timing;
+        timing.name = stage.name;
+        timing.dwStarted = static_cast<DWORD>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(stage.started - m_started).count());
+        timing.dwDuration = static_cast<DWORD>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(stage.finished - stage.started).count());
+        timings.push_back(timing);
+    }
+    return timings;
+}
+
+#pragma endregion
+
+#pragma region Helper Functions
+
+/**
+ *   Queue a stage on the pool. A pool that is shutting down refuses new
+ *   work; the stage then runs on the calling thread.
+ *
+ *   @param pool - the pool
+ *   @param index - the stage
+ */
+void StartupStages::Schedule(ThreadPool &pool, size_t index)
+{
+    if (!pool.Submit([this, &pool, index]() { Execute(pool, index); }))
+    {
+        Execute(pool, index);
+    }
+}
+
+/**
+ *   Run one stage, record its timing and schedule the stages that were
+ *   only waiting for it. After a failure nothing new is scheduled.
+ *
+ *   @param pool - the pool that runs the stages
+ *   @param index - the stage
+ */
+void StartupStages::Execute(ThreadPool &pool, size_t index)
+{
+    Stage &stage = m_stages[index];
+    Clock::time_point started = Clock::now();
+    unsigned long long traced = Trace::IsEnabled() ? Trace::Now() : 0;
+    std::exception_ptr error;
+    try
+    {
+        stage.action();
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    Clock::time_point finished = Clock::now();
+    if (traced != 0)
+    {
+        Trace::Span(Trace::Intern(stage.name), "stage", traced);
+    }
+
+    std::vector<size_t> ready;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        stage.ran = true;
+        stage.started = started;
+        stage.finished = finished;
+        m_finished++;
+
+        if (error && !m_error)
+        {
+            m_error = error;
+        }
+        if (!m_error)
+        {
+            for (size_t d = 0; d < stage.dependents.size(); d++)
+            {
+                if (--m_stages[stage.dependents[d]].waiting == 0)
+                    ready.push_back(stage.dependents[d]);
+            }
+        }
+        m_running += ready.size();
+        m_running--;
+        m_changed.notify_all();
+    }
+
+    for (size_t i = 0; i < ready.size(); i++)
+    {
+        Schedule(pool, ready[i]);
+    }
+}
+
+/**
+ *   The wait hint for the remaining stages: the longest estimate among the
+ *   stages that have not finished, since the next progress report comes no
+ *   later than when the slowest running stage finishes. Called with the
+ *   lock held.
+ */
+DWORD StartupStages::GetWaitHint(void) const
+{
+    DWORD dwWaitHint = 0;
+    for (size_t i = 0; i < m_stages.size(); i++)
+    {
+        if (!m_stages[i].ran)
+            dwWaitHint = std::max(dwWaitHint, m_stages[i].dwWaitHint);
+    }
+    return dwWaitHint;
+}
+
+#pragma endregion
@@ -0,0 +1,104 @@
+/*
+ * Named initialization stages with dependencies.
+ *
+ * A service declares the steps of its startup (load caches, open
+ * connections, warm models) and what each one needs first. Run executes
+ * every stage whose dependencies are done on the thread pool, so
+ * independent stages overlap, and reports progress after each stage so the
+ * caller can keep the control manager's checkpoint and wait hint current.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Platform.h"
+#include "ThreadPool.h"
+
+class StartupStages
+{
+public:
+    typedef std::function<void(void)> Action;
+
+    // Called on the thread that runs the stages whenever a stage finishes,
+    // with the number of finished stages and the wait hint, in
+    // milliseconds, for the stages still to come.
+    typedef std::function<void(size_t finished, size_t total, DWORD dwWaitHint)> Progress;
+
+    // How long a stage is expected to take when it gives no estimate.
+    static const DWORD DefaultWaitHint = 30000;
+
+    // The timing of one stage, in milliseconds from the start of Run.
+    struct Timing
+    {
+        std::wstring name;
+        DWORD dwStarted;
+        DWORD dwDuration;
+    };
+
+    // Declare a stage. It runs once every stage named in dependencies has
+    // finished. dwWaitHint is how long it is expected to take, in ms.
+    void Add(const wchar_t *pszName,
+             Action action,
+             const std::vector<std::wstring> &dependencies = std::vector<std::wstring>(),
+             DWORD dwWaitHint = 0);
+
+    // True if no stage has been declared.
+    bool Empty(void) const { return m_stages.empty(); }
+
+    // Run the stages on the pool and wait for them. If a stage throws, the
+    // stages that have not started are skipped and, once the running ones
+    // have finished, the exception is rethrown. Throws ERROR_INVALID_PARAMETER
+    // for an unknown dependency or a dependency cycle.
+    void Run(ThreadPool &pool, const Progress &progress);
+
+    // The timings of the stages that ran, in the order they were declared.
+    std::vector<Timing> GetTimings(void) const;
+
+    // Forget the declared stages and their timings.
+    void Clear(void);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Stage
+    {
+        std::wstring name;
+        Action action;
+        std::vector<std::wstring> dependencies;
+        DWORD dwWaitHint;
+
+        // Stages that depend on this one, and how many of its own
+        // dependencies are not finished yet
+        std::vector<size_t> dependents;
+        size_t waiting;
+
+        bool ran;
+        Clock::time_point started;
+        Clock::time_point finished;
+    };
+
+    // Queue a stage on the pool, or run it here if the pool refuses it.
+    void Schedule(ThreadPool &pool, size_t index);
+
+    // Run one stage and release the stages that depend on it.
+    void Execute(ThreadPool &pool, size_t index);
+
+    // The wait hint for the stages that have not finished.
+    DWORD GetWaitHint(void) const;
+
+    std::vector<Stage> m_stages;
+    Clock::time_point m_started;
+
+    mutable std::mutex m_lock;
+    std::condition_variable m_changed;
+    size_t m_finished;
+    size_t m_running;
+    std::exception_ptr m_error;
+};
@@ -0,0 +1,75 @@
+#pragma region Includes
+#include "StatusSnapshot.h"
+#include <string.h>
+#include <thread>
+#pragma endregion
+
+#pragma region Status Snapshot
+
+StatusSnapshot::StatusSnapshot(void)
+    : m_sequence(0)
+{
+    static_assert(sizeof(SERVICE_STATUS) == FieldCount * sizeof(DWORD),
+                  "SERVICE_STATUS is expected to be a plain array of DWORDs");
+    for (size_t i = 0; i < FieldCount; i++)
+    {
+        m_fields[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+/**
+ *   Read a consistent copy of the status. Spins (yielding now and then)
+ *   only while a store is in progress, which takes a few nanoseconds.
+ *
+ *   @return the last published status
+ */
+SERVICE_STATUS StatusSnapshot::Load(void) const
+{
+    DWORD fields[FieldCount];
+    for (unsigned int attempt = 0;; attempt++)
+    {
+        unsigned long before = m_sequence.load(std::memory_order_acquire);
+        if ((before & 1) == 0)
+        {
+            for (size_t i = 0; i < FieldCount; i++)
+            {
+                fields[i] = m_fields[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (m_sequence.load(std::memory_order_relaxed) == before)
+            {
+                break;
+            }
+        }
+        if (attempt % 64 == 63)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    SERVICE_STATUS status;
+    memcpy(&status, fields, sizeof(status));
+    return status;
+}
+
+/**
+ *   Publish a new status.
+ *
+ *   @param status - the status
+ */
+void StatusSnapshot::Store(const SERVICE_STATUS &status)
+{
+    DWORD fields[FieldCount];
+    memcpy(fields, &status, sizeof(fields));
+
+    unsigned long sequence = m_sequence.load(std::memory_order_relaxed);
+    m_sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < FieldCount; i++)
+    {
+        m_fields[i].store(fields[i], std::memory_order_relaxed);
+    }
+    m_sequence.store(sequence + 2, std::memory_order_release);
+}
+
+#pragma endregion
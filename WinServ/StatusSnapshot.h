@@ -0,0 +1,36 @@
+/*
+ * A SERVICE_STATUS that any thread can read without taking a lock.
+ *
+ * The status is published with a sequence lock: the writer makes the
+ * sequence odd, stores the fields and makes it even again; a reader copies
+ * the fields and retries if the sequence was odd or moved meanwhile. The
+ * fields are relaxed atomics, so the copy is never a data race.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include "Platform.h"
+
+class StatusSnapshot
+{
+public:
+    StatusSnapshot(void);
+
+    StatusSnapshot(const StatusSnapshot &) = delete;
+    StatusSnapshot &operator=(const StatusSnapshot &) = delete;
+
+    // Read a consistent copy of the status. Lock-free; never blocks the
+    // writer.
+    SERVICE_STATUS Load(void) const;
+
+    // Publish a new status. Writers must be serialized by the caller.
+    void Store(const SERVICE_STATUS &status);
+
+private:
+    static const size_t FieldCount = sizeof(SERVICE_STATUS) / sizeof(DWORD);
+
+    std::atomic<unsigned long> m_sequence;
+    std::atomic<DWORD> m_fields[FieldCount];
+};
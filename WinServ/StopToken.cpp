@@ -0,0 +1,183 @@
+#pragma region Includes
+#include "StopToken.h"
+#include <chrono>
+#pragma endregion
+
+#pragma region Stop Token
+
+/**
+ *   Check whether a stop has been requested. This is a single atomic
+ *   load, cheap enough for tight loops.
+ */
+bool StopToken::StopRequested(void) const
+{
+    return m_state && m_state->requested.load(std::memory_order_acquire);
+}
+
+/**
+ *   Block until a stop is requested or the timeout elapses.
+ *
+ *   @param dwMilliseconds - the longest time to wait
+ *   @return true if a stop was requested
+ */
+bool StopToken::WaitFor(DWORD dwMilliseconds) const
+{
+    if (m_state == NULL)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(dwMilliseconds));
+        return false;
+    }
+
+    std::unique_lock<std::mutex> guard(m_state->lock);
+    return m_state->changed.wait_for(guard, std::chrono::milliseconds(dwMilliseconds),
+                                     [this]() { return m_state->requested.load(); });
+}
+
+/**
+ *   Block until a stop is requested. Returns immediately for a token
+ *   that cannot be stopped.
+ */
+void StopToken::Wait(void) const
+{
+    if (m_state == NULL)
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> guard(m_state->lock);
+    m_state->changed.wait(guard, [this]() { return m_state->requested.load(); });
+}
+
+#pragma endregion
+
+#pragma region Stop Source
+
+StopSource::StopSource(void)
+    : m_state(std::make_shared<StopToken::State>())
+{
+}
+
+/**
+ *   Request a stop. Waiters are woken first; then the registered callbacks
+ *   run one by one on the calling thread, without the lock held, so they
+ *   may block or deregister other callbacks.
+ *
+ *   @return false if a stop was already requested
+ */
+bool StopSource::RequestStop(void)
+{
+    std::unique_lock<std::mutex> guard(m_state->lock);
+    if (m_state->requested.load())
+    {
+        return false;
+    }
+    m_state->requested.store(true, std::memory_order_release);
+    m_state->changed.notify_all();
+
+    while (m_state->callbacks)
+    {
+        StopCallback *callback = m_state->callbacks;
+        m_state->callbacks = callback->m_next;
+        if (callback->m_next)
+        {
+            callback->m_next->m_prev = NULL;
+        }
+        callback->m_registered = false;
+        m_state->running = callback;
+        m_state->runner = std::this_thread::get_id();
+
+        guard.unlock();
+        try
+        {
+            callback->m_callback();
+        }
+        catch (...)
+        {
+            // One failing callback must not keep the others from running.
+        }
+        guard.lock();
+
+        m_state->running = NULL;
+        m_state->changed.notify_all();
+    }
+    return true;
+}
+
+bool StopSource::StopRequested(void) const
+{
+    return m_state->requested.load(std::memory_order_acquire);
+}
+
+StopToken StopSource::GetToken(void) const
+{
+    return StopToken(m_state);
+}
+
+#pragma endregion
+
+#pragma region Stop Callback
+
+/**
+ *   Register a callback, or run it right away if the stop has already
+ *   been requested.
+ *
+ *   @param token - the token to watch
+ *   @param callback - the function to run when the stop is requested
+ */
+StopCallback::StopCallback(const StopToken &token, std::function<void(void)> callback)
+    : m_state(token.m_state), m_callback(std::move(callback)),
+      m_prev(NULL), m_next(NULL), m_registered(false)
+{
+    if (m_state == NULL)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(m_state->lock);
+        if (!m_state->requested.load())
+        {
+            m_next = m_state->callbacks;
+            if (m_next)
+            {
+                m_next->m_prev = this;
+            }
+            m_state->callbacks = this;
+            m_registered = true;
+            return;
+        }
+    }
+    m_callback();
+}
+
+/**
+ *   Deregister the callback. If RequestStop is running it on another
+ *   thread, wait until it returns so that nothing it uses goes away.
+ */
+StopCallback::~StopCallback(void)
+{
+    if (m_state == NULL)
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> guard(m_state->lock);
+    if (m_registered)
+    {
+        if (m_prev)
+            m_prev->m_next = m_next;
+        else
+            m_state->callbacks = m_next;
+        if (m_next)
+            m_next->m_prev = m_prev;
+        m_registered = false;
+        return;
+    }
+
+    if (m_state->running == this && m_state->runner != std::this_thread::get_id())
+    {
+        m_state->changed.wait(guard, [this]() { return m_state->running != this; });
+    }
+}
+
+#pragma endregion
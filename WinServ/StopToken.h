@@ -0,0 +1,102 @@
+/*
+ * Cooperative cancellation.
+ *
+ * A StopSource owns a stop state; StopTokens are cheap copies that observe
+ * it. Code that may run for a while checks StopRequested(), waits on the
+ * token instead of sleeping, or registers a StopCallback to interrupt a
+ * blocking call (close a socket, signal an event) when the stop arrives.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "Platform.h"
+
+class StopCallback;
+
+class StopToken
+{
+public:
+    // A token that can never be stopped.
+    StopToken(void) {}
+
+    // True once a stop has been requested.
+    bool StopRequested(void) const;
+
+    // True if the token is connected to a StopSource.
+    bool StopPossible(void) const { return m_state != NULL; }
+
+    // Block until a stop is requested or the timeout (in milliseconds)
+    // elapses. Returns true if a stop was requested.
+    bool WaitFor(DWORD dwMilliseconds) const;
+
+    // Block until a stop is requested.
+    void Wait(void) const;
+
+private:
+    friend class StopSource;
+    friend class StopCallback;
+
+    struct State
+    {
+        State(void) : requested(false), callbacks(NULL), running(NULL) {}
+
+        std::atomic<bool> requested;
+        std::mutex lock;
+        std::condition_variable changed;
+
+        // Registered callbacks, and the one being invoked right now.
+        StopCallback *callbacks;
+        StopCallback *running;
+        std::thread::id runner;
+    };
+
+    explicit StopToken(const std::shared_ptr<State> &state) : m_state(state) {}
+
+    std::shared_ptr<State> m_state;
+};
+
+class StopSource
+{
+public:
+    StopSource(void);
+
+    // Request a stop: wake every waiter and run the registered callbacks on
+    // the calling thread. Returns false if a stop was already requested.
+    bool RequestStop(void);
+
+    bool StopRequested(void) const;
+
+    StopToken GetToken(void) const;
+
+private:
+    std::shared_ptr<StopToken::State> m_state;
+};
+
+// Runs a function when a stop is requested on a token; immediately (in the
+// constructor) if it already was. Destroying the callback deregisters it
+// and, if it is running on another thread, waits for it to return.
+class StopCallback
+{
+public:
+    StopCallback(const StopToken &token, std::function<void(void)> callback);
+    ~StopCallback(void);
+
+    StopCallback(const StopCallback &) = delete;
+    StopCallback &operator=(const StopCallback &) = delete;
+
+private:
+    friend class StopSource;
+
+    std::shared_ptr<StopToken::State> m_state;
+    std::function<void(void)> m_callback;
+    StopCallback *m_prev;
+    StopCallback *m_next;
+    bool m_registered;
+};
@@ -0,0 +1,279 @@
+#pragma region Includes
+#include "Task.h"
+#include <atomic>
+#include <mutex>
+#pragma endregion
+
+#pragma region Closure Block Pool
+
+namespace
+{
+    // Block sizes served from the free lists. Larger closures go straight to
+    // the heap.
+    const size_t c_blockSizes[] = {64, 128, 256, 512, 1024};
+    const size_t c_classCount = sizeof(c_blockSizes) / sizeof(c_blockSizes[0]);
+
+    // Blocks a thread keeps before handing a batch back to the depot, and
+    // the size of the batches moved between a thread and the depot.
+    const size_t c_cacheLimit = 128;
+    const size_t c_batchSize = 32;
+
+    struct BlockLink
+    {
+        BlockLink *next;
+    };
+
+    std::atomic<size_t> g_heapAllocations(0);
+
+    // Process-wide store of free blocks. Threads only visit it in batches,
+    // when their own cache runs dry or overflows, which happens when blocks
+    // are allocated on one thread and freed on another.
+    struct Depot
+    {
+        std::mutex lock;
+        BlockLink *head[c_classCount];
+        size_t count[c_classCount];
+
+        Depot(void)
+        {
+            for (size_t i = 0; i < c_classCount; i++)
+            {
+                head[i] = NULL;
+                count[i] = 0;
+            }
+        }
+
+        static Depot &Instance(void)
+        {
+            // Never destroyed: thread caches may flush into it while the
+            // process is exiting.
+            static Depot *depot = new Depot();
+            return *depot;
+        }
+    };
+
+    struct ThreadCache
+    {
+        BlockLink *head[c_classCount];
+        size_t count[c_classCount];
+
+        ThreadCache(void)
+        {
+            for (size_t i = 0; i < c_classCount; i++)
+            {
+                head[i] = NULL;
+                count[i] = 0;
+            }
+        }
+
+        // Give everything back to the depot when the thread exits.
+        ~ThreadCache(void)
+        {
+            for (size_t i = 0; i < c_classCount; i++)
+            {
+                Release(i, count[i]);
+            }
+        }
+
+        // Move up to c_batchSize blocks of a class from the depot.
+        void Refill(size_t sizeClass)
+        {
+            Depot &depot = Depot::Instance();
+            std::lock_guard<std::mutex> guard(depot.lock);
+            for (size_t n = 0; n < c_batchSize && depot.head[sizeClass]; n++)
+            {
+                BlockLink *block = depot.head[sizeClass];
+                depot.head[sizeClass] = block->next;
+                depot.count[sizeClass]--;
+                block->next = head[sizeClass];
+                head[sizeClass] = block;
+                count[sizeClass]++;
+            }
+        }
+
+        // Move the given number of blocks of a class to the depot.
+        void Release(size_t sizeClass, size_t blocks)
+        {
+            if (blocks == 0)
+                return;
+
+            Depot &depot = Depot::Instance();
+            std::lock_guard<std::mutex> guard(depot.lock);
+            for (size_t n = 0; n < blocks && head[sizeClass]; n++)
+            {
+                BlockLink *block = head[sizeClass];
+                head[sizeClass] = block->next;
+                count[sizeClass]--;
+                block->next = depot.head[sizeClass];
+                depot.head[sizeClass] = block;
+                depot.count[sizeClass]++;
+            }
+        }
+    };
+
+    thread_local ThreadCache t_cache;
+
+    // The size class serving a closure, or c_classCount if it is too large.
+    size_t SizeClass(size_t size)
+    {
+        size_t i = 0;
+        while (i < c_classCount && c_blockSizes[i] < size)
+            i++;
+        return i;
+    }
+}
+
+/**
+ *   Get a block for a closure that does not fit inline. Served from the
+ *   calling thread's free list, refilled from the depot in batches; only a
+ *   cold pool falls back to the heap.
+ *
+ *   @param size - the size of the closure
+ */
+void *Task::AllocateBlock(size_t size)
+{
+    size_t sizeClass = SizeClass(size);
+    if (sizeClass == c_classCount)
+    {
+        g_heapAllocations.fetch_add(1, std::memory_order_relaxed);
+        return ::operator new(size);
+    }
+
+    ThreadCache &cache = t_cache;
+    if (cache.head[sizeClass] == NULL)
+    {
+        cache.Refill(sizeClass);
+    }
+    if (cache.head[sizeClass] == NULL)
+    {
+        g_heapAllocations.fetch_add(1, std::memory_order_relaxed);
+        return ::operator new(c_blockSizes[sizeClass]);
+    }
+
+    BlockLink *block = cache.head[sizeClass];
+    cache.head[sizeClass] = block->next;
+    cache.count[sizeClass]--;
+    return block;
+}
+
+/**
+ *   Return a closure block to the calling thread's free list, spilling a
+ *   batch to the depot when the list is full.
+ *
+ *   @param block - the block to free
+ *   @param size - the size of the closure it held
+ */
+void Task::FreeBlock(void *block, size_t size) noexcept
+{
+    size_t sizeClass = SizeClass(size);
+    if (sizeClass == c_classCount)
+    {
+        ::operator delete(block);
+        return;
+    }
+
+    ThreadCache &cache = t_cache;
+    BlockLink *node = static_cast<BlockLink *>(block);
+    node->next = cache.head[sizeClass];
+    cache.head[sizeClass] = node;
+    cache.count[sizeClass]++;
+
+    if (cache.count[sizeClass] > c_cacheLimit)
+    {
+        try
+        {
+            cache.Release(sizeClass, c_batchSize);
+        }
+        catch (...)
+        {
+            // Failing to lock the depot only means the block stays cached.
+        }
+    }
+}
+
+/**
+ *   The number of closure blocks obtained from the heap so far.
+ */
+size_t Task::GetHeapAllocationCount(void)
+{
+    return g_heapAllocations.load(std::memory_order_relaxed);
+}
+
+#pragma endregion
+
+#pragma region Task Queue
+
+/**
+ *   Create an empty queue.
+ *
+ *   @param capacity - initial capacity, rounded up to a power of two
+ */
+TaskQueue::TaskQueue(size_t capacity)
+    : m_head(0), m_count(0)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    m_items.resize(size);
+}
+
+/**
+ *   Append a task at the back of the queue.
+ */
+void TaskQueue::PushBack(Task &&task)
+{
+    if (m_count == m_items.size())
+    {
+        Grow();
+    }
+    m_items[(m_head + m_count) & (m_items.size() - 1)] = std::move(task);
+    m_count++;
+}
+
+/**
+ *   Remove the newest task. The queue must not be empty.
+ */
+void TaskQueue::PopBack(Task &task)
+{
+    m_count--;
+    task = std::move(m_items[(m_head + m_count) & (m_items.size() - 1)]);
+}
+
+/**
+ *   Remove the oldest task. The queue must not be empty.
+ */
+void TaskQueue::PopFront(Task &task)
+{
+    task = std::move(m_items[m_head]);
+    m_head = (m_head + 1) & (m_items.size() - 1);
+    m_count--;
+}
+
+/**
+ *   Grow the queue until it holds at least the given number of tasks.
+ *
+ *   @param capacity - the number of tasks
+ */
+void TaskQueue::Reserve(size_t capacity)
+{
+    while (m_items.size() < capacity)
+    {
+        Grow();
+    }
+}
+
+/**
+ *   Double the capacity, unwrapping the ring into the new buffer.
+ */
+void TaskQueue::Grow(void)
+{
+    std::vector<Task> items(m_items.size() * 2);
+    for (size_t i = 0; i < m_count; i++)
+    {
+        items[i] = std::move(m_items[(m_head + i) & (m_items.size() - 1)]);
+    }
+    m_items.swap(items);
+    m_head = 0;
+}
+
+#pragma endregion
@@ -0,0 +1,199 @@
+/*
+ * Allocation-free work items for the thread pool.
+ *
+ * Task is a move-only callable. Closures up to InlineSize bytes are stored
+ * inside the task itself; larger ones live in blocks recycled through
+ * per-thread free lists (backed by a shared depot), so queueing and running
+ * work does not touch the heap once the caches are warm. TaskQueue is the
+ * ring buffer the pool keeps its tasks in; it only ever grows.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+class Task
+{
+public:
+    // Closures up to this size (and nothrow movable) are stored inline.
+    static const size_t InlineSize = 48;
+
+    Task(void) noexcept : m_ops(NULL) {}
+
+    template <typename F,
+              typename = typename std::enable_if<
+                  !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F &&function) : m_ops(NULL)
+    {
+        typedef typename std::decay<F>::type Closure;
+        static_assert(alignof(Closure) <= alignof(std::max_align_t),
+                      "over-aligned closures are not supported");
+
+        typedef std::integral_constant<
+            bool, sizeof(Closure) <= InlineSize &&
+                      std::is_nothrow_move_constructible<Closure>::value>
+            FitsInline;
+        Construct<Closure>(std::forward<F>(function), FitsInline());
+    }
+
+    Task(Task &&other) noexcept : m_ops(other.m_ops)
+    {
+        if (m_ops)
+        {
+            m_ops->move(m_storage, other.m_storage);
+            other.m_ops = NULL;
+        }
+    }
+
+    Task &operator=(Task &&other) noexcept
+    {
+        if (this != &other)
+        {
+            Reset();
+            m_ops = other.m_ops;
+            if (m_ops)
+            {
+                m_ops->move(m_storage, other.m_storage);
+                other.m_ops = NULL;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    ~Task(void) { Reset(); }
+
+    // Run the closure. The task must not be empty.
+    void operator()(void) { m_ops->invoke(m_storage); }
+
+    explicit operator bool(void) const { return m_ops != NULL; }
+
+    // The type of the closure, which tells what the task is when it has to
+    // be reported. The task must not be empty.
+    const std::type_info &GetType(void) const { return *m_ops->type; }
+
+    // Destroy the closure and release its storage.
+    void Reset(void) noexcept
+    {
+        if (m_ops)
+        {
+            m_ops->destroy(m_storage);
+            m_ops = NULL;
+        }
+    }
+
+    // Number of closure blocks obtained from the heap so far. Once the
+    // free lists are warm this stops growing.
+    static size_t GetHeapAllocationCount(void);
+
+private:
+    struct Ops
+    {
+        void (*invoke)(void *storage);
+        void (*move)(void *to, void *from);
+        void (*destroy)(void *storage);
+        const std::type_info *type;
+    };
+
+    template <typename Closure>
+    struct InlineOps
+    {
+        static void Invoke(void *storage) { (*static_cast<Closure *>(storage))(); }
+        static void Move(void *to, void *from)
+        {
+            Closure *source = static_cast<Closure *>(from);
+            new (to) Closure(std::move(*source));
+            source->~Closure();
+        }
+        static void Destroy(void *storage) { static_cast<Closure *>(storage)->~Closure(); }
+        static const Ops s_ops;
+    };
+
+    template <typename Closure>
+    struct PooledOps
+    {
+        static Closure *Get(void *storage) { return *static_cast<Closure **>(storage); }
+        static void Invoke(void *storage) { (*Get(storage))(); }
+        static void Move(void *to, void *from) { *static_cast<void **>(to) = *static_cast<void **>(from); }
+        static void Destroy(void *storage)
+        {
+            Closure *closure = Get(storage);
+            closure->~Closure();
+            FreeBlock(closure, sizeof(Closure));
+        }
+        static const Ops s_ops;
+    };
+
+    // Store a small closure inside the task.
+    template <typename Closure, typename F>
+    void Construct(F &&function, std::true_type)
+    {
+        new (m_storage) Closure(std::forward<F>(function));
+        m_ops = &InlineOps<Closure>::s_ops;
+    }
+
+    // Store a large closure in a pooled block.
+    template <typename Closure, typename F>
+    void Construct(F &&function, std::false_type)
+    {
+        void *block = AllocateBlock(sizeof(Closure));
+        try
+        {
+            new (block) Closure(std::forward<F>(function));
+        }
+        catch (...)
+        {
+            FreeBlock(block, sizeof(Closure));
+            throw;
+        }
+        *reinterpret_cast<void **>(m_storage) = block;
+        m_ops = &PooledOps<Closure>::s_ops;
+    }
+
+    // Closure blocks, recycled through per-thread free lists.
+    static void *AllocateBlock(size_t size);
+    static void FreeBlock(void *block, size_t size) noexcept;
+
+    alignas(std::max_align_t) unsigned char m_storage[InlineSize];
+    const Ops *m_ops;
+};
+
+template <typename Closure>
+const Task::Ops Task::InlineOps<Closure>::s_ops = {&Invoke, &Move, &Destroy, &typeid(Closure)};
+
+template <typename Closure>
+const Task::Ops Task::PooledOps<Closure>::s_ops = {&Invoke, &Move, &Destroy, &typeid(Closure)};
+
+// A growable ring buffer of tasks supporting push/pop at the back and pop at
+// the front. Capacity is kept as a power of two and is never given back, so
+// a queue that has reached its working size no longer allocates.
+class TaskQueue
+{
+public:
+    explicit TaskQueue(size_t capacity = 64);
+
+    bool Empty(void) const { return m_count == 0; }
+    size_t Size(void) const { return m_count; }
+
+    void PushBack(Task &&task);
+    void PopBack(Task &task);
+    void PopFront(Task &task);
+
+    // Grow the queue to hold at least capacity tasks without growing again.
+    void Reserve(size_t capacity);
+
+private:
+    void Grow(void);
+
+    std::vector<Task> m_items;
+    size_t m_head;
+    size_t m_count;
+};
@@ -0,0 +1,1269 @@
+#pragma region Includes
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include "Trace.h"
+#pragma endregion
+
+namespace
+{
+    const wchar_t *const c_priorityNames[PriorityCount] = {L"high", L"normal", L"low"};
+
+    // A worker looks at low priority work first on one turn in this many.
+    const unsigned int c_lowPriorityTurn = 64;
+
+    // How often the controller samples a pool unless told otherwise, and
+    // how long the workers of the default pool may sleep before retiring,
+    // in milliseconds.
+    const DWORD c_controlInterval = 100;
+    const DWORD c_idleTimeout = 20000;
+
+    // A change of throughput by less than this fraction counts as flat.
+    const double c_throughputMargin = 0.1;
+
+    // The pool is behind when queued work has waited this long, in
+    // microseconds.
+    const unsigned long long c_behindWait = 1000;
+
+    unsigned long long NowMicroseconds(void)
+    {
+        return static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+}
+
+#pragma region Static Members
+
+thread_local ThreadPool *ThreadPool::t_pool = NULL;
+thread_local size_t ThreadPool::t_index = 0;
+
+/**
+ *   The process-wide pool shared by the framework. It is created on first
+ *   use and joined when the process exits.
+ */
+ThreadPool &ThreadPool::Default(void)
+{
+    static ThreadPool pool(GetDefaultSizing());
+    return pool;
+}
+
+PoolSizing ThreadPool::GetDefaultSizing(void)
+{
+    PoolSizing sizing;
+    sizing.minThreads = std::max<size_t>(std::thread::hardware_concurrency(), 2);
+    sizing.maxThreads = std::max<size_t>(sizing.minThreads * 4, 16);
+    sizing.dwInterval = c_controlInterval;
+    sizing.dwIdleTimeout = c_idleTimeout;
+    return sizing;
+}
+
+#pragma endregion
+
+#pragma region Pool Constructor and Destructor
+
+/**
+ *   Create the pool and start its workers.
+ *
+ *   @param threadCount - number of workers, zero for one per hardware thread
+ */
+ThreadPool::ThreadPool(size_t threadCount)
+    : m_started(0), m_nextNode(0), m_pending(0), m_sleepers(0), m_stopping(false),
+      m_watchdog(Watchdog::Default()), m_paused(false), m_pauseCount(0), m_running(0), m_idleWaiters(0), m_threads(0), m_target(0)
+{
+    PoolSizing sizing;
+    sizing.minThreads = threadCount;
+    sizing.maxThreads = threadCount;
+    sizing.dwInterval = c_controlInterval;
+    sizing.dwIdleTimeout = INFINITE;
+    Start(sizing, PoolPlacement());
+}
+
+/**
+ *   Create the pool with its workers placed on the machine, and start them.
+ *
+ *   @param threadCount - number of workers, zero for one per CPU the pool
+ *   may use
+ *   @param placement - the CPUs the pool may use and how its workers are
+ *   pinned to them
+ */
+ThreadPool::ThreadPool(size_t threadCount, const PoolPlacement &placement)
+    : m_started(0), m_nextNode(0), m_pending(0), m_sleepers(0), m_stopping(false),
+      m_watchdog(Watchdog::Default()), m_paused(false), m_pauseCount(0), m_running(0), m_idleWaiters(0), m_threads(0), m_target(0)
+{
+    PoolSizing sizing;
+    sizing.minThreads = threadCount;
+    sizing.maxThreads = threadCount;
+    sizing.dwInterval = c_controlInterval;
+    sizing.dwIdleTimeout = INFINITE;
+    Start(sizing, placement);
+}
+
+/**
+ *   Create a pool that sizes itself, and start its fewest workers.
+ *
+ *   @param sizing - the fewest and most workers, zero for one per CPU the
+ *   pool may use, and how the controller samples the pool
+ *   @param placement - where the workers run
+ */
+ThreadPool::ThreadPool(const PoolSizing &sizing, const PoolPlacement &placement)
+    : m_started(0), m_nextNode(0), m_pending(0), m_sleepers(0), m_stopping(false),
+      m_watchdog(Watchdog::Default()), m_paused(false), m_pauseCount(0), m_running(0), m_idleWaiters(0), m_threads(0), m_target(0)
+{
+    Start(sizing, placement);
+}
+
+/**
+ *   Register the metrics of the pool, create every worker it may have and
+ *   its node groups, and start the fewest workers. Placed workers are
+ *   spread evenly over the CPUs the pool may use, in node order, so that
+ *   each node gets its share; workers beyond the fewest wrap around.
+ *
+ *   @param sizing - the fewest and most workers, or zero
+ *   @param placement - where the workers run
+ */
+void ThreadPool::Start(const PoolSizing &sizing, const PoolPlacement &placement)
+{
+    MetricsRegistry &metrics = MetricsRegistry::Default();
+    m_submitted = metrics.GetCounter(L"threadpool.submitted");
+    m_rejected = metrics.GetCounter(L"threadpool.rejected");
+    m_executed = metrics.GetCounter(L"threadpool.executed");
+    m_stolen = metrics.GetCounter(L"threadpool.stolen");
+    m_failed = metrics.GetCounter(L"threadpool.failed");
+    m_nodeLocal = metrics.GetCounter(L"threadpool.node_local");
+    m_nodeRemote = metrics.GetCounter(L"threadpool.node_remote");
+    m_pinFailed = metrics.GetCounter(L"threadpool.pin_failed");
+    m_threadsGauge = metrics.GetGauge(L"threadpool.threads");
+    m_targetGauge = metrics.GetGauge(L"threadpool.target");
+    m_throughput = metrics.GetGauge(L"threadpool.throughput");
+    m_oldestWait = metrics.GetGauge(L"threadpool.oldest_wait_us");
+    m_grown = metrics.GetCounter(L"threadpool.grown");
+    m_retired = metrics.GetCounter(L"threadpool.retired");
+    m_starved = metrics.GetCounter(L"threadpool.starved");
+    for (size_t p = 0; p < PriorityCount; p++)
+    {
+        std::wstring prefix = std::wstring(L"threadpool.") + c_priorityNames[p];
+        m_classes[p].depth = metrics.GetGauge((prefix + L".depth").c_str());
+        m_classes[p].wait = metrics.GetHistogram((prefix + L".wait_us").c_str());
+        m_classes[p].rejected = metrics.GetCounter((prefix + L".rejected").c_str());
+        m_classes[p].shed = metrics.GetCounter((prefix + L".shed").c_str());
+    }
+
+    // The CPUs the workers are placed on, in node order, and their groups.
+    std::vector<unsigned int> cpus;
+    std::vector<size_t> cpuNodes;
+    size_t cpuCount;
+    if (placement.affinity == AffinityNone)
+    {
+        m_nodes.push_back(std::unique_ptr<NodeGroup>(new NodeGroup()));
+        cpuCount = std::thread::hardware_concurrency();
+    }
+    else
+    {
+        CpuTopology topology = (placement.topology != NULL) ? *placement.topology : CpuTopology::Current();
+        if (!placement.cpus.empty())
+        {
+            topology.Restrict(placement.cpus);
+        }
+        for (size_t n = 0; n < topology.GetNodeCount(); n++)
+        {
+            m_nodes.push_back(std::unique_ptr<NodeGroup>(new NodeGroup()));
+            m_nodes[n]->cpus = topology.GetNode(n).cpus;
+            cpus.insert(cpus.end(), m_nodes[n]->cpus.begin(), m_nodes[n]->cpus.end());
+            cpuNodes.insert(cpuNodes.end(), m_nodes[n]->cpus.size(), n);
+        }
+        cpuCount = cpus.size();
+    }
+    m_sizing = sizing;
+    m_sizing.minThreads = std::max<size_t>((sizing.minThreads == 0) ? cpuCount : sizing.minThreads, 2);
+    m_sizing.maxThreads = std::max((sizing.maxThreads == 0) ? cpuCount : sizing.maxThreads, m_sizing.minThreads);
+    size_t threadCount = m_sizing.minThreads;
+
+    // Create every worker before starting any thread so that thieves can
+    // walk the whole list without synchronization. The deques of workers
+    // that may never run stay small.
+    for (size_t i = 0; i < m_sizing.maxThreads; i++)
+    {
+        std::unique_ptr<Worker> worker(new Worker());
+        if (i >= threadCount)
+        {
+            worker->items = TaskQueue(1);
+        }
+        worker->node = 0;
+        worker->fSleeping = false;
+        worker->fActive = false;
+        worker->slot = NULL;
+        worker->completed.store(0, std::memory_order_relaxed);
+        if (!cpus.empty())
+        {
+            size_t cpu = (i * cpus.size() / threadCount) % cpus.size();
+            worker->node = cpuNodes[cpu];
+            if (placement.affinity == AffinityCpu)
+                worker->cpus.push_back(cpus[cpu]);
+            else
+                worker->cpus = m_nodes[worker->node]->cpus;
+        }
+        if (m_nodes[worker->node]->firstWorker == SIZE_MAX)
+        {
+            m_nodes[worker->node]->firstWorker = i;
+        }
+        m_workers.push_back(std::move(worker));
+    }
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_target = threadCount;
+    m_targetGauge.Set(static_cast<long long>(threadCount));
+    for (size_t i = 0; i < threadCount; i++)
+    {
+        StartWorker(i);
+    }
+    if (m_sizing.minThreads < m_sizing.maxThreads)
+    {
+        m_controller = std::thread(&ThreadPool::ControlLoop, this);
+    }
+}
+
+/**
+ *   Drain the queued work and join the workers.
+ */
+ThreadPool::~ThreadPool(void)
+{
+    Shutdown();
+}
+
+#pragma endregion
+
+#pragma region Queueing and Dispatch
+
+/**
+ *   Stop accepting work, run whatever is already queued and join the
+ *   workers. Calling it more than once is harmless.
+ */
+void ThreadPool::Shutdown(void)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stopping = true;
+        WakeAll();
+        m_controlWake.notify_all();
+    }
+    if (m_controller.joinable())
+    {
+        m_controller.join();
+    }
+
+    // Refuse the submitters waiting for room.
+    for (size_t p = 0; p < PriorityCount; p++)
+    {
+        std::lock_guard<std::mutex> guard(m_classes[p].lock);
+        m_classes[p].room.notify_all();
+    }
+
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        std::thread &thread = m_workers[i]->thread;
+        if (!thread.joinable())
+            continue;
+
+        // A worker shutting down its own pool cannot join itself.
+        if (thread.get_id() == std::this_thread::get_id())
+            thread.detach();
+        else
+            thread.join();
+    }
+}
+
+/**
+ *   Hold normal and low priority work until every pause has been resumed.
+ *   The workers finish what they are running and then take high priority
+ *   work only.
+ */
+void ThreadPool::Pause(void)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_pauseCount++;
+    m_paused = true;
+}
+
+/**
+ *   Wait until the normal and low priority work that was running when the
+ *   pool was paused has finished.
+ *
+ *   @param dwMilliseconds - the longest wait, or INFINITE
+ *   @return true if no such work is running
+ */
+bool ThreadPool::WaitUntilQuiet(DWORD dwMilliseconds)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    auto quiet = [this]() { return m_running.load() == 0 || !m_paused.load(); };
+    if (dwMilliseconds == INFINITE)
+    {
+        m_quiet.wait(guard, quiet);
+        return true;
+    }
+    return m_quiet.wait_for(guard, std::chrono::milliseconds(dwMilliseconds), quiet);
+}
+
+/**
+ *   End a pause. After the last one the workers take normal and low
+ *   priority work again; they are still running, so the held work starts
+ *   at once.
+ */
+void ThreadPool::Resume(void)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_pauseCount == 0 || --m_pauseCount != 0)
+    {
+        return;
+    }
+    m_paused = false;
+    m_quiet.notify_all();
+    WakeAll();
+}
+
+/**
+ *   Wait until the pool has run everything queued and no normal or low
+ *   priority work is running. A worker counts itself in m_running before
+ *   it takes an item, so an item is always either queued or counted.
+ *
+ *   @param dwMilliseconds - the longest wait, or INFINITE
+ *   @return true if the pool is idle
+ */
+bool ThreadPool::WaitUntilIdle(DWORD dwMilliseconds)
+{
+    // Count the waiter before looking at m_running. Paired with the
+    // decrement in LeaveRunning, either the wait sees the pool idle, or
+    // the last worker to leave sees the waiter and wakes it.
+    m_idleWaiters.fetch_add(1);
+    bool fIdle;
+    {
+        std::unique_lock<std::mutex> guard(m_lock);
+        auto idle = [this]() { return m_pending.load() == 0 && m_running.load() == 0; };
+        if (dwMilliseconds == INFINITE)
+        {
+            m_quiet.wait(guard, idle);
+            fIdle = true;
+        }
+        else
+        {
+            fIdle = m_quiet.wait_for(guard, std::chrono::milliseconds(dwMilliseconds), idle);
+        }
+    }
+    m_idleWaiters.fetch_sub(1);
+    return fIdle;
+}
+
+/**
+ *   The number of workers running, retired ones not included.
+ */
+size_t ThreadPool::GetThreadCount(void) const
+{
+    return m_threads.load();
+}
+
+size_t ThreadPool::GetNodeCount(void) const
+{
+    return m_nodes.size();
+}
+
+/**
+ *   The node group the calling thread is closest to: its own if it is a
+ *   worker of the pool, else the group of the CPU it is running on.
+ */
+Locality ThreadPool::GetLocality(void) const
+{
+    Locality locality;
+    locality.node = 0;
+    if (t_pool == this)
+    {
+        locality.node = m_workers[t_index]->node;
+        return locality;
+    }
+
+    unsigned int cpu = CpuTopology::GetCurrentCpu();
+    for (size_t n = 0; n < m_nodes.size(); n++)
+    {
+        if (std::binary_search(m_nodes[n]->cpus.begin(), m_nodes[n]->cpus.end(), cpu))
+        {
+            locality.node = n;
+            break;
+        }
+    }
+    return locality;
+}
+
+/**
+ *   Bound the queue of a priority class. Submitters waiting for room
+ *   re-evaluate under the new limit.
+ *
+ *   @param priority - the class
+ *   @param limit - its capacity and overflow policy
+ */
+void ThreadPool::SetQueueLimit(WorkPriority priority, const QueueLimit &limit)
+{
+    ClassQueue &queue = m_classes[priority];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    queue.limit = limit;
+    queue.room.notify_all();
+}
+
+/**
+ *   Size the queue of a priority class, and its ring of queue times, for a
+ *   number of items, so that bursts up to that size queue without
+ *   allocating.
+ *
+ *   @param priority - the class
+ *   @param capacity - the number of items
+ */
+void ThreadPool::ReserveQueue(WorkPriority priority, size_t capacity)
+{
+    ClassQueue &queue = m_classes[priority];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    queue.Reserve(capacity);
+}
+
+size_t ThreadPool::GetQueueDepth(WorkPriority priority) const
+{
+    const ClassQueue &queue = m_classes[priority];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    return queue.items.Size();
+}
+
+/**
+ *   Queue a work item. A worker queues normal priority work to its own
+ *   deque; everything else goes to the queue of its class, subject to the
+ *   limit of the class.
+ *
+ *   @param item - the work to run
+ *   @param priority - the class of the work
+ *   @return false if the pool is shutting down or the class queue refused
+ *   the work
+ */
+bool ThreadPool::Enqueue(Task &&item, WorkPriority priority)
+{
+    if (priority == PriorityNormal && t_pool == this)
+    {
+        // Count the item before checking for shutdown, so that a worker
+        // never sees "stopping and nothing pending" while an accepted item
+        // is still on its way into a queue.
+        m_pending.fetch_add(1);
+        if (m_stopping.load())
+        {
+            m_pending.fetch_sub(1);
+            m_rejected.Increment();
+            return false;
+        }
+
+        Worker &self = *m_workers[t_index];
+        std::lock_guard<std::mutex> guard(self.lock);
+        self.items.PushBack(std::move(item));
+    }
+    else
+    {
+        ClassQueue &queue = m_classes[priority];
+
+        // Shed items are destroyed after the lock is released; their
+        // destructors may submit work of their own.
+        std::vector<Task> shed;
+        bool fAccepted = true;
+        {
+            std::unique_lock<std::mutex> guard(queue.lock);
+            std::chrono::steady_clock::time_point deadline;
+            bool fDeadline = false;
+            auto hasRoom = [this, &queue]() {
+                return m_stopping.load() || queue.limit.policy != OverflowBlock ||
+                       queue.limit.capacity == 0 || queue.items.Size() < queue.limit.capacity;
+            };
+
+            while (!m_stopping.load() && queue.limit.capacity != 0 &&
+                   queue.items.Size() >= queue.limit.capacity)
+            {
+                if (queue.limit.policy == OverflowShedOldest)
+                {
+                    shed.emplace_back();
+                    queue.Pop(shed.back());
+                    queue.depth.Add(-1);
+                    m_pending.fetch_sub(1);
+                    continue;
+                }
+                if (queue.limit.policy != OverflowBlock || t_pool == this)
+                {
+                    fAccepted = false;
+                    break;
+                }
+
+                queue.waiters++;
+                bool fRoom;
+                if (queue.limit.dwTimeout == INFINITE)
+                {
+                    queue.room.wait(guard, hasRoom);
+                    fRoom = true;
+                }
+                else
+                {
+                    if (!fDeadline)
+                    {
+                        deadline = std::chrono::steady_clock::now() +
+                                   std::chrono::milliseconds(queue.limit.dwTimeout);
+                        fDeadline = true;
+                    }
+                    fRoom = queue.room.wait_until(guard, deadline, hasRoom);
+                }
+                queue.waiters--;
+                if (!fRoom)
+                {
+                    fAccepted = false;
+                    break;
+                }
+            }
+
+            if (fAccepted)
+            {
+                // Counted before checking for shutdown, as above.
+                m_pending.fetch_add(1);
+                if (m_stopping.load())
+                {
+                    m_pending.fetch_sub(1);
+                    fAccepted = false;
+                }
+                else
+                {
+                    queue.Push(std::move(item), NowMicroseconds());
+                    queue.depth.Add(1);
+                }
+            }
+        }
+
+        if (!shed.empty())
+        {
+            queue.shed.Increment(shed.size());
+        }
+        if (!fAccepted)
+        {
+            m_rejected.Increment();
+            queue.rejected.Increment();
+            return false;
+        }
+    }
+    m_submitted.Increment();
+
+    // The item was counted before looking for sleepers. Paired with the
+    // increment of m_sleepers in WorkerLoop, this guarantees that either we
+    // see the sleeper or the sleeper sees the item. A worker wakes one of
+    // its own node; work from outside wakes the groups in turn.
+    if (m_sleepers.load() > 0)
+    {
+        size_t node = (t_pool == this) ? m_workers[t_index]->node
+                                       : m_nextNode.fetch_add(1, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> guard(m_lock);
+        WakeOne(node);
+    }
+    return true;
+}
+
+/**
+ *   Queue normal priority work for the workers of a node group. A worker of
+ *   that group queues it to its own deque, like any work it submits.
+ *
+ *   @param item - the work to run
+ *   @param node - the index of the group, wrapped around the group count
+ *   @return false if the pool is shutting down
+ */
+bool ThreadPool::EnqueueLocal(Task &&item, size_t node)
+{
+    node %= m_nodes.size();
+    if (t_pool == this && m_workers[t_index]->node == node)
+    {
+        return Enqueue(std::move(item), PriorityNormal);
+    }
+
+    // Counted before checking for shutdown, as in Enqueue.
+    m_pending.fetch_add(1);
+    if (m_stopping.load())
+    {
+        m_pending.fetch_sub(1);
+        m_rejected.Increment();
+        return false;
+    }
+
+    NodeGroup &group = *m_nodes[node];
+    {
+        std::lock_guard<std::mutex> guard(group.lock);
+        group.items.PushBack(std::move(item));
+        group.count.store(group.items.Size(), std::memory_order_relaxed);
+    }
+    m_submitted.Increment();
+
+    if (m_sleepers.load() > 0)
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        WakeOne(node);
+    }
+    return true;
+}
+
+/**
+ *   Wake the sleeping worker that fell asleep last in the given group, or
+ *   else in the next group that has one. It is taken off the list here, so
+ *   two wake-ups never go to the same worker.
+ *
+ *   @param node - the group to look in first
+ */
+void ThreadPool::WakeOne(size_t node)
+{
+    for (size_t i = 0; i < m_nodes.size(); i++)
+    {
+        NodeGroup &group = *m_nodes[(node + i) % m_nodes.size()];
+        if (!group.sleepers.empty())
+        {
+            Worker *worker = group.sleepers.back();
+            group.sleepers.pop_back();
+            worker->fSleeping = false;
+            worker->wake.notify_one();
+            return;
+        }
+    }
+}
+
+void ThreadPool::WakeAll(void)
+{
+    for (size_t n = 0; n < m_nodes.size(); n++)
+    {
+        NodeGroup &group = *m_nodes[n];
+        for (size_t i = 0; i < group.sleepers.size(); i++)
+        {
+            group.sleepers[i]->fSleeping = false;
+            group.sleepers[i]->wake.notify_one();
+        }
+        group.sleepers.clear();
+    }
+}
+
+/**
+ *   Take the oldest item of a class queue and record how long it waited.
+ *
+ *   @param priority - the class
+ *   @param item - receives the work item
+ *   @return true if an item was found
+ */
+bool ThreadPool::TryDequeueClass(WorkPriority priority, Task &item)
+{
+    ClassQueue &queue = m_classes[priority];
+    if (queue.count.load(std::memory_order_relaxed) == 0)
+    {
+        // Most looks find the queue empty; they need not take the lock. An
+        // item this misses is still counted in m_pending, so the worker
+        // looks again before it sleeps.
+        return false;
+    }
+
+    unsigned long long queuedAt;
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.items.Empty())
+        {
+            return false;
+        }
+        queuedAt = queue.Pop(item);
+        queue.depth.Add(-1);
+        if (queue.waiters != 0)
+        {
+            queue.room.notify_one();
+        }
+    }
+
+    unsigned long long now = NowMicroseconds();
+    queue.wait.Record(now > queuedAt ? now - queuedAt : 0);
+    return true;
+}
+
+/**
+ *   Take the oldest item queued for a node group.
+ *
+ *   @param node - the group
+ *   @param item - receives the work item
+ *   @return true if an item was found
+ */
+bool ThreadPool::TryDequeueNode(size_t node, Task &item)
+{
+    NodeGroup &group = *m_nodes[node];
+    if (group.count.load(std::memory_order_relaxed) == 0)
+    {
+        // As in TryDequeueClass, a missed item is still counted in
+        // m_pending.
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(group.lock);
+    if (group.items.Empty())
+    {
+        return false;
+    }
+    group.items.PopFront(item);
+    group.count.store(group.items.Size(), std::memory_order_relaxed);
+    return true;
+}
+
+/**
+ *   Find the next item for a worker.
+ *
+ *   @param index - the index of the calling worker
+ *   @param item - receives the work item
+ *   @return true if an item was found
+ */
+bool ThreadPool::TryDequeue(size_t index, Task &item, bool &fCounted)
+{
+    Worker &self = *m_workers[index];
+
+    // Count the worker as running before it looks at the pause flag.
+    // Paired with the store in Pause, either WaitUntilQuiet sees the
+    // worker, or the worker sees the pause and takes high priority work
+    // only.
+    m_running.fetch_add(1);
+    fCounted = true;
+    if (m_paused.load() && !m_stopping.load())
+    {
+        LeaveRunning();
+        fCounted = false;
+        return TryDequeueClass(PriorityHigh, item);
+    }
+
+    // Now and then low priority work goes first, so that a steady stream
+    // of other work does not starve it entirely.
+    if (++self.turns % c_lowPriorityTurn == 0 && TryDequeueClass(PriorityLow, item))
+    {
+        return true;
+    }
+
+    if (TryDequeueClass(PriorityHigh, item))
+    {
+        // High priority work is never held, and need not be waited for.
+        LeaveRunning();
+        fCounted = false;
+        return true;
+    }
+
+    // Newest local work next, while its data is still hot in cache.
+    {
+        std::lock_guard<std::mutex> guard(self.lock);
+        if (!self.items.Empty())
+        {
+            self.items.PopBack(item);
+            return true;
+        }
+    }
+
+    // Then work submitted for the node of the worker, and normal priority
+    // work submitted from outside the pool.
+    if (TryDequeueNode(self.node, item))
+    {
+        m_nodeLocal.Increment();
+        return true;
+    }
+    if (TryDequeueClass(PriorityNormal, item))
+    {
+        return true;
+    }
+
+    // Finally steal the oldest item of another worker, starting with the
+    // next one so that thieves spread over the victims: first from the
+    // workers of the same node, then from the other nodes, their queues
+    // before their workers.
+    size_t started = m_started.load(std::memory_order_acquire);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (size_t n = 1; pass == 1 && n < m_nodes.size(); n++)
+        {
+            if (TryDequeueNode((self.node + n) % m_nodes.size(), item))
+            {
+                m_nodeRemote.Increment();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < started; i++)
+        {
+            Worker &victim = *m_workers[(index + i) % started];
+            if ((victim.node == self.node) != (pass == 0))
+            {
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(victim.lock, std::try_to_lock);
+            if (guard.owns_lock() && !victim.items.Empty())
+            {
+                victim.items.PopFront(item);
+                m_stolen.Increment();
+                return true;
+            }
+        }
+    }
+
+    // Low priority work only when there is nothing else.
+    if (TryDequeueClass(PriorityLow, item))
+    {
+        return true;
+    }
+
+    LeaveRunning();
+    fCounted = false;
+    return false;
+}
+
+/**
+ *   Uncount a worker that has finished, or did not find, normal or low
+ *   priority work, and wake WaitUntilQuiet or WaitUntilIdle if it was the
+ *   last one.
+ */
+void ThreadPool::LeaveRunning(void)
+{
+    if (m_running.fetch_sub(1) == 1 && (m_paused.load() || m_idleWaiters.load() > 0))
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_quiet.notify_all();
+    }
+}
+
+/**
+ *   Whether high priority work is queued, which a paused pool still runs.
+ *   Taking the queue lock orders the check after a submitter's push, or the
+ *   submitter's look for sleepers after this worker became one.
+ */
+bool ThreadPool::HasHighPriorityWork(void) const
+{
+    const ClassQueue &queue = m_classes[PriorityHigh];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    return !queue.items.Empty();
+}
+
+/**
+ *   Add an item to the back of the queue, growing the ring of queue times
+ *   along with the task queue.
+ *
+ *   @param item - the work
+ *   @param now - the time it was queued, in microseconds
+ */
+void ThreadPool::ClassQueue::Push(Task &&item, unsigned long long now)
+{
+    size_t size = items.Size();
+    if (size == queuedAt.size())
+    {
+        Reserve(size == 0 ? 64 : size * 2);
+    }
+    queuedAt[(firstQueuedAt + size) % queuedAt.size()] = now;
+    items.PushBack(std::move(item));
+    count.store(items.Size(), std::memory_order_relaxed);
+}
+
+/**
+ *   Make room for a number of items in the task queue and the ring of
+ *   queue times, unwrapping the ring into the new buffer.
+ *
+ *   @param capacity - the number of items
+ */
+void ThreadPool::ClassQueue::Reserve(size_t capacity)
+{
+    items.Reserve(capacity);
+    if (queuedAt.size() >= capacity)
+    {
+        return;
+    }
+
+    size_t size = items.Size();
+    std::vector<unsigned long long> grown(capacity);
+    for (size_t i = 0; i < size; i++)
+    {
+        grown[i] = queuedAt[(firstQueuedAt + i) % queuedAt.size()];
+    }
+    queuedAt.swap(grown);
+    firstQueuedAt = 0;
+}
+
+/**
+ *   Take the item at the front of the queue.
+ *
+ *   @param item - receives the work
+ *   @return the time it was queued, in microseconds
+ */
+unsigned long long ThreadPool::ClassQueue::Pop(Task &item)
+{
+    items.PopFront(item);
+    unsigned long long queued = queuedAt[firstQueuedAt];
+    firstQueuedAt = (firstQueuedAt + 1) % queuedAt.size();
+    count.store(items.Size(), std::memory_order_relaxed);
+    return queued;
+}
+
+/**
+ *   The body of each worker thread. Runs work until the pool is stopping
+ *   and nothing is left queued.
+ *
+ *   @param index - the index of this worker
+ */
+void ThreadPool::WorkerLoop(size_t index)
+{
+    t_pool = this;
+    t_index = index;
+    WatchdogSlot *slot = m_watchdog.Register(L"threadpool", index);
+    Trace::SetThreadName(Trace::Intern(L"threadpool " + std::to_wstring(index)));
+
+    Worker &self = *m_workers[index];
+    NodeGroup &group = *m_nodes[self.node];
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        self.slot = slot;
+    }
+    if (!self.cpus.empty() && !CpuTopology::PinCurrentThread(self.cpus))
+    {
+        m_pinFailed.Increment();
+    }
+
+    // The system places memory on the node of the thread that touches it
+    // first: swap the deque, which is small until the worker first runs,
+    // and the first worker of a placed node the queue of the node, for
+    // ones allocated here, once pinned.
+    {
+        std::lock_guard<std::mutex> guard(self.lock);
+        if (self.items.Empty())
+            self.items = TaskQueue();
+    }
+    if (!self.cpus.empty() && group.firstWorker == index)
+    {
+        std::lock_guard<std::mutex> guard(group.lock);
+        if (group.items.Empty())
+            group.items = TaskQueue();
+    }
+
+    Task item;
+    bool fCounted;
+    for (;;)
+    {
+        if (TryDequeue(index, item, fCounted))
+        {
+            m_pending.fetch_sub(1);
+            slot->Begin(item.GetType());
+            unsigned long long started = Trace::IsEnabled() ? Trace::Now() : 0;
+            try
+            {
+                item();
+            }
+            catch (...)
+            {
+                // A failing work item must not take the worker down with it.
+                m_failed.Increment();
+            }
+            slot->End();
+            if (started != 0)
+            {
+                Trace::Span(item.GetType(), "task", started);
+            }
+            item.Reset();
+            m_executed.Increment();
+            self.completed.store(self.completed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            if (fCounted)
+            {
+                LeaveRunning();
+            }
+            if (m_threads.load(std::memory_order_relaxed) > m_target.load(std::memory_order_relaxed) &&
+                RetireAfterTask(self))
+            {
+                break;
+            }
+            continue;
+        }
+
+        // While the pool is paused, queued work other than high priority
+        // work is no reason to stay awake. A worker above the fewest that
+        // sleeps through the idle timeout retires.
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_sleepers.fetch_add(1);
+        bool fIdle = false;
+        while (!m_stopping &&
+               (m_pending.load() == 0 || (m_paused.load() && !HasHighPriorityWork())))
+        {
+            if (!self.fSleeping)
+            {
+                self.fSleeping = true;
+                group.sleepers.push_back(&self);
+            }
+            if (m_sizing.dwIdleTimeout == INFINITE || m_threads.load() <= m_sizing.minThreads)
+            {
+                self.wake.wait(guard);
+            }
+            else if (self.wake.wait_for(guard, std::chrono::milliseconds(m_sizing.dwIdleTimeout)) ==
+                         std::cv_status::timeout &&
+                     self.fSleeping && m_threads.load() > m_sizing.minThreads)
+            {
+                fIdle = true;
+                break;
+            }
+        }
+        if (self.fSleeping)
+        {
+            // Woken by something other than WakeOne or WakeAll.
+            self.fSleeping = false;
+            group.sleepers.erase(std::find(group.sleepers.begin(), group.sleepers.end(), &self));
+        }
+        m_sleepers.fetch_sub(1);
+        if (fIdle)
+        {
+            Retire(self);
+            break;
+        }
+        if (m_stopping && m_pending.load() == 0)
+        {
+            self.slot = NULL;
+            break;
+        }
+    }
+
+    m_watchdog.Unregister(slot);
+    t_pool = NULL;
+}
+
+#pragma endregion
+
+#pragma region Sizing
+
+/**
+ *   Change the bounds of the pool. The most is capped at the most the pool
+ *   was created with, and the controller is started if the pool did not
+ *   have one. Sleeping workers wake to pick up the new idle timeout.
+ *
+ *   @param sizing - the fewest and most workers and how the pool is
+ *   sampled
+ */
+void ThreadPool::SetSizing(const PoolSizing &sizing)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_sizing.minThreads = std::min(std::max<size_t>(sizing.minThreads, 2), m_workers.size());
+    m_sizing.maxThreads = std::min(std::max(sizing.maxThreads, m_sizing.minThreads), m_workers.size());
+    m_sizing.dwInterval = std::max<DWORD>(sizing.dwInterval, 1);
+    m_sizing.dwIdleTimeout = sizing.dwIdleTimeout;
+    if (!m_stopping && !m_controller.joinable() && m_sizing.minThreads < m_sizing.maxThreads)
+    {
+        m_controller = std::thread(&ThreadPool::ControlLoop, this);
+    }
+    m_controlWake.notify_all();
+    WakeAll();
+}
+
+PoolSizing ThreadPool::GetSizing(void) const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_sizing;
+}
+
+/**
+ *   Give a worker that is not active a thread.
+ *
+ *   @param index - the index of the worker
+ *   @return the thread of its previous run, if it ran before, to be joined
+ *   by the caller once m_lock is released
+ */
+std::thread ThreadPool::StartWorker(size_t index)
+{
+    Worker &worker = *m_workers[index];
+    std::thread last(std::move(worker.thread));
+    worker.fActive = true;
+    worker.turns = 0;
+    if (index >= m_started.load())
+    {
+        m_started.store(index + 1, std::memory_order_release);
+    }
+    m_threads.fetch_add(1);
+    m_threadsGauge.Set(static_cast<long long>(m_threads.load()));
+    worker.thread = std::thread(&ThreadPool::WorkerLoop, this, index);
+    return last;
+}
+
+/**
+ *   Retire the calling worker after a task if the pool has more workers
+ *   than the controller wants. Only a worker with an empty deque retires:
+ *   nothing else can queue work to it, so nothing is left behind.
+ *
+ *   @param self - the calling worker
+ *   @return true if the worker is retired and must exit
+ */
+bool ThreadPool::RetireAfterTask(Worker &self)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_stopping || m_threads.load() <= std::max(m_target.load(), m_sizing.minThreads))
+    {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> selfGuard(self.lock);
+        if (!self.items.Empty())
+        {
+            return false;
+        }
+    }
+    Retire(self);
+    return true;
+}
+
+/**
+ *   Mark the calling worker retired. It may have been woken for work that
+ *   is still queued, so another sleeper is woken in its place.
+ *
+ *   @param self - the calling worker
+ */
+void ThreadPool::Retire(Worker &self)
+{
+    self.fActive = false;
+    self.slot = NULL;
+    m_threads.fetch_sub(1);
+    m_threadsGauge.Set(static_cast<long long>(m_threads.load()));
+    m_retired.Increment();
+    if (m_pending.load() > 0)
+    {
+        WakeOne(self.node);
+    }
+}
+
+/**
+ *   How long the oldest item of the class queues has been waiting. Work
+ *   in the deques of the workers and the queues of the node groups is not
+ *   timed; it is either work the workers made themselves or hinted work,
+ *   which the same queues would show if it backed up.
+ *
+ *   @return the wait, in microseconds, or 0 if nothing is queued
+ */
+unsigned long long ThreadPool::GetOldestWait(void) const
+{
+    unsigned long long now = NowMicroseconds();
+    unsigned long long oldest = 0;
+    for (size_t p = 0; p < PriorityCount; p++)
+    {
+        const ClassQueue &queue = m_classes[p];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (!queue.items.Empty())
+        {
+            unsigned long long queuedAt = queue.queuedAt[queue.firstQueuedAt];
+            oldest = std::max(oldest, now > queuedAt ? now - queuedAt : 0);
+        }
+    }
+    return oldest;
+}
+
+/**
+ *   The body of the controller thread. Every interval it samples the pool:
+ *   the tasks completed since the last sample, how long the oldest queued
+ *   work has waited, and the workers that are on a task and that have been
+ *   on the same one for the whole interval.
+ *
+ *   The pool is behind when work has waited for a while and no worker is
+ *   asleep. Then, if every worker is blocked, a worker is added at once.
+ *   Otherwise the count climbs a worker at a time: a move that raised
+ *   throughput is followed by another the same way, one that lowered it is
+ *   undone, and when throughput stays flat a worker is shed, since it was
+ *   not earning its keep. A pool that is not behind keeps its workers and
+ *   forgets the climb; its idle workers retire on their own.
+ */
+void ThreadPool::ControlLoop(void)
+{
+    unsigned long long lastCompleted = 0;
+    double lastThroughput = 0;
+    size_t lastThreads = 0;
+    int direction = 1;
+    std::chrono::steady_clock::time_point lastSample = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> guard(m_lock);
+    for (;;)
+    {
+        m_controlWake.wait_for(guard, std::chrono::milliseconds(m_sizing.dwInterval));
+        if (m_stopping)
+        {
+            break;
+        }
+
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(now - lastSample).count();
+        lastSample = now;
+
+        // Sample the workers.
+        unsigned long long completed = 0;
+        size_t blocked = 0;
+        unsigned long long nowMs = WatchdogSlot::Now();
+        size_t started = m_started.load();
+        for (size_t i = 0; i < started; i++)
+        {
+            Worker &worker = *m_workers[i];
+            completed += worker.completed.load(std::memory_order_relaxed);
+            unsigned long long startedAt = (worker.slot != NULL) ? worker.slot->GetStartedAt() : 0;
+            if (startedAt != 0 && nowMs - startedAt >= m_sizing.dwInterval)
+            {
+                blocked++;
+            }
+        }
+        double throughput = (seconds > 0) ? (completed - lastCompleted) / seconds : 0;
+        lastCompleted = completed;
+        unsigned long long oldestWait = GetOldestWait();
+        m_throughput.Set(static_cast<long long>(throughput));
+        m_oldestWait.Set(static_cast<long long>(oldestWait));
+
+        size_t threads = m_threads.load();
+        size_t target = threads;
+        bool fBehind = !m_paused.load() && m_sleepers.load() == 0 && oldestWait >= c_behindWait;
+        if (!fBehind)
+        {
+            lastThreads = 0;
+        }
+        else if (blocked >= threads)
+        {
+            target = threads + 1;
+            direction = 1;
+            lastThreads = 0;
+            m_starved.Increment();
+        }
+        else
+        {
+            if (lastThreads != 0 && lastThreads != threads)
+            {
+                double change = (throughput - lastThroughput) / std::max(lastThroughput, 1.0);
+                bool fGrew = threads > lastThreads;
+                if (change > c_throughputMargin)
+                    direction = fGrew ? 1 : -1;
+                else if (change < -c_throughputMargin)
+                    direction = fGrew ? -1 : 1;
+                else
+                    direction = -1;
+            }
+            target = (direction > 0) ? threads + 1 : threads - 1;
+            lastThreads = threads;
+            lastThroughput = throughput;
+        }
+
+        // Stay within the bounds; a climb that hits one turns around.
+        if (target < m_sizing.minThreads || target > m_sizing.maxThreads)
+        {
+            target = std::min(std::max(target, m_sizing.minThreads), m_sizing.maxThreads);
+            direction = -direction;
+        }
+        m_target = target;
+        m_targetGauge.Set(static_cast<long long>(target));
+
+        // Add workers in the lowest free places. Workers above the target
+        // retire as they finish their tasks.
+        std::vector<std::thread> finished;
+        for (size_t i = 0; i < m_workers.size() && m_threads.load() < target; i++)
+        {
+            if (!m_workers[i]->fActive)
+            {
+                finished.push_back(StartWorker(i));
+                m_grown.Increment();
+            }
+        }
+        if (!finished.empty())
+        {
+            guard.unlock();
+            for (size_t i = 0; i < finished.size(); i++)
+            {
+                if (finished[i].joinable())
+                    finished[i].join();
+            }
+            guard.lock();
+        }
+    }
+}
+
+#pragma endregion
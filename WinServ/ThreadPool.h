@@ -1,39 +1,502 @@
 /*
- * Provides the ability to queue simple member functions
- * of a class to the Windows thread pool.
+ * A work-stealing thread pool built on std::thread.
+ *
+ * Every worker owns a deque. Work submitted from a worker goes to the back
+ * of its own deque and is popped from the back (LIFO, cache friendly);
+ * work submitted from any other thread goes to a shared injection queue.
+ * An idle worker drains its own deque first, then the injection queue, and
+ * finally steals from the front of another worker's deque.
+ *
+ * Work items are Task objects, so a submit/run round trip does not allocate
+ * once the queues and closure caches have reached their working size.
+ *
+ * Work is submitted in one of three priority classes, each with its own
+ * injection queue. Workers take high priority work before anything else
+ * and low priority work only when nothing else is queued, apart from an
+ * occasional look so that it is never starved entirely. Each class queue
+ * can be bounded, with a policy for what happens when it is full, so that
+ * an overloaded service sheds bulk work instead of growing without limit
+ * and keeps control handling responsive. A worker's own deque holds the
+ * normal priority work it submits itself; it is not bounded, since
+ * refusing the continuation of work that was already admitted would leave
+ * that work half done.
+ *
+ * A paused pool holds normal and low priority work in its queues, without
+ * stopping its workers, until it is resumed; high priority work keeps
+ * running, so a paused service still handles its controls.
+ *
+ * A pool can be placed on the machine: its workers pinned to the CPUs of
+ * their NUMA node, or each to a CPU of its own, and grouped by node. Each
+ * node group has a queue of its own for work submitted with a Locality
+ * hint, which the workers of the node look at before the shared queue and
+ * the workers of other nodes only once they have nothing else to do. A
+ * worker steals from the workers of its own node before it looks further,
+ * and the memory of its deque and of its node's queue is touched first by
+ * the workers themselves, once pinned, so that the system places it on
+ * their node.
+ *
+ * A pool can size itself between a fewest and a most workers. A
+ * controller thread samples the pool every interval: how many tasks it
+ * completed, how long the oldest queued work has waited and which workers
+ * have been on one task for the whole interval. While work is waiting and
+ * every worker is blocked on a task, it adds a worker at once. Otherwise,
+ * while work keeps waiting, it climbs: it moves the worker count by one and
+ * keeps going that way as long as throughput improves, turns back when it
+ * drops, and sheds a worker when it stays flat. A worker above the target
+ * retires when it finishes its task; a worker that has slept through the
+ * idle timeout retires too, down to the fewest. Its decisions are
+ * published as threadpool.* metrics.
+ *
+ * Every worker stamps the start and end of its tasks in a slot of the
+ * default Watchdog, which reports a task that runs for too long; the
+ * controller reads the same stamps to tell a blocked worker. While
+ * tracing is enabled, every task is also recorded as a span named after
+ * the type of its closure.
  *
  */
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <memory>
-#include <Windows.h>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "CpuTopology.h"
+#include "Metrics.h"
+#include "Pausable.h"
+#include "Platform.h"
+#include "StopToken.h"
+#include "Task.h"
+#include "Watchdog.h"
+
+enum WorkPriority
+{
+    PriorityHigh = 0,
+    PriorityNormal = 1,
+    PriorityLow = 2,
+    PriorityCount = 3
+};
+
+// What Submit does when the queue of the priority class is full.
+enum OverflowPolicy
+{
+    // Refuse the new work.
+    OverflowReject,
+
+    // Wait up to the timeout for room, then refuse the new work. Workers of
+    // the pool never wait, since they may be what frees the room; they are
+    // refused at once.
+    OverflowBlock,
+
+    // Drop the oldest queued work of the class, without running it, to make
+    // room for the new work.
+    OverflowShedOldest
+};
+
+struct QueueLimit
+{
+    // The most items queued in the class; zero for no limit.
+    size_t capacity;
+    OverflowPolicy policy;
+
+    // For OverflowBlock: the longest wait for room, or INFINITE.
+    DWORD dwTimeout;
+};
+
+// Where the workers of a pool run.
+enum WorkerAffinity
+{
+    // Wherever the system schedules them, as one group.
+    AffinityNone,
+
+    // Each on the CPUs of its NUMA node, grouped by node.
+    AffinityNode,
+
+    // Each on one CPU, the workers spread evenly over the CPUs and grouped
+    // by the node of their CPU.
+    AffinityCpu
+};
+
+struct PoolPlacement
+{
+    PoolPlacement(void) : topology(NULL), affinity(AffinityNone) {}
+
+    // The machine to place the workers on, or NULL for
+    // CpuTopology::Current().
+    const CpuTopology *topology;
+
+    // The CPUs the pool may use; every CPU of the topology if empty.
+    std::vector<unsigned int> cpus;
+
+    WorkerAffinity affinity;
+};
+
+// The bounds of an adaptive pool, and how its controller samples it.
+struct PoolSizing
+{
+    // The fewest and the most workers. A pool never has fewer than two,
+    // nor more than the most it was created with.
+    size_t minThreads;
+    size_t maxThreads;
+
+    // How often the controller samples the pool, in milliseconds. A worker
+    // on one task for this long, with work waiting, counts as blocked.
+    DWORD dwInterval;
+
+    // How long a worker sleeps without work before it retires, in
+    // milliseconds, or INFINITE to keep it.
+    DWORD dwIdleTimeout;
+};
 
-class ThreadPool
+// A hint that work should run on a worker of the given node group. Work
+// is never refused for it: if the workers of the node are busy for long
+// enough, others take the work.
+struct Locality
+{
+    // The index of the node group of the pool, from 0 to
+    // GetNodeCount() - 1; larger indexes wrap around.
+    size_t node;
+};
+
+class ThreadPool : public Pausable
 {
 public:
+    // Create a pool with the given number of workers. Zero picks one worker
+    // per hardware thread (and never fewer than two).
+    explicit ThreadPool(size_t threadCount = 0);
+
+    // Create a pool placed on the machine. Zero picks one worker per CPU
+    // the pool may use (and never fewer than two).
+    ThreadPool(size_t threadCount, const PoolPlacement &placement);
+
+    // Create a pool that sizes itself within the given bounds, starting
+    // with the fewest workers.
+    explicit ThreadPool(const PoolSizing &sizing, const PoolPlacement &placement = PoolPlacement());
+
+    // Drains the queued work and joins the workers.
+    ~ThreadPool(void);
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Queue any callable for execution on a worker thread. Returns false if
+    // the pool is shutting down and the work was not accepted.
+    template <typename F>
+    bool Submit(F &&function)
+    {
+        return Enqueue(Task(std::forward<F>(function)), PriorityNormal);
+    }
+
+    // Queue a callable in the given priority class. Returns false if the
+    // pool is shutting down or the class queue is full and its policy
+    // refused the work.
+    template <typename F>
+    bool Submit(F &&function, WorkPriority priority)
+    {
+        return Enqueue(Task(std::forward<F>(function)), priority);
+    }
+
+    // Queue a callable at normal priority for a worker of the given node.
+    template <typename F>
+    bool Submit(F &&function, Locality locality)
+    {
+        return EnqueueLocal(Task(std::forward<F>(function)), locality.node);
+    }
+
+    // Queue a callable that is skipped if a stop is requested on the token
+    // before a worker gets to it.
+    template <typename F>
+    bool Submit(F &&function, const StopToken &token)
+    {
+        return Submit([function = std::forward<F>(function), token]() mutable {
+            if (!token.StopRequested())
+                function();
+        });
+    }
+
+    // Bound the queue of a priority class. Every class is unbounded until
+    // this is called.
+    void SetQueueLimit(WorkPriority priority, const QueueLimit &limit);
+
+    // Size the queue of a priority class for the given number of items up
+    // front, so that queueing that many never allocates.
+    void ReserveQueue(WorkPriority priority, size_t capacity);
+
+    // The number of items waiting in the queue of a priority class.
+    size_t GetQueueDepth(WorkPriority priority) const;
+
+    // Hold normal and low priority work in the queues until every Pause
+    // has had its Resume. Work can still be submitted; the workers only
+    // take high priority work.
+    virtual void Pause(void);
+
+    // Wait until no normal or low priority work is running. Must not be
+    // called from such work.
+    virtual bool WaitUntilQuiet(DWORD dwMilliseconds);
+
+    // End a pause; after the last one the workers take the held work
+    // again.
+    virtual void Resume(void);
+
+    // True while only high priority work runs.
+    bool IsPaused(void) const { return m_paused.load(); }
+
+    // Wait until nothing is queued and no normal or low priority work is
+    // running, as when a stopping service drains the pool. Returns false if
+    // that has not happened within dwMilliseconds (or INFINITE). Must not
+    // be called from work on the pool.
+    bool WaitUntilIdle(DWORD dwMilliseconds);
+
+    // Stop accepting work, run what is already queued, even if the pool is
+    // paused, and join the workers.
+    void Shutdown(void);
+
+    // Change the bounds of the pool and how it is sampled. A pool created
+    // with a fixed number of workers keeps it until it is given bounds
+    // that differ.
+    void SetSizing(const PoolSizing &sizing);
+
+    PoolSizing GetSizing(void) const;
+
+    // The bounds of the default pool: as many workers as hardware threads,
+    // growing to four times as many (and at least 16) when tasks block.
+    static PoolSizing GetDefaultSizing(void);
+
+    // The number of worker threads running.
+    size_t GetThreadCount(void) const;
+
+    // The number of node groups: 1 unless the workers are placed.
+    size_t GetNodeCount(void) const;
+
+    // The node group of the calling worker or, from a thread outside the
+    // pool, the group of the CPU it is running on (group 0 if no group has
+    // that CPU).
+    Locality GetLocality(void) const;
+
+    // The process-wide pool shared by the framework.
+    static ThreadPool &Default(void);
+
+    // Queue a member function of a class to the default pool.
     template <typename T>
-    static void QueueWorkItem(void (T::*function)(void), T *object, ULONG flags = WT_EXECUTELONGFUNCTION)
+    static void QueueWorkItem(void (T::*function)(void), T *object)
     {
-        typedef std::pair<void (T::*)(), T *> CallbackType;
-        std::auto_ptr<CallbackType> p(new CallbackType(function, object));
-        if (::QueueUserWorkItem(ThreadProc<T>, p.get(), flags))
-        {
-            p.release();
-        }
-        else
+        if (!Default().Submit([function, object]() { (object->*function)(); }))
         {
-            throw GetLastError();
+            throw static_cast<DWORD>(ERROR_OPERATION_ABORTED);
         }
     }
 
 private:
-    template <typename T>
-    static DWORD WINAPI ThreadProc(PVOID context)
+    struct Worker
     {
-        typedef std::pair<void (T::*)(), T *> CallbackType;
-        std::auto_ptr<CallbackType> p(static_cast<CallbackType *>(context));
-        (p->second->*p->first)();
-        return 0;
-    }
-};
\ No newline at end of file
+        std::mutex lock;
+        TaskQueue items;
+        std::thread thread;
+
+        // Items taken, to pick the turns that look at low priority first
+        unsigned int turns;
+
+        // The node group of the worker, and the CPUs it is pinned to, if
+        // any
+        size_t node;
+        std::vector<unsigned int> cpus;
+
+        // Whether the worker is asleep on wake and listed in the sleepers
+        // of its group; both under m_lock
+        std::condition_variable wake;
+        bool fSleeping;
+
+        // Whether the worker has a thread, which has not retired, and the
+        // watchdog slot it stamps while it has one; both under m_lock
+        bool fActive;
+        WatchdogSlot *slot;
+
+        // Tasks run, written by the worker only
+        std::atomic<unsigned long long> completed;
+    };
+
+    // The workers of a NUMA node and the work submitted for them.
+    struct NodeGroup
+    {
+        std::mutex lock;
+        TaskQueue items;
+
+        // The number of items, readable without the lock
+        std::atomic<size_t> count;
+
+        // The sleeping workers of the group, the last to fall asleep on
+        // top, under m_lock
+        std::vector<Worker *> sleepers;
+
+        // The first worker of the group, which touches its queue first, or
+        // SIZE_MAX if it has none; and the CPUs of the node
+        size_t firstWorker;
+        std::vector<unsigned int> cpus;
+
+        NodeGroup(void) : count(0), firstWorker(SIZE_MAX) {}
+    };
+
+    // The injection queue of a priority class. Every item carries the time
+    // it was queued, in a ring that mirrors the task queue.
+    struct ClassQueue
+    {
+        mutable std::mutex lock;
+        std::condition_variable room;
+        TaskQueue items;
+        std::vector<unsigned long long> queuedAt;
+        size_t firstQueuedAt;
+        QueueLimit limit;
+
+        // The number of items, readable without the lock
+        std::atomic<size_t> count;
+
+        // Submitters waiting for room
+        size_t waiters;
+
+        MetricGauge depth;
+        MetricHistogram wait;
+        MetricCounter rejected;
+        MetricCounter shed;
+
+        ClassQueue(void) : firstQueuedAt(0), count(0), waiters(0)
+        {
+            limit.capacity = 0;
+            limit.policy = OverflowReject;
+            limit.dwTimeout = INFINITE;
+        }
+
+        // Add an item, or take the oldest one, or make room for capacity
+        // items. The lock must be held.
+        void Push(Task &&item, unsigned long long now);
+        unsigned long long Pop(Task &item);
+        void Reserve(size_t capacity);
+    };
+
+    bool Enqueue(Task &&item, WorkPriority priority);
+
+    // Queue normal priority work for a node group.
+    bool EnqueueLocal(Task &&item, size_t node);
+
+    // Create the workers and their node groups, and start the fewest. A
+    // bound of zero is one worker per CPU.
+    void Start(const PoolSizing &sizing, const PoolPlacement &placement);
+
+    // Wake a sleeping worker, of the given group if it has one. Called with
+    // m_lock held.
+    void WakeOne(size_t node);
+
+    // Wake every sleeping worker. Called with m_lock held.
+    void WakeAll(void);
+
+    // Take the oldest item of a node group's queue, if any.
+    bool TryDequeueNode(size_t node, Task &item);
+
+    // Take the oldest item of a class queue, if any.
+    bool TryDequeueClass(WorkPriority priority, Task &item);
+
+    // Find the next item for the given worker: high priority work, its own
+    // deque, its node's queue, normal priority work, the deques of the
+    // workers of its node, the queues and deques of other nodes, then low
+    // priority work; only high priority work while the pool is paused.
+    // fCounted is set if the item is counted in m_running.
+    bool TryDequeue(size_t index, Task &item, bool &fCounted);
+
+    // Uncount a worker from m_running.
+    void LeaveRunning(void);
+
+    // Whether high priority work is queued. Called with m_lock held.
+    bool HasHighPriorityWork(void) const;
+
+    void WorkerLoop(size_t index);
+
+    // Give a worker that is not active a thread. Called with m_lock held;
+    // returns the thread of its last run, which the caller joins once the
+    // lock is released.
+    std::thread StartWorker(size_t index);
+
+    // Whether the calling worker should retire now that its task is done:
+    // the pool has more workers than the controller wants and the
+    // worker's deque is empty. Marks it retired if so.
+    bool RetireAfterTask(Worker &self);
+
+    // Mark a worker retired. Called with m_lock held.
+    void Retire(Worker &self);
+
+    // Controller thread body: samples the pool and adds workers or lowers
+    // the target.
+    void ControlLoop(void);
+
+    // How long the oldest item of the class queues has waited, in
+    // microseconds.
+    unsigned long long GetOldestWait(void) const;
+
+    // Every worker the pool may have, created with the pool; only those
+    // below m_started have ever run, so thieves look no further.
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<size_t> m_started;
+    std::vector<std::unique_ptr<NodeGroup>> m_nodes;
+
+    // Spreads the wake-ups for work submitted from outside over the groups
+    std::atomic<size_t> m_nextNode;
+
+    // Work submitted in each priority class, and normal priority work
+    // submitted from threads that do not belong to the pool.
+    ClassQueue m_classes[PriorityCount];
+
+    // Number of items queued anywhere in the pool.
+    std::atomic<size_t> m_pending;
+
+    // Number of workers asleep (or about to be).
+    std::atomic<size_t> m_sleepers;
+
+    std::atomic<bool> m_stopping;
+    mutable std::mutex m_lock;
+
+    // Watches the workers for hung tasks; created before the pool so that
+    // it outlives the default pool.
+    Watchdog &m_watchdog;
+
+    // Whether normal and low priority work is held, the pauses that hold
+    // it (under m_lock), and the number of workers running (or about to
+    // take) such work; WaitUntilQuiet and WaitUntilIdle, counted in
+    // m_idleWaiters, wait on m_quiet for it to drop to 0
+    std::atomic<bool> m_paused;
+    size_t m_pauseCount;
+    std::atomic<size_t> m_running;
+    std::atomic<size_t> m_idleWaiters;
+    std::condition_variable m_quiet;
+
+    // The bounds of the pool, under m_lock; the number of active workers
+    // and the number the controller wants; and the controller, which
+    // waits on m_controlWake between samples
+    PoolSizing m_sizing;
+    std::atomic<size_t> m_threads;
+    std::atomic<size_t> m_target;
+    std::thread m_controller;
+    std::condition_variable m_controlWake;
+
+    // Metrics of the pool
+    MetricCounter m_submitted;
+    MetricCounter m_rejected;
+    MetricCounter m_executed;
+    MetricCounter m_stolen;
+    MetricCounter m_failed;
+    MetricCounter m_nodeLocal;
+    MetricCounter m_nodeRemote;
+    MetricCounter m_pinFailed;
+    MetricGauge m_threadsGauge;
+    MetricGauge m_targetGauge;
+    MetricGauge m_throughput;
+    MetricGauge m_oldestWait;
+    MetricCounter m_grown;
+    MetricCounter m_retired;
+    MetricCounter m_starved;
+
+    // The pool and worker index of the calling thread, if it is a worker.
+    static thread_local ThreadPool *t_pool;
+    static thread_local size_t t_index;
+};
@@ -0,0 +1,603 @@
+#pragma region Includes
+#include "TimerService.h"
+#pragma endregion
+
+namespace
+{
+    const unsigned long long c_never = ~0ULL;
+}
+
+#pragma region Static Members
+
+/**
+ *   The process-wide timer service. Its callbacks run on the default
+ *   thread pool.
+ */
+TimerService &TimerService::Default(void)
+{
+    static TimerService service(ThreadPool::Default());
+    return service;
+}
+
+#pragma endregion
+
+#pragma region Timer Service Constructor and Destructor
+
+/**
+ *   Create an empty timer wheel and start the timer thread.
+ *
+ *   @param pool - the pool that runs the callbacks
+ *   @param dwResolution - the length of a tick, in milliseconds
+ */
+TimerService::TimerService(ThreadPool &pool, DWORD dwResolution)
+    : m_pool(pool),
+      m_resolution(std::chrono::milliseconds(dwResolution ? dwResolution : 1)),
+      m_start(Clock::now()),
+      m_current(0),
+      m_wakeTick(c_never),
+      m_nextId(1),
+      m_link(new Link(this)),
+      m_running(0),
+      m_paused(false),
+      m_pauseCount(0),
+      m_random(static_cast<unsigned int>(m_start.time_since_epoch().count())),
+      m_stopping(false)
+{
+    for (unsigned int level = 0; level < LevelCount; level++)
+    {
+        for (unsigned int slot = 0; slot < SlotCount; slot++)
+        {
+            m_wheel[level][slot] = NULL;
+        }
+    }
+    m_thread = std::thread(&TimerService::TimerLoop, this);
+}
+
+/**
+ *   Cancel all timers and stop the timer thread.
+ */
+TimerService::~TimerService(void)
+{
+    Shutdown();
+}
+
+#pragma endregion
+
+#pragma region Scheduling and Cancellation
+
+/**
+ *   Run a callback once after a delay.
+ *
+ *   @param dwDelay - the delay, in milliseconds
+ *   @param callback - the function to run on the pool
+ *   @return the id of the timer, for Cancel
+ */
+TimerService::TimerId TimerService::ScheduleOnce(DWORD dwDelay, Callback callback)
+{
+    return Schedule(ToTicks(dwDelay), 0, 0, std::move(callback));
+}
+
+/**
+ *   Run a callback periodically.
+ *
+ *   @param dwPeriod - the period, in milliseconds
+ *   @param callback - the function to run on the pool
+ *   @param dwJitter - the largest random extension of a period, in milliseconds
+ *   @param dwInitialDelay - the delay before the first run, in milliseconds
+ *   @return the id of the timer, for Cancel
+ */
+TimerService::TimerId TimerService::SchedulePeriodic(DWORD dwPeriod,
+                                                     Callback callback,
+                                                     DWORD dwJitter,
+                                                     DWORD dwInitialDelay)
+{
+    unsigned long long period = ToTicks(dwPeriod);
+    return Schedule(ToTicks(dwInitialDelay), period ? period : 1, ToTicks(dwJitter),
+                    std::move(callback));
+}
+
+/**
+ *   Put a new timer on the wheel, waking the timer thread if the timer is
+ *   due before the thread would otherwise wake up.
+ */
+TimerService::TimerId TimerService::Schedule(unsigned long long delay,
+                                             unsigned long long period,
+                                             unsigned long long jitter,
+                                             Callback &&callback)
+{
+    std::shared_ptr<Timer> timer(new Timer());
+    timer->period = period;
+    timer->jitter = jitter;
+    timer->callback = std::move(callback);
+    timer->slot = NULL;
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->cancelled = false;
+    timer->running = false;
+    timer->held = false;
+
+    // Round up to the next tick boundary, so a timer never fires early.
+    timer->expires = CurrentTick() + 1 + delay;
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_stopping)
+    {
+        return 0;
+    }
+    timer->id = m_nextId++;
+    m_timers[timer->id] = timer;
+    Insert(timer.get());
+
+    if (timer->expires < m_wakeTick)
+    {
+        m_wake.notify_one();
+    }
+    return timer->id;
+}
+
+/**
+ *   Cancel a timer. A run that is queued but has not started is skipped;
+ *   a run in progress is waited for, unless this is called from it.
+ *
+ *   @param id - the timer to cancel
+ *   @return false if there is no such timer
+ */
+bool TimerService::Cancel(TimerId id)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    std::unordered_map<TimerId, std::shared_ptr<Timer>>::iterator it = m_timers.find(id);
+    if (it == m_timers.end())
+    {
+        return false;
+    }
+
+    std::shared_ptr<Timer> timer = it->second;
+    m_timers.erase(it);
+    timer->cancelled = true;
+    Unlink(timer.get());
+
+    std::thread::id self = std::this_thread::get_id();
+    m_idle.wait(guard, [&timer, self]() {
+        return timer->runner == std::thread::id() || timer->runner == self;
+    });
+    return true;
+}
+
+/**
+ *   Cancel every timer, wait for running callbacks and stop the timer
+ *   thread. Calling it more than once is harmless.
+ */
+void TimerService::Shutdown(void)
+{
+    bool inCallback = false;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stopping = true;
+
+        for (std::unordered_map<TimerId, std::shared_ptr<Timer>>::iterator it = m_timers.begin();
+             it != m_timers.end(); ++it)
+        {
+            it->second->cancelled = true;
+            Unlink(it->second.get());
+            if (it->second->runner == std::this_thread::get_id())
+                inCallback = true;
+        }
+        m_timers.clear();
+        m_held.clear();
+    }
+
+    // Runs still queued on the pool may not start for a long time, if the
+    // pool is paused: cut them off from this object, then wait only for
+    // the callbacks that are running.
+    {
+        std::lock_guard<std::mutex> guard(m_link->lock);
+        m_link->service = NULL;
+    }
+    {
+        std::unique_lock<std::mutex> guard(m_lock);
+        size_t self = inCallback ? 1 : 0;
+        m_idle.wait(guard, [this, self]() { return m_running <= self; });
+    }
+    m_wake.notify_one();
+
+    if (m_thread.joinable() && m_thread.get_id() != std::this_thread::get_id())
+    {
+        m_thread.join();
+    }
+}
+
+/**
+ *   Hold back the callbacks that come due from now on, until every pause
+ *   has been resumed. Timers can still be scheduled and cancelled.
+ */
+void TimerService::Pause(void)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_pauseCount++;
+    m_paused = true;
+}
+
+/**
+ *   Wait until the callbacks that were running when the service was
+ *   paused have returned.
+ *
+ *   @param dwMilliseconds - the longest wait, or INFINITE
+ *   @return true if no callback is running
+ */
+bool TimerService::WaitUntilQuiet(DWORD dwMilliseconds)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    auto quiet = [this]() { return m_running == 0 || !m_paused; };
+    if (dwMilliseconds == INFINITE)
+    {
+        m_idle.wait(guard, quiet);
+        return true;
+    }
+    return m_idle.wait_for(guard, std::chrono::milliseconds(dwMilliseconds), quiet);
+}
+
+/**
+ *   End a pause. After the last one, run every timer that came due while
+ *   the service was paused, once, unless it was cancelled since.
+ */
+void TimerService::Resume(void)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_pauseCount == 0 || --m_pauseCount != 0)
+    {
+        return;
+    }
+    m_paused = false;
+    m_idle.notify_all();
+
+    std::vector<std::shared_ptr<Timer>> held;
+    held.swap(m_held);
+    for (size_t i = 0; i < held.size(); i++)
+    {
+        held[i]->held = false;
+        if (!held[i]->cancelled)
+        {
+            Queue(held[i]);
+        }
+    }
+}
+
+/**
+ *   Whether the service is paused, so callbacks that come due are held
+ *   back until it is resumed.
+ */
+bool TimerService::IsPaused(void) const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_paused;
+}
+
+/**
+ *   The number of timers currently scheduled.
+ */
+size_t TimerService::GetTimerCount(void) const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_timers.size();
+}
+
+#pragma endregion
+
+#pragma region Timing Wheel
+
+/**
+ *   Convert milliseconds to ticks, rounding up.
+ */
+unsigned long long TimerService::ToTicks(DWORD dwMilliseconds) const
+{
+    Clock::duration duration = std::chrono::milliseconds(dwMilliseconds);
+    return static_cast<unsigned long long>((duration + m_resolution - Clock::duration(1)) / m_resolution);
+}
+
+/**
+ *   The number of whole ticks since the service was created.
+ */
+unsigned long long TimerService::CurrentTick(void) const
+{
+    return static_cast<unsigned long long>((Clock::now() - m_start) / m_resolution);
+}
+
+/**
+ *   Put a timer in the slot for its expiry. Timers due within 64 ticks go
+ *   to level 0, within 64^2 ticks to level 1, and so on; timers further
+ *   out than the top level can hold wait in its last slot and are placed
+ *   again when that slot is cascaded.
+ *
+ *   @param timer - the timer; it must not be on the wheel
+ */
+void TimerService::Insert(Timer *timer)
+{
+    if (timer->expires <= m_current)
+    {
+        timer->expires = m_current + 1;
+    }
+
+    unsigned long long at = timer->expires;
+    unsigned long long delta = at - m_current;
+    unsigned int level = 0;
+    while (level < LevelCount - 1 && delta >= (1ULL << (LevelBits * (level + 1))))
+    {
+        level++;
+    }
+    if (delta >= (1ULL << (LevelBits * LevelCount)))
+    {
+        at = m_current + (1ULL << (LevelBits * LevelCount)) - 1;
+    }
+
+    Timer **slot = &m_wheel[level][(at >> (LevelBits * level)) & (SlotCount - 1)];
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot)
+    {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+}
+
+/**
+ *   Take a timer off the wheel, if it is on it.
+ */
+void TimerService::Unlink(Timer *timer)
+{
+    if (timer->slot == NULL)
+    {
+        return;
+    }
+
+    if (timer->prev)
+    {
+        timer->prev->next = timer->next;
+    }
+    else
+    {
+        *timer->slot = timer->next;
+    }
+    if (timer->next)
+    {
+        timer->next->prev = timer->prev;
+    }
+    timer->slot = NULL;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+/**
+ *   Move the wheel forward by one tick: cascade the higher levels whose
+ *   slot boundary was crossed, then collect the timers due in this tick.
+ *
+ *   @param expired - receives the timers that are due
+ */
+void TimerService::Advance(std::vector<std::shared_ptr<Timer>> &expired)
+{
+    unsigned long long tick = ++m_current;
+
+    // Cascade from the top down, so timers moving down a level are never
+    // put into a lower slot that was already cascaded for this tick.
+    unsigned int top = 0;
+    while (top < LevelCount - 1 && (tick & ((1ULL << (LevelBits * (top + 1))) - 1)) == 0)
+    {
+        top++;
+    }
+    for (unsigned int level = top; level >= 1; level--)
+    {
+        Timer **slot = &m_wheel[level][(tick >> (LevelBits * level)) & (SlotCount - 1)];
+        Timer *timer = *slot;
+        *slot = NULL;
+        while (timer)
+        {
+            Timer *next = timer->next;
+            Insert(timer);
+            timer = next;
+        }
+    }
+
+    Timer **slot = &m_wheel[0][tick & (SlotCount - 1)];
+    Timer *timer = *slot;
+    *slot = NULL;
+    while (timer)
+    {
+        Timer *next = timer->next;
+        timer->slot = NULL;
+        timer->prev = NULL;
+        timer->next = NULL;
+        if (timer->expires > tick)
+        {
+            Insert(timer);
+        }
+        else
+        {
+            expired.push_back(m_timers.find(timer->id)->second);
+        }
+        timer = next;
+    }
+}
+
+/**
+ *   The number of ticks the timer thread can sleep: up to the next
+ *   occupied level 0 slot, or to the next cascade if there is none.
+ */
+unsigned long long TimerService::TicksUntilNextEvent(void) const
+{
+    if (m_timers.empty())
+    {
+        return c_never;
+    }
+
+    unsigned long long untilCascade = SlotCount - (m_current & (SlotCount - 1));
+    for (unsigned long long k = 1; k < untilCascade; k++)
+    {
+        if (m_wheel[0][(m_current + k) & (SlotCount - 1)])
+        {
+            return k;
+        }
+    }
+    return untilCascade;
+}
+
+#pragma endregion
+
+#pragma region Dispatch
+
+/**
+ *   Hand an expired timer to the pool, rescheduling it if it is periodic,
+ *   or hold it back while the service is paused. A periodic run is
+ *   skipped while the previous one is still going. The caller holds
+ *   m_lock.
+ */
+void TimerService::Dispatch(const std::shared_ptr<Timer> &timer)
+{
+    if (timer->period)
+    {
+        timer->expires += timer->period;
+        if (timer->jitter)
+        {
+            timer->expires += m_random() % (timer->jitter + 1);
+        }
+        Insert(timer.get());
+    }
+
+    if (m_paused)
+    {
+        if (!timer->held)
+        {
+            timer->held = true;
+            m_held.push_back(timer);
+        }
+        return;
+    }
+    Queue(timer);
+}
+
+/**
+ *   Hand a run of a timer to the pool, unless the previous run is still
+ *   going. The caller holds m_lock.
+ */
+void TimerService::Queue(const std::shared_ptr<Timer> &timer)
+{
+    if (timer->running)
+    {
+        return;
+    }
+
+    timer->running = true;
+    std::shared_ptr<Link> link = m_link;
+    std::shared_ptr<Timer> queued = timer;
+    if (!m_pool.Submit([link, queued]() { Run(link, queued); }))
+    {
+        timer->running = false;
+        if (!timer->period)
+        {
+            m_timers.erase(timer->id);
+        }
+    }
+}
+
+/**
+ *   Run a timer callback on a pool thread, unless the timer was cancelled
+ *   while the run was queued or the service has shut down since.
+ *
+ *   @param link - the link to the service that queued the run
+ *   @param timer - the timer to run
+ */
+void TimerService::Run(const std::shared_ptr<Link> &link, const std::shared_ptr<Timer> &timer)
+{
+    TimerService *service;
+    {
+        std::lock_guard<std::mutex> guard(link->lock);
+        service = link->service;
+        if (service == NULL || !service->BeginRun(timer))
+        {
+            return;
+        }
+    }
+
+    try
+    {
+        timer->callback();
+    }
+    catch (...)
+    {
+        // A failing callback must not stop its timer or the pool worker.
+    }
+    service->EndRun(timer);
+}
+
+/**
+ *   Mark a queued run as started. Once it is, Shutdown waits for it.
+ *
+ *   @param timer - the timer to run
+ *   @return false if the timer was cancelled and must not run
+ */
+bool TimerService::BeginRun(const std::shared_ptr<Timer> &timer)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (timer->cancelled)
+    {
+        timer->running = false;
+        return false;
+    }
+    timer->runner = std::this_thread::get_id();
+    m_running++;
+    return true;
+}
+
+/**
+ *   Mark a run as finished, dropping a one-shot timer that ran.
+ *
+ *   @param timer - the timer that ran
+ */
+void TimerService::EndRun(const std::shared_ptr<Timer> &timer)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    timer->running = false;
+    timer->runner = std::thread::id();
+    m_running--;
+    if (!timer->period && !timer->cancelled)
+    {
+        m_timers.erase(timer->id);
+    }
+    m_idle.notify_all();
+}
+
+/**
+ *   The timer thread. Advances the wheel to the current time, dispatches
+ *   what expired and sleeps until the next occupied slot.
+ */
+void TimerService::TimerLoop(void)
+{
+    std::vector<std::shared_ptr<Timer>> expired;
+    std::unique_lock<std::mutex> guard(m_lock);
+    while (!m_stopping)
+    {
+        unsigned long long now = CurrentTick();
+        while (m_current < now)
+        {
+            Advance(expired);
+        }
+        for (size_t i = 0; i < expired.size(); i++)
+        {
+            Dispatch(expired[i]);
+        }
+        expired.clear();
+
+        unsigned long long ticks = TicksUntilNextEvent();
+        if (ticks == c_never)
+        {
+            m_wakeTick = c_never;
+            m_wake.wait(guard);
+        }
+        else
+        {
+            m_wakeTick = m_current + ticks;
+            m_wake.wait_until(guard, m_start + m_resolution * static_cast<Clock::rep>(m_wakeTick));
+        }
+    }
+}
+
+#pragma endregion
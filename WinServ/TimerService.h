@@ -0,0 +1,185 @@
+/*
+ * One-shot and periodic timers on a hierarchical timing wheel.
+ *
+ * A single timer thread advances four wheels of 64 slots each; a timer is
+ * placed in the slot matching its expiry, so scheduling and cancelling are
+ * O(1) and the thread only touches the timers that are due. Expired
+ * callbacks are dispatched to a thread pool, never run on the timer thread.
+ *
+ * While the service is paused the wheel keeps turning, but callbacks that
+ * come due are held back: each held timer runs once when the service is
+ * resumed, and a periodic one then carries on with its period.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Pausable.h"
+#include "Platform.h"
+#include "ThreadPool.h"
+
+class TimerService : public Pausable
+{
+public:
+    typedef unsigned long long TimerId;
+    typedef std::function<void(void)> Callback;
+
+    // Create a timer service that runs callbacks on the given pool. Expiry
+    // times are rounded up to the resolution, in milliseconds.
+    explicit TimerService(ThreadPool &pool, DWORD dwResolution = 10);
+
+    // Cancels every timer and stops the timer thread.
+    ~TimerService(void);
+
+    TimerService(const TimerService &) = delete;
+    TimerService &operator=(const TimerService &) = delete;
+
+    // Run a callback once after the given delay, in milliseconds.
+    TimerId ScheduleOnce(DWORD dwDelay, Callback callback);
+
+    // Run a callback every dwPeriod milliseconds, the first time after
+    // dwInitialDelay. Each period is stretched by a random amount of up to
+    // dwJitter milliseconds so that many timers started together do not
+    // fire in lock step. A run is skipped if the previous one is still busy.
+    TimerId SchedulePeriodic(DWORD dwPeriod,
+                             Callback callback,
+                             DWORD dwJitter = 0,
+                             DWORD dwInitialDelay = 0);
+
+    // Cancel a timer. When it returns the callback will not start again and
+    // is not running, unless Cancel was called from the callback itself.
+    // Returns false if the timer did not exist (or a one-shot already ran).
+    bool Cancel(TimerId id);
+
+    // Hold back the callbacks that come due until every Pause has had its
+    // Resume.
+    virtual void Pause(void);
+
+    // Wait until no callback is running. Runs queued on the pool but not
+    // started are left to the pool, which may be paused as well.
+    virtual bool WaitUntilQuiet(DWORD dwMilliseconds);
+
+    // End a pause; after the last one, run the held callbacks, each once,
+    // and let timers fire again.
+    virtual void Resume(void);
+
+    // True while callbacks that come due are held back.
+    bool IsPaused(void) const;
+
+    // Cancel every timer, wait for the callbacks that are running and stop
+    // the timer thread. Runs queued on the pool but not started are let go:
+    // they return at once when the pool gets to them, even after the
+    // service is gone, so a paused pool does not hold Shutdown up.
+    void Shutdown(void);
+
+    // Number of timers currently scheduled.
+    size_t GetTimerCount(void) const;
+
+    // The pool the callbacks run on.
+    ThreadPool &GetPool(void) const { return m_pool; }
+
+    // The process-wide timer service, running callbacks on the default pool.
+    static TimerService &Default(void);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    static const unsigned int LevelBits = 6;
+    static const unsigned int SlotCount = 1 << LevelBits;
+    static const unsigned int LevelCount = 4;
+
+    struct Timer
+    {
+        TimerId id;
+        unsigned long long expires; // in ticks
+        unsigned long long period;  // in ticks, 0 for one-shot
+        unsigned long long jitter;  // in ticks
+        Callback callback;
+
+        // Intrusive links of the wheel slot the timer is in; slot is NULL
+        // while the timer is off the wheel.
+        Timer **slot;
+        Timer *prev;
+        Timer *next;
+
+        // Written under the service lock.
+        bool cancelled;
+        bool running;
+        bool held;
+        std::thread::id runner;
+    };
+
+    TimerId Schedule(unsigned long long delay,
+                     unsigned long long period,
+                     unsigned long long jitter,
+                     Callback &&callback);
+
+    unsigned long long ToTicks(DWORD dwMilliseconds) const;
+    unsigned long long CurrentTick(void) const;
+
+    // Wheel maintenance; the caller holds m_lock.
+    void Insert(Timer *timer);
+    void Unlink(Timer *timer);
+    void Advance(std::vector<std::shared_ptr<Timer>> &expired);
+    unsigned long long TicksUntilNextEvent(void) const;
+
+    // What a run queued on the pool holds instead of the service; the
+    // service clears it when it shuts down.
+    struct Link
+    {
+        explicit Link(TimerService *service) : service(service) {}
+
+        std::mutex lock;
+        TimerService *service;
+    };
+
+    void Dispatch(const std::shared_ptr<Timer> &timer);
+    void Queue(const std::shared_ptr<Timer> &timer);
+    static void Run(const std::shared_ptr<Link> &link, const std::shared_ptr<Timer> &timer);
+    bool BeginRun(const std::shared_ptr<Timer> &timer);
+    void EndRun(const std::shared_ptr<Timer> &timer);
+    void TimerLoop(void);
+
+    ThreadPool &m_pool;
+    Clock::duration m_resolution;
+    Clock::time_point m_start;
+
+    mutable std::mutex m_lock;
+    std::condition_variable m_wake;
+    std::condition_variable m_idle;
+
+    // Slot heads of each wheel level.
+    Timer *m_wheel[LevelCount][SlotCount];
+
+    // The last tick processed by the timer thread.
+    unsigned long long m_current;
+
+    // Tick the timer thread is sleeping until.
+    unsigned long long m_wakeTick;
+
+    TimerId m_nextId;
+    std::unordered_map<TimerId, std::shared_ptr<Timer>> m_timers;
+
+    // The link of the runs handed to the pool, and how many of them are
+    // running.
+    std::shared_ptr<Link> m_link;
+    size_t m_running;
+
+    // Whether callbacks are held back, by how many pauses, and the timers
+    // that came due while they were.
+    bool m_paused;
+    size_t m_pauseCount;
+    std::vector<std::shared_ptr<Timer>> m_held;
+    std::minstd_rand m_random;
+    bool m_stopping;
+    std::thread m_thread;
+};
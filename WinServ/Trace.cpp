@@ -0,0 +1,528 @@
+#pragma region Includes
+#include "Trace.h"
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#ifndef _WIN32
+#include <cxxabi.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#pragma endregion
+
+namespace
+{
+    // What an event is.
+    enum EventFlags
+    {
+        // A span, with a duration, rather than an instant event
+        EventSpan = 1,
+
+        // The name is the mangled name of a type
+        EventTypeName = 2
+    };
+
+    // A slot of a ring. Every field is atomic so that the exporter may read
+    // it while the owner writes; sequence is 2 * index + 1 while event
+    // index is being written into the slot and 2 * index + 2 once it is.
+    struct TraceEvent
+    {
+        std::atomic<unsigned long long> sequence;
+        std::atomic<unsigned long long> start;
+        std::atomic<unsigned long long> duration;
+        std::atomic<const char *> name;
+        std::atomic<const char *> category;
+        std::atomic<const char *> argName;
+        std::atomic<unsigned long long> value;
+        std::atomic<unsigned int> flags;
+    };
+
+    // The events of one thread. Only the thread writes to it; next is the
+    // index of the next event.
+    struct Ring
+    {
+        TraceEvent events[Trace::RingSize];
+        std::atomic<unsigned long long> next;
+        std::atomic<const char *> threadName;
+        unsigned long long threadId;
+    };
+
+    // Every ring, the names interned and the time of the last Clear.
+    struct Registry
+    {
+        std::mutex lock;
+        std::vector<Ring *> rings;
+        std::deque<Ring *> exited;
+        std::set<std::string> interned;
+        std::atomic<unsigned long long> clearedAt;
+        std::atomic<unsigned long long> epoch;
+    };
+
+    // The registry is never destroyed: threads may still record, and
+    // exit, while static objects are being destroyed.
+    Registry &GetRegistry(void)
+    {
+        static Registry *registry = []() {
+            Registry *created = new Registry();
+            created->clearedAt = 0;
+            created->epoch = 0;
+            return created;
+        }();
+        return *registry;
+    }
+
+    unsigned long long GetThreadIdentifier(void)
+    {
+#ifdef _WIN32
+        return GetCurrentThreadId();
+#else
+        return static_cast<unsigned long long>(syscall(SYS_gettid));
+#endif
+    }
+
+    unsigned long long GetProcessIdentifier(void)
+    {
+#ifdef _WIN32
+        return GetCurrentProcessId();
+#else
+        return static_cast<unsigned long long>(getpid());
+#endif
+    }
+
+    // The ring of the calling thread, and its name until it has one. The
+    // ring moves to the exited rings when the thread exits.
+    struct ThreadRing
+    {
+        Ring *ring;
+        const char *name;
+
+        ~ThreadRing(void)
+        {
+            if (ring == NULL)
+            {
+                return;
+            }
+            Registry &registry = GetRegistry();
+            std::lock_guard<std::mutex> guard(registry.lock);
+            registry.rings.erase(std::find(registry.rings.begin(), registry.rings.end(), ring));
+            registry.exited.push_back(ring);
+            if (registry.exited.size() > Trace::MaxExitedRings)
+            {
+                delete registry.exited.front();
+                registry.exited.pop_front();
+            }
+        }
+    };
+
+    thread_local ThreadRing t_ring = {NULL, NULL};
+
+    // Give the calling thread a ring. It is value-initialized: every slot
+    // has sequence 0, which no event has.
+    Ring *CreateRing(void)
+    {
+        std::unique_ptr<Ring> ring(new Ring());
+        ring->threadName.store(t_ring.name, std::memory_order_relaxed);
+        ring->threadId = GetThreadIdentifier();
+
+        Registry &registry = GetRegistry();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        registry.rings.push_back(ring.get());
+        t_ring.ring = ring.release();
+        return t_ring.ring;
+    }
+
+    // Write an event into the ring of the calling thread.
+    void Record(const char *pszName, const char *pszCategory, unsigned long long start,
+                unsigned long long duration, unsigned int flags, const char *pszArgName,
+                unsigned long long value)
+    {
+        Ring *ring = t_ring.ring;
+        if (ring == NULL)
+        {
+            ring = CreateRing();
+        }
+
+        // Mark the slot as being written before writing to it, and as
+        // written after.
+        unsigned long long index = ring->next.load(std::memory_order_relaxed);
+        TraceEvent &event = ring->events[index % Trace::RingSize];
+        event.sequence.store(2 * index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        event.start.store(start, std::memory_order_relaxed);
+        event.duration.store(duration, std::memory_order_relaxed);
+        event.name.store(pszName, std::memory_order_relaxed);
+        event.category.store(pszCategory, std::memory_order_relaxed);
+        event.argName.store(pszArgName, std::memory_order_relaxed);
+        event.value.store(value, std::memory_order_relaxed);
+        event.flags.store(flags, std::memory_order_relaxed);
+        event.sequence.store(2 * index + 2, std::memory_order_release);
+        ring->next.store(index + 1, std::memory_order_release);
+    }
+
+    // An event copied out of a ring.
+    struct ExportedEvent
+    {
+        unsigned long long threadId;
+        unsigned long long start;
+        unsigned long long duration;
+        const char *name;
+        const char *category;
+        const char *argName;
+        unsigned long long value;
+        unsigned int flags;
+    };
+
+    // Copy the events of a ring that are complete and recorded since the
+    // last Clear. Called with the registry lock held, which keeps the ring
+    // alive.
+    void CopyEvents(const Ring &ring, unsigned long long clearedAt, std::vector<ExportedEvent> &events)
+    {
+        unsigned long long next = ring.next.load(std::memory_order_acquire);
+        unsigned long long first = (next > Trace::RingSize) ? next - Trace::RingSize : 0;
+        for (unsigned long long index = first; index < next; index++)
+        {
+            const TraceEvent &slot = ring.events[index % Trace::RingSize];
+            unsigned long long sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence != 2 * index + 2)
+            {
+                continue;
+            }
+
+            ExportedEvent event;
+            event.threadId = ring.threadId;
+            event.start = slot.start.load(std::memory_order_relaxed);
+            event.duration = slot.duration.load(std::memory_order_relaxed);
+            event.name = slot.name.load(std::memory_order_relaxed);
+            event.category = slot.category.load(std::memory_order_relaxed);
+            event.argName = slot.argName.load(std::memory_order_relaxed);
+            event.value = slot.value.load(std::memory_order_relaxed);
+            event.flags = slot.flags.load(std::memory_order_relaxed);
+
+            // The owner may have started to overwrite the slot meanwhile.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) != sequence || event.start < clearedAt)
+            {
+                continue;
+            }
+            events.push_back(event);
+        }
+    }
+
+    // Append text as a JSON string.
+    void AppendString(std::string &json, const char *text)
+    {
+        json += '"';
+        for (; *text != '\0'; text++)
+        {
+            unsigned char ch = static_cast<unsigned char>(*text);
+            if (ch == '"' || ch == '\\')
+            {
+                json += '\\';
+                json += static_cast<char>(ch);
+            }
+            else if (ch < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+                json += escaped;
+            }
+            else
+            {
+                json += static_cast<char>(ch);
+            }
+        }
+        json += '"';
+    }
+
+    // The readable name of a type from its mangled name.
+    std::string Demangle(const char *pszName)
+    {
+#ifdef _WIN32
+        return pszName;
+#else
+        int status = 0;
+        char *demangled = abi::__cxa_demangle(pszName, NULL, NULL, &status);
+        std::string name((status == 0 && demangled != NULL) ? demangled : pszName);
+        free(demangled);
+        return name;
+#endif
+    }
+}
+
+#pragma region Recording
+
+std::atomic<bool> Trace::s_fEnabled(false);
+
+/**
+ *   Start or stop recording. The first start sets the origin of the
+ *   timeline.
+ *
+ *   @param fEnabled - whether to record
+ */
+void Trace::Enable(bool fEnabled)
+{
+    Registry &registry = GetRegistry();
+    unsigned long long none = 0;
+    if (fEnabled)
+    {
+        registry.epoch.compare_exchange_strong(none, Now());
+    }
+    s_fEnabled.store(fEnabled);
+}
+
+unsigned long long Trace::Now(void)
+{
+    return static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+/**
+ *   @param pszName - what happened
+ *   @param pszCategory - the part of the process it happened in
+ *   @param pszArgName - the name of a number to show with the event, or
+ *   NULL
+ *   @param value - the number
+ */
+void Trace::Instant(const char *pszName, const char *pszCategory, const char *pszArgName, unsigned long long value)
+{
+    if (IsEnabled())
+    {
+        Record(pszName, pszCategory, Now(), 0, 0, pszArgName, value);
+    }
+}
+
+/**
+ *   @param pszName - what was done
+ *   @param pszCategory - the part of the process it was done in
+ *   @param start - when it started, from Now
+ *   @param pszArgName - the name of a number to show with the span, or NULL
+ *   @param value - the number
+ */
+void Trace::Span(const char *pszName, const char *pszCategory, unsigned long long start,
+                 const char *pszArgName, unsigned long long value)
+{
+    if (IsEnabled())
+    {
+        unsigned long long now = Now();
+        Record(pszName, pszCategory, start, now - start, EventSpan, pszArgName, value);
+    }
+}
+
+/**
+ *   @param type - the type the span is named after
+ *   @param pszCategory - the part of the process it was done in
+ *   @param start - when it started, from Now
+ */
+void Trace::Span(const std::type_info &type, const char *pszCategory, unsigned long long start)
+{
+    if (IsEnabled())
+    {
+        unsigned long long now = Now();
+        Record(type.name(), pszCategory, start, now - start, EventSpan | EventTypeName, NULL, 0);
+    }
+}
+
+/**
+ *   @param text - the text
+ *   @return its UTF-8 copy, which is never freed
+ */
+const char *Trace::Intern(const std::wstring &text)
+{
+    std::string utf8;
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        unsigned long ch = static_cast<unsigned long>(text[i]);
+        if (sizeof(wchar_t) == 2 && ch >= 0xD800 && ch < 0xDC00 && i + 1 < text.size())
+        {
+            ch = 0x10000 + ((ch - 0xD800) << 10) + (static_cast<unsigned long>(text[++i]) - 0xDC00);
+        }
+        if (ch < 0x80)
+        {
+            utf8 += static_cast<char>(ch);
+        }
+        else if (ch < 0x800)
+        {
+            utf8 += static_cast<char>(0xC0 | (ch >> 6));
+            utf8 += static_cast<char>(0x80 | (ch & 0x3F));
+        }
+        else if (ch < 0x10000)
+        {
+            utf8 += static_cast<char>(0xE0 | (ch >> 12));
+            utf8 += static_cast<char>(0x80 | ((ch >> 6) & 0x3F));
+            utf8 += static_cast<char>(0x80 | (ch & 0x3F));
+        }
+        else
+        {
+            utf8 += static_cast<char>(0xF0 | (ch >> 18));
+            utf8 += static_cast<char>(0x80 | ((ch >> 12) & 0x3F));
+            utf8 += static_cast<char>(0x80 | ((ch >> 6) & 0x3F));
+            utf8 += static_cast<char>(0x80 | (ch & 0x3F));
+        }
+    }
+
+    // Elements of a set never move, so their text can be handed out.
+    Registry &registry = GetRegistry();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    return registry.interned.insert(utf8).first->c_str();
+}
+
+/**
+ *   @param pszName - the name of the calling thread
+ */
+void Trace::SetThreadName(const char *pszName)
+{
+    t_ring.name = pszName;
+    if (t_ring.ring != NULL)
+    {
+        t_ring.ring->threadName.store(pszName, std::memory_order_relaxed);
+    }
+}
+
+void Trace::Clear(void)
+{
+    GetRegistry().clearedAt.store(Now());
+}
+
+#pragma endregion
+
+#pragma region Export
+
+/**
+ *   Copy the events of every ring and format them as Chrome trace-event
+ *   JSON: a complete ("X") event per span, a thread-scoped instant ("i")
+ *   event per instant event and a thread_name metadata event per named
+ *   thread. Times are in microseconds from the first Enable.
+ *
+ *   @return the JSON document
+ */
+std::string Trace::ExportJson(void)
+{
+    Registry &registry = GetRegistry();
+    unsigned long long clearedAt = registry.clearedAt.load();
+    unsigned long long epoch = registry.epoch.load();
+
+    std::vector<ExportedEvent> events;
+    std::vector<std::pair<unsigned long long, const char *>> threads;
+    {
+        std::lock_guard<std::mutex> guard(registry.lock);
+        for (int list = 0; list < 2; list++)
+        {
+            size_t count = (list == 0) ? registry.rings.size() : registry.exited.size();
+            for (size_t i = 0; i < count; i++)
+            {
+                const Ring &ring = (list == 0) ? *registry.rings[i] : *registry.exited[i];
+                CopyEvents(ring, clearedAt, events);
+                const char *pszThreadName = ring.threadName.load(std::memory_order_relaxed);
+                if (pszThreadName != NULL)
+                {
+                    threads.push_back(std::make_pair(ring.threadId, pszThreadName));
+                }
+            }
+        }
+    }
+    std::sort(events.begin(), events.end(),
+              [](const ExportedEvent &a, const ExportedEvent &b) { return a.start < b.start; });
+
+    unsigned long long pid = GetProcessIdentifier();
+    std::map<const char *, std::string> typeNames;
+    std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    char buffer[160];
+    bool fFirst = true;
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        snprintf(buffer, sizeof(buffer),
+                 "%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%llu,\"tid\":%llu,\"args\":{\"name\":",
+                 fFirst ? "" : ",", pid, threads[i].first);
+        json += buffer;
+        AppendString(json, threads[i].second);
+        json += "}}";
+        fFirst = false;
+    }
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        const ExportedEvent &event = events[i];
+        json += fFirst ? "\n{\"name\":" : ",\n{\"name\":";
+        fFirst = false;
+        if (event.flags & EventTypeName)
+        {
+            std::map<const char *, std::string>::iterator it = typeNames.find(event.name);
+            if (it == typeNames.end())
+            {
+                it = typeNames.insert(std::make_pair(event.name, Demangle(event.name))).first;
+            }
+            AppendString(json, it->second.c_str());
+        }
+        else
+        {
+            AppendString(json, event.name);
+        }
+        json += ",\"cat\":";
+        AppendString(json, event.category);
+
+        unsigned long long start = (event.start > epoch) ? event.start - epoch : 0;
+        if (event.flags & EventSpan)
+        {
+            snprintf(buffer, sizeof(buffer), ",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu",
+                     start / 1000, start % 1000, event.duration / 1000, event.duration % 1000);
+        }
+        else
+        {
+            snprintf(buffer, sizeof(buffer), ",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu.%03llu", start / 1000,
+                     start % 1000);
+        }
+        json += buffer;
+        snprintf(buffer, sizeof(buffer), ",\"pid\":%llu,\"tid\":%llu", pid, event.threadId);
+        json += buffer;
+        if (event.argName != NULL)
+        {
+            json += ",\"args\":{";
+            AppendString(json, event.argName);
+            snprintf(buffer, sizeof(buffer), ":%llu}", event.value);
+            json += buffer;
+        }
+        json += '}';
+    }
+    json += "\n]}\n";
+    return json;
+}
+
+/**
+ *   Write the events of every thread to a file, replacing it.
+ *
+ *   @param pszPath - the path of the file
+ */
+void Trace::Export(const wchar_t *pszPath)
+{
+    std::string json = ExportJson();
+
+    FILE *file = NULL;
+#ifdef _WIN32
+    if (_wfopen_s(&file, pszPath, L"wb") != 0)
+    {
+        file = NULL;
+    }
+#else
+    std::string narrow(wcstombs(NULL, pszPath, 0) + 1, '\0');
+    wcstombs(&narrow[0], pszPath, narrow.size());
+    file = fopen(narrow.c_str(), "wb");
+#endif
+    if (file == NULL)
+    {
+        throw static_cast<DWORD>(ERROR_WRITE_FAULT);
+    }
+    bool fWritten = fwrite(json.data(), 1, json.size(), file) == json.size();
+    fWritten = (fclose(file) == 0) && fWritten;
+    if (!fWritten)
+    {
+        throw static_cast<DWORD>(ERROR_WRITE_FAULT);
+    }
+}
+
+#pragma endregion
@@ -0,0 +1,117 @@
+/*
+ * Recording what the process does over time, for a timeline.
+ *
+ * Spans (a name, a start and a duration) and instant events are written by
+ * each thread into a ring of its own, so recording takes no lock and never
+ * waits for another thread: a read of the monotonic clock and a few stores
+ * into memory only that thread writes. A ring keeps the last RingSize
+ * events of its thread, overwriting older ones, and takes half a megabyte.
+ * It is created the first time its thread records while tracing is
+ * enabled, and outlives the thread, so that work done by threads that have
+ * exited still shows; only the rings of the last MaxExitedRings threads to
+ * exit are kept.
+ *
+ * Export reads the rings while their threads keep recording and writes the
+ * events as Chrome trace-event JSON, which Perfetto (ui.perfetto.dev) and
+ * chrome://tracing open. Every slot of a ring carries a sequence number,
+ * written before and after the event, so that an event overwritten while
+ * it is read is left out rather than torn.
+ *
+ * Names are not copied: they must be string literals, the names of types
+ * (demangled on export) or strings returned by Intern. Tracing is off
+ * until Enable is called; while it is off, recording costs the load of a
+ * flag.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <typeinfo>
+#include "Platform.h"
+
+class Trace
+{
+public:
+    // The events each thread keeps.
+    static const size_t RingSize = 8192;
+
+    // The rings of exited threads that are kept.
+    static const size_t MaxExitedRings = 64;
+
+    // Start or stop recording. Events already recorded are kept.
+    static void Enable(bool fEnabled);
+
+    static bool IsEnabled(void)
+    {
+        return s_fEnabled.load(std::memory_order_relaxed);
+    }
+
+    // Nanoseconds on the monotonic clock the events are stamped with.
+    static unsigned long long Now(void);
+
+    // Record an instant event, with an optional named number.
+    static void Instant(const char *pszName, const char *pszCategory,
+                        const char *pszArgName = NULL, unsigned long long value = 0);
+
+    // Record a span from start, a reading of Now, until now, with an
+    // optional named number.
+    static void Span(const char *pszName, const char *pszCategory, unsigned long long start,
+                     const char *pszArgName = NULL, unsigned long long value = 0);
+
+    // Record a span named after a type, such as the closure of a task.
+    static void Span(const std::type_info &type, const char *pszCategory, unsigned long long start);
+
+    // A UTF-8 copy of the text that lives as long as the process, for names
+    // that are not literals. The same text always gives the same copy.
+    static const char *Intern(const std::wstring &text);
+
+    // Name the calling thread in the timeline. The name must be a literal
+    // or come from Intern.
+    static void SetThreadName(const char *pszName);
+
+    // Leave out the events recorded so far from later exports.
+    static void Clear(void);
+
+    // The events of every thread, as Chrome trace-event JSON.
+    static std::string ExportJson(void);
+
+    // Write the events to a file as Chrome trace-event JSON. Throws the
+    // error if the file cannot be written.
+    static void Export(const wchar_t *pszPath);
+
+private:
+    static std::atomic<bool> s_fEnabled;
+};
+
+// Records a span from its construction to its destruction, if tracing is
+// enabled when it is constructed.
+class TraceSpan
+{
+public:
+    TraceSpan(const char *pszName, const char *pszCategory,
+              const char *pszArgName = NULL, unsigned long long value = 0)
+        : m_name(pszName), m_category(pszCategory), m_argName(pszArgName), m_value(value),
+          m_start(Trace::IsEnabled() ? Trace::Now() : 0)
+    {
+    }
+
+    ~TraceSpan(void)
+    {
+        if (m_start != 0)
+        {
+            Trace::Span(m_name, m_category, m_start, m_argName, m_value);
+        }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+    const char *m_name;
+    const char *m_category;
+    const char *m_argName;
+    unsigned long long m_value;
+    unsigned long long m_start;
+};
@@ -0,0 +1,664 @@
+#pragma region Includes
+#include "Watchdog.h"
+#include "Logger.h"
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#ifdef _WIN32
+#include <DbgHelp.h>
+#include <strsafe.h>
+#else
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <stdlib.h>
+#endif
+#pragma endregion
+
+#ifdef _WIN32
+#pragma comment(lib, "dbghelp.lib")
+#endif
+
+namespace
+{
+    const wchar_t *const c_logSource = L"Watchdog";
+
+    // Widen ASCII text, such as a symbol name.
+    std::wstring Widen(const char *text)
+    {
+        std::wstring wide;
+        for (; *text != '\0'; text++)
+        {
+            wide += static_cast<wchar_t>(static_cast<unsigned char>(*text));
+        }
+        return wide;
+    }
+
+    // The name of a type, demangled where the compiler mangles it.
+    std::wstring GetTypeName(const std::type_info &type)
+    {
+#ifdef _WIN32
+        return Widen(type.name());
+#else
+        int status = 0;
+        char *demangled = abi::__cxa_demangle(type.name(), NULL, NULL, &status);
+        std::wstring name = Widen((status == 0 && demangled != NULL) ? demangled : type.name());
+        free(demangled);
+        return name;
+#endif
+    }
+
+#ifndef _WIN32
+    // The slot of the calling thread, for the signal handler.
+    thread_local WatchdogSlot *t_slot = NULL;
+
+    // The signal that asks a worker for a sample of its stack. SIGRTMIN
+    // itself carries custom controls to the service host.
+    int GetSampleSignal(void)
+    {
+        return SIGRTMIN + 1;
+    }
+#endif
+}
+
+#pragma region Slots
+
+WatchdogSlot::WatchdogSlot(void)
+    : m_startedAt(0), m_task(NULL), m_index(0), m_reported(0), m_thread(), m_frameCount(0)
+{
+#ifdef _WIN32
+    m_stackLow = 0;
+    m_stackHigh = 0;
+#endif
+}
+
+#pragma endregion
+
+#pragma region Watchdog Constructor and Destructor
+
+/**
+ *   Create the watchdog. The logger and the metrics registry are created
+ *   first, so that they outlive a watchdog with static lifetime.
+ *
+ *   @param dwThreshold - milliseconds a task may run before it is
+ *   reported, or INFINITE to report none
+ */
+Watchdog::Watchdog(DWORD dwThreshold)
+    : m_sampling(NULL), m_fStopping(false), m_dwThreshold(dwThreshold)
+{
+#ifdef _WIN32
+    m_stackCopy.resize(StackCopySize);
+#endif
+    m_logger = &Logger::Default();
+    MetricsRegistry &metrics = MetricsRegistry::Default();
+    m_stalls = metrics.GetCounter(L"watchdog.stalls");
+    m_stalled = metrics.GetGauge(L"watchdog.stalled");
+    m_stallTime = metrics.GetHistogram(L"watchdog.stall_ms");
+    m_samplesFailed = metrics.GetCounter(L"watchdog.samples_failed");
+
+#ifndef _WIN32
+    static std::once_flag s_handlerInstalled;
+    std::call_once(s_handlerInstalled, &Watchdog::InstallSampleHandler);
+#endif
+}
+
+Watchdog::~Watchdog(void)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_fStopping = true;
+        m_wake.notify_all();
+    }
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+    }
+}
+
+/**
+ *   The process-wide watchdog. It is created on first use, by the first
+ *   thread pool at the latest.
+ */
+Watchdog &Watchdog::Default(void)
+{
+    static Watchdog watchdog;
+    return watchdog;
+}
+
+#pragma endregion
+
+#pragma region Registration
+
+/**
+ *   Register the calling thread as a worker of an executor and start the
+ *   watchdog thread if it is not running yet.
+ *
+ *   @param pszExecutor - the name of the executor, used in the reports
+ *   @param index - the index of the worker within the executor
+ *   @return the slot the worker stamps its tasks in
+ */
+WatchdogSlot *Watchdog::Register(const wchar_t *pszExecutor, size_t index)
+{
+    std::unique_ptr<WatchdogSlot> slot(new WatchdogSlot());
+    slot->m_executor = pszExecutor;
+    slot->m_index = index;
+
+#ifdef _WIN32
+    if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &slot->m_thread,
+                         THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION, FALSE, 0))
+    {
+        // The worker is still watched; it just cannot be sampled.
+        slot->m_thread = NULL;
+    }
+    GetCurrentThreadStackLimits(&slot->m_stackLow, &slot->m_stackHigh);
+#else
+    slot->m_thread = pthread_self();
+    t_slot = slot.get();
+
+    // The thread may have inherited a mask that blocks every signal.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, GetSampleSignal());
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+#endif
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_slots.push_back(std::move(slot));
+    if (!m_thread.joinable())
+    {
+        m_thread = std::thread(&Watchdog::WatchLoop, this);
+    }
+    return m_slots.back().get();
+}
+
+/**
+ *   Stop watching a slot and release it, once a sample of it that is under
+ *   way is over. A task it reported that has not been seen to finish is
+ *   counted as finished now.
+ *
+ *   @param slot - a slot returned by Register, on the thread it was
+ *   registered on
+ */
+void Watchdog::Unregister(WatchdogSlot *slot)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    m_sampled.wait(guard, [this, slot]() { return m_sampling != slot; });
+#ifndef _WIN32
+    // A sample signal still on its way finds no slot.
+    t_slot = NULL;
+#endif
+
+    for (size_t i = 0; i < m_slots.size(); i++)
+    {
+        if (m_slots[i].get() == slot)
+        {
+            if (slot->m_reported != 0)
+            {
+                m_stalled.Add(-1);
+            }
+#ifdef _WIN32
+            if (slot->m_thread != NULL)
+            {
+                CloseHandle(slot->m_thread);
+            }
+#endif
+            m_slots.erase(m_slots.begin() + i);
+            break;
+        }
+    }
+}
+
+#pragma endregion
+
+#pragma region Settings
+
+/**
+ *   @param dwThreshold - milliseconds a task may run before it is
+ *   reported, or INFINITE to report none
+ */
+void Watchdog::SetThreshold(DWORD dwThreshold)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_dwThreshold = dwThreshold;
+    m_wake.notify_all();
+}
+
+DWORD Watchdog::GetThreshold(void) const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_dwThreshold;
+}
+
+/**
+ *   @param handler - called with every stall reported from now on, or
+ *   empty
+ */
+void Watchdog::SetStallHandler(StallHandler handler)
+{
+    std::lock_guard<std::mutex> guard(m_handlerLock);
+    m_handler = std::move(handler);
+}
+
+/**
+ *   @param logger - the logger the reports go to from now on
+ */
+void Watchdog::SetLogger(Logger &logger)
+{
+    std::lock_guard<std::mutex> guard(m_handlerLock);
+    m_logger = &logger;
+}
+
+/**
+ *   The scan interval: a quarter of the threshold, so a stall is reported
+ *   within a quarter of the threshold of crossing it, but not more often
+ *   than every 10 ms. Called with m_lock held.
+ */
+DWORD Watchdog::GetInterval(void) const
+{
+    if (m_dwThreshold == INFINITE)
+    {
+        return INFINITE;
+    }
+    DWORD dwInterval = m_dwThreshold / 4;
+    return (dwInterval < 10) ? 10 : dwInterval;
+}
+
+#pragma endregion
+
+#pragma region Watching
+
+/**
+ *   The body of the watchdog thread: scan the slots every interval until
+ *   the watchdog is destroyed. Stalls are reported with the lock released,
+ *   so that a handler or a slow sink does not hold up the workers that
+ *   register and unregister.
+ */
+void Watchdog::WatchLoop(void)
+{
+    std::vector<Stall> stalls;
+    std::unique_lock<std::mutex> guard(m_lock);
+    while (!m_fStopping)
+    {
+        DWORD dwInterval = GetInterval();
+        if (dwInterval == INFINITE)
+        {
+            m_wake.wait(guard);
+        }
+        else
+        {
+            m_wake.wait_for(guard, std::chrono::milliseconds(dwInterval));
+        }
+        if (m_fStopping)
+        {
+            break;
+        }
+
+        Scan(stalls, guard);
+        if (!stalls.empty())
+        {
+            guard.unlock();
+            for (size_t i = 0; i < stalls.size(); i++)
+            {
+                Report(stalls[i]);
+            }
+            stalls.clear();
+            guard.lock();
+        }
+    }
+}
+
+/**
+ *   Look at every slot: note the reported tasks that have finished since
+ *   the last scan, and sample the workers whose task has run past the
+ *   threshold and has not been reported yet. A task that finishes while
+ *   its worker is sampled is not reported.
+ *
+ *   @param stalls - receives the stalls and finished stalls to report
+ *   @param guard - holds m_lock; sampling may release it for a while
+ */
+void Watchdog::Scan(std::vector<Stall> &stalls, std::unique_lock<std::mutex> &guard)
+{
+    unsigned long long now = WatchdogSlot::Now();
+    for (size_t i = 0; i < m_slots.size(); i++)
+    {
+        WatchdogSlot *slot = m_slots[i].get();
+        unsigned long long started = slot->m_startedAt.load(std::memory_order_acquire);
+
+        if (slot->m_reported != 0 && started != slot->m_reported)
+        {
+            Stall finished;
+            finished.executor = slot->m_executor;
+            finished.index = slot->m_index;
+            finished.task = NULL;
+            finished.dwElapsed = static_cast<DWORD>(now - slot->m_reported);
+            finished.fFinished = true;
+            m_stalled.Add(-1);
+            m_stallTime.Record(finished.dwElapsed);
+            stalls.push_back(std::move(finished));
+            slot->m_reported = 0;
+        }
+
+        if (started == 0 || started == slot->m_reported || m_dwThreshold == INFINITE ||
+            now - started < m_dwThreshold)
+        {
+            continue;
+        }
+
+        Stall stall;
+        stall.executor = slot->m_executor;
+        stall.index = slot->m_index;
+        stall.task = slot->m_task.load(std::memory_order_relaxed);
+        stall.dwElapsed = static_cast<DWORD>(now - started);
+        stall.fFinished = false;
+        Sample(slot, stall, guard);
+
+        // Other slots may have come and gone while the lock was released;
+        // this one stays until the sample is over.
+        for (i = 0; m_slots[i].get() != slot; i++)
+        {
+        }
+        if (slot->m_startedAt.load(std::memory_order_acquire) != started)
+        {
+            continue;
+        }
+
+        slot->m_reported = started;
+        m_stalls.Increment();
+        m_stalled.Add(1);
+        stalls.push_back(std::move(stall));
+    }
+}
+
+/**
+ *   Take a sample of the stack of a slot's worker while it runs.
+ *
+ *   @param slot - the slot of the worker
+ *   @param stall - receives the frames, innermost first
+ *   @param guard - holds m_lock; released while the watchdog waits for the
+ *   worker to sample itself
+ */
+void Watchdog::Sample(WatchdogSlot *slot, Stall &stall, std::unique_lock<std::mutex> &guard)
+{
+    stall.frames.clear();
+    stall.skipped = 0;
+#ifdef _WIN32
+    // The worker may hold any lock, the heap's or the loader's among them,
+    // so nothing that could take one runs while it is suspended: its
+    // registers and the live part of its stack are copied into memory set
+    // aside beforehand, and the copy is unwound once it runs again.
+    if (slot->m_thread == NULL || SuspendThread(slot->m_thread) == static_cast<DWORD>(-1))
+    {
+        m_samplesFailed.Increment();
+        return;
+    }
+
+    CONTEXT context;
+    ZeroMemory(&context, sizeof(context));
+    context.ContextFlags = CONTEXT_FULL;
+    bool fContext = GetThreadContext(slot->m_thread, &context) != FALSE;
+#if defined(_M_X64)
+    ULONG_PTR stackTop = static_cast<ULONG_PTR>(context.Rsp);
+    size_t copied = 0;
+    if (fContext && stackTop >= slot->m_stackLow && stackTop < slot->m_stackHigh)
+    {
+        copied = std::min((slot->m_stackHigh - stackTop) / sizeof(ULONG_PTR), StackCopySize - StackCopySlack);
+        memcpy(&m_stackCopy[0], reinterpret_cast<const void *>(stackTop), copied * sizeof(ULONG_PTR));
+    }
+#endif
+    ResumeThread(slot->m_thread);
+
+    void *frames[WatchdogSlot::MaxFrames];
+    size_t count = 0;
+#if defined(_M_X64)
+    if (copied != 0)
+    {
+        // Point what pointed into the stack into the copy: the registers,
+        // and the frame pointers and such saved on the stack.
+        ULONG_PTR copyBase = reinterpret_cast<ULONG_PTR>(&m_stackCopy[0]);
+        ULONG_PTR copyEnd = copyBase + copied * sizeof(ULONG_PTR);
+        ULONG_PTR stackEnd = stackTop + copied * sizeof(ULONG_PTR);
+        auto relocate = [stackTop, stackEnd, copyBase](DWORD64 &value) {
+            if (value >= stackTop && value < stackEnd)
+            {
+                value = value - stackTop + copyBase;
+            }
+        };
+        for (size_t i = 0; i < copied; i++)
+        {
+            DWORD64 value = m_stackCopy[i];
+            relocate(value);
+            m_stackCopy[i] = static_cast<ULONG_PTR>(value);
+        }
+        DWORD64 *registers[] = {&context.Rax, &context.Rcx, &context.Rdx, &context.Rbx, &context.Rsp,
+                                &context.Rbp, &context.Rsi, &context.Rdi, &context.R8,  &context.R9,
+                                &context.R10, &context.R11, &context.R12, &context.R13, &context.R14,
+                                &context.R15};
+        for (size_t i = 0; i < sizeof(registers) / sizeof(registers[0]); i++)
+        {
+            relocate(*registers[i]);
+        }
+
+        // Unwind with the function tables of the modules, which needs
+        // neither frame pointers nor the symbols, until a frame falls
+        // outside the copy.
+        while (count < WatchdogSlot::MaxFrames && context.Rip != 0 && context.Rsp >= copyBase &&
+               context.Rsp < copyEnd)
+        {
+            frames[count++] = reinterpret_cast<void *>(context.Rip);
+            DWORD64 imageBase = 0;
+            PRUNTIME_FUNCTION function = RtlLookupFunctionEntry(context.Rip, &imageBase, NULL);
+            if (function == NULL)
+            {
+                // A leaf function: the return address is on top of the stack.
+                context.Rip = *reinterpret_cast<DWORD64 *>(context.Rsp);
+                context.Rsp += sizeof(DWORD64);
+            }
+            else
+            {
+                PVOID handlerData = NULL;
+                DWORD64 establisherFrame = 0;
+                RtlVirtualUnwind(UNW_FLAG_NHANDLER, imageBase, context.Rip, function, &context,
+                                 &handlerData, &establisherFrame, NULL);
+            }
+        }
+    }
+#elif defined(_M_IX86)
+    if (fContext)
+    {
+        frames[count++] = reinterpret_cast<void *>(context.Eip);
+    }
+#endif
+    stall.frames.assign(frames, frames + count);
+#else
+    // The worker samples itself in the signal handler. The lock is not held
+    // while waiting for it, so workers can come and go meanwhile; this one
+    // stays until the sample is over.
+    slot->m_frameCount.store(-1);
+    if (pthread_kill(slot->m_thread, GetSampleSignal()) == 0)
+    {
+        m_sampling = slot;
+        guard.unlock();
+        int count = -1;
+        for (DWORD dwWaited = 0; dwWaited < SampleTimeout; dwWaited++)
+        {
+            count = slot->m_frameCount.load(std::memory_order_acquire);
+            if (count >= 0)
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        guard.lock();
+        m_sampling = NULL;
+        m_sampled.notify_all();
+        if (count >= 0)
+        {
+            stall.frames.assign(slot->m_frames, slot->m_frames + count);
+        }
+    }
+
+    // The handler and the signal trampoline come first.
+    stall.skipped = (stall.frames.size() > 2) ? 2 : stall.frames.size();
+#endif
+    if (stall.frames.empty())
+    {
+        m_samplesFailed.Increment();
+    }
+}
+
+#ifndef _WIN32
+
+/**
+ *   Install the handler of the sample signal for the process. The first
+ *   backtrace loads the unwinder, which is not safe to do in a signal
+ *   handler, so one is taken here.
+ */
+void Watchdog::InstallSampleHandler(void)
+{
+    void *frame;
+    backtrace(&frame, 1);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &Watchdog::OnSampleSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(GetSampleSignal(), &action, NULL);
+}
+
+/**
+ *   The handler of the sample signal: record the stack of the calling
+ *   worker in its slot. A sample that was not asked for is ignored.
+ */
+void Watchdog::OnSampleSignal(int)
+{
+    int error = errno;
+    WatchdogSlot *slot = t_slot;
+    if (slot != NULL && slot->m_frameCount.load() == -1)
+    {
+        int count = backtrace(slot->m_frames, static_cast<int>(WatchdogSlot::MaxFrames));
+        slot->m_frameCount.store(count, std::memory_order_release);
+    }
+    errno = error;
+}
+
+#endif
+
+#pragma endregion
+
+#pragma region Reporting
+
+/**
+ *   Log a stall, a line per frame of its stack, and hand it to the stall
+ *   handler; or log that a reported task has finished.
+ *
+ *   @param stall - what the scan found
+ */
+void Watchdog::Report(const Stall &stall)
+{
+    std::unique_lock<std::mutex> guard(m_handlerLock);
+    Logger &logger = *m_logger;
+    wchar_t szMessage[LogRecord::MaxMessageLength];
+    if (stall.fFinished)
+    {
+        StringCchPrintf(szMessage, ARRAYSIZE(szMessage), L"The stalled task on %ls worker %lu finished after %lu ms",
+                 stall.executor.c_str(), static_cast<unsigned long>(stall.index), stall.dwElapsed);
+        logger.Write(c_logSource, szMessage, EVENTLOG_INFORMATION_TYPE);
+        return;
+    }
+
+    StallReport report;
+    report.executor = stall.executor;
+    report.index = stall.index;
+    report.task = (stall.task != NULL) ? GetTypeName(*stall.task) : std::wstring(L"unknown");
+    report.dwElapsed = stall.dwElapsed;
+    for (size_t i = stall.skipped; i < stall.frames.size(); i++)
+    {
+        report.stack.push_back(DescribeFrame(stall.frames[i]));
+    }
+
+    StringCchPrintf(szMessage, ARRAYSIZE(szMessage), L"A task on %ls worker %lu has been running for %lu ms: %ls",
+             report.executor.c_str(), static_cast<unsigned long>(report.index), report.dwElapsed,
+             report.task.c_str());
+    logger.Write(c_logSource, szMessage, EVENTLOG_WARNING_TYPE);
+    if (report.stack.empty())
+    {
+        logger.Write(c_logSource, L"    (no stack sample)", EVENTLOG_WARNING_TYPE);
+    }
+    for (size_t i = 0; i < report.stack.size(); i++)
+    {
+        StringCchPrintf(szMessage, ARRAYSIZE(szMessage), L"    #%lu %ls", static_cast<unsigned long>(i),
+                 report.stack[i].c_str());
+        logger.Write(c_logSource, szMessage, EVENTLOG_WARNING_TYPE);
+    }
+
+    StallHandler handler = m_handler;
+    guard.unlock();
+    if (handler)
+    {
+        handler(report);
+    }
+}
+
+/**
+ *   Describe a return address: the function and the offset into it, or,
+ *   without symbols, the module and the offset into that, which a
+ *   symbolizer such as addr2line can resolve later. Only the watchdog
+ *   thread calls this, as the Windows symbol handler requires.
+ *
+ *   @param address - an address from a stack sample
+ *   @return the description
+ */
+std::wstring Watchdog::DescribeFrame(void *address)
+{
+    wchar_t szFrame[LogRecord::MaxMessageLength];
+#ifdef _WIN32
+    static bool s_fSymbols = (SymInitializeW(GetCurrentProcess(), NULL, TRUE) != FALSE);
+
+    union
+    {
+        SYMBOL_INFOW info;
+        unsigned char buffer[sizeof(SYMBOL_INFOW) + MAX_SYM_NAME * sizeof(wchar_t)];
+    } symbol;
+    ZeroMemory(&symbol, sizeof(symbol));
+    symbol.info.SizeOfStruct = sizeof(SYMBOL_INFOW);
+    symbol.info.MaxNameLen = MAX_SYM_NAME;
+    DWORD64 displacement = 0;
+    if (s_fSymbols && SymFromAddrW(GetCurrentProcess(), reinterpret_cast<DWORD64>(address), &displacement, &symbol.info))
+    {
+        StringCchPrintf(szFrame, ARRAYSIZE(szFrame), L"%ls+0x%llx", symbol.info.Name, displacement);
+    }
+    else
+    {
+        StringCchPrintf(szFrame, ARRAYSIZE(szFrame), L"0x%p", address);
+    }
+#else
+    Dl_info info;
+    if (dladdr(address, &info) == 0 || info.dli_fname == NULL)
+    {
+        StringCchPrintf(szFrame, ARRAYSIZE(szFrame), L"%p", address);
+        return szFrame;
+    }
+
+    const char *module = strrchr(info.dli_fname, '/');
+    module = (module != NULL) ? module + 1 : info.dli_fname;
+    if (info.dli_sname != NULL)
+    {
+        int status = 0;
+        char *demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+        StringCchPrintf(szFrame, ARRAYSIZE(szFrame), L"%s!%s+0x%lx", module,
+                 (status == 0 && demangled != NULL) ? demangled : info.dli_sname,
+                 static_cast<unsigned long>(static_cast<char *>(address) - static_cast<char *>(info.dli_saddr)));
+        free(demangled);
+    }
+    else
+    {
+        StringCchPrintf(szFrame, ARRAYSIZE(szFrame), L"%s+0x%lx", module,
+                 static_cast<unsigned long>(static_cast<char *>(address) - static_cast<char *>(info.dli_fbase)));
+    }
+#endif
+    return szFrame;
+}
+
+#pragma endregion
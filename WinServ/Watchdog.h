@@ -0,0 +1,267 @@
+/*
+ * Noticing work that hangs.
+ *
+ * Every thread that runs work for an executor, such as a worker of a
+ * thread pool, registers a slot with the watchdog and stamps it when a task
+ * starts and when it finishes: the slot is the worker's heartbeat. A stamp
+ * is a read of the coarse system clock and two stores into a cache line
+ * only that worker writes, so it costs a few nanoseconds per task.
+ *
+ * A watchdog thread looks at the slots a few times per threshold. A task
+ * still running past the threshold is reported once: the executor, the
+ * worker, the type of the task and a sample of the worker's stack go to the
+ * log, to the watchdog.* metrics and to an optional handler. When the task
+ * finally finishes, that is logged too, with how long it ran.
+ *
+ * The stack is sampled while the process keeps running. On Windows the
+ * worker is suspended for the moment it takes to copy its registers and
+ * the live part of its stack, which is unwound once it runs again: nothing
+ * that may take a lock the worker holds runs while it is suspended (64-bit
+ * builds; 32-bit ones report the current instruction only). Elsewhere the
+ * worker is sent a signal, SIGRTMIN + 1, whose handler records its own
+ * backtrace; a worker that does not run the handler within SampleTimeout
+ * is reported without a stack, and the watchdog's lock is released while
+ * it waits.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+#include "Metrics.h"
+#include "Platform.h"
+#ifndef _WIN32
+#include <pthread.h>
+#include <time.h>
+#endif
+
+class Logger;
+class Watchdog;
+
+// The heartbeat of one worker. Only the worker it was registered on calls
+// Begin and End.
+class alignas(64) WatchdogSlot
+{
+public:
+    // Mark the start of a task of the given type.
+    void Begin(const std::type_info &task)
+    {
+        m_task.store(&task, std::memory_order_relaxed);
+        m_startedAt.store(Now(), std::memory_order_release);
+    }
+
+    // Mark the end of the task.
+    void End(void)
+    {
+        m_startedAt.store(0, std::memory_order_release);
+    }
+
+    // When the running task started, on the clock of Now, or 0 while the
+    // worker is idle. Any thread may look.
+    unsigned long long GetStartedAt(void) const
+    {
+        return m_startedAt.load(std::memory_order_acquire);
+    }
+
+    // Milliseconds on the clock the slots are stamped with: the coarse
+    // monotonic clock of the system, which is never 0.
+    static unsigned long long Now(void)
+    {
+#ifdef _WIN32
+        return GetTickCount64();
+#else
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        return static_cast<unsigned long long>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+#endif
+    }
+
+private:
+    friend class Watchdog;
+
+    // The most frames a stack sample holds.
+    static const size_t MaxFrames = 32;
+
+    WatchdogSlot(void);
+
+    // When the running task started, or 0 while the worker is idle, and
+    // its type
+    std::atomic<unsigned long long> m_startedAt;
+    std::atomic<const std::type_info *> m_task;
+
+    // Only the watchdog thread, holding the watchdog's lock, touches the
+    // rest.
+    std::wstring m_executor;
+    size_t m_index;
+
+    // The start of the task last reported, until it finishes
+    unsigned long long m_reported;
+
+    // The worker thread, and the frames of its last stack sample: the
+    // signal handler that takes the sample sets m_frameCount, -1 until then
+#ifdef _WIN32
+    HANDLE m_thread;
+
+    // The bounds of the worker's stack
+    ULONG_PTR m_stackLow;
+    ULONG_PTR m_stackHigh;
+#else
+    pthread_t m_thread;
+#endif
+    void *m_frames[MaxFrames];
+    std::atomic<int> m_frameCount;
+};
+
+class Watchdog
+{
+public:
+    // A task that has run past the threshold.
+    struct StallReport
+    {
+        // The executor and the index of the worker running the task.
+        std::wstring executor;
+        size_t index;
+
+        // The type of the task, demangled where the compiler mangles it.
+        std::wstring task;
+
+        // The milliseconds the task had been running, to the resolution of
+        // the coarse clock.
+        DWORD dwElapsed;
+
+        // The worker's stack, innermost frame first, one symbol (or module
+        // and offset) per frame; empty if it could not be sampled.
+        std::vector<std::wstring> stack;
+    };
+
+    typedef std::function<void(const StallReport &report)> StallHandler;
+
+    // How long the watchdog waits for a worker to sample its own stack, in
+    // milliseconds.
+    static const DWORD SampleTimeout = 100;
+
+    // Create a watchdog that reports tasks running longer than dwThreshold
+    // milliseconds. Its thread starts with the first registration.
+    explicit Watchdog(DWORD dwThreshold = 10000);
+
+    // Stops the watchdog thread. Every slot must have been unregistered.
+    ~Watchdog(void);
+
+    Watchdog(const Watchdog &) = delete;
+    Watchdog &operator=(const Watchdog &) = delete;
+
+    // Register the calling thread as worker index of the named executor.
+    // The slot belongs to the watchdog; give it back with Unregister before
+    // the thread exits.
+    WatchdogSlot *Register(const wchar_t *pszExecutor, size_t index);
+
+    // Stop watching a slot.
+    void Unregister(WatchdogSlot *slot);
+
+    // Change how long a task may run before it is reported. Tasks already
+    // running are measured against the new threshold.
+    void SetThreshold(DWORD dwThreshold);
+
+    DWORD GetThreshold(void) const;
+
+    // Call the handler, on the watchdog thread, for every stall reported
+    // from now on, after it has been logged. An empty handler removes it.
+    void SetStallHandler(StallHandler handler);
+
+    // Log the reports to the given logger instead of the process-wide one.
+    // Returns once no report is being logged to the previous one; the
+    // logger must outlive its use by the watchdog.
+    void SetLogger(Logger &logger);
+
+    // The process-wide watchdog, watching the workers of every thread pool.
+    static Watchdog &Default(void);
+
+private:
+    // A stall found by a scan, turned into a report once the lock is
+    // released
+    struct Stall
+    {
+        std::wstring executor;
+        size_t index;
+        const std::type_info *task;
+        DWORD dwElapsed;
+        std::vector<void *> frames;
+
+        // The frames of the sampling itself, at the start of frames
+        size_t skipped;
+
+        // Whether this is a reported task that has since finished, after
+        // dwElapsed ms
+        bool fFinished;
+    };
+
+    // Watchdog thread body.
+    void WatchLoop(void);
+
+    // Look at every slot. Called with m_lock held, which sampling may
+    // release for a while; fills in the stalls to report.
+    void Scan(std::vector<Stall> &stalls, std::unique_lock<std::mutex> &guard);
+
+    // Sample the stack of a slot's worker. Called with m_lock held; it is
+    // released while the watchdog waits for the worker.
+    void Sample(WatchdogSlot *slot, Stall &stall, std::unique_lock<std::mutex> &guard);
+
+    // Log a stall and hand it to the handler.
+    void Report(const Stall &stall);
+
+    // The function or module and offset of an address.
+    static std::wstring DescribeFrame(void *address);
+
+#ifndef _WIN32
+    // Install the handler of the sample signal, once per process.
+    static void InstallSampleHandler(void);
+
+    // The handler: a worker samples its own stack.
+    static void OnSampleSignal(int signal);
+#endif
+
+    // How often the slots are scanned: a quarter of the threshold.
+    DWORD GetInterval(void) const;
+
+    // Guards the slots and the thread; the watchdog thread waits on m_wake
+    // between scans
+    mutable std::mutex m_lock;
+    std::condition_variable m_wake;
+    std::vector<std::unique_ptr<WatchdogSlot>> m_slots;
+    std::thread m_thread;
+
+    // The slot being sampled with the lock released, which Unregister
+    // waits for, and the signal that the sample is over
+    WatchdogSlot *m_sampling;
+    std::condition_variable m_sampled;
+
+#ifdef _WIN32
+    // The live part of a worker's stack, copied while it is suspended.
+    // Set aside up front, so that nothing is allocated then; the words
+    // past StackCopySize - StackCopySlack stay zero, for an unwind that
+    // reads past the end of what was copied.
+    static const size_t StackCopySize = 16384;
+    static const size_t StackCopySlack = 512;
+    std::vector<ULONG_PTR> m_stackCopy;
+#endif
+    bool m_fStopping;
+    DWORD m_dwThreshold;
+
+    // Guards the handler and the logger; held while a report is logged
+    std::mutex m_handlerLock;
+    StallHandler m_handler;
+    Logger *m_logger;
+
+    MetricCounter m_stalls;
+    MetricGauge m_stalled;
+    MetricHistogram m_stallTime;
+    MetricCounter m_samplesFailed;
+};
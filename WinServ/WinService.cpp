@@ -2,39 +2,58 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #pragma region Includes
+#ifdef _WIN32
 #include <Windows.h>
-#include <wininet.h>
+#endif
 #include "WinService.h"
-#include "ThreadPool.h"
 #pragma endregion
 
-#pragma comment(lib, "wininet.lib")
-
-#define BUFLEN 2048 // Max length of buffer
-
 WinService::WinService(PWSTR pszServiceName,
+                       PWSTR pszConfigPath,
                        BOOL fCanStop,
                        BOOL fCanShutdown,
                        BOOL fCanPauseContinue)
-    : ServiceBase(pszServiceName, fCanStop, fCanShutdown, fCanPauseContinue)
+    : ServiceBase(pszServiceName, fCanStop, fCanShutdown, fCanPauseContinue),
+      m_config(pszConfigPath)
 {
-    m_fStopping = FALSE;
+    m_connectivity = 0;
 
-    // Create a manual-reset event that is not signaled at first to indicate
-    // the stopped signal of the service.
-    m_hStoppedEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-    if (m_hStoppedEvent == NULL)
-    {
-        throw GetLastError();
-    }
+    // The settings are read at every start and again on a parameter
+    // change, so tuning them needs neither a rebuild nor a restart.
+    SetConfig(m_config);
+
+    // A pause holds the timers, including the main loop's, and the work
+    // queued on the thread pool; the threads stay up for the continue.
+    AddPausable(TimerService::Default());
+    AddPausable(ThreadPool::Default());
+
+    // A stop lets the work queued on the thread pool finish, as far as the
+    // stop deadline allows, before the log is written out.
+    AddDrainStep(L"thread pool", [](DWORD dwMilliseconds) {
+        return ThreadPool::Default().WaitUntilIdle(dwMilliseconds);
+    });
 }
 
 WinService::~WinService(void)
 {
-    if (m_hStoppedEvent)
+    // A stop leaves these behind if OnStop did not run, or if the main loop
+    // outlived the drain deadline; both refer to this object.
+    if (m_connectivity != 0)
+    {
+        ConnectivityMonitor::Default().Unsubscribe(m_connectivity);
+    }
+    // The loop refers to this object, so it is waited for however long it
+    // takes; one that is late is reported first.
+    if (m_worker.valid())
     {
-        CloseHandle(m_hStoppedEvent);
-        m_hStoppedEvent = NULL;
+        DWORD dwDeadline = GetStopDeadline();
+        if (dwDeadline != INFINITE &&
+            m_worker.wait_for(std::chrono::milliseconds(dwDeadline)) != std::future_status::ready)
+        {
+            WriteEventLogEntry(L"SampleWindowsService is waiting for a main loop that did not stop",
+                               EVENTLOG_WARNING_TYPE);
+        }
+        m_worker.wait();
     }
 }
 
@@ -50,29 +69,64 @@ void WinService::OnStart(DWORD dwArgc, LPWSTR *lpszArgv)
     // Log a service start message to the Application log.
     WriteEventLogEntry(L"SampleWindowsService is started", EVENTLOG_INFORMATION_TYPE);
 
-    // Queue the main service function for execution in a worker thread.
-    ThreadPool::QueueWorkItem(&WinService::ServiceWorkerThread, this);
+    ApplyConfig();
+
+    // A main loop that outlived the last stop has been told to stop; there
+    // is only ever one. It gets another stop deadline to finish, and if it
+    // is still running the start fails rather than hang.
+    if (m_worker.valid())
+    {
+        DWORD dwDeadline = GetStopDeadline();
+        if (dwDeadline != INFINITE &&
+            m_worker.wait_for(std::chrono::milliseconds(dwDeadline)) != std::future_status::ready)
+        {
+            WriteEventLogEntry(L"SampleWindowsService main loop of the last run did not stop",
+                               EVENTLOG_ERROR_TYPE);
+            throw static_cast<DWORD>(ERROR_TIMEOUT);
+        }
+        m_worker.wait();
+    }
+
+    // Hear about the network going down and coming back rather than
+    // finding out from failed requests.
+    m_connectivity = ConnectivityMonitor::Default().Subscribe([this](bool fConnected) {
+        WriteEventLogEntry(fConnected ? L"WinServ network connection restored"
+                                      : L"WinServ network connection lost",
+                           fConnected ? EVENTLOG_INFORMATION_TYPE : EVENTLOG_WARNING_TYPE);
+    });
+
+    // Start the main service function. It runs on the thread pool and
+    // holds no thread while it waits.
+    m_worker = CoSpawn(ServiceWorker());
 }
 
 /**
- *   Performs the main function of the service. It runs on a thread pool worker thread.
+ *   Performs the main function of the service: a loop that does its work
+ *   every 50 seconds until the service stops. It is a coroutine, so the
+ *   waits suspend it instead of blocking a thread; a stop ends the wait at
+ *   once.
  */
-void WinService::ServiceWorkerThread(void)
+CoTask<void> WinService::ServiceWorker(void)
 {
-    DWORD dwFlags;
-    BOOL bConnected = InternetGetConnectedState(&dwFlags, 0);
-    BOOL isFirstTime = TRUE;
-
-    // Periodically check if the service is stopping.
-    while (!m_fStopping)
+    StopToken token = GetStopToken();
+    ConfigReader config(m_config);
+    for (;;)
     {
-        WriteEventLogEntry(L"WinServ is running",
-                           EVENTLOG_INFORMATION_TYPE);
-        Sleep(50000);
-    }
+        // Work that needs the network rests while the machine is offline
+        // instead of failing and retrying.
+        if (ConnectivityMonitor::Default().IsConnected())
+        {
+            WriteEventLogEntry(L"WinServ is running",
+                               EVENTLOG_INFORMATION_TYPE);
+        }
 
-    // Signal the stopped event.
-    SetEvent(m_hStoppedEvent);
+        // A new interval takes effect from the next wait.
+        bool fSlept = co_await CoDelay(config.Get().GetDword(L"WorkInterval", 50000), token);
+        if (!fSlept)
+        {
+            break;
+        }
+    }
 }
 
 /**
@@ -82,14 +136,64 @@ void WinService::ServiceWorkerThread(void)
 void WinService::OnStop()
 {
     // In this example, OnStop logs a service-stop message to the application log and
-    // waits for the finish of the main service function.
+    // waits for the main loop. The stop token was signalled before OnStop, which ends
+    // the loop's wait at once, so stopping takes effect immediately.
     WriteEventLogEntry(L"SampleWindowsService stopped",
                        EVENTLOG_INFORMATION_TYPE);
 
-    // Indicate that the service is stopping and wait for the finish of the
-    m_fStopping = TRUE;
-    if (WaitForSingleObject(m_hStoppedEvent, INFINITE) != WAIT_OBJECT_0)
+    // A main loop stuck in a task would hold up the stop for good, so the
+    // wait ends with the drain deadline; the watchdog reports the task.
+    if (m_worker.valid())
+    {
+        DWORD dwTimeLeft = GetDrainTimeLeft();
+        if (dwTimeLeft == INFINITE ||
+            m_worker.wait_for(std::chrono::milliseconds(dwTimeLeft)) == std::future_status::ready)
+        {
+            m_worker.get();
+        }
+        else
+        {
+            // The loop still refers to this object; its future is kept so
+            // that the next start and the destructor wait for it.
+            WriteEventLogEntry(L"SampleWindowsService main loop did not stop in time",
+                               EVENTLOG_WARNING_TYPE);
+        }
+    }
+
+    if (m_connectivity != 0)
     {
-        throw GetLastError();
+        ConnectivityMonitor::Default().Unsubscribe(m_connectivity);
+        m_connectivity = 0;
     }
+}
+
+/**
+ *   Executes when the configuration has been reloaded on a parameter
+ *   change.
+ */
+void WinService::OnParamChange()
+{
+    ApplyConfig();
+}
+
+/**
+ *   Apply the settings that tune the framework: how long a stop may take
+ *   before it is logged as slow, how long a pause may wait for the work in
+ *   flight, the deadlines of the drain on stop and shutdown, how long a
+ *   task may run before the watchdog reports it, and the bounds of the
+ *   default thread pool.
+ */
+void WinService::ApplyConfig(void)
+{
+    std::shared_ptr<const ConfigSnapshot> config = m_config.Get();
+    SetStopLatencyBudget(config->GetDword(L"StopLatencyBudget", 100));
+    SetPauseTimeout(config->GetDword(L"PauseTimeout", 30000));
+    SetDrainDeadlines(config->GetDword(L"StopDeadline", 20000),
+                      config->GetDword(L"ShutdownDeadline", 5000));
+    Watchdog::Default().SetThreshold(config->GetDword(L"StallThreshold", 10000));
+
+    PoolSizing sizing = ThreadPool::GetDefaultSizing();
+    sizing.minThreads = config->GetDword(L"MinThreads", static_cast<DWORD>(sizing.minThreads));
+    sizing.maxThreads = config->GetDword(L"MaxThreads", static_cast<DWORD>(sizing.maxThreads));
+    ThreadPool::Default().SetSizing(sizing);
 }
\ No newline at end of file
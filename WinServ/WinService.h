@@ -1,22 +1,40 @@
 #pragma once
 
+#include <future>
+#include "Config.h"
+#include "ConnectivityMonitor.h"
+#include "Coroutine.h"
 #include "ServiceBase.h"
+#include "Watchdog.h"
 
 class WinService : public ServiceBase
 {
 public:
+    // pszConfigPath is the file the settings of the service are read from.
     WinService(PWSTR pszServiceName,
+               PWSTR pszConfigPath,
                BOOL fCanStop = TRUE,
                BOOL fCanShutdown = TRUE,
-               BOOL fCanPauseContinue = FALSE);
+               BOOL fCanPauseContinue = TRUE);
     virtual ~WinService(void);
 
 protected:
     virtual void OnStart(DWORD dwArgc, LPWSTR *pszArgv);
     virtual void OnStop();
-    void ServiceWorkerThread(void);
+    virtual void OnParamChange();
+    CoTask<void> ServiceWorker(void);
+
+    // Apply the settings that tune the framework.
+    void ApplyConfig(void);
 
 private:
-    BOOL m_fStopping;
-    HANDLE m_hStoppedEvent;
+    // The settings of the service, reloaded on SERVICE_CONTROL_PARAMCHANGE.
+    Config m_config;
+
+    // The main loop, running as a coroutine on the thread pool. It refers
+    // to this object, so its future is kept until it has finished.
+    std::future<void> m_worker;
+
+    // The subscription that logs when the network goes down or comes back.
+    ConnectivityMonitor::SubscriptionId m_connectivity;
 };
\ No newline at end of file